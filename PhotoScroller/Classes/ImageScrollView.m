@@ -67,6 +67,9 @@
         // tiling view's contentScaleFactor to 1.0. (If we omitted this, it would be 2.0 on high resolution screens,
         // which would cause the CATiledLayer to ask us for tiles of the wrong scales.)
         _imageView.contentScaleFactor = 1.0;
+
+        // every scroll and zoom comes through here: get the tiles just off screen, and the next level each way, off the disk now
+        [(TilingView *)_imageView prefetchVisibleRect:[self convertRect:self.bounds toView:_imageView] zoomScale:self.zoomScale];
     }
 }
 
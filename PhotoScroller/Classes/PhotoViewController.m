@@ -57,6 +57,8 @@ static uint64_t DeltaMAT(uint64_t then, uint64_t now);
     CGFloat								percentScrolledIntoFirstVisiblePage;
 
 	NSMutableArray						*tileBuilders;
+	NSMutableArray						*downloads;			// the ConcurrentOps still running, by page
+	NSInteger							prioritizedPage;
 	
 	uint64_t							startTime;
 	__block uint32_t					milliSeconds;
@@ -166,8 +168,10 @@ static uint64_t DeltaMAT(uint64_t then, uint64_t now);
     recycledPages = [[NSMutableSet alloc] init];
     visiblePages  = [[NSMutableSet alloc] init];
 	tileBuilders  = [[NSMutableArray alloc] init];
+	downloads     = [[NSMutableArray alloc] init];
 	if(_isWebTest) {
 		operationsRunner = [[OperationsRunner alloc] initWithDelegate:self];
+		operationsRunner.adaptiveMaxOps = 8;	// from the link: a slow one does best with few, a fast one with more
 		[self fetchWebImages];
 	} else {
 		[self constructStaticImages];
@@ -204,6 +208,7 @@ static uint64_t DeltaMAT(uint64_t then, uint64_t now);
 	// Note" probably a better strategy is to put the new images in their own array, then swap arrays when done
 	if(op.imageBuilder) {
 		[tileBuilders replaceObjectAtIndex:op.index withObject:op.imageBuilder];
+		[downloads replaceObjectAtIndex:op.index withObject:@""];
 	} else {
 		NSLog(@"Never will show images! Just kill the app now!");
 		// Real code should obviously deal with this! I had a network failure myself while testing.
@@ -228,6 +233,12 @@ static uint64_t DeltaMAT(uint64_t then, uint64_t now);
 	}
 }
 
+// Each download holds a builder; past about two per build slot they only wait for the decodes, holding memory
+- (NSUInteger)operationsMemoryLimit
+{
+	return 2 * [TiledImageBuilder buildConcurrency];
+}
+
 #pragma mark -
 #pragma mark Tiling and page configuration
 
@@ -320,13 +331,32 @@ static uint64_t DeltaMAT(uint64_t then, uint64_t now);
 		op.urlStr = path;
 		op.decoder = _decoder;
 		op.index = idx;
+		op.priority = idx ? normalImagePriority : highImagePriority;	// the first page is the one on screen
+		op.queuePriority = op.priority;									// its download first, too
 		//op.zoomLevels = ZOOM_LEVELS;
 		op.orientation = _orientation;
+		op.segments = _decoder == libjpegIncremental ? 0 : 4;	// incremental decodes want the bytes in order
 
+		[downloads addObject:op];
 		[operationsRunner runOperation:op withMsg:path];
 	}
 }
 
+// The page swiped to gets the bandwidth and the decode first, its neighbours next, the rest wait
+- (void)prioritizePage:(NSInteger)index
+{
+	prioritizedPage = index;
+	[downloads enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop)
+		{
+			if([obj isKindOfClass:[ConcurrentOp class]]) {
+				ConcurrentOp *op = obj;
+				NSInteger distance = labs((NSInteger)idx - index);
+				op.priority = distance == 0 ? highImagePriority : distance == 1 ? normalImagePriority : lowImagePriority;
+				[self->operationsRunner setPriority:op.priority ofOperation:op];
+			}
+		} ];
+}
+
 - (void)tilePages 
 {
 	if(!ok2tile) return;
@@ -400,6 +430,11 @@ static uint64_t DeltaMAT(uint64_t then, uint64_t now);
 		// dispatch fixes some recursive call to scrollViewDidScroll in tilePages (related to removeFromSuperView)
 		// The reason can be found here: http://stackoverflow.com/questions/3854739
 		dispatch_async(dispatch_get_main_queue(), ^{ [self tilePages]; });
+
+		NSInteger page = (NSInteger)lrint(floor(CGRectGetMidX(scrollView.bounds) / CGRectGetWidth(scrollView.bounds)));
+		if(page != prioritizedPage && page >= 0 && page < (NSInteger)[downloads count]) {
+			[self prioritizePage:page];
+		}
 	}
 }
 
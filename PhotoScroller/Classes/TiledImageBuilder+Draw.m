@@ -20,6 +20,13 @@
 
 static inline long offsetFromScale(float scale) { long s = lrintf(1/scale); long idx = 0; while(s > 1) { s /= 2.0f; ++idx; } return idx; }
 
+static const void *PhotoScrollerProviderGetBytePointer (
+    void *info
+);
+static void PhotoScrollerProviderReleaseBytePointer (
+    void *info,
+    const void *pointer
+);
 static size_t PhotoScrollerProviderGetBytesAtPosition (
     void *info,
     void *buffer,
@@ -50,55 +57,26 @@ static void PhotoScrollerProviderReleaseInfoCallback (
 	int row = (int)lrint(pt.y);
 
 	long idx = offsetFromScale((float)scale);
-	imageMemory *im = (imageMemory *)malloc(sizeof(imageMemory));
-	memcpy(im, &self.ims[idx], sizeof(imageMemory));
-	im->col = col;
-	im->row = row;
-
-	BOOL newCol = NO;
-	BOOL newRow = NO;
-	
-	switch(self.orientation) {
-	default:
-	case 0:
-	case 1:
-	case 5:
-		break;
-	case 2:
-	case 8:
-		newCol = YES;
-		break;
-	case 3:
-	case 7:
-		newCol = YES;
-		newRow = YES;
-		break;
-	case 4:
-	case 6:
-		newRow = YES;
-		break;
-	}
-	int ncol = newCol ? (int)(im->cols - col - 1) : col;
-	int nrow = newRow ? (int)(im->rows - row - 1) : row;
-			
-	size_t x = ncol * tileDimension;
-	size_t y = nrow * tileDimension;
-
-	im->tileWidth = MIN(im->map.width-x, tileDimension);
-	im->tileHeight = MIN(im->map.height-y, tileDimension);
+#if TRACE_TILES == 1
+	LOG(@"tile %ld %d %d", idx, col, row);
+#endif
+	// CG reads the pixels where they are - the tile cache or a mapping - no copy
+	TCTileView *view = TCBuilderGetTileView(self.core, idx, col, row);
+	if(!view) return nil;
 
-	// LOG(@"PT:%@->%@ box:%@ h=%ld w=%ld", NSStringFromCGPoint(origPt), NSStringFromCGPoint(pt), NSStringFromCGSize(box.size), im->tileHeight, im->tileWidth);
+	// LOG(@"PT:%@->%@ box:%@ h=%ld w=%ld", NSStringFromCGPoint(origPt), NSStringFromCGPoint(pt), NSStringFromCGSize(box.size), view->height, view->width);
 
-	size_t imgSize = tileBytesPerRow*im->tileHeight;
-	struct CGDataProviderDirectCallbacks callBacks = { 0, 0, 0, PhotoScrollerProviderGetBytesAtPosition, PhotoScrollerProviderReleaseInfoCallback};
-	CGDataProviderRef dataProvider = CGDataProviderCreateDirect(im, imgSize, &callBacks);
+	size_t tileWidth = view->width;
+	size_t tileHeight = view->height;
+	struct CGDataProviderDirectCallbacks callBacks = { 0, PhotoScrollerProviderGetBytePointer, PhotoScrollerProviderReleaseBytePointer, PhotoScrollerProviderGetBytesAtPosition, PhotoScrollerProviderReleaseInfoCallback};
+	CGDataProviderRef dataProvider = CGDataProviderCreateDirect(view, view->length, &callBacks);
 	
 	CGImageRef image = CGImageCreate(
-	   im->tileWidth,
-	   im->tileHeight,
+	   tileWidth,
+	   tileHeight,
 	   bitsPerComponent,
 	   4*bitsPerComponent,
-	   tileBytesPerRow,
+	   TC_TILE_SIZE*TC_BYTES_PER_PIXEL,
 	   [TiledImageBuilder colorSpace],
 	   kCGImageAlphaPremultipliedFirst | kCGBitmapByteOrder32Little,	// kCGImageAlphaPremultipliedFirst kCGImageAlphaPremultipliedLast        kCGBitmapByteOrder32Big kCGBitmapByteOrder32Little
 	   dataProvider,
@@ -110,10 +88,35 @@ static void PhotoScrollerProviderReleaseInfoCallback (
 	return image;
 }
 
+- (void)prefetchForScale:(CGFloat)scale visibleRect:(CGRect)rect
+{
+	if(self.failed || CGRectIsEmpty(rect)) return;
+
+	long idx = MIN(offsetFromScale((float)scale), (long)self.zoomLevels - 1);
+	size_t cols, rows;
+	TCBuilderGetLevelTiles(self.core, idx, &cols, &rows);
+	if(self.orientation >= 5) {
+		size_t t = cols; cols = rows; rows = t;	// as displayed
+	}
+	if(!cols || !rows) return;
+
+	CGFloat side = (CGFloat)(TC_TILE_SIZE << idx);	// image points per tile at this level
+	CGFloat maxCol = (CGFloat)cols - 1;
+	CGFloat maxRow = (CGFloat)rows - 1;
+	CGPoint first = CGPointMake(MIN(MAX(floor(CGRectGetMinX(rect)/side), 0), maxCol), MIN(MAX(floor(CGRectGetMinY(rect)/side), 0), maxRow));
+	CGPoint last = CGPointMake(MIN(MAX(ceil(CGRectGetMaxX(rect)/side) - 1, 0), maxCol), MIN(MAX(ceil(CGRectGetMaxY(rect)/side) - 1, 0), maxRow));
+
+	// opposite corners as displayed are still opposite corners as stored
+	CGPoint a = [self translateTileForScale:scale location:first];
+	CGPoint b = [self translateTileForScale:scale location:last];
+	TCBuilderPrefetch(self.core, idx, (size_t)MIN(a.x, b.x), (size_t)MIN(a.y, b.y), (size_t)MAX(a.x, b.x), (size_t)MAX(a.y, b.y));
+}
+
 - (CGPoint)translateTileForScale:(CGFloat)scale location:(CGPoint)origPt
 {
 	NSUInteger idx = offsetFromScale((float)scale);
-	imageMemory *imP = &self.ims[idx];
+	size_t cols, rows;
+	TCBuilderGetLevelTiles(self.core, idx, &cols, &rows);
 	
 	CGPoint newPt;
 	switch(self.orientation) {
@@ -122,25 +125,25 @@ static void PhotoScrollerProviderReleaseInfoCallback (
 		newPt = origPt;
 		break;
 	case 2:
-		newPt = CGPointMake(imP->cols - origPt.x - 1, origPt.y);
+		newPt = CGPointMake(cols - origPt.x - 1, origPt.y);
 		break;
 	case 3:
-		newPt = CGPointMake(imP->cols - origPt.x - 1, imP->rows - origPt.y - 1);
+		newPt = CGPointMake(cols - origPt.x - 1, rows - origPt.y - 1);
 		break;
 	case 4:
-		newPt = CGPointMake(origPt.x, imP->rows - origPt.y - 1);
+		newPt = CGPointMake(origPt.x, rows - origPt.y - 1);
 		break;
 	case 5:
 		newPt = CGPointMake(origPt.y, origPt.x);
 		break;
 	case 6:
-		newPt = CGPointMake(origPt.y, imP->rows - origPt.x - 1);
+		newPt = CGPointMake(origPt.y, rows - origPt.x - 1);
 		break;
 	case 7:
-		newPt = CGPointMake(imP->cols - origPt.y - 1, imP->rows - origPt.x - 1);
+		newPt = CGPointMake(cols - origPt.y - 1, rows - origPt.x - 1);
 		break;
 	case 8:
-		newPt = CGPointMake(imP->cols - origPt.y - 1, origPt.x);
+		newPt = CGPointMake(cols - origPt.y - 1, origPt.x);
 		break;
 	}
 	// LOG(@"OLDPT=%@ NEWPT=%@", NSStringFromCGPoint(origPt), NSStringFromCGPoint(newPt) );
@@ -213,52 +216,36 @@ static void PhotoScrollerProviderReleaseInfoCallback (
 
 @end
 
+static const void *PhotoScrollerProviderGetBytePointer (
+    void *info
+) {
+	return ((TCTileView *)info)->bytes;
+}
+
+static void PhotoScrollerProviderReleaseBytePointer (
+    void *info,
+    const void *pointer
+) {
+	// the view holds the bytes until the provider lets it go
+}
+
 static size_t PhotoScrollerProviderGetBytesAtPosition (
     void *info,
     void *buffer,
     off_t position,
     size_t origCount
 ) {
-	imageMemory *im = (imageMemory *)info;
-
-	size_t mapSize = tileDimension*tileBytesPerRow;
-	size_t offset = (im->row*im->cols + im->col) * mapSize;
-
-	// orientation - to find this code below
-	if(!im->col) {
-		offset += im->map.col0offset;
-	}
-	if(!im->row) {
-		offset += im->map.row0offset * tileBytesPerRow;
-	}
-	//LOG(@"Draw col=%ld rowl%ld", im->col, im->row);
-
-#if MAPPING_IMAGES == 1	
-	// Turning the NOCACHE flag off might up performance, but really clog the system
-	// Note that the OS calls this on multiple threads. Thus, we cannot read directly from the file - we'd have to single thread those reads.
-	// mmap lets us map as many areas as we need.
-	unsigned char *startPtr = mmap(NULL, mapSize, PROT_READ, MAP_FILE | MAP_SHARED | MAP_NOCACHE, im->map.fd, offset);  /*| MAP_NOCACHE */
-	if(startPtr == MAP_FAILED) {
-		//LOG(@"errno4=%s", strerror(errno) );
-		return 0;
-	}
-
-	memcpy(buffer, startPtr+position, origCount);	// blit the image, then return. How nice is that!
-	munmap(startPtr, mapSize);
-#else
-	ssize_t readSize = pread(im->map.fd, buffer, origCount, offset + position);
-	if((size_t)readSize != origCount) {
-		//LOG(@"errno4=%s", strerror(errno) );
-		return 0;
-	}
-#endif
-	return origCount;
+	TCTileView *view = (TCTileView *)info;
+	if((size_t)position >= view->length) return 0;
+	size_t count = MIN(origCount, view->length - (size_t)position);
+	memcpy(buffer, view->bytes + position, count);
+	return count;
 }
 
 static void PhotoScrollerProviderReleaseInfoCallback (
     void *info
 ) {
-	free(info);
+	TCTileViewRelease(info);
 }
 
 #if 0
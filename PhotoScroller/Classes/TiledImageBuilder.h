@@ -47,14 +47,20 @@
 @interface TiledImageBuilder : NSObject
 @property (nonatomic, strong, readonly) NSDictionary *properties;	// image properties from CGImageSourceCopyPropertiesAtIndex()
 @property (nonatomic, assign) NSInteger orientation;				// 0 == automatically set using EXIF orientation from image
-@property (nonatomic, assign) NSUInteger zoomLevels;				// explose the init setting
+@property (nonatomic, assign, readonly) NSUInteger zoomLevels;		// explose the init setting
 @property (nonatomic, assign) uint64_t startTime;					// time stamp of when this operation started decoding
 @property (nonatomic, assign) uint64_t finishTime;					// time stamp of when this operation finished  decoding
 @property (nonatomic, assign) uint32_t milliSeconds;				// elapsed time
-@property (nonatomic, assign) int32_t ubc_threshold;				// UBC threshold above which outstanding writes are flushed to the file system (dynamic default)
+@property (nonatomic, assign) int64_t ubc_threshold;				// UBC threshold above which outstanding writes are flushed to the file system (dynamic default)
 @property (nonatomic, assign, readonly) BOOL failed;				// global Error flags
+@property (nonatomic, assign) ImagePriority priority;				// decodes waiting for others to finish go highest first
 
 + (void)setUbcThreshold:(float)val;									// default is 0.5 - Image disk cache can use half of the available free memory pool
++ (void)setDCTScaling:(BOOL)val;									// libjpegTurboDecoder: build the 1/2, 1/4 and 1/8 levels from the DCT coefficients (default NO)
++ (void)setDecodeThreads:(NSUInteger)val;							// libjpegTurboDecoder: decode JPEGs with restart markers on this many threads (default 0, one)
++ (void)setTileQuality:(int)val;									// keep finished tiles as JPEGs of this quality, about 10x less disk (default 0, raw tiles)
++ (void)setTileCacheRatio:(float)val;								// default is 0.25 - drawn tiles are kept in memory, up to a quarter of the available free memory
++ (NSUInteger)buildConcurrency;										// whole image decodes that can run at once right now, from cores and free memory
 
 #if LEVELS_INIT == 0
 - (id)initWithImage:(CGImageRef)image size:(CGSize)sz orientation:(NSInteger)orientation;
@@ -66,7 +72,11 @@
 - (id)initForNetworkDownloadWithDecoder:(ImageDecoder)dec levels:(NSUInteger)levels orientation:(NSInteger)orientation;
 #endif
 
+- (id)initWithArchive:(NSString *)path;								// a previously saved image, ready to draw - nil if not a valid archive
+- (BOOL)saveToArchive:(NSString *)path;								// once the image is tiled, atomically write it to one file
+
 - (void)writeToImageFile:(NSData *)data;
+- (void)writeToImageFile:(NSData *)data atOffset:(NSUInteger)offset;	// segmented downloads: in any order, from any thread
 - (void)dataFinished;
 - (CGSize)imageSize;	// orientation modifies over what is downloaded
 
@@ -78,6 +88,7 @@
 - (UIImage *)tileForScale:(CGFloat)scale location:(CGPoint)pt; // used when doing drawRect, but now for getImageColor
 - (CGAffineTransform)transformForRect:(CGRect)box; //  scale:(CGFloat)scale;
 - (CGPoint)translateTileForScale:(CGFloat)scale location:(CGPoint)origPt;
+- (void)prefetchForScale:(CGFloat)scale visibleRect:(CGRect)rect;	// rect in image points, read the tiles around it in the background
 
 @end
 
@@ -85,6 +96,12 @@
 @interface TiledImageBuilder (JPEG_PUB)
 
 - (BOOL)jpegAdvance:(NSData *)data;
+- (BOOL)jpegAppendData:(dispatch_data_t)data;	// instead of jpegAdvance: - no copies, each region is decoded where it is and let go once used. NO once failed
+- (BOOL)jpegStartDecodeThread:(dispatch_block_t)resume;	// or decode on a thread of its own, after init: resume is called (on it) when a paused download can go on
+- (BOOL)jpegQueueData:(dispatch_data_t)data;	// with the decode thread, no copies either. NO: pause the download until resume is called
+- (BOOL)jpegFinishData;							// the download is over, wait for the decode thread. YES if the image is complete
+- (size_t)jpegPeakBufferedBytes;				// jpegAppendData: or jpegQueueData: the most bytes of the download held at once
+- (CGImageRef)newPreviewImage;		// progressive downloads: the whole image so far at 1/8 size or less, as stored (see translateTileForScale:), NULL if none yet
 
 @end
 #endif
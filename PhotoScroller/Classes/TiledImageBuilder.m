@@ -22,65 +22,12 @@
 
 #define LOG NSLog
 
-static size_t	calcDimension(size_t d) { return(d + (tileDimension-1)) & ~(tileDimension-1); }
-static size_t	calcBytesPerRow(size_t row) { return calcDimension(row) * bytesPerPixel; }
-
-static BOOL dump_memory_usage(struct task_basic_info *info);
-
-
-#ifndef NDEBUG
-//static void dumpMapper(const char *str, mapper *m)
-//{
-//	printf("MAP: %s\n", str);
-//	printf(" fd = %d\n", m->fd);
-//	printf(" emptyAddr = %p\n", m->emptyAddr);
-//	printf(" addr = %p\n", m->addr);
-//	printf(" mappedSize = %lu\n", m->mappedSize);
-//	printf(" height = %lu\n", m->height);
-//	printf(" width = %lu\n", m->width);
-//	printf(" bytesPerRow = %lu\n", m->bytesPerRow);
-//	printf(" emptyTileRowSize = %lu\n", m->emptyTileRowSize);
-//	putchar('\n');
-//}
-#endif
-
-#ifndef NDEBUG
-//static void dumpIMS(const char *str, imageMemory *i)
-//{
-//	printf("IMS: %s\n", str);
-//	dumpMapper("map:", &i->map);
-//
-//	printf(" idx = %ld\n", i->index);
-//	printf(" cols = %ld\n", i->cols);
-//	printf(" rows = %ld\n", i->rows);
-//	printf(" outline = %ld\n", i->outLine);
-//	printf(" col = %ld\n", i->col);
-//	printf(" row = %ld\n", i->row);
-//	putchar('\n');
-//}
-#endif
-
-//static BOOL tileBuilder(imageMemory *im, BOOL useMMAP, int32_t ubc_thresh);
-
 // Create one and use it everywhere
 static CGColorSpaceRef		colorSpace;
+static BOOL					dctScaling;
+static NSUInteger			decodeThreads;
+static int					tileQuality;
 
-// Compliments to Rainer Brockerhoff
-static uint64_t DeltaMAT(uint64_t then, uint64_t now)
-{
-	uint64_t delta = now - then;
-
-	/* Get the timebase info */
-	mach_timebase_info_data_t info;
-	mach_timebase_info(&info);
-
-	/* Convert to nanoseconds */
-	delta *= info.numer;
-	delta /= info.denom;
-
-	return (uint64_t)((double)delta / 1e6); // ms
-}
-	 
 #if 0
 static void foo(int sig)
 {
@@ -88,37 +35,12 @@ static void foo(int sig)
 }
 #endif
 
-/*
- * We use a dispatch_grpoup so we can "block" on access to it, when memory pressure looks high.
- * A heuritc is empployed: the max of some percentage of free memory or a lower percentage of all memory
- * The queue is simply used as a place to attach the group to - you cannot suspend or resume a group
- * The suspended flag sets and resets the current queue state.
- * When a file is sync'd to disk, usage goes up by its size, and decremented when the sync is complete.
- * The ratio is used to compute a threshold (see the code).
- */
- // Will figure a way to make these static again soon
-
-volatile int32_t			fileFlushGroupSuspended;
-volatile int32_t			ubc_usage;					// rough idea of what our buffer cache usage is
-
-static dispatch_queue_t		fileFlushQueue;
-static dispatch_group_t		fileFlushGroup;
-static float				ubc_threshold_ratio;
-
-
 @implementation TiledImageBuilder
-{
-	NSString	*_imagePath;
-	BOOL		mapWholeFile;
-}
+
 + (void)initialize
 {
 	if(self == [TiledImageBuilder class]) {
 		colorSpace = CGColorSpaceCreateDeviceRGB();
-
-		fileFlushQueue = dispatch_queue_create("com.dfh.TiledImageBuilder", DISPATCH_QUEUE_SERIAL);
-		fileFlushGroup = dispatch_group_create();
-		ubc_threshold_ratio = 0.5f;	// default ration - can override with class method below
 		//for(int i=0; i<=31; ++i) signal(i, foo);	// trying to find out why system was killing me - never did
 	}
 }
@@ -129,31 +51,43 @@ static float				ubc_threshold_ratio;
 
 + (void)setUbcThreshold:(float)val
 {
-	ubc_threshold_ratio = val;
+	TCSetUbcThreshold(val);
 }
 
-+ (dispatch_queue_t)fileFlushQueue
++ (void)setDCTScaling:(BOOL)val
 {
-	return fileFlushQueue;
+	dctScaling = val;
 }
-+ (dispatch_group_t)fileFlushGroup
+
++ (void)setDecodeThreads:(NSUInteger)val
 {
-	return fileFlushGroup;
+	decodeThreads = val;
+}
+
++ (void)setTileQuality:(int)val
+{
+	tileQuality = val;
+}
+
++ (void)setTileCacheRatio:(float)val
+{
+	TCSetTileCacheRatio(val);
+}
+
++ (NSUInteger)buildConcurrency
+{
+	return TCGetBuildConcurrency();
 }
 
 #if LEVELS_INIT == 0
 - (id)initWithImage:(CGImageRef)image size:(CGSize)sz orientation:(NSInteger)orient
 {
-	if((self = [self initWithDecoder:cgimageDecoder size:sz])) {
-		_orientation = orient;
-		{
-			mapWholeFile = YES;
-			[self decodeImage:image];
-		}
+	if((self = [self initWithDecoder:cgimageDecoder size:sz orientation:orient])) {
+		[self decodeImage:image];
 
 #if TIMING_STATS == 1 && !defined(NDEBUG)
 		_finishTime = [self timeStamp];
-		_milliSeconds = (uint32_t)DeltaMAT(_startTime, _finishTime);
+		_milliSeconds = TCDeltaMilliSeconds(_startTime, _finishTime);
 		LOG(@"FINISH: %u milliseconds", _milliSeconds);
 #endif
 #if MEMORY_DEBUGGING == 1
@@ -165,21 +99,19 @@ static float				ubc_threshold_ratio;
 
 - (id)initWithImagePath:(NSString *)path withDecode:(ImageDecoder)dec size:(CGSize)sz  orientation:(NSInteger)orient
 {
-	if((self = [self initWithDecoder:dec size:sz])) {
-		_orientation = orient;
+	if((self = [self initWithDecoder:dec size:sz orientation:orient])) {
 #ifdef LIBJPEG
 		if(_decoder == libjpegIncremental) {
 			[self jpegInitFile:path];
 		} else
 #endif		
 		{
-			mapWholeFile = YES;
 			[self decodeImageURL:[NSURL fileURLWithPath:path]];
 		}
 
 #if TIMING_STATS == 1 && !defined(NDEBUG)
 		_finishTime = [self timeStamp];
-		_milliSeconds = (uint32_t)DeltaMAT(_startTime, _finishTime);
+		_milliSeconds = TCDeltaMilliSeconds(_startTime, _finishTime);
 		LOG(@"FINISH-I: %u milliseconds", _milliSeconds);
 #endif
 #if MEMORY_DEBUGGING == 1
@@ -190,41 +122,30 @@ static float				ubc_threshold_ratio;
 }
 - (id)initForNetworkDownloadWithDecoder:(ImageDecoder)dec size:(CGSize)sz orientation:(NSInteger)orient
 {
-	if((self = [self initWithDecoder:dec size:sz])) {
-		_orientation = orient;
+	if((self = [self initWithDecoder:dec size:sz orientation:orient])) {
 #ifdef LIBJPEG
 		if(_decoder == libjpegIncremental) {
 			[self jpegInitNetwork];
 		} else
 #endif
 		{
-			mapWholeFile = YES;
-			[self createImageFile];
+			TCBuilderCreateImageFile(_core);
 		}
 	}
 	return self;
 }
-- (id)initWithDecoder:(ImageDecoder)dec size:(CGSize)sz 
+- (id)initWithDecoder:(ImageDecoder)dec size:(CGSize)sz orientation:(NSInteger)orient
 {
 	if((self = [super init])) {
 #if TIMING_STATS == 1 && !defined(NDEBUG)
 		_startTime = [self timeStamp];
 #endif		
 		_decoder	= dec;
-		_pageSize	= getpagesize();
 		_size		= sz;
 
-		// Take a big chunk of either free memory or all memory
-		freeMemory fm		= [self freeMemory:@"Initialize"];
-		float freeThresh	= (float)fm.freeMemory*ubc_threshold_ratio;
-		float totalThresh	= (float)fm.totlMemory*ubc_threshold_ratio;
-		_ubc_threshold		= (int32_t)lrintf(MAX(freeThresh, totalThresh));
-
-#ifdef LIBJPEG
-		_src_mgr			= calloc(1, sizeof(co_jpeg_source_mgr));
-#endif
-		//LOG(@"A: freeThresh=%lf totalThresh=%lf ubc_thresh=%u", (freeThresh), (totalThresh), ubc_threshold);
-		//LOG(@"B: freeThresh=%d totalThresh=%d ubc_thresh=%d", (int)(freeThresh/(1024*1024)), (int)(totalThresh/(1024*1024)), (int)(_ubc_threshold/(1024*1024)));
+		TCBuilderOptions options = { (size_t)sz.width, (size_t)sz.height, 0, (int)orient, [NSTemporaryDirectory() fileSystemRepresentation], dctScaling, decodeThreads, tileQuality, 0, TC_PRIORITY_NORMAL };
+		_core		= TCBuilderCreate(&options);
+		assert(_core);
 
 		[[NSNotificationCenter defaultCenter] addObserver:self selector: @selector(lowMemory:) name:UIApplicationDidReceiveMemoryWarningNotification object:[UIApplication sharedApplication]];
 	}
@@ -235,17 +156,13 @@ static float				ubc_threshold_ratio;
 
 - (id)initWithImage:(CGImageRef)image levels:(NSUInteger)levels orientation:(NSInteger)orient
 {
-	if((self = [self initWithDecoder:cgimageDecoder levels:levels])) {
-		orientation = orient;
-		{
-			mapWholeFile = YES;
-			[self decodeImage:image];
-		}
+	if((self = [self initWithDecoder:cgimageDecoder levels:levels orientation:orient])) {
+		[self decodeImage:image];
 
 #if TIMING_STATS == 1 && !defined(NDEBUG)
-		finishTime = [self timeStamp];
-		milliSeconds = (uint32_t)DeltaMAT(startTime, finishTime);
-		LOG(@"FINISH: %u milliseconds", milliSeconds);
+		_finishTime = [self timeStamp];
+		_milliSeconds = TCDeltaMilliSeconds(_startTime, _finishTime);
+		LOG(@"FINISH: %u milliseconds", _milliSeconds);
 #endif
 #if MEMORY_DEBUGGING == 1
 		[self freeMemory:@"FINISHED"];
@@ -256,22 +173,20 @@ static float				ubc_threshold_ratio;
 
 - (id)initWithImagePath:(NSString *)path withDecode:(ImageDecoder)dec levels:(NSUInteger)levels orientation:(NSInteger)orient
 {
-	if((self = [self initWithDecoder:dec levels:levels])) {
-		orientation = orient;
+	if((self = [self initWithDecoder:dec levels:levels orientation:orient])) {
 #ifdef LIBJPEG
-		if(decoder == libjpegIncremental) {
+		if(_decoder == libjpegIncremental) {
 			[self jpegInitFile:path];
 		} else
 #endif		
 		{
-			mapWholeFile = YES;
 			[self decodeImageURL:[NSURL fileURLWithPath:path]];
 		}
 
 #if TIMING_STATS == 1 && !defined(NDEBUG)
-		finishTime = [self timeStamp];
-		milliSeconds = (uint32_t)DeltaMAT(startTime, finishTime);
-		LOG(@"FINISH-I: %u milliseconds", milliSeconds);
+		_finishTime = [self timeStamp];
+		_milliSeconds = TCDeltaMilliSeconds(_startTime, _finishTime);
+		LOG(@"FINISH-I: %u milliseconds", _milliSeconds);
 #endif
 #if MEMORY_DEBUGGING == 1
 		[self freeMemory:@"FINISHED"];
@@ -281,112 +196,148 @@ static float				ubc_threshold_ratio;
 }
 - (id)initForNetworkDownloadWithDecoder:(ImageDecoder)dec levels:(NSUInteger)levels orientation:(NSInteger)orient
 {
-	if((self = [self initWithDecoder:dec levels:levels])) {
-		orientation = orient;
+	if((self = [self initWithDecoder:dec levels:levels orientation:orient])) {
 #ifdef LIBJPEG
-		if(decoder == libjpegIncremental) {
+		if(_decoder == libjpegIncremental) {
 			[self jpegInitNetwork];
 		} else 
 #endif
 		{
-			mapWholeFile = YES;
-			[self createImageFile];
+			TCBuilderCreateImageFile(_core);
 		}
 	}
 	return self;
 }
-- (id)initWithDecoder:(ImageDecoder)dec levels:(NSUInteger)levels
+- (id)initWithDecoder:(ImageDecoder)dec levels:(NSUInteger)levels orientation:(NSInteger)orient
 {
 	if((self = [super init])) {
 #if TIMING_STATS == 1 && !defined(NDEBUG)
-		startTime = [self timeStamp];
+		_startTime = [self timeStamp];
 #endif		
-		zoomLevels = levels;
-		ims = calloc(zoomLevels, sizeof(imageMemory));
-		decoder = dec;
-		pageSize = getpagesize();
+		_decoder	= dec;
 
-		// Take a big chunk of either free memory or all memory
-		freeMemory fm		= [self freeMemory:@"Initialize"];
-		float freeThresh	= (float)fm.freeMemory*ubc_threshold_ratio;
-		float totalThresh	= (float)fm.totlMemory*ubc_threshold_ratio;
-		ubc_threshold		= lrintf(MAX(freeThresh, totalThresh));
+		TCBuilderOptions options = { 0, 0, levels, (int)orient, [NSTemporaryDirectory() fileSystemRepresentation], dctScaling, decodeThreads, tileQuality, 0, TC_PRIORITY_NORMAL };
+		_core		= TCBuilderCreate(&options);
+		assert(_core);
 
-#ifdef LIBJPEG
-		src_mgr				= calloc(1, sizeof(co_jpeg_source_mgr));
+		[[NSNotificationCenter defaultCenter] addObserver:self selector: @selector(lowMemory:) name:UIApplicationDidReceiveMemoryWarningNotification object:[UIApplication sharedApplication]];
+	}
+	return self;
+}
+#endif // LEVELS_INIT == 0
+
+- (id)initWithArchive:(NSString *)path
+{
+	if((self = [super init])) {
+#if TIMING_STATS == 1 && !defined(NDEBUG)
+		_startTime = [self timeStamp];
 #endif
-		//LOG(@"freeThresh=%d totalThresh=%d ubc_thresh=%d", (int)freeThresh/(1024*1024), (int)totalThresh/(1024*1024), (int)ubc_threshold/(1024*1024));
+		_core = TCBuilderOpenArchive([path fileSystemRepresentation]);
+		if(!_core) return nil;
 
+#if TIMING_STATS == 1 && !defined(NDEBUG)
+		_finishTime = [self timeStamp];
+		_milliSeconds = TCDeltaMilliSeconds(_startTime, _finishTime);
+		LOG(@"ARCHIVE: %u milliseconds", _milliSeconds);
+#endif
 		[[NSNotificationCenter defaultCenter] addObserver:self selector: @selector(lowMemory:) name:UIApplicationDidReceiveMemoryWarningNotification object:[UIApplication sharedApplication]];
 	}
 	return self;
 }
-#endif // LEVELS_INIT == 0
+
+- (BOOL)saveToArchive:(NSString *)path
+{
+	return TCBuilderSaveArchive(_core, [path fileSystemRepresentation]);
+}
 
 - (void)dealloc
 {
 	[[NSNotificationCenter defaultCenter] removeObserver:self];		
 
-	for(NSUInteger idx=0; idx<_zoomLevels;++idx) {
-		int fd = _ims[idx].map.fd;
-		if(fd>0) close(fd);
-	}
-	free(_ims);
-
-	if(_imageFile) fclose(_imageFile);
-	if(_imagePath) unlink([_imagePath fileSystemRepresentation]);
-#ifdef LIBJPEG
-	if(_src_mgr->cinfo.src)	jpeg_destroy_decompress(&_src_mgr->cinfo);
-	free(_src_mgr);
-#endif
+	TCBuilderRelease(_core);
 }
 
 - (void)lowMemory:(NSNotification *)note
 {
-LOG(@"YIKES LOW MEMORY: ubc_threshold=%d ubc_usage=%d", _ubc_threshold, ubc_usage);
-	_ubc_threshold = (int32_t)lrintf((float)_ubc_threshold * ubc_threshold_ratio);
-	
-	[self freeMemory:@"Yikes!"];
+LOG(@"YIKES LOW MEMORY: ubc_threshold=%lld", TCBuilderGetUbcThreshold(_core));
+	TCBuilderLowMemory(_core);
 }		
 
-- (NSUInteger)zoomLevelsForSize:(CGSize)imageSize;
+#pragma mark Core State
+
+- (BOOL)failed
 {
-	int zLevels = 1;	// Must always have "1"
-	while(YES) {
-		imageSize.width /= 2.0f;
-		imageSize.height /= 2.0f;
-		//LOG(@"zoomLevelsForSize: TEST IF reducedHeight=%f <= height=%f || reductedWidth=%f < width=%f zLevels=%d", imageSize.height, size.height, imageSize.width, size.width, zLevels);
-		
-		// We don't want to define levels that could only be magnified when viewed, not reduced.
-		if(imageSize.height < _size.height || imageSize.width < _size.width) break;
-		++zLevels;
-	}
-LOG(@"ZLEVELS=%d", zLevels);
-	return zLevels;
+	return TCBuilderFailed(_core);
+}
+- (void)setFailed:(BOOL)failed
+{
+	if(failed) TCBuilderSetFailed(_core);
 }
 
+- (NSInteger)orientation
+{
+	return TCBuilderGetOrientation(_core);
+}
+- (void)setOrientation:(NSInteger)orientation
+{
+	TCBuilderSetOrientation(_core, (int)orientation);
+}
+
+- (NSUInteger)zoomLevels
+{
+	return TCBuilderGetZoomLevels(_core);
+}
+
+- (int64_t)ubc_threshold
+{
+	return TCBuilderGetUbcThreshold(_core);
+}
+- (void)setUbc_threshold:(int64_t)ubc_threshold
+{
+	TCBuilderSetUbcThreshold(_core, ubc_threshold);
+}
+
+- (void)setPriority:(ImagePriority)priority
+{
+	_priority = priority;
+	TCBuilderSetPriority(_core, (int)priority);
+}
+
+#pragma mark Decoding
+
 - (void)writeToImageFile:(NSData *)data
 {
 	size_t len = [data length];	// got a zero byte data object!
-	if(!_failed && len) {
-		size_t ret = fwrite([data bytes], len, 1, _imageFile);
-		assert(ret == 1);
-		if(ret != 1) _failed = YES;
+	if(len) {
+		BOOL ret = TCBuilderAppendImageData(_core, [data bytes], len);
+		assert(ret);
+		(void)ret;
 	}
 }
 
+- (void)writeToImageFile:(NSData *)data atOffset:(NSUInteger)offset
+{
+	// a dispatch_data_t, so each of its regions where it is
+	dispatch_data_apply((dispatch_data_t)data, ^bool(dispatch_data_t region, size_t regionOffset, const void *buffer, size_t size) {
+		(void)region;
+		return TCBuilderWriteImageData(self->_core, (off_t)(offset + regionOffset), buffer, size);
+	});
+}
+
 - (void)dataFinished
 {
-	if(!_failed) {
+	if(!self.failed) {
 		_startTime = [self timeStamp];
 
-		fclose(_imageFile); _imageFile = NULL;
-		[self decodeImageURL:[NSURL fileURLWithPath:_imagePath]];
-		unlink([_imagePath fileSystemRepresentation]); _imagePath = NULL;
+		const char *path = TCBuilderCloseImageFile(_core);
+		if(path) {
+			[self decodeImageURL:[NSURL fileURLWithPath:[NSString stringWithUTF8String:path]]];
+		}
+		TCBuilderRemoveImageFile(_core);
 		
 #if TIMING_STATS == 1 && !defined(NDEBUG)
 		_finishTime = [self timeStamp];
-		_milliSeconds = (uint32_t)DeltaMAT(_startTime, _finishTime);
+		_milliSeconds = TCDeltaMilliSeconds(_startTime, _finishTime);
 		LOG(@"FINISH: %u milliseconds", _milliSeconds);
 #endif
 #if MEMORY_DEBUGGING == 1
@@ -405,25 +356,26 @@ LOG(@"ZLEVELS=%d", zLevels);
 	} else
 #endif
 	if(_decoder == cgimageDecoder) {
-		_failed = YES;
+		BOOL success = NO;
 		CGImageSourceRef imageSourcRef = CGImageSourceCreateWithURL((__bridge CFURLRef)url, NULL);
 		if(imageSourcRef) {
 			CFDictionaryRef dict = CGImageSourceCopyPropertiesAtIndex(imageSourcRef, 0, NULL);
 			if(dict) {
 				//CFShow(dict);
 				_properties = CFBridgingRelease(dict);
-				if(!_orientation) {
-					_orientation = [[_properties objectForKey:@"Orientation"] integerValue];
+				if(!self.orientation) {
+					self.orientation = [[_properties objectForKey:@"Orientation"] integerValue];
 				}
 			}
 			CGImageRef image = CGImageSourceCreateImageAtIndex(imageSourcRef, 0, NULL);
 			CFRelease(imageSourcRef); imageSourcRef = NULL;
 			if(image) {
-				_failed = NO;
+				success = YES;
 				[self decodeImage:image];
 				CGImageRelease(image);
 			}
 		}
+		if(!success) self.failed = YES;
 	}
 }
 
@@ -433,216 +385,49 @@ LOG(@"ZLEVELS=%d", zLevels);
 	
 	size_t width	= CGImageGetWidth(image);
 	size_t height	= CGImageGetHeight(image);
-	
-#if LEVELS_INIT == 0
-	_zoomLevels = [self zoomLevelsForSize:CGSizeMake(width, height)];
-	_ims = calloc(_zoomLevels, sizeof(imageMemory));
-#endif
-
-	[self mapMemoryForIndex:0 width:width height:height];
-	[self drawImage:image];
-	if(!_failed) [self createLevelsAndTile];
-}
-
-- (BOOL)createImageFile
-{
-	BOOL success;
-	int fd = [self createTempFile:NO size:0];
-	if(fd == -1) {
-		_failed = YES;
-		success = NO;
-	} else {
-		if ((_imageFile = fdopen(fd, "r+")) == NULL) {
-			LOG(@"Error: failed to fdopen image file \"%@\" for \"r+\" (%d).", _imagePath, errno);
-			close(fd);
-			_failed = YES;
-			success = NO;
-		} else {
-			success = YES;
-		}
-	}
-	return success;
-}
-
-- (int)createTempFile:(BOOL)unlinkFile size:(size_t)sz
-{
-	char *template = strdup([[NSTemporaryDirectory() stringByAppendingPathComponent:@"imXXXXXX"] fileSystemRepresentation]);
-	int fd = mkstemp(template);
-	//LOG(@"CREATE TMP FILE: %s fd=%d", template, fd);
-	if(fd == -1) {
-		_failed = YES;
-		LOG(@"OPEN failed file %s %s", template, strerror(errno));
-	} else {
-		if(unlinkFile) {
-			unlink(template);	// so it goes away when the fd is closed or on a crash
-
-			int ret = fcntl(fd, F_RDAHEAD, 0);	// don't clog up the system's disk cache
-			if(ret == -1) {
-				LOG(@"Warning: cannot turn off F_RDAHEAD for input file (errno %s).", strerror(errno) );
-			}
-
-			fstore_t fst;
-			fst.fst_flags      = 0; 				/* iOS10 broke F_ALLOCATECONTIG;*/  // could add F_ALLOCATEALL?
-			fst.fst_posmode    = F_PEOFPOSMODE;     // allocate from EOF (0)
-			fst.fst_offset     = 0;                 // offset relative to the EOF
-			fst.fst_length     = sz;
-			fst.fst_bytesalloc = 0;                 // why not but is not needed
-
-			ret = ftruncate(fd, sz);				// Now the file is there for sure
-			if(ret == -1) {
-				LOG(@"Warning: cannot ftruncate input file (errno %s).", strerror(errno) );
-			}
-		} else {
-			_imagePath = [NSString stringWithCString:template encoding:NSASCIIStringEncoding];
-			
-			int ret = fcntl(fd, F_NOCACHE, 1);	// don't clog up the system's disk cache
-			if(ret == -1) {
-				LOG(@"Warning: cannot turn off cacheing for input file (errno %s).", strerror(errno) );
-			}
-		}
-	}
-	free(template);
+	size_t bytesPerRow;
 
-	return fd;
-}
-- (void)mapMemoryForIndex:(size_t)idx width:(size_t)w height:(size_t)h
-{
-	// Don't open another file til memory pressure has dropped
-	dispatch_group_wait(fileFlushGroup, DISPATCH_TIME_FOREVER);
-	imageMemory *imsP = &_ims[idx];
-	
-	imsP->map.width = w;
-	imsP->map.height = h;
-	
-	imsP->index = idx;
-	imsP->rows = calcDimension(imsP->map.height)/tileDimension;
-	imsP->cols = calcDimension(imsP->map.width)/tileDimension;
-#if 0
-#error This exposed a compiler bug
-	mapper *mapP = &imsP->map;
-	imsP->col0offset = see below;
-	imsP->row0offset = see below
-#else
-	[self mapMemory:&imsP->map];
-	
-	{
-		BOOL colOffset = NO;
-		BOOL rowOffset = NO; 
-		switch(_orientation) {
-		case 0:
-		case 1:
-		case 5:
-			break;
-		case 2:
-		case 8:
-			colOffset = YES;
-			break;
-		case 3:
-		case 7:
-			colOffset = YES;
-			rowOffset = YES;
-			break;
-		case 4:
-		case 6:
-			rowOffset = YES;
-			break;
-		}
-		if(colOffset) {
-			imsP->map.col0offset = imsP->map.bytesPerRow - imsP->map.width*bytesPerPixel;
-		}
-		if(rowOffset) {
-			imsP->map.row0offset = imsP->rows * tileDimension - imsP->map.height;
-			// LOG(@"ROW OFFSET = %ld", imsP->map.row0offset);
-		}
-		if(_orientation >= 5 && _orientation <= 8) imsP->rotated = YES;
+	unsigned char *addr = TCBuilderBeginImage(_core, width, height, &bytesPerRow);
+	if(addr) {
+		[self drawImage:image into:addr width:width height:height bytesPerRow:bytesPerRow];
+		TCBuilderFinishImage(_core);
 	}
 }
 
-- (void)mapMemory:(mapper *)mapP
+- (void)updateProperties:(NSData *)data
 {
-#endif
-	mapP->bytesPerRow = calcBytesPerRow(mapP->width);
-	mapP->emptyTileRowSize = mapP->bytesPerRow * tileDimension;
-	mapP->mappedSize = mapP->bytesPerRow * calcDimension(mapP->height) + mapP->emptyTileRowSize;
-	// LOG(@"CALC: %lu", calcDimension(mapP->height));
-
-	//dumpMapper("Yikes!", mapP);
-
-	//LOG(@"mapP->fd = %d", mapP->fd);
-	if(mapP->fd <= 0) {
-		//LOG(@"Was 0 so call create");
-		mapP->fd = [self createTempFile:YES size:mapP->mappedSize];
-		if(mapP->fd == -1) return;
-	}
+	CGImageSourceRef imageSourcRef = CGImageSourceCreateIncremental(NULL);
+	CGImageSourceUpdateData(imageSourcRef, (__bridge CFDataRef)data, NO);
 
-	if(mapWholeFile && !mapP->emptyAddr) {	
-		mapP->emptyAddr = mmap(NULL, mapP->mappedSize, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED | MAP_NOCACHE, mapP->fd, 0);	//  | MAP_NOCACHE
-		mapP->addr = mapP->emptyAddr + mapP->emptyTileRowSize;
-		if(mapP->emptyAddr == MAP_FAILED) {
-			_failed = YES;
-			LOG(@"FAILED to allocate %lu bytes - errno3=%s", mapP->mappedSize, strerror(errno) );
-			mapP->emptyAddr = NULL;
-			mapP->addr = NULL;
-			mapP->mappedSize = 0;
-		}
-#if MMAP_DEBUGGING == 1
-		LOG(@"MMAP[%d]: addr=%p 0x%X bytes", mapP->fd, mapP->emptyAddr, (NSUInteger)mapP->mappedSize);
-#endif
+	CFDictionaryRef dict = CGImageSourceCopyPropertiesAtIndex(imageSourcRef, 0, NULL);
+	if(dict) {
+		//CFShow(dict);
+		self.properties = CFBridgingRelease(dict);
 	}
+	CFRelease(imageSourcRef);
 }
 
 - (CGSize)imageSize
 {
-#if LIBJPEG
-	switch(self.orientation) {
-	case 5:
-	case 6:
-	case 7:
-	case 8:
-		return CGSizeMake(_ims[0].map.height, _ims[0].map.width);
-	default:
-		return CGSizeMake(_ims[0].map.width, _ims[0].map.height);
-	}
-#else
-	//NSLog(@"decoder %d", (int)(cgimageDecoder));
-	//NSLog(@"props %@", _properties);
-
-	CGFloat width = [_properties[@"PixelWidth"] floatValue];
-	CGFloat height = [_properties[@"PixelHeight"] floatValue];
-	
-	switch(self.orientation) {
-	case 5:
-	case 6:
-	case 7:
-	case 8:
-		return CGSizeMake(height, width);
-	default:
-		return CGSizeMake(width, height);
-	}
-#endif
+	size_t width, height;
+	TCBuilderGetImageSize(_core, &width, &height);	// orientation already applied
+	return CGSizeMake(width, height);
 }
 
-- (void)drawImage:(CGImageRef)image
+- (void)drawImage:(CGImageRef)image into:(unsigned char *)addr width:(size_t)width height:(size_t)height bytesPerRow:(size_t)bytesPerRow
 {
-	if(image && !_failed) {
-		assert(_ims[0].map.addr);
-
+	if(image && !self.failed) {
 #if MEMORY_DEBUGGING == 1
 		[self freeMemory:@"drawImage start"];
 #endif
-		madvise(_ims[0].map.addr, _ims[0].map.mappedSize-_ims[0].map.emptyTileRowSize, MADV_SEQUENTIAL);
-
-		unsigned char *addr = _ims[0].map.addr + _ims[0].map.col0offset + _ims[0].map.row0offset*_ims[0].map.bytesPerRow;
-		CGContextRef context = CGBitmapContextCreate(addr, _ims[0].map.width, _ims[0].map.height, bitsPerComponent, _ims[0].map.bytesPerRow, colorSpace,
+		CGContextRef context = CGBitmapContextCreate(addr, width, height, bitsPerComponent, bytesPerRow, colorSpace,
 			kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder32Little); 	// kCGImageAlphaNoneSkipFirst kCGImageAlphaNoneSkipLast   kCGBitmapByteOrder32Big kCGBitmapByteOrder32Little
 		assert(context);
 		CGContextSetBlendMode(context, kCGBlendModeCopy); // Apple uses this in QA1708
-		CGRect rect = CGRectMake(0, 0, _ims[0].map.width, _ims[0].map.height);
+		CGRect rect = CGRectMake(0, 0, width, height);
 		CGContextDrawImage(context, rect, image);
 		CGContextRelease(context);
 
-		madvise(_ims[0].map.addr, _ims[0].map.mappedSize-_ims[0].map.emptyTileRowSize, MADV_FREE); // MADV_DONTNEED
-
 #if MEMORY_DEBUGGING == 1
 		[self freeMemory:@"drawImage done"];
 #endif
@@ -653,7 +438,7 @@ LOG(@"ZLEVELS=%d", zLevels);
 
 - (uint64_t)timeStamp
 {
-	return mach_absolute_time();
+	return TCTimeStamp();
 }
 
 - (uint64_t)freeDiskspace
@@ -681,80 +466,7 @@ LOG(@"ZLEVELS=%d", zLevels);
 
 - (freeMemory)freeMemory:(NSString *)msg
 {
-	// http://stackoverflow.com/questions/5012886
-    mach_port_t host_port;
-    mach_msg_type_number_t host_size;
-    vm_size_t pagesize;
-	freeMemory fm = { 0, 0, 0, 0, 0 };
-
-    host_port = mach_host_self();
-    host_size = sizeof(vm_statistics_data_t) / sizeof(integer_t);
-    host_page_size(host_port, &pagesize);        
-
-    vm_statistics_data_t vm_stat;
-
-    if (host_statistics(host_port, HOST_VM_INFO, (host_info_t)&vm_stat, &host_size) != KERN_SUCCESS) {
-        LOG(@"Failed to fetch vm statistics");
-	} else {
-		/* Stats in bytes */ 
-		natural_t mem_used = (natural_t)((vm_stat.active_count +
-							  vm_stat.inactive_count +
-							  vm_stat.wire_count) * pagesize);
-		natural_t mem_free = (natural_t)(vm_stat.free_count * pagesize);
-		natural_t mem_total = mem_used + mem_free;
-		
-		fm.freeMemory = (size_t)mem_free;
-		fm.usedMemory = (size_t)mem_used;
-		fm.totlMemory = (size_t)mem_total;
-		
-		struct task_basic_info info;
-		if(dump_memory_usage(&info)) {
-			fm.resident_size = (size_t)info.resident_size;
-			fm.virtual_size = (size_t)info.virtual_size;
-		}
-		
-#if MEMORY_DEBUGGING == 1
-		LOG(@"%@:   "
-			"total: %u "
-			"used: %u "
-			"FREE: %u "
-			"  [resident=%u virtual=%u]", 
-			msg, 
-			(unsigned int)mem_total, 
-			(unsigned int)mem_used, 
-			(unsigned int)mem_free, 
-			(unsigned int)fm.resident_size, 
-			(unsigned int)fm.virtual_size
-		);
-#endif
-	}
-	return fm;
+	return TCFreeMemory([msg UTF8String]);
 }
 
-
 @end
-
-#if 0
-// http://stackoverflow.com/questions/5182924/where-is-my-ipad-runtime-memory-going
-# include <mach/mach.h>
-# include <mach/mach_host.h>
-
-void dump_memory_usage() {
-  task_basic_info info;
-  mach_msg_type_number_t size = sizeof( info );
-  kern_return_t kerr = task_info( mach_task_self(), TASK_BASIC_INFO, (task_info_t)&info, &size );
-  if ( kerr == KERN_SUCCESS ) {
-    LOG( @"task_info: 0x%08lx 0x%08lx\n", info.virtual_size, info.resident_size );
-  }
-  else {
-    LOG( @"task_info failed with error %ld ( 0x%08lx ), '%s'\n", kerr, kerr, mach_error_string( kerr ) );
-  }
-}
-#endif
-
-
-static BOOL dump_memory_usage(struct task_basic_info *info) {
-  mach_msg_type_number_t size = sizeof( struct task_basic_info );
-  kern_return_t kerr = task_info( mach_task_self(), TASK_BASIC_INFO, (task_info_t)info, &size );
-  return ( kerr == KERN_SUCCESS );
-}
@@ -21,6 +21,7 @@
 
 - (id)initWithImageBuilder:(TiledImageBuilder *)imageBuilder;
 - (CGSize)imageSize;
+- (void)prefetchVisibleRect:(CGRect)rect zoomScale:(CGFloat)zoomScale;	// rect in this view's coordinates
 //- (UIImage *)image;
 
 @end
@@ -64,6 +64,11 @@
     return self;
 }
 
+- (void)prefetchVisibleRect:(CGRect)rect zoomScale:(CGFloat)zoomScale
+{
+	[tb prefetchForScale:zoomScale visibleRect:CGRectIntersection(rect, self.bounds)];
+}
+
 //static inline long offsetFromScale(CGFloat scale) { long s = lrintf(1/scale); long idx = 0; while(s > 1) s /= 2.0f, ++idx; return idx; }
 
 - (void)drawLayer:(CALayer*)layer inContext:(CGContextRef)context
@@ -25,6 +25,7 @@
 @property (nonatomic, assign) NSUInteger orientation;				// 0 == automatic, or force one using 1-8
 @property (nonatomic, assign) NSUInteger zoomLevels;				// type of operation to perform
 @property (nonatomic, assign) NSUInteger index;						// if multiple operations, what index am i
+@property (nonatomic, assign) ImagePriority priority;				// of the builder, see -[TiledImageBuilder priority]
 @property (nonatomic, assign, readonly) uint32_t milliSeconds;		// time it takes to decode the image
 @property (nonatomic, strong) TiledImageBuilder *imageBuilder;		// controller for the bit maps used to provide CATiles
 
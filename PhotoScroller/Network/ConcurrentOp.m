@@ -21,7 +21,7 @@
 
 @implementation ConcurrentOp
 {
-	NSMutableData *data;
+	BOOL	throttled;		// suspended by setWebData: until the decode thread catches up - under @synchronized(self)
 }
 
 - (uint32_t)milliSeconds
@@ -31,26 +31,81 @@
 
 - (NSMutableURLRequest *)setup
 {
-	data = [NSMutableData dataWithCapacity:10000];
-	self.imageBuilder = [[TiledImageBuilder alloc] initForNetworkDownloadWithDecoder:_decoder size:CGSizeMake(320, 320) orientation:_orientation];
+	[self createImageBuilder];
 	return [super setup];
 }
 
+- (void)setPriority:(ImagePriority)priority
+{
+	_priority = priority;
+	_imageBuilder.priority = priority;	// a decode waiting for a build slot moves too
+}
+
+- (void)createImageBuilder
+{
+	self.imageBuilder = [[TiledImageBuilder alloc] initForNetworkDownloadWithDecoder:_decoder size:CGSizeMake(320, 320) orientation:_orientation];
+	_imageBuilder.priority = _priority;
+#ifdef LIBJPEG
+	if(_decoder == libjpegIncremental) {
+		// the builder decodes on a thread of its own; when that falls behind the task is suspended until it catches up
+		__weak __typeof__(self) weakSelf = self;
+		[_imageBuilder jpegStartDecodeThread:^{
+			dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+				[weakSelf resumeDownload];
+			});
+		}];
+	}
+#endif
+}
+
+// A resumed download just goes on: the builder (and its decode thread) never saw the connection drop. Only when
+// the server sent the whole image again, because it changed, is there a new builder for it.
+- (void)restarted
+{
+#ifdef LIBJPEG
+	if(_decoder == libjpegIncremental) {
+		(void)[_imageBuilder jpegFinishData];
+		[self createImageBuilder];
+	}
+#endif
+	[super restarted];
+}
+
+#ifdef LIBJPEG
+// After setWebData: has suspended the task, never before - both hold the lock
+- (void)resumeDownload
+{
+	@synchronized(self) {
+		throttled = NO;
+		[self resumeTask:self.task];
+	}
+}
+#endif
+
+// Neither the runner ending a preemption nor a resumed transfer may let the bytes in while the decode thread is behind
+- (void)resumeTask:(NSURLSessionTask *)task
+{
+	@synchronized(self) {
+		if(!throttled) {
+			[super resumeTask:task];
+		}
+	}
+}
+
 - (void)setWebData:(NSData *)webData
 {
 	super.webData = webData;
 
 #ifdef LIBJPEG
 	if(_decoder == libjpegIncremental) {
-		// Since the SesslonDelegate is trying to be sophisticated, and use the chained dispatch_data obhects,
-		// our consumer is just consuming chunks at its own pace. So we'll always keep the webData at 0 byes,
-		// and use our own internal mutable object to transfer bytes. Its the best compromise we can use.
+		// The SessionDelegate chains what arrives as dispatch_data objects: each region goes to the decode thread as it is,
+		// which lets go of it once it is used, so webData is always reset to 0 bytes here and nothing is copied.
 		if([webData length]) {
-			[data appendData:webData];
-			BOOL consumed = [_imageBuilder jpegAdvance:data];
-			if(consumed) {
-				// This use to be hidden in the imagebuilder class, really was hard to spot
-				[data setLength:0];
+			@synchronized(self) {
+				if(![_imageBuilder jpegQueueData:(dispatch_data_t)webData]) {
+					throttled = YES;
+					[self.task suspend];
+				}
 			}
 			dispatch_queue_t q	= dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
 			void *argNull = NULL;
@@ -61,23 +116,41 @@
 #endif
 }
 
+// Each range of a segmented transfer goes straight to its place in the image file, in whatever order they come
+- (void)receivedData:(NSData *)data atOffset:(NSUInteger)offset
+{
+	[_imageBuilder writeToImageFile:data atOffset:offset];
+}
+
 - (void)completed
 {
 	
 #ifdef LIBJPEG
 	if(_decoder == libjpegIncremental) {
-		if(_imageBuilder.failed) {
+		if(![_imageBuilder jpegFinishData]) {
 			NSLog(@"FAILED!");
 			self.imageBuilder = nil;
 		}
 	} else
 #endif
 	{
-		[_imageBuilder writeToImageFile:self.webData];
+		if(!self.segmentedLength) {
+			[_imageBuilder writeToImageFile:self.webData];	// segmented transfers are in the file already
+		}
 		[_imageBuilder dataFinished];
 	}
 
 	[super completed];
 }
 
+- (void)failed
+{
+#ifdef LIBJPEG
+	if(_decoder == libjpegIncremental) {
+		(void)[_imageBuilder jpegFinishData];	// cut short, the decode thread gives up
+	}
+#endif
+	[super failed];
+}
+
 @end
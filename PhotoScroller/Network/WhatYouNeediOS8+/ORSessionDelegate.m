@@ -36,6 +36,69 @@
 #define LOG(...)
 #endif
 
+#define RESUME_DELAY			0.25	// seconds before the first resume, doubled each time after
+
+// Header values, whatever case the server used
+static NSString *headerValue(NSHTTPURLResponse *response, NSString *name)
+{
+	__block NSString *value;
+	[[response allHeaderFields] enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSString *obj, BOOL *stop)
+		{
+			if([key caseInsensitiveCompare:name] == NSOrderedSame) {
+				value = obj;
+				*stop = YES;
+			}
+		} ];
+	return value;
+}
+
+// What If-Range can use to make sure the rest is from the same resource: a strong ETag, or failing that the date.
+// Bodies the session decompresses can't be resumed, the offsets we count aren't the server's.
+static NSString *resumeValidator(NSHTTPURLResponse *response)
+{
+	NSString *encoding = headerValue(response, @"Content-Encoding");
+	if(encoding && ![encoding isEqualToString:@"identity"]) return nil;
+	if([headerValue(response, @"Accept-Ranges") isEqualToString:@"none"]) return nil;
+
+	NSString *etag = headerValue(response, @"ETag");
+	if(etag && ![etag hasPrefix:@"W/"]) return etag;
+	return headerValue(response, @"Last-Modified");
+}
+
+// What a 206 holds: "Content-Range: bytes <first>-<last>/<length>", length 0 if the server didn't say ("*")
+static BOOL contentRange(NSHTTPURLResponse *response, NSUInteger *first, NSUInteger *last, NSUInteger *length)
+{
+	if([response statusCode] != 206) return NO;
+
+	NSScanner *scanner = [NSScanner scannerWithString:headerValue(response, @"Content-Range") ?: @""];
+	unsigned long long f, l, n = 0;
+	if(![scanner scanString:@"bytes" intoString:NULL] || ![scanner scanUnsignedLongLong:&f] || ![scanner scanString:@"-" intoString:NULL]
+	   || ![scanner scanUnsignedLongLong:&l] || ![scanner scanString:@"/" intoString:NULL]) {
+		return NO;
+	}
+	(void)[scanner scanUnsignedLongLong:&n];
+	*first	= (NSUInteger)f;
+	*last	= (NSUInteger)l;
+	*length	= (NSUInteger)n;
+	return YES;
+}
+
+static dispatch_time_t resumeTime(NSUInteger resumes)
+{
+	return dispatch_time(DISPATCH_TIME_NOW, (int64_t)(RESUME_DELAY * (1 << MIN(resumes - 1, 4)) * NSEC_PER_SEC));
+}
+
+// One range of a segmented transfer, hung on its task
+@interface ORSegment : NSObject
+@property (nonatomic, assign) NSUInteger offset;	// where its next byte goes
+@property (nonatomic, assign) NSUInteger end;		// one past its last
+@end
+
+@implementation ORSegment
+@end
+
+static char segmentKey;
+
 @implementation FECWF_SESSION_DELEGATE
 
 // Overriding the super methods
@@ -75,11 +138,30 @@ LOG(@"YIKES: \"URLSession:didReceiveResponse:task:...\" fetcher=%@ response=%@",
 
 	assert([response isKindOfClass:[NSHTTPURLResponse class]]);
 	NSHTTPURLResponse *httpResponse = (NSHTTPURLResponse *)response;
+
+	if(!fetcher.timeToFirstByte && fetcher.startTime) {
+		fetcher.timeToFirstByte = [NSDate timeIntervalSinceReferenceDate] - fetcher.startTime;
+	}
 	
 	fetcher.htmlStatus = [httpResponse statusCode];
+
+	// a range of a segmented transfer, or the first one, which starts it
+	if(objc_getAssociatedObject(dataTask, &segmentKey) || (fetcher.segments > 1 && !fetcher.segmentedLength && fetcher.htmlStatus == 206 && dataTask == fetcher.task)) {
+		[self segmentTask:dataTask ofFetcher:fetcher inSession:session didReceiveResponse:httpResponse];
+		completionHandler(fetcher.error ? NSURLSessionResponseCancel : NSURLSessionResponseAllow);
+		return;
+	}
+
+	// a resumed transfer carries on where it stopped, unless the server sent the whole thing again
+	NSUInteger first, last, length;
+	BOOL resumed = fetcher.resumes && contentRange(httpResponse, &first, &last, &length) && first == fetcher.resumeOffset;
+	if(fetcher.resumes && !resumed && fetcher.htmlStatus == 200) {
+		[fetcher restarted];
+	}
+
 	BOOL err;
 #if CANCEL_ON_HTML_STATUS
-	err = fetcher.htmlStatus != 200;
+	err = fetcher.htmlStatus != (resumed ? 206 : 200);
 #else
 	err = fetcher.htmlStatus >= 500;
 #endif
@@ -95,14 +177,21 @@ LOG(@"YIKES: \"URLSession:didReceiveResponse:task:...\" fetcher=%@ response=%@",
 	if([[fetcher class] printDebugging]) LOG(@"Connection:didReceiveResponse: response=%@ len=%tu", response, responseLength);
 #endif
 
-	// Must do this here, since we can get an error and still get data!
-	fetcher.totalReceiveSize = responseLength;
-	// LOG(@"EXPECT SIZE %u", responseLength);
-	fetcher.currentReceiveSize = 0;
-	dispatch_queue_t q	= dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	if(resumed) {
+		// what came in before stays, this is the rest of it
+		fetcher.totalReceiveSize = fetcher.resumeOffset + responseLength;
+	} else {
+		// Must do this here, since we can get an error and still get data!
+		fetcher.totalReceiveSize = responseLength;
+		// LOG(@"EXPECT SIZE %u", responseLength);
+		fetcher.currentReceiveSize = 0;
+		fetcher.resumeOffset = 0;
+		fetcher.resumeValidator = resumeValidator(httpResponse);
+		dispatch_queue_t q	= dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
 
-	void *nullArg = NULL;
-	fetcher.webData		= (NSData *)dispatch_data_create(nullArg, 0, q, ^{});
+		void *nullArg = NULL;
+		fetcher.webData		= (NSData *)dispatch_data_create(nullArg, 0, q, ^{});
+	}
 
 	if(fetcher.error) {
 		LOG(@"Cancel due to error: %@", fetcher.error);
@@ -121,6 +210,28 @@ LOG(@"YIKES: \"URLSession:didReceiveResponse:task:...\" fetcher=%@ response=%@",
 		return;
 	}
 
+	if(objc_getAssociatedObject(task, &segmentKey)) {
+		[self segmentTask:task ofFetcher:fetcher inSession:session didCompleteWithError:error];
+		return;
+	}
+
+	// dropped part way: ask for the rest after a pause, and if that can't be done, fail as before
+	if(error && !fetcher.error && fetcher.resumeOffset && [fetcher canResumeAfterError:error]) {
+		fetcher.resumes += 1;
+		LOG(@"RESUME %tu at %tu: %@", fetcher.resumes, fetcher.resumeOffset, error);
+		dispatch_after(resumeTime(fetcher.resumes), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
+			{
+				if(![FECWF_OPERATIONSRUNNER resumeTask:task inSession:session]) {
+					[session.delegateQueue addOperationWithBlock:^
+						{
+							fetcher.resumes = [[fetcher class] maxResumes];
+							[self URLSession:session task:task didCompleteWithError:error];
+						} ];
+				}
+			} );
+		return;
+	}
+
 	if(error && !fetcher.error) {
 		fetcher.error = error;
 	}
@@ -139,8 +250,123 @@ LOG(@"YIKES: \"URLSession:didReceiveResponse:task:...\" fetcher=%@ response=%@",
 	FECWF_WEBFETCHER *fetcher = [FECWF_OPERATIONSRUNNER fetcherForTask:dataTask];
 	//LOG(@"YIKES: \"URLSession:didReceiveData:task:...\" fetcher=%@", fetcher.runMessage);
 
-	fetcher.currentReceiveSize += [data length];
+	@synchronized(fetcher) {	// the ranges of a segmented transfer come in on several threads at once
+		fetcher.currentReceiveSize += [data length];
+		fetcher.transferredBytes += [data length];
+	}
+
+	ORSegment *segment = objc_getAssociatedObject(dataTask, &segmentKey);
+	if(segment) {
+		// straight to its place in the body, and never past the end of the range
+		NSUInteger len = MIN([data length], segment.end - segment.offset);
+		if(len) {
+			NSData *bytes = len == [data length] ? data : (NSData *)dispatch_data_create_subrange((dispatch_data_t)data, 0, len);
+			[fetcher receivedData:bytes atOffset:segment.offset];
+		}
+		segment.offset += len;
+		return;
+	}
+	fetcher.resumeOffset += [data length];
 	fetcher.webData = (NSData *)dispatch_data_create_concat((dispatch_data_t)fetcher.webData, (dispatch_data_t)data);
 }
 
+#pragma mark Segmented Transfers
+
+// The first range says how big the body is: the rest is split over the other connections. Later ranges just have to be the ones asked for.
+- (void)segmentTask:(NSURLSessionDataTask *)task ofFetcher:(FECWF_WEBFETCHER *)fetcher inSession:(NSURLSession *)session didReceiveResponse:(NSHTTPURLResponse *)response
+{
+	ORSegment *segment = objc_getAssociatedObject(task, &segmentKey);
+	NSUInteger first, last, length;
+	BOOL ok = contentRange(response, &first, &last, &length) && first == (segment ? segment.offset : 0) && last >= first
+			  && (segment ? last < segment.end : length > last);
+
+	if(ok && !segment) {
+		@synchronized(fetcher) {
+			fetcher.segmentedLength		= length;
+			fetcher.totalReceiveSize	= length;
+			fetcher.currentReceiveSize	= 0;
+			fetcher.resumeValidator		= resumeValidator(response);
+			fetcher.segmentTasks		= [NSMutableSet setWithObject:task];
+
+			segment = [ORSegment new];
+			segment.end = last + 1;
+			objc_setAssociatedObject(task, &segmentKey, segment, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+
+			NSUInteger minimum	= [[fetcher class] segmentSize];
+			NSUInteger rest		= length - segment.end;
+			NSUInteger count	= MIN(fetcher.segments - 1, (rest + minimum - 1) / minimum);
+			NSUInteger size		= count ? (rest + count - 1) / count : rest;
+			for(NSUInteger start = segment.end; start < length; start += size) {
+				ORSegment *range = [ORSegment new];
+				range.offset	= start;
+				range.end		= MIN(start + size, length);
+
+				NSURLRequest *request = [fetcher rangeRequest:task.originalRequest first:range.offset last:range.end - 1];
+				NSURLSessionDataTask *rangeTask = [FECWF_OPERATIONSRUNNER taskForFetcher:fetcher request:request inSession:session];
+				objc_setAssociatedObject(rangeTask, &segmentKey, range, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+				[fetcher.segmentTasks addObject:rangeTask];
+				[fetcher resumeTask:rangeTask];
+			}
+			LOG(@"SEGMENTED %@: %tu bytes, %tu more ranges of %tu", fetcher.runMessage, length, count, size);
+		}
+	}
+	if(!ok) {
+		@synchronized(fetcher) {
+			if(!fetcher.error) {
+				NSString *msg = [NSString stringWithFormat:@"Network Error %tu, not the range asked for", fetcher.htmlStatus];
+				fetcher.error = [NSError errorWithDomain:@"com.dfh.orsd" code:fetcher.htmlStatus userInfo:@{NSLocalizedDescriptionKey : msg}];
+			}
+		}
+	}
+}
+
+// Done once every range is; a range that drops is asked for again from where it stopped, anything else fails them all.
+// Ranges complete on several threads at once: what they share is looked at and changed under @synchronized(fetcher).
+- (void)segmentTask:(NSURLSessionTask *)task ofFetcher:(FECWF_WEBFETCHER *)fetcher inSession:(NSURLSession *)session didCompleteWithError:(NSError *)error
+{
+	ORSegment *segment = objc_getAssociatedObject(task, &segmentKey);
+	if(!error && segment.offset < segment.end) {
+		error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorNetworkConnectionLost userInfo:@{NSLocalizedDescriptionKey : @"range cut short"}];
+	}
+
+	NSArray *cancelTasks = nil;
+	finishBlock finalBlock;
+	@synchronized(fetcher) {
+		[fetcher.segmentTasks removeObject:task];
+		if(!fetcher.finalBlock) {
+			return;		// already failed
+		}
+
+		if(error && !fetcher.error && [fetcher canResumeAfterError:error]) {
+			fetcher.resumes += 1;
+			LOG(@"RESUME %tu of range at %tu: %@", fetcher.resumes, segment.offset, error);
+			NSURLRequest *request = [fetcher rangeRequest:task.originalRequest first:segment.offset last:segment.end - 1];
+			NSURLSessionDataTask *rangeTask = [FECWF_OPERATIONSRUNNER taskForFetcher:fetcher request:request inSession:session];
+			objc_setAssociatedObject(rangeTask, &segmentKey, segment, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+			[fetcher.segmentTasks addObject:rangeTask];
+			dispatch_after(resumeTime(fetcher.resumes), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
+				{
+					[fetcher resumeTask:rangeTask];	// cancelling the fetcher meanwhile cancelled it
+				} );
+			return;
+		}
+
+		if(error || fetcher.error) {
+			if(!fetcher.error) {
+				fetcher.error = error;
+			}
+			fetcher.errorMessage = [fetcher.error localizedDescription];
+			cancelTasks = [fetcher.segmentTasks allObjects];
+		} else if([fetcher.segmentTasks count]) {
+			return;		// the others are still coming in
+		}
+		finalBlock = fetcher.finalBlock;	// only the last range, or the first to fail, gets it
+		fetcher.finalBlock = nil;
+	}
+	[cancelTasks makeObjectsPerformSelector:@selector(cancel)];
+
+	LOG(@"YIKES: segmented transfer done fetcher=%@ error=%@", fetcher.runMessage, fetcher.error);
+	finalBlock(fetcher, fetcher.errorMessage ? NO : YES);
+}
+
 @end
@@ -33,6 +33,7 @@
 #define DEFAULT_MAX_OPS					4						// Apple suggests a number like 4 for iOS, would not exceed 10, as each is a NSThread
 #define DEFAULT_PRIORITY	DISPATCH_QUEUE_PRIORITY_DEFAULT		// both dispatch queues use this
 #define DEFAULT_MILLI_SEC_CANCEL_DELAY	100
+#define DEFAULT_ADAPTIVE_MAX_OPS		0						// 0 == maxOps stays where it is set
 
 // how do you want the return message delivered
 typedef enum { msgDelOnMainThread=0, msgDelOnAnyThread, msgOnSpecificThread, msgOnSpecificQueue } msgType;
@@ -46,6 +47,7 @@ typedef enum { msgDelOnMainThread=0, msgDelOnAnyThread, msgOnSpecificThread, msg
 @property (nonatomic, assign) long priority;					// targets the internal GCD queue doleing out the operations
 @property (nonatomic, assign) NSUInteger maxOps;				// set the NSOperationQueue's maxConcurrentOperationCount
 @property (nonatomic, assign) NSUInteger mSecCancelDelay;		// set the NSOperationQueue's maxConcurrentOperationCount
+@property (nonatomic, assign) NSUInteger adaptiveMaxOps;		// non-0: maxOps is tuned between 1 and this, from throughput and time to first byte
 
 // Optionally share one session between every instance of OperationsRunner (if you create this all future operations will use it
 + (void)createSharedSessionWithConfiguration:(NSURLSessionConfiguration *)config delegate:(id <NSURLSessionDataDelegate>) delegate;
@@ -53,11 +55,16 @@ typedef enum { msgDelOnMainThread=0, msgDelOnAnyThread, msgOnSpecificThread, msg
 // Given the task, get the fetcher (needed by the Session Delegate)
 + (FECWF_WEBFETCHER *)fetcherForTask:(NSURLSessionTask *)task;
 
+// More tasks for a running fetcher (also needed by the Session Delegate): the rest of a dropped transfer, or any other request, not yet resumed
++ (BOOL)resumeTask:(NSURLSessionTask *)task inSession:(NSURLSession *)session;
++ (NSURLSessionDataTask *)taskForFetcher:(FECWF_WEBFETCHER *)fetcher request:(NSURLRequest *)request inSession:(NSURLSession *)session;
+
 // These methods are for direct messaging. The reason cancelOperations is here is to prevent the creation of an object, just to cancel it.
 - (id)initWithDelegate:(id <FECWF_OPSRUNNER_PROTOCOL>)del;		// designated initializer
 
 - (void)runOperation:(FECWF_WEBFETCHER *)op withMsg:(NSString *)msg;	// to submit an operation
 - (BOOL)runOperations:(NSOrderedSet *)operations;	// Set of FECWF_WEBFETCHER objects with their runMessage set (or not)
+- (void)setPriority:(NSInteger)priority ofOperation:(FECWF_WEBFETCHER *)op;	// its queuePriority, waiting or running: higher ones go first, and suspend lower ones when all slots are taken
 - (NSUInteger)operationsCount;						// returns the total number of outstanding operations, use wisely, some finished ops already queued count until delivered
 - (BOOL)cancelOperations;							// stop all work, will not get any more delegate calls after it returns, returns YES if everything torn down properly
 
@@ -25,6 +25,8 @@
 #include <libkern/OSAtomic.h>
 #endif
 
+#include <stdatomic.h>
+
 #if 0	// 0 == no debug, 1 == lots of mesages
 #define LOG(...) NSLog(__VA_ARGS__)
 #else
@@ -35,17 +37,59 @@
 #import "ORSessionDelegate.h"
 #import "WebFetcher8.h"
 
+// Adaptive maxOps: measured in windows while operations wait for a slot, one more or one less at a time
+#define ADAPT_TICK				0.5		// seconds between looks at the bytes transferred
+#define ADAPT_WINDOW_TICKS		4		// a window is 2 seconds of transfers
+#define ADAPT_LEVELS			32		// most operations that are ever measured
+#define ADAPT_STALE				8		// windows before the rate at a level is measured again
+#define ADAPT_MARGIN			0.05	// rates this close are the same
+#define ADAPT_TTFB_FACTOR		2.0		// first bytes this much slower than lately: requests queue somewhere, back off
+#define ADAPT_TTFB_WINDOWS		8		// lately: the best of this many windows, since maxOps last changed
+
 static NSURLSession *sharedSession;
 
+// The running and held operations belong to the opRunnerQueue alone. Other threads hand it work through the intake: a
+// lock free stack any thread pushes on, that the queue takes all at once and puts back in order. One drain block runs
+// for however many pushes came before it, and the count of operations is a counter - nothing waits on a lock.
+typedef enum { intakeSubmit, intakeFinished } intakeKind;
+
+typedef struct orIntake {
+	struct orIntake		*next;
+	void				*op;		// retained
+	intakeKind			kind;
+} orIntake;
+
+static bool intakePush(orIntake *_Atomic *stack, orIntake *item)	// true == it was empty, the drain needs scheduling
+{
+	item->next	= atomic_load_explicit(stack, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(stack, &item->next, item, memory_order_release, memory_order_relaxed)) ;
+	return item->next == NULL;
+}
+
+static orIntake *intakeTake(orIntake *_Atomic *stack)	// everything pushed so far, oldest first
+{
+	orIntake *item = atomic_exchange_explicit(stack, NULL, memory_order_acquire);
+	orIntake *list = NULL;
+	while(item) {
+		orIntake *next = item->next;
+		item->next = list;
+		list = item;
+		item = next;
+	}
+	return list;
+}
+
+static void *queueKey = &queueKey;
+
 
 @interface FECWF_WEBFETCHER (OperationsRunner)
 - (BOOL)_OR_cancel:(NSUInteger)millisecondDelay;							// for use by OperationsRunner
+- (void)_OR_preempt:(BOOL)preempt;											// for use by OperationsRunner
 @end
 
 @interface FECWF_OPERATIONSRUNNER ()
-@property (nonatomic, strong) NSMutableSet				*operations;
-@property (nonatomic, strong) NSMutableOrderedSet		*operationsOnHold;	// output ops in the order they arrived
-@property (nonatomic, strong) dispatch_semaphore_t		dataSema;
+@property (nonatomic, strong) NSMutableSet				*operations;		// opRunnerQueue only
+@property (nonatomic, strong) NSMutableOrderedSet		*operationsOnHold;	// opRunnerQueue only: highest queuePriority first, then in the order they arrived (or were preempted)
 @property (nonatomic, strong) dispatch_queue_t			opRunnerQueue;
 @property (nonatomic, strong) dispatch_group_t			opRunnerGroup;
 @property (nonatomic, strong) NSURLSession				*urlSession;
@@ -62,6 +106,24 @@ static NSURLSession *sharedSession;
 @implementation FECWF_OPERATIONSRUNNER
 {
 	long		_priority;							// the queue priority      
+
+	orIntake * _Atomic	intake;
+	atomic_size_t		outstanding;					// submitted and not finished, from any thread
+
+	// adaptive maxOps - the rest of these only on the opRunnerQueue
+	dispatch_source_t	adaptTimer;
+	uint64_t			finishedBytes;					// transferred by operations no longer here
+	NSTimeInterval		ttfbSum;						// of the operations finished this window
+	NSUInteger			ttfbCount;
+	NSTimeInterval		ttfbAt[ADAPT_TTFB_WINDOWS];		// ring, the mean of each of the last windows
+	NSUInteger			ttfbWindows;					// in the ring, 0 after every change of maxOps
+	uint64_t			adaptBytes;						// all transferred, as of the last tick
+	uint64_t			windowBytes;
+	NSUInteger			windowTicks;
+	NSUInteger			settleTicks;					// after a change, while the new connections get going
+	NSUInteger			windows;
+	double				rateAt[ADAPT_LEVELS+1];			// bytes/second with that many operations
+	NSUInteger			windowAt[ADAPT_LEVELS+1];		// when that was measured, 0 == never
 #ifdef VERIFY_DEALLOC
 	int32_t		_DO_NOT_ACCESS_operationsTotal;		// named so as to discourage direct access
 #endif
@@ -85,6 +147,27 @@ static NSURLSession *sharedSession;
 	return fetcher;
 }
 
++ (BOOL)resumeTask:(NSURLSessionTask *)task inSession:(NSURLSession *)session
+{
+	FECWF_WEBFETCHER *fetcher = [self fetcherForTask:task];
+	if(!fetcher || fetcher.isCancelled || !task.originalRequest) {
+		return NO;
+	}
+
+	NSURLSessionDataTask *resumeTask = [self taskForFetcher:fetcher request:[fetcher resumeRequest:task.originalRequest] inSession:session];
+	fetcher.task = resumeTask;	// weak
+	LOG(@"Resume Operation: %@ at %tu", fetcher.runMessage, fetcher.resumeOffset);
+	[fetcher resumeTask:resumeTask];	// preempted meanwhile? then later
+	return YES;
+}
+
++ (NSURLSessionDataTask *)taskForFetcher:(FECWF_WEBFETCHER *)fetcher request:(NSURLRequest *)request inSession:(NSURLSession *)session
+{
+	NSURLSessionDataTask *task = [session dataTaskWithRequest:request];
+	objc_setAssociatedObject(task, &sharedSession, fetcher, OBJC_ASSOCIATION_RETAIN_NONATOMIC);	// strong
+	return task;
+}
+
 - (id)initWithDelegate:(id <FECWF_OPSRUNNER_PROTOCOL>)del
 {
     if((self = [super init])) {
@@ -92,11 +175,11 @@ static NSURLSession *sharedSession;
 		
 		_operations			= [NSMutableSet setWithCapacity:10];
 		_operationsOnHold	= [NSMutableOrderedSet orderedSetWithCapacity:10];
-		_dataSema			= dispatch_semaphore_create(1);
 #ifdef VERIFY_DEALLOC
 		_deallocs			= dispatch_semaphore_create(0);
 #endif
 		_opRunnerQueue		= dispatch_queue_create("com.dfh.opRunnerQueue", DISPATCH_QUEUE_SERIAL);
+		dispatch_queue_set_specific(_opRunnerQueue, queueKey, (__bridge void *)self, NULL);
 		_opRunnerGroup		= dispatch_group_create();
 		
 		_priority			= DEFAULT_PRIORITY;
@@ -173,6 +256,30 @@ static NSURLSession *sharedSession;
 	}
 }
 
+- (void)setAdaptiveMaxOps:(NSUInteger)adaptiveMaxOps
+{
+	_adaptiveMaxOps = adaptiveMaxOps;
+
+	if(adaptiveMaxOps && !adaptTimer) {
+		if(_maxOps > adaptiveMaxOps) {
+			_maxOps = adaptiveMaxOps;
+		}
+		adaptTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _opRunnerQueue);
+		uint64_t tick = (uint64_t)(ADAPT_TICK * NSEC_PER_SEC);
+		dispatch_source_set_timer(adaptTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)tick), tick, tick/10);
+		__weak __typeof__(self) weakSelf = self;
+		dispatch_source_set_event_handler(adaptTimer, ^
+			{
+				[weakSelf adaptTick];
+			} );
+		dispatch_resume(adaptTimer);
+	} else
+	if(!adaptiveMaxOps && adaptTimer) {
+		dispatch_source_cancel(adaptTimer);
+		adaptTimer = nil;
+	}
+}
+
 - (void)runOperation:(FECWF_WEBFETCHER *)op withMsg:(NSString *)msg
 {
 	if(self.cancelled) {
@@ -197,14 +304,8 @@ static NSURLSession *sharedSession;
 	((FECWF_WEBFETCHER *)op).runMessage = msg;
 #endif
 
-	if([self addOp:op]) {
-		__weak __typeof__(self) weakSelf = self;
-		dispatch_group_async(_opRunnerGroup, _opRunnerQueue, ^
-			{
-				[weakSelf _runOperation:op];
-				//LOG(@"END _run %@", op.runMessage);
-			} );
-	}
+	atomic_fetch_add_explicit(&outstanding, 1, memory_order_relaxed);
+	[self intake:intakeSubmit op:op];
 }
 
 - (BOOL)runOperations:(NSOrderedSet *)ops
@@ -236,86 +337,200 @@ static NSURLSession *sharedSession;
 	}
 #endif
 	
-	NSSet *rSet = [self addOps:ops];
+	atomic_fetch_add_explicit(&outstanding, (size_t)count, memory_order_relaxed);
+	[ops enumerateObjectsUsingBlock:^(FECWF_WEBFETCHER *op, NSUInteger idx, BOOL *stop)
+		{
+			[self intake:intakeSubmit op:op];
+		} ];
+	return YES;
+}
 
+- (void)setPriority:(NSInteger)priority ofOperation:(FECWF_WEBFETCHER *)op
+{
 	__weak __typeof__(self) weakSelf = self;
 	dispatch_group_async(_opRunnerGroup, _opRunnerQueue, ^
 		{
-			[rSet enumerateObjectsUsingBlock:^(FECWF_WEBFETCHER *op, BOOL *stop)
-				{
-					[weakSelf _runOperation:op];
-				} ];
-				
+			__typeof__(self) strongSelf = weakSelf;
+			if(!strongSelf) return;
+
+			BOOL onHold = [strongSelf.operationsOnHold containsObject:op];
+			if(onHold) {
+				[strongSelf.operationsOnHold removeObject:op];
+			}
+			op.queuePriority = priority;
+			if(onHold) {
+				[strongSelf holdOp:op];
+			}
+			[strongSelf startOps:[strongSelf scheduleOps]];
 		} );
-	return YES;
 }
 
-- (BOOL)addOp:(FECWF_WEBFETCHER *)op
+// Any thread: the op goes on the intake, and the first push since the last drain schedules the next one
+- (void)intake:(intakeKind)kind op:(FECWF_WEBFETCHER *)op
 {
-	BOOL ret;
+	__weak __typeof__(self) weakSelf = self;
+	orIntake *item = malloc(sizeof(orIntake));
+	if(!item) {
+		// no memory for the intake: a block of its own then, behind the drains already queued
+		dispatch_group_async(_opRunnerGroup, _opRunnerQueue, ^
+			{
+				__typeof__(self) strongSelf = weakSelf;
+				if(strongSelf && !strongSelf.cancelled) {
+					[strongSelf takeIn:kind op:op];
+					[strongSelf startOps:[strongSelf scheduleOps]];
+				}
+			} );
+		return;
+	}
+	item->op	= (__bridge_retained void *)op;
+	item->kind	= kind;
+	if(intakePush(&intake, item)) {
+		dispatch_group_async(_opRunnerGroup, _opRunnerQueue, ^
+			{
+				[weakSelf drainIntake];
+			} );
+	}
+}
 
-/***/dispatch_semaphore_wait(_dataSema, DISPATCH_TIME_FOREVER);
-	if([_operations count] >= self.maxOps) {
-		[_operationsOnHold addObject:op];
-		ret = FALSE;
-	} else {
-		[_operations addObject:op]; 	// Second we retain and save a reference to the operation
-		ret = YES;
+// On the queue: everything on the intake taken in, then the free slots filled
+- (void)drainIntake
+{
+	for(orIntake *item = intakeTake(&intake), *next; item; item = next) {
+		next = item->next;
+		FECWF_WEBFETCHER *op = (__bridge_transfer FECWF_WEBFETCHER *)item->op;
+		intakeKind kind = item->kind;
+		free(item);
+
+		if(!self.cancelled) {
+			[self takeIn:kind op:op];
+		}
+	}
+	if(!self.cancelled) {
+		[self startOps:[self scheduleOps]];
 	}
-/***/dispatch_semaphore_signal(_dataSema);
+}
 
-	return ret;
+// On the queue: new operations are held by priority, finished ones let go
+- (void)takeIn:(intakeKind)kind op:(FECWF_WEBFETCHER *)op
+{
+	switch(kind) {
+	case intakeSubmit:
+		[self holdOp:op];
+		break;
+	case intakeFinished:
+		finishedBytes += op.transferredBytes;
+		if(op.timeToFirstByte) {
+			ttfbSum += op.timeToFirstByte;
+			ttfbCount += 1;
+		}
+		[_operations removeObject:op];
+		[_operationsOnHold removeObject:op];	// preempted just as it finished
+		break;
+	}
 }
-- (NSSet *)addOps:(NSOrderedSet *)ops
+
+// On the queue: behind everything of the same or higher priority
+- (void)holdOp:(FECWF_WEBFETCHER *)op
 {
-	NSMutableSet *rSet = [NSMutableSet setWithCapacity:[ops count]];
+	NSUInteger idx = [_operationsOnHold indexOfObject:op inSortedRange:NSMakeRange(0, [_operationsOnHold count])
+								options:NSBinarySearchingInsertionIndex | NSBinarySearchingLastEqual
+								usingComparator:^NSComparisonResult(FECWF_WEBFETCHER *op1, FECWF_WEBFETCHER *op2)
+								{
+									NSInteger p1 = op1.queuePriority, p2 = op2.queuePriority;
+									return p1 > p2 ? NSOrderedAscending : p1 < p2 ? NSOrderedDescending : NSOrderedSame;
+								} ];
+	[_operationsOnHold insertObject:op atIndex:idx];
+}
 
-/***/dispatch_semaphore_wait(_dataSema, DISPATCH_TIME_FOREVER);
-	[ops enumerateObjectsUsingBlock:^(FECWF_WEBFETCHER *op, NSUInteger idx, BOOL *stop)
-		{
-			if([_operations count] >= self.maxOps) {
-				[_operationsOnHold addObject:op];
-			} else {
-				[_operations addObject:op]; 	// Second we retain and save a reference to the operation
-				[rSet addObject:op];
+// On the queue: fill the free slots from the front of the hold, then let it take the place of running operations
+// of lower priority - they are suspended and held, to go on where they stopped. Returns what startOps: has to start.
+- (NSArray *)scheduleOps
+{
+	NSMutableArray *startOps = [NSMutableArray array];
+
+	while([_operationsOnHold count]) {
+		FECWF_WEBFETCHER *runOp = [_operationsOnHold objectAtIndex:0];
+		if([_operations count] >= self.maxOps) {
+			FECWF_WEBFETCHER *victim;
+			for(FECWF_WEBFETCHER *op in _operations) {
+				// only transfers underway can be suspended; one that has not started yet soon will be
+				if(op.isExecuting && !op.isFinished && op.queuePriority < runOp.queuePriority && (!victim || op.queuePriority < victim.queuePriority)) {
+					victim = op;
+				}
 			}
-		} ];
-/***/dispatch_semaphore_signal(_dataSema);
+			if(!victim) {
+				break;
+			}
+			[victim _OR_preempt:YES];
+			[_operations removeObject:victim];
+			[self holdOp:victim];
+		}
+		[_operationsOnHold removeObjectAtIndex:0];
+		[_operations addObject:runOp]; 	// Second we retain and save a reference to the operation
+		[startOps addObject:runOp];
+	}
+	return startOps;
+}
 
-	return rSet;
+// On the queue: new operations are set up and started right here, preempted ones just go on
+- (void)startOps:(NSArray *)ops
+{
+	for(FECWF_WEBFETCHER *op in ops) {
+		if(op.isPreempted) {
+			[op _OR_preempt:NO];
+		} else {
+			[self _runOperation:op];
+		}
+	}
+}
+
+// The bookkeeping from off the queue: cancelling, describing
+- (void)onQueue:(dispatch_block_t)block
+{
+	if(dispatch_get_specific(queueKey) == (__bridge void *)self) {
+		block();
+	} else {
+		dispatch_sync(_opRunnerQueue, block);
+	}
 }
 
 - (NSUInteger)cancelAllOps
 {
 	__block NSUInteger cancelFailures = 0;
 	
-/***/dispatch_semaphore_wait(_dataSema, DISPATCH_TIME_FOREVER);
-	[_operationsOnHold removeAllObjects];
-
-	[_operations enumerateObjectsUsingBlock:^(FECWF_WEBFETCHER *op, BOOL *stop)
+	[self onQueue:^
 		{
-			BOOL ret = [op _OR_cancel:_mSecCancelDelay];
-			if(!ret) ++cancelFailures;
-			// [op.task cancel], op.task = nil;	// in WebFetcher8, since cancel can be sent by subclass too
-			//LOG(@"SEND CANCEL TO %@", op.runMessage);
-		} ];
+			NSUInteger delay = self.mSecCancelDelay;
+			[self.operationsOnHold enumerateObjectsUsingBlock:^(FECWF_WEBFETCHER *op, NSUInteger idx, BOOL *stop)
+				{
+					if(op.isPreempted) {
+						BOOL ret = [op _OR_cancel:delay];	// its tasks are suspended, not gone
+						if(!ret) ++cancelFailures;
+					}
+				} ];
+			[self.operationsOnHold removeAllObjects];
 
-	if(!_usingSharedSession) {
-		[_urlSession invalidateAndCancel];
-		_urlSession = nil;
-	}
-	[_operations removeAllObjects];
-/***/dispatch_semaphore_signal(_dataSema);
+			[self.operations enumerateObjectsUsingBlock:^(FECWF_WEBFETCHER *op, BOOL *stop)
+				{
+					BOOL ret = [op _OR_cancel:delay];
+					if(!ret) ++cancelFailures;
+					// [op.task cancel], op.task = nil;	// in WebFetcher8, since cancel can be sent by subclass too
+					//LOG(@"SEND CANCEL TO %@", op.runMessage);
+				} ];
+
+			if(!self.usingSharedSession) {
+				[self.urlSession invalidateAndCancel];
+				self.urlSession = nil;
+			}
+			[self.operations removeAllObjects];
+			atomic_store(&self->outstanding, 0);
+		} ];
 	
 	return cancelFailures;
 }
 - (NSUInteger)operationsCount
 {
-/***/dispatch_semaphore_wait(_dataSema, DISPATCH_TIME_FOREVER);
-	NSUInteger count = [_operations count] + [_operationsOnHold count];
-/***/dispatch_semaphore_signal(_dataSema);
-	
-	return count;
+	return atomic_load_explicit(&outstanding, memory_order_relaxed);
 }
 
 - (void)_runOperation:(FECWF_WEBFETCHER *)op	// on queue
@@ -336,7 +551,8 @@ static NSURLSession *sharedSession;
 			{
 				__typeof__(self) strongSelf = weakSelf;
 				if(strongSelf) {
-					dispatch_group_async(strongSelf.opRunnerGroup, strongSelf.opRunnerQueue, ^
+					// not on the serial queue: the completions of many small fetches (or a decode in one) shouldn't line up
+					dispatch_group_async(strongSelf.opRunnerGroup, dispatch_get_global_queue(strongSelf->_priority, 0), ^
 						{
 							if(succeeded) {
 								[_op completed];
@@ -383,6 +599,7 @@ static NSURLSession *sharedSession;
 	
 	self.delegate = nil;
 	self.cancelled = YES;
+	self.adaptiveMaxOps = 0;
 
 	LOG(@"CANCEL ALL OPS");
 
@@ -445,7 +662,7 @@ static NSURLSession *sharedSession;
 }
 #endif
 
-- (void)_operationFinished:(FECWF_WEBFETCHER *)op	// excutes in opRunnerQueue
+- (void)_operationFinished:(FECWF_WEBFETCHER *)op	// excutes on a global queue after completed/failed, or in opRunnerQueue if it never started
 {
 	if(self.cancelled || op.isCancelled) {
 		return;
@@ -489,26 +706,8 @@ static NSURLSession *sharedSession;
 		return;
 	}
 
-/***/dispatch_semaphore_wait(_dataSema, DISPATCH_TIME_FOREVER);
-	[_operations removeObject:op];
-	NSUInteger remainingCount = [_operationsOnHold count];
-	FECWF_WEBFETCHER *runOp;
-	if(remainingCount) {
-		runOp = [_operationsOnHold objectAtIndex:0];
-		[_operationsOnHold removeObjectAtIndex:0];
-		[_operations addObject:runOp]; 	// Second we retain and save a reference to the operation
-		remainingCount -= 1;
-	}
-	remainingCount += [_operations count];
-/***/dispatch_semaphore_signal(_dataSema);
-
-	if(runOp) {
-		__weak __typeof__(self) weakSelf = self;
-		dispatch_group_async(_opRunnerGroup, _opRunnerQueue, ^
-			{
-				[weakSelf _runOperation:runOp];
-			} );
-	}
+	NSUInteger remainingCount = atomic_fetch_sub_explicit(&outstanding, 1, memory_order_relaxed) - 1;
+	[self intake:intakeFinished op:op];		// its slot goes to the next one on the queue
 	
 	[self.delegate operationFinished:op count:remainingCount];
 
@@ -520,15 +719,109 @@ static NSURLSession *sharedSession;
 #endif
 }
 
+#pragma mark Adaptive maxOps
+
+// Every ADAPT_TICK on the opRunnerQueue. Only while every slot is busy and more wait does a window tell what maxOps gives.
+- (void)adaptTick
+{
+	uint64_t bytes;
+	BOOL saturated;
+	NSTimeInterval ttfb = 0;
+
+	bytes = finishedBytes;
+	for(FECWF_WEBFETCHER *op in _operations) {
+		bytes += op.transferredBytes;
+	}
+	for(FECWF_WEBFETCHER *op in _operationsOnHold) {
+		bytes += op.transferredBytes;
+	}
+	saturated = [_operationsOnHold count] && [_operations count] >= _maxOps;
+	if(windowTicks + 1 == ADAPT_WINDOW_TICKS && saturated && !settleTicks) {
+		ttfb = ttfbCount ? ttfbSum / ttfbCount : 0;
+		ttfbSum = 0;
+		ttfbCount = 0;
+	}
+
+	uint64_t delta = bytes - adaptBytes;
+	adaptBytes = bytes;
+
+	if(!saturated || settleTicks) {
+		if(settleTicks) --settleTicks;
+		windowTicks = 0;
+		windowBytes = 0;
+		return;
+	}
+	windowBytes += delta;
+	if(++windowTicks < ADAPT_WINDOW_TICKS) {
+		return;
+	}
+
+	double rate = windowBytes / (ADAPT_WINDOW_TICKS * ADAPT_TICK);
+	windowTicks = 0;
+	windowBytes = 0;
+	[self adaptToRate:rate timeToFirstByte:ttfb];
+}
+
+// Hill climbing on the rate each level gave: down a level if it is as fast, up one if that is faster or not measured lately.
+// First bytes coming much slower than they did in the last few windows at this level means requests queue (too many
+// connections for the host or the link), so that cuts the operations by a quarter. One quick response (cached, or tiny)
+// only counts for those few windows. The delegate can always hold it down, for memory.
+- (void)adaptToRate:(double)rate timeToFirstByte:(NSTimeInterval)ttfb
+{
+	NSUInteger n = MIN(_maxOps, ADAPT_LEVELS);
+	NSUInteger ceiling = MIN(_adaptiveMaxOps, ADAPT_LEVELS);
+
+	windows += 1;
+	rateAt[n] = windowAt[n] ? (rateAt[n] + rate) / 2 : rate;
+	windowAt[n] = windows;
+
+	BOOL (^fresh)(NSUInteger) = ^BOOL(NSUInteger level) { return self->windowAt[level] && self->windows - self->windowAt[level] <= ADAPT_STALE; };
+
+	NSTimeInterval baseTTFB = 0;
+	for(NSUInteger i = 0; i < MIN(ttfbWindows, ADAPT_TTFB_WINDOWS); ++i) {
+		baseTTFB = baseTTFB ? MIN(baseTTFB, ttfbAt[i]) : ttfbAt[i];
+	}
+	if(ttfb) {
+		ttfbAt[ttfbWindows++ % ADAPT_TTFB_WINDOWS] = ttfb;
+	}
+
+	NSUInteger next = n;
+	if(n > 1 && ttfb > ADAPT_TTFB_FACTOR * baseTTFB && baseTTFB) {
+		next = MAX(1, MIN(n - 1, n * 3 / 4));
+	} else
+	if(n > 1 && fresh(n - 1) && rateAt[n - 1] >= (1 - ADAPT_MARGIN) * rateAt[n]) {
+		next = n - 1;
+	} else
+	if(n < ceiling && (!fresh(n + 1) || rateAt[n + 1] > (1 + ADAPT_MARGIN) * rateAt[n])) {
+		next = n + 1;
+	}
+
+	id <FECWF_OPSRUNNER_PROTOCOL> del = self.delegate;
+	if([del respondsToSelector:@selector(operationsMemoryLimit)]) {
+		next = MIN(next, MAX(1, [del operationsMemoryLimit]));
+	}
+	LOG(@"ADAPT: %tu ops %.0f KB/s ttfb %.3f (lately %.3f) -> %tu", n, rate/1024, ttfb, baseTTFB, next);
+
+	if(next != _maxOps) {
+		_maxOps = next;					// fewer: the running ones finish, more: they start now
+		[self startOps:[self scheduleOps]];
+		settleTicks = 1;
+		ttfbWindows = 0;				// first bytes at the new level are compared to each other
+	}
+}
+
 - (NSString *)description
 {
 	NSMutableString *mStr = [NSMutableString stringWithCapacity:256];
-	[mStr appendFormat:@"OpsOnHold=%zd OpsRunning=%zd\n", [_operationsOnHold count], [_operations count]];
-	[_operations enumerateObjectsUsingBlock:^(FECWF_WEBFETCHER *op, BOOL *stop)
+	[self onQueue:^
 		{
-			[mStr appendString:[op description]];
-			[mStr appendString:@"\n"];
-		}];
+			[mStr appendFormat:@"OpsOnHold=%zd OpsRunning=%zd\n", [self.operationsOnHold count], [self.operations count]];
+			[self.operations enumerateObjectsUsingBlock:^(FECWF_WEBFETCHER *op, BOOL *stop)
+				{
+					[mStr appendString:[op description]];
+					[mStr appendString:@"\n"];
+				}];
+		} ];
 	return mStr;
 }
 
@@ -40,7 +40,11 @@
 // can get this on main thread (default), a specific thread you request, or anyThread
  - (void)operationFinished:(FECWF_WEBFETCHER *)op count:(NSUInteger)remainingOps;
 
-@optional // Must be provided if you do not use the shared session
+@optional
+// Adaptive runners: the most operations memory allows right now (each holds a response, a decoder...). Sent on the runner's queue.
+- (NSUInteger)operationsMemoryLimit;
+
+// Must be provided if you do not use the shared session
 
 // Subclass that provides your specific values. Sent on the same thread as the first message
 // causing the OperationsRunner to instantiate. The returned object is retained.
@@ -51,6 +51,26 @@ typedef void(^finishBlock)(FECWF_WEBFETCHER *op, BOOL succeeded);
 @property (nonatomic, assign) NSUInteger currentReceiveSize;
 @property (nonatomic, strong) finishBlock finalBlock;
 
+// Resumable transfers: when the connection drops, the rest of the body is asked for with Range and If-Range
+@property (nonatomic, assign) NSUInteger resumeOffset;		// bytes of the body received so far, all attempts
+@property (nonatomic, copy) NSString *resumeValidator;		// strong ETag or Last-Modified of the full response, nil == can't resume
+@property (nonatomic, assign) NSUInteger resumes;			// attempts made
+
+// Segmented transfers: a large body over several connections at once, each a range of it. The bytes come to
+// receivedData:atOffset:, in no particular order, instead of webData - unless the server won't do ranges.
+@property (nonatomic, assign) NSUInteger segments;			// connections, 0 or 1 == one (the default)
+@property (nonatomic, assign) NSUInteger segmentedLength;	// of the body, once the first range said - 0 == not segmented
+@property (atomic, strong) NSMutableSet *segmentTasks;		// the ranges still coming in - use under @synchronized(fetcher), enumerate a copy
+
+// Priorities: waiting operations start highest first, and a running one is suspended (bytes kept) for a higher one
+@property (atomic, assign) NSInteger queuePriority;			// 0 by default; once submitted, change it with -[OperationsRunner setPriority:ofOperation:]
+@property (atomic, assign, readonly) BOOL isPreempted;		// suspended until a slot frees up
+
+// What the transfer says about the link, for runners that adapt maxOps
+@property (atomic, assign) NSUInteger transferredBytes;		// every byte received, all tasks and attempts
+@property (atomic, assign) NSTimeInterval startTime;		// when start: sent the request
+@property (atomic, assign) NSTimeInterval timeToFirstByte;	// from then to the first response, 0 == none yet
+
 // Subclasses can set
 @property (nonatomic, strong) NSError *error;
 @property (nonatomic, copy) NSString *errorMessage;		// MUST be non-nil to indicate an error
@@ -67,6 +87,8 @@ typedef void(^finishBlock)(FECWF_WEBFETCHER *op, BOOL succeeded);
 + (BOOL)printDebugging;
 + (BOOL)persistentConnection;
 + (NSUInteger)timeout;
++ (NSUInteger)maxResumes;					// times a dropped transfer is picked up again, default 3, 0 to never
++ (NSUInteger)segmentSize;					// segmented transfers: the first range, and the smallest of the rest. Default 1 MB
 
 - (NSMutableURLRequest *)setup;				// get the app started, object->continue, nil->failed so return
 - (BOOL)start:(NSMutableURLRequest *)request __attribute__((unused));
@@ -74,5 +96,11 @@ typedef void(^finishBlock)(FECWF_WEBFETCHER *op, BOOL succeeded);
 - (void)failed;								// subclasses to override, call super
 - (void)finish;								// subclasses to override for cleanup, call super, only called if the operation successfully starts
 - (void)cancel;								// for subclasses, called on operation's thread
+- (BOOL)canResumeAfterError:(NSError *)error;	// a dropped connection, and the server can be asked for the rest
+- (NSMutableURLRequest *)resumeRequest:(NSURLRequest *)request;	// the same request, for the bytes from resumeOffset on
+- (NSMutableURLRequest *)rangeRequest:(NSURLRequest *)request first:(NSUInteger)first last:(NSUInteger)last;	// bytes first...last, NSNotFound == to the end
+- (void)receivedData:(NSData *)data atOffset:(NSUInteger)offset;	// segmented transfers, subclasses that set segments store it
+- (void)resumeTask:(NSURLSessionTask *)task;	// a suspended or new task of this fetcher, unless it is preempted (then it waits for the runner)
+- (void)restarted;							// asked for the rest, got all of it again (the resource changed) - subclasses start over, call super
 
 @end
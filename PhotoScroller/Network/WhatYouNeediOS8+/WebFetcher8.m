@@ -41,6 +41,7 @@
 @property (atomic, assign, readwrite) BOOL isCancelled;
 @property (atomic, assign, readwrite) BOOL isExecuting;
 @property (atomic, assign, readwrite) BOOL isFinished;
+@property (atomic, assign, readwrite) BOOL isPreempted;
 
 @end
 
@@ -60,6 +61,8 @@
 + (BOOL)persistentConnection { return YES; }
 + (NSUInteger)timeout { return 60; }
 + (BOOL)printDebugging { return NO; }
++ (NSUInteger)maxResumes { return 3; }
++ (NSUInteger)segmentSize { return 1024*1024; }
 
 // Only sent by OperationsRunner
 - (BOOL)_OR_cancel:(NSUInteger)millisecondDelay
@@ -71,12 +74,47 @@
 	return YES;
 }
 
+// Only sent by OperationsRunner: suspend every task (the bytes so far are kept), or let them go on
+- (void)_OR_preempt:(BOOL)preempt
+{
+	@synchronized(self) {
+		NSMutableArray *tasks = [NSMutableArray arrayWithArray:[self.segmentTasks allObjects]];
+		NSURLSessionTask *task = self.task;
+		if(task) {
+			[tasks addObject:task];
+		}
+		self.isPreempted = preempt;
+		for(task in tasks) {
+			if(preempt && task.state == NSURLSessionTaskStateRunning) {
+				[task suspend];
+			} else if(!preempt) {
+				[self resumeTask:task];
+			}
+		}
+	}
+	LOG(@"%@: %@", self.runMessage, preempt ? @"PREEMPTED" : @"RESUMED");
+}
+
+- (void)resumeTask:(NSURLSessionTask *)task
+{
+	@synchronized(self) {
+		if(!self.isPreempted && task.state == NSURLSessionTaskStateSuspended) {
+			[task resume];
+		}
+	}
+}
+
 - (void)cancel
 {
 	LOG(@"%@: got CANCEL", self);
 	self.isFinished = YES;
 	self.isCancelled = YES;
 	[self.task cancel]; self.task = nil;
+	NSArray *tasks;
+	@synchronized(self) {
+		tasks = [self.segmentTasks allObjects];
+	}
+	[tasks makeObjectsPerformSelector:@selector(cancel)];
 }
 
 - (NSMutableURLRequest *)setup
@@ -93,6 +131,10 @@
 		[request setValue:@"Keep-Alive" forHTTPHeaderField:@"Connection"];
 		[request setHTTPShouldUsePipelining:YES];
 	}
+	if(_segments > 1) {
+		// the first range tells how big the body is, then the rest is split up (see the Session Delegate)
+		[request setValue:[NSString stringWithFormat:@"bytes=0-%tu", [class segmentSize]-1] forHTTPHeaderField:@"Range"];
+	}
 	return request;
 }
 
@@ -100,6 +142,7 @@
 {
 	NSURLSessionTask *task = _task;	// weak to strong to avoid warnings (and its the right thing to do)
 	self.isExecuting = YES;
+	self.startTime = [NSDate timeIntervalSinceReferenceDate];
 
 #ifndef NDEBUG
 	//LOG(@"%@ Start", self.runMessage);
@@ -161,6 +204,52 @@
 	return self.task ? YES : NO;
 }
 
+- (BOOL)canResumeAfterError:(NSError *)error
+{
+	if(self.isCancelled || !_resumeValidator || _resumes >= [[self class] maxResumes]) {
+		return NO;
+	}
+	if(![error.domain isEqualToString:NSURLErrorDomain]) {
+		return NO;
+	}
+	switch(error.code) {
+	case NSURLErrorTimedOut:
+	case NSURLErrorNetworkConnectionLost:
+	case NSURLErrorNotConnectedToInternet:
+	case NSURLErrorCannotConnectToHost:
+		return YES;
+	default:
+		return NO;
+	}
+}
+
+- (NSMutableURLRequest *)resumeRequest:(NSURLRequest *)request
+{
+	return [self rangeRequest:request first:_resumeOffset last:NSNotFound];
+}
+
+- (NSMutableURLRequest *)rangeRequest:(NSURLRequest *)request first:(NSUInteger)first last:(NSUInteger)last
+{
+	NSMutableURLRequest *rangeRequest = [request mutableCopy];
+	NSString *range = last == NSNotFound ? [NSString stringWithFormat:@"bytes=%tu-", first] : [NSString stringWithFormat:@"bytes=%tu-%tu", first, last];
+	[rangeRequest setValue:range forHTTPHeaderField:@"Range"];
+	if(_resumeValidator) {
+		[rangeRequest setValue:_resumeValidator forHTTPHeaderField:@"If-Range"];	// changed since? then all of it
+	}
+	return rangeRequest;
+}
+
+- (void)receivedData:(NSData *)data atOffset:(NSUInteger)offset // subclasses that set segments override
+{
+	assert(!"segmented transfer, but nowhere to put it");
+}
+
+- (void)restarted // subclasses to override then finally call super
+{
+	LOG(@"%@: resource changed, starting over", self);
+	self.resumeOffset = 0;
+}
+
 - (void)completed // subclasses to override then finally call super
 {
 #ifndef NDEBUG
@@ -0,0 +1,815 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * ortest - the download code in WhatYouNeediOS8+ against a server of its own on the loopback, for command line macOS.
+ * Build with "make" in this directory, "make check" runs it.
+ *
+ *   ortest resume
+ *		Fetches a 1 MB body with an ORWebFetcher through an OperationsRunner while the server cuts responses short: the rest
+ *		has to be asked for with Range and If-Range and come back as a 206 - or as a 200 with all of it, when the resource
+ *		changed meanwhile (restarted). Without a strong validator, with "Accept-Ranges: none", or dropped more than
+ *		maxResumes times it has to fail. Then segmented transfers: four ranges at once, one of them dropping, and a server
+ *		that ignores Range. Checks every byte of the body, and the resumes, restarts and 206s it took.
+ *
+ *   ortest adapt [connKB/s [linkKB/s [hostSlots [seconds]]]]
+ *		Adaptive maxOps against a server held to a rate per connection (default 256 KB/s) and for the link (1024 KB/s), that
+ *		sends at most hostSlots responses at once (6) - the others wait for a slot before their headers, so their first byte
+ *		comes late - and takes 50 ms for every response. A runner with adaptiveMaxOps 16 starts at maxOps 1 and always has
+ *		more 512 KB fetches waiting, for 120 seconds (or the ones given). Prints the requests the server had at once, the
+ *		rate and the time to first byte every 4 seconds. Checks that in the last third of the run the runner kept between the
+ *		fewest requests that fill the link and the host's slots (one more, probing), at 80% of what the server can send.
+ *
+ *   ortest intake [threads,... [ops]]
+ *		The runner's bookkeeping alone: 1, 2, 4 and 8 threads (or the ones given) submit 100000 operations (or the number
+ *		given) between them to one runner at the default maxOps. The operations fail in setup, so each one goes through the
+ *		intake twice - submitted, then finished - and never touches the network. Prints operations per second. Checks every
+ *		one finished exactly once, each thread's started in the order it submitted them, and operationsCount is back to 0.
+ */
+
+#import <Foundation/Foundation.h>
+
+#import "OperationsRunner8.h"
+#import "ORSessionDelegate.h"
+#import "WebFetcher8.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_CHUNK	16384		// body bytes per write
+#define REQUEST_BYTES	8192		// most a request's headers take
+#define FETCH_TIMEOUT	30			// seconds a check waits for its operation
+#define SEGMENT_SIZE	65536		// the first range of a segmented transfer, and the smallest of the others
+
+static int resumeCommand(int argc, char **argv);
+static int adaptCommand(int argc, char **argv);
+static int intakeCommand(int argc, char **argv);
+
+static const struct {
+	const char	*name;
+	int			(*run)(int argc, char **argv);
+	const char	*usage;
+} commands[] = {
+	{ "resume", resumeCommand, "" },
+	{ "adapt", adaptCommand, "[connKB/s [linkKB/s [hostSlots [seconds]]]]" },
+	{ "intake", intakeCommand, "[threads,... [ops]]" },
+};
+
+int main(int argc, char **argv)
+{
+	signal(SIGPIPE, SIG_IGN);		// the server writes to connections the session has given up on
+	@autoreleasepool {
+		for(size_t i=0; argc > 1 && i<sizeof(commands)/sizeof(commands[0]); ++i) {
+			if(!strcmp(argv[1], commands[i].name)) return commands[i].run(argc-2, argv+2);
+		}
+	}
+	for(size_t i=0; i<sizeof(commands)/sizeof(commands[0]); ++i) {
+		fprintf(stderr, "%s ortest %s %s\n", i ? "      " : "usage:", commands[i].name, commands[i].usage);
+	}
+	return 2;
+}
+
+#pragma mark Server
+
+// One body, served with or without ranges, that can cut responses short and be held to a rate. The checks set it up between fetches.
+typedef enum { validatorNone, validatorETag, validatorWeakETag, validatorDate } validatorKind;
+
+typedef struct {
+	size_t			size;			// of the body
+	unsigned		version;		// what its bytes are, and its validator
+	validatorKind	validator;
+	bool			ranges;			// Range honoured, else "Accept-Ranges: none" and all of it
+	unsigned		drops;			// responses still to cut short
+	size_t			dropAfter;		// the body bytes they send first
+	long long		dropFirst;		// only responses starting at this byte, -1 == any
+	bool			changeOnDrop;	// a new version after each one, as if the resource changed meanwhile
+	double			connRate;		// bytes/s each response is held to, 0 == as fast as it goes
+	double			linkRate;		// bytes/s all of them together are held to
+	unsigned		hostSlots;		// responses sent at once, the others wait for one before their headers - 0 == any number
+	double			latency;		// seconds before the headers of each
+
+	unsigned		full;			// 200s sent
+	unsigned		partial;		// 206s sent
+	unsigned		busy;			// responses underway, waiting for a slot or not
+	unsigned		serving;		// holding a slot
+	double			linkNext;		// when the link can take the next chunk
+	uint64_t		sent;			// body bytes
+	double			waitSum;		// seconds from requests to their headers
+	unsigned		waits;
+} serverState;
+
+typedef struct {
+	bool			range;
+	long long		first;
+	long long		last;			// -1 == to the end
+	char			ifRange[128];
+} serverRequest;
+
+static pthread_mutex_t	serverLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	serverSlot = PTHREAD_COND_INITIALIZER;
+static serverState		server;		// under serverLock
+static unsigned short	serverPort;
+
+static unsigned char bodyByte(unsigned version, size_t offset)
+{
+	uint32_t h = (uint32_t)offset * 2654435761u ^ (version + 1) * 0x9e3779b9u;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return (unsigned char)h;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleepUntil(double when)
+{
+	double wait = when - now();
+	if(wait > 0) {
+		struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+		nanosleep(&ts, NULL);
+	}
+}
+
+static bool validatorValue(const serverState *s, char *value, size_t size)
+{
+	switch(s->validator) {
+	case validatorNone:		return false;
+	case validatorETag:		snprintf(value, size, "\"v%u\"", s->version); break;
+	case validatorWeakETag:	snprintf(value, size, "W/\"v%u\"", s->version); break;
+	case validatorDate:		snprintf(value, size, "Sun, %02u Jan 2017 00:00:00 GMT", s->version % 28 + 1); break;
+	}
+	return true;
+}
+
+static bool sendAll(int fd, const void *bytes, size_t length)
+{
+	for(const char *p = bytes; length; ) {
+		ssize_t n = send(fd, p, length, 0);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		p += n;
+		length -= (size_t)n;
+	}
+	return true;
+}
+
+// The next request on the connection: what is left of the last read stays in buffer
+static bool readRequest(int fd, char *buffer, size_t *length, serverRequest *req)
+{
+	char *end;
+	while(!(end = memmem(buffer, *length, "\r\n\r\n", 4))) {
+		if(*length == REQUEST_BYTES) return false;
+		ssize_t n = recv(fd, buffer + *length, REQUEST_BYTES - *length, 0);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		*length += (size_t)n;
+	}
+	*end = '\0';
+
+	memset(req, 0, sizeof(*req));
+	req->last = -1;
+	for(char *line = strstr(buffer, "\r\n"); line; ) {
+		line += 2;
+		char *next = strstr(line, "\r\n");
+		if(next) *next = '\0';
+		char *value = strchr(line, ':');
+		if(value) {
+			for(++value; *value == ' '; ++value) ;
+			if(!strncasecmp(line, "Range:", 6)) {
+				req->range = sscanf(value, "bytes=%lld-%lld", &req->first, &req->last) >= 1;
+			} else if(!strncasecmp(line, "If-Range:", 9)) {
+				snprintf(req->ifRange, sizeof(req->ifRange), "%s", value);
+			}
+		}
+		line = next;
+	}
+
+	size_t used = (size_t)(end + 4 - buffer);
+	memmove(buffer, buffer + used, *length - used);
+	*length -= used;
+	return true;
+}
+
+// false == the connection is done with: cut short, or gone
+static bool serveRequest(int fd, const serverRequest *req)
+{
+	char validator[64];
+	double start = now();
+	pthread_mutex_lock(&serverLock);
+	serverState s = server;
+	bool hasValidator = validatorValue(&s, validator, sizeof(validator));
+	bool partial = s.ranges && req->range && req->first >= 0 && (size_t)req->first < s.size
+				   && (!req->ifRange[0] || (hasValidator && !strcmp(req->ifRange, validator)));
+	size_t first = partial ? (size_t)req->first : 0;
+	size_t last = partial && req->last >= 0 && (size_t)req->last < s.size ? (size_t)req->last : s.size - 1;
+	size_t length = last + 1 - first;
+	size_t cut = length;
+	if(s.drops && (s.dropFirst < 0 || (size_t)s.dropFirst == first) && s.dropAfter < length) {
+		cut = s.dropAfter;
+		server.drops -= 1;
+		if(s.changeOnDrop) server.version += 1;
+	}
+	if(partial) server.partial += 1;
+	else server.full += 1;
+
+	server.busy += 1;
+	while(s.hostSlots && server.serving >= s.hostSlots) {
+		pthread_cond_wait(&serverSlot, &serverLock);
+	}
+	server.serving += 1;
+	pthread_mutex_unlock(&serverLock);
+
+	if(s.latency) sleepUntil(now() + s.latency);
+
+	char head[512];
+	int n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\nAccept-Ranges: %s\r\n",
+					 partial ? "206 Partial Content" : "200 OK", length, s.ranges ? "bytes" : "none");
+	if(partial) {
+		n += snprintf(head + n, sizeof(head) - (size_t)n, "Content-Range: bytes %zu-%zu/%zu\r\n", first, last, s.size);
+	}
+	if(hasValidator) {
+		n += snprintf(head + n, sizeof(head) - (size_t)n, "%s: %s\r\n", s.validator == validatorDate ? "Last-Modified" : "ETag", validator);
+	}
+	n += snprintf(head + n, sizeof(head) - (size_t)n, "\r\n");
+	bool ok = sendAll(fd, head, (size_t)n);
+
+	pthread_mutex_lock(&serverLock);
+	server.waitSum += now() - start;
+	server.waits += 1;
+	pthread_mutex_unlock(&serverLock);
+
+	// each chunk goes when this response's rate and the link's allow
+	unsigned char chunk[SERVER_CHUNK];
+	double connNext = 0;
+	for(size_t sent=0; ok && sent<cut; ) {
+		size_t count = cut - sent < SERVER_CHUNK ? cut - sent : SERVER_CHUNK;
+		double at = now();
+		if(s.connRate) {
+			at = at > connNext ? at : connNext;
+			connNext = at + count / s.connRate;
+		}
+		pthread_mutex_lock(&serverLock);
+		if(s.linkRate) {
+			at = at > server.linkNext ? at : server.linkNext;
+			server.linkNext = at + count / s.linkRate;
+		}
+		server.sent += count;
+		pthread_mutex_unlock(&serverLock);
+		sleepUntil(at);
+
+		for(size_t i=0; i<count; ++i) chunk[i] = bodyByte(s.version, first + sent + i);
+		ok = sendAll(fd, chunk, count);
+		sent += count;
+	}
+
+	pthread_mutex_lock(&serverLock);
+	server.serving -= 1;
+	server.busy -= 1;
+	pthread_cond_signal(&serverSlot);
+	pthread_mutex_unlock(&serverLock);
+	return ok && cut == length;
+}
+
+static void *connectionThread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char buffer[REQUEST_BYTES];
+	size_t length = 0;
+	serverRequest req;
+	while(readRequest(fd, buffer, &length, &req) && serveRequest(fd, &req)) ;
+
+	// cut short: the client gets every byte sent and then the end of the connection, not a reset that can throw them away
+	shutdown(fd, SHUT_WR);
+	struct timeval linger = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &linger, sizeof(linger));
+	while(recv(fd, buffer, sizeof(buffer), 0) > 0) ;
+	close(fd);
+	return NULL;
+}
+
+static void *acceptThread(void *arg)
+{
+	int listener = (int)(intptr_t)arg;
+	for(;;) {
+		int fd = accept(listener, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			perror("accept");
+			return NULL;
+		}
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		pthread_t tid;
+		if(pthread_create(&tid, NULL, connectionThread, (void *)(intptr_t)fd)) {
+			close(fd);
+		} else {
+			pthread_detach(tid);
+		}
+	}
+}
+
+static bool startServer(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family			= AF_INET;
+	addr.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	pthread_t tid;
+
+	if(fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) || bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+	   || listen(fd, 64) || getsockname(fd, (struct sockaddr *)&addr, &len) || pthread_create(&tid, NULL, acceptThread, (void *)(intptr_t)fd)) {
+		perror("cannot start the server");
+		if(fd >= 0) close(fd);
+		return false;
+	}
+	pthread_detach(tid);
+	serverPort = ntohs(addr.sin_port);
+	return true;
+}
+
+static void setServer(const serverState *s)
+{
+	pthread_mutex_lock(&serverLock);
+	server = *s;
+	pthread_mutex_unlock(&serverLock);
+}
+
+static serverState getServer(void)
+{
+	pthread_mutex_lock(&serverLock);
+	serverState s = server;
+	pthread_mutex_unlock(&serverLock);
+	return s;
+}
+
+static bool bodyMatches(NSData *data, size_t size, unsigned version)
+{
+	if([data length] != size) return false;
+	__block bool same = true;
+	[data enumerateByteRangesUsingBlock:^(const void *bytes, NSRange range, BOOL *stop)
+		{
+			for(NSUInteger i=0; i<range.length; ++i) {
+				if(((const unsigned char *)bytes)[i] != bodyByte(version, range.location + i)) {
+					same = false;
+					*stop = YES;
+					return;
+				}
+			}
+		} ];
+	return same;
+}
+
+#pragma mark Fetching
+
+// What ConcurrentOp does with the bytes, minus the image: segmented transfers are put together in body
+@interface TestFetcher : FECWF_WEBFETCHER
+@property (nonatomic, strong) NSMutableData *body;		// under @synchronized(self)
+@property (atomic, assign) NSUInteger restarts;
+@property (atomic, assign) BOOL succeeded;
+@end
+
+@implementation TestFetcher
+
++ (NSUInteger)timeout { return 10; }
++ (NSUInteger)segmentSize { return SEGMENT_SIZE; }
+
+- (void)receivedData:(NSData *)data atOffset:(NSUInteger)offset
+{
+	@synchronized(self) {
+		if(!_body) {
+			_body = [NSMutableData dataWithLength:self.segmentedLength];
+		}
+		if(offset + [data length] > [_body length]) {
+			[_body setLength:offset + [data length]];
+		}
+		[_body replaceBytesInRange:NSMakeRange(offset, [data length]) withBytes:[data bytes]];
+	}
+}
+
+- (void)restarted
+{
+	self.restarts += 1;
+	[super restarted];
+}
+
+- (void)completed
+{
+	self.succeeded = YES;
+	[super completed];
+}
+
+@end
+
+@interface TestRunnerDelegate : NSObject <FECWF_OPSRUNNER_PROTOCOL>
+@property (nonatomic, strong) dispatch_semaphore_t finished;
+@end
+
+@implementation TestRunnerDelegate
+
+- (void)operationFinished:(FECWF_WEBFETCHER *)op count:(NSUInteger)remainingOps
+{
+	dispatch_semaphore_signal(_finished);
+}
+
+- (NSURLSessionConfiguration *)urlSessionConfig
+{
+	NSURLSessionConfiguration *config = [NSURLSessionConfiguration ephemeralSessionConfiguration];
+	config.URLCache = nil;
+	config.HTTPMaximumConnectionsPerHost = 32;		// the runner's maxOps is what limits them
+	return config;
+}
+
+- (FECWF_SESSION_DELEGATE *)urlSessionDelegate
+{
+	return [FECWF_SESSION_DELEGATE new];
+}
+
+@end
+
+static NSString *serverURL(void)
+{
+	return [NSString stringWithFormat:@"http://127.0.0.1:%u/body", serverPort];
+}
+
+// One fetch through a runner of its own, nil if it never finished
+static TestFetcher *fetchBody(NSUInteger segments)
+{
+	TestRunnerDelegate *del = [TestRunnerDelegate new];
+	del.finished = dispatch_semaphore_create(0);
+	FECWF_OPERATIONSRUNNER *runner = [[FECWF_OPERATIONSRUNNER alloc] initWithDelegate:del];
+	runner.msgDelOn = msgDelOnAnyThread;
+	runner.noDebugMsgs = YES;
+
+	TestFetcher *fetcher = [TestFetcher new];
+	fetcher.urlStr = serverURL();
+	fetcher.segments = segments;
+	[runner runOperation:fetcher withMsg:@"ortest"];
+	long timedOut = dispatch_semaphore_wait(del.finished, dispatch_time(DISPATCH_TIME_NOW, (int64_t)FETCH_TIMEOUT * (int64_t)NSEC_PER_SEC));
+	[runner cancelOperations];
+	return timedOut ? nil : fetcher;
+}
+
+#pragma mark Resume
+
+#define RESUME_BODY		(1024*1024)
+#define RANGE_TWO		393216		// where the second of the three ranges after the first starts: 64 KB + (1 MB - 64 KB) / 3
+
+typedef struct {
+	const char		*name;
+	NSUInteger		segments;
+	validatorKind	validator;
+	bool			ranges;
+	unsigned		drops;
+	size_t			dropAfter;
+	long long		dropFirst;
+	bool			changeOnDrop;
+
+	bool			succeeds;
+	NSUInteger		resumes;
+	NSUInteger		restarts;
+	unsigned		partial;		// 206s
+} resumeCheck;
+
+static const resumeCheck resumeChecks[] = {
+	{ "whole",							1, validatorETag,		true,	0, 0,		-1,			false,	true,	0, 0, 0 },
+	{ "dropped, ETag",					1, validatorETag,		true,	1, 300000,	-1,			false,	true,	1, 0, 1 },
+	{ "dropped, Last-Modified",			1, validatorDate,		true,	1, 300000,	-1,			false,	true,	1, 0, 1 },
+	{ "dropped, then changed",			1, validatorETag,		true,	1, 300000,	-1,			true,	true,	1, 1, 0 },
+	{ "dropped 3 times",				1, validatorETag,		true,	3, 200000,	-1,			false,	true,	3, 0, 3 },
+	{ "dropped 4 times",				1, validatorETag,		true,	4, 200000,	-1,			false,	false,	3, 0, 3 },
+	{ "dropped, weak ETag",				1, validatorWeakETag,	true,	1, 300000,	-1,			false,	false,	0, 0, 0 },
+	{ "dropped, no ranges",				1, validatorETag,		false,	1, 300000,	-1,			false,	false,	0, 0, 0 },
+	{ "segmented",						4, validatorETag,		true,	0, 0,		-1,			false,	true,	0, 0, 4 },
+	{ "segmented, a range dropped",		4, validatorETag,		true,	1, 100000,	RANGE_TWO,	false,	true,	1, 0, 5 },
+	{ "segmented, no ranges",			4, validatorETag,		false,	0, 0,		-1,			false,	true,	0, 0, 0 },
+};
+
+static int resumeCommand(int argc, char **argv)
+{
+	if(argc) return 2;
+	if(!startServer()) return 1;
+
+	int status = 0;
+	for(size_t i=0; i<sizeof(resumeChecks)/sizeof(resumeChecks[0]); ++i) {
+		const resumeCheck *c = &resumeChecks[i];
+		serverState s = { RESUME_BODY, 0, c->validator, c->ranges, c->drops, c->dropAfter, c->dropFirst, c->changeOnDrop, 0, 0, 0, 0 };
+		setServer(&s);
+
+		TestFetcher *fetcher = fetchBody(c->segments);
+		s = getServer();
+		bool segmented = c->segments > 1 && c->ranges;
+		NSData *body;
+		@synchronized(fetcher) {
+			body = fetcher.segmentedLength ? [fetcher.body copy] : fetcher.webData;
+		}
+		const char *failure = !fetcher ? "never finished" :
+							  fetcher.succeeded != c->succeeds ? (c->succeeds ? "failed" : "succeeded") :
+							  c->succeeds && !bodyMatches(body, s.size, s.version) ? "the body differs from the one served" :
+							  c->succeeds && (fetcher.segmentedLength != 0) != segmented ? "segmented or not, the wrong way" :
+							  fetcher.resumes != c->resumes ? "resumes" :
+							  fetcher.restarts != c->restarts ? "restarts" :
+							  s.partial != c->partial ? "206s" : NULL;
+
+		printf("%-28s %tu resumes, %tu restarts, %u 200s, %u 206s: %s%s\n", c->name, fetcher.resumes, fetcher.restarts, s.full, s.partial,
+			failure ? "FAILED: " : "ok", failure ?: "");
+		if(failure) status = 1;
+	}
+	return status;
+}
+
+#pragma mark Adapt
+
+#define ADAPT_BODY		(512*1024)
+#define ADAPT_CEILING	16			// adaptiveMaxOps
+#define ADAPT_LATENCY	0.05		// seconds before the headers of each response
+#define ADAPT_SAMPLE	0.1			// seconds between looks at the server
+#define ADAPT_REPORT	40			// samples to a line
+
+// Waiting a long time for a slot is what the server does here, not a reason to give up
+@interface AdaptFetcher : TestFetcher
+@end
+
+@implementation AdaptFetcher
+
++ (NSUInteger)timeout { return 120; }
+
+@end
+
+static FECWF_WEBFETCHER *adaptFetcher(void)
+{
+	AdaptFetcher *fetcher = [AdaptFetcher new];
+	fetcher.urlStr = serverURL();
+	return fetcher;
+}
+
+// One more waiting for each one done, so the runner always has more than it runs
+@interface AdaptRunnerDelegate : TestRunnerDelegate
+@property (atomic, weak) FECWF_OPERATIONSRUNNER *runner;
+@property (atomic, assign) BOOL running;
+@property (nonatomic, assign) NSUInteger failures;		// under @synchronized(self)
+@end
+
+@implementation AdaptRunnerDelegate
+
+- (void)operationFinished:(FECWF_WEBFETCHER *)op count:(NSUInteger)remainingOps
+{
+	if(!((TestFetcher *)op).succeeded) {
+		@synchronized(self) {
+			_failures += 1;
+		}
+	}
+	if(self.running) {
+		[self.runner runOperation:adaptFetcher() withMsg:@"adapt"];
+	}
+}
+
+@end
+
+static int adaptCommand(int argc, char **argv)
+{
+	double connRate = (argc > 0 ? atof(argv[0]) : 256) * 1024;
+	double linkRate = (argc > 1 ? atof(argv[1]) : 1024) * 1024;
+	int hostSlots = argc > 2 ? atoi(argv[2]) : 6;
+	double seconds = argc > 3 ? atof(argv[3]) : 120;
+	if(connRate <= 0 || linkRate <= 0 || hostSlots <= 0 || seconds <= 0) return 2;
+	if(!startServer()) return 1;
+
+	serverState s = { ADAPT_BODY, 0, validatorETag, true, 0, 0, -1, false, connRate, linkRate, (unsigned)hostSlots, ADAPT_LATENCY };
+	setServer(&s);
+
+	AdaptRunnerDelegate *del = [AdaptRunnerDelegate new];
+	FECWF_OPERATIONSRUNNER *runner = [[FECWF_OPERATIONSRUNNER alloc] initWithDelegate:del];
+	runner.msgDelOn = msgDelOnAnyThread;
+	runner.noDebugMsgs = YES;
+	runner.maxOps = 1;
+	runner.adaptiveMaxOps = ADAPT_CEILING;
+	del.runner = runner;
+	del.running = YES;
+	for(int i=0; i<2*ADAPT_CEILING; ++i) {
+		[runner runOperation:adaptFetcher() withMsg:@"adapt"];
+	}
+
+	// right: at least the fewest requests that fill the link, at most what the host sends at once
+	unsigned fewest = (unsigned)ceil(linkRate / connRate);
+	if(fewest > (unsigned)hostSlots) fewest = (unsigned)hostSlots;
+	double best = linkRate < hostSlots * connRate ? linkRate : hostSlots * connRate;
+
+	printf("%7s %8s %8s %8s\n", "seconds", "at once", "KB/s", "ttfb");
+	double start = now(), busy = 0, lastWaitSum = 0, tailBusy = 0;
+	uint64_t lastSent = 0, tailSent = 0;
+	unsigned lastWaits = 0;
+	size_t tailSamples = 0;
+	for(size_t tick=1; tick * ADAPT_SAMPLE <= seconds; ++tick) {
+		sleepUntil(start + tick * ADAPT_SAMPLE);
+		double t = tick * ADAPT_SAMPLE;
+		s = getServer();
+		busy += s.busy;
+		if(t > seconds * 2 / 3) {
+			if(!tailSamples++) tailSent = s.sent;
+			tailBusy += s.busy;
+		}
+		if(!(tick % ADAPT_REPORT)) {
+			printf("%7.1f %8.1f %8.0f %8.3f\n", t, busy / ADAPT_REPORT, (s.sent - lastSent) / 1024.0 / (ADAPT_REPORT * ADAPT_SAMPLE),
+				s.waits > lastWaits ? (s.waitSum - lastWaitSum) / (s.waits - lastWaits) : 0);
+			busy = 0;
+			lastSent = s.sent;
+			lastWaitSum = s.waitSum;
+			lastWaits = s.waits;
+		}
+	}
+	del.running = NO;
+	[runner cancelOperations];
+
+	double atOnce = tailSamples ? tailBusy / tailSamples : 0;
+	double rate = tailSamples > 1 ? (s.sent - tailSent) / ((tailSamples - 1) * ADAPT_SAMPLE) : 0;
+	NSUInteger failures;
+	@synchronized(del) {
+		failures = del.failures;
+	}
+	const char *failure = atOnce < fewest - 0.5 ? "too few at once" : atOnce > hostSlots + 1 ? "too many at once" :
+						  rate < 0.8 * best ? "too slow" : failures ? "fetches failed" : NULL;
+	printf("last third: %.1f at once (%u to %d is right), %.0f KB/s of %.0f, %tu failed: %s%s\n", atOnce, fewest, hostSlots,
+		rate / 1024, best / 1024, failures, failure ? "FAILED: " : "ok", failure ?: "");
+	return failure ? 1 : 0;
+}
+
+#pragma mark Intake
+
+#define INTAKE_THREADS	64			// most producers
+
+static NSUInteger		intakeStarted[INTAKE_THREADS];	// the next each producer's operations should start with, on the runner's queue
+static atomic_bool		intakeDisorder;
+
+// Fails in setup, the first thing the runner's queue does with it: straight back through the intake as finished
+@interface IntakeFetcher : FECWF_WEBFETCHER
+@property (nonatomic, assign) NSUInteger producer;
+@property (nonatomic, assign) NSUInteger index;			// of its producer's
+@property (atomic, assign) NSUInteger finishes;
+@end
+
+@implementation IntakeFetcher
+
+- (NSMutableURLRequest *)setup
+{
+	if(_index != intakeStarted[_producer]) {
+		atomic_store(&intakeDisorder, true);
+	}
+	intakeStarted[_producer] = _index + 1;
+	return nil;
+}
+
+@end
+
+@interface IntakeRunnerDelegate : NSObject <FECWF_OPSRUNNER_PROTOCOL>
+@property (nonatomic, strong) dispatch_semaphore_t finished;	// once all have
+@property (nonatomic, assign) NSUInteger total;
+@end
+
+@implementation IntakeRunnerDelegate
+{
+	atomic_size_t	count;
+}
+
+- (void)operationFinished:(FECWF_WEBFETCHER *)op count:(NSUInteger)remainingOps
+{
+	((IntakeFetcher *)op).finishes += 1;
+	if(atomic_fetch_add(&count, 1) + 1 == _total) {
+		dispatch_semaphore_signal(_finished);
+	}
+}
+
+- (NSURLSessionConfiguration *)urlSessionConfig
+{
+	return [NSURLSessionConfiguration ephemeralSessionConfiguration];
+}
+
+- (FECWF_SESSION_DELEGATE *)urlSessionDelegate
+{
+	return [FECWF_SESSION_DELEGATE new];
+}
+
+@end
+
+typedef struct {
+	void		*runner;		// FECWF_OPERATIONSRUNNER
+	void		*ops;			// NSArray of its IntakeFetchers, retained
+} intakeProducer;
+
+static void *intakeThread(void *arg)
+{
+	intakeProducer *p = arg;
+	@autoreleasepool {
+		FECWF_OPERATIONSRUNNER *runner = (__bridge FECWF_OPERATIONSRUNNER *)p->runner;
+		for(IntakeFetcher *op in (__bridge NSArray *)p->ops) {
+			[runner runOperation:op withMsg:nil];
+		}
+	}
+	return NULL;
+}
+
+static int intakeCommand(int argc, char **argv)
+{
+	const char *threadList = argc > 0 ? argv[0] : "1,2,4,8";
+	size_t total = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+	if(!total) return 2;
+
+	int status = 0;
+	for(const char *t=threadList; *t; ) {
+		char *end;
+		size_t threads = strtoul(t, &end, 10);
+		if(end == t || !threads || threads > INTAKE_THREADS) return 2;
+		t = *end ? end + 1 : end;
+
+		IntakeRunnerDelegate *del = [IntakeRunnerDelegate new];
+		del.finished = dispatch_semaphore_create(0);
+		del.total = total;
+		FECWF_OPERATIONSRUNNER *runner = [[FECWF_OPERATIONSRUNNER alloc] initWithDelegate:del];
+		runner.msgDelOn = msgDelOnAnyThread;
+		runner.noDebugMsgs = YES;
+
+		// made beforehand, the producers only submit them
+		NSMutableArray *all = [NSMutableArray arrayWithCapacity:total];
+		NSMutableArray *perThread = [NSMutableArray arrayWithCapacity:threads];
+		for(size_t i=0; i<threads; ++i) {
+			NSMutableArray *ops = [NSMutableArray array];
+			for(size_t n=i; n<total; n+=threads) {
+				IntakeFetcher *op = [IntakeFetcher new];
+				op.producer = i;
+				op.index = [ops count];
+				[ops addObject:op];
+				[all addObject:op];
+			}
+			[perThread addObject:ops];
+			intakeStarted[i] = 0;
+		}
+		atomic_store(&intakeDisorder, false);
+
+		intakeProducer producers[INTAKE_THREADS];
+		pthread_t tids[INTAKE_THREADS];
+		size_t started = 0;
+		double start = now();
+		for(; started<threads; ++started) {
+			producers[started].runner = (__bridge void *)runner;
+			producers[started].ops = (__bridge_retained void *)perThread[started];
+			if(pthread_create(&tids[started], NULL, intakeThread, &producers[started])) {
+				CFRelease(producers[started].ops);
+				break;
+			}
+		}
+		long timedOut = started == threads ? dispatch_semaphore_wait(del.finished, dispatch_time(DISPATCH_TIME_NOW, (int64_t)FETCH_TIMEOUT * (int64_t)NSEC_PER_SEC)) : 1;
+		double seconds = now() - start;
+		for(size_t i=0; i<started; ++i) {
+			pthread_join(tids[i], NULL);
+			CFRelease(producers[i].ops);
+		}
+
+		NSUInteger outstanding = [runner operationsCount];
+		[runner cancelOperations];
+		NSUInteger once = 0;
+		for(IntakeFetcher *op in all) {
+			if(op.finishes == 1) ++once;
+		}
+
+		const char *failure = started < threads ? "cannot start the threads" : timedOut ? "never all finished" :
+							  once != total ? "finished other than once" : atomic_load(&intakeDisorder) ? "started out of order" :
+							  outstanding ? "operationsCount not 0" : NULL;
+		printf("%2zu threads: %zu operations in %.0f ms, %.0fK/s: %s%s\n", threads, total, seconds * 1e3, total / seconds / 1e3,
+			failure ? "FAILED: " : "ok", failure ?: "");
+		if(failure) status = 1;
+	}
+	return status;
+}
@@ -20,6 +20,12 @@ typedef NS_ENUM(NSInteger, ImageDecoder) {
 	libjpegIncremental		// Used when we download a file from the web, so we can process it a chunk at a time.
 };
 
+typedef NS_ENUM(NSInteger, ImagePriority) {	// same values as TC_PRIORITY_LOW ... TC_PRIORITY_HIGH
+	lowImagePriority=-1,	// prefetching pages nobody may look at
+	normalImagePriority,
+	highImagePriority		// the page on screen
+};
+
 #define ZOOM_LEVELS			 4
 #define TILE_SIZE			256		// could make larger or smaller, but power of 2
 #define ANNOTATE_TILES		YES
@@ -0,0 +1,305 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+#include <libgen.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error The archive format is little endian - add byte swapping before using it here
+#endif
+
+#define COPY_BUFFER_SIZE		(1024*1024)
+
+static size_t	alignUp(size_t v) { return (v + (tcArchiveAlignment-1)) & ~(tcArchiveAlignment-1); }
+static bool		copyLevel(int outFd, int inFd, size_t len, off_t offset, unsigned char *buffer);
+static void		syncDirectory(const char *path);
+
+#pragma mark Save
+
+/*
+ * The level files are already in tile order, so the archive is just a header, the geometry that
+ * used to live in the mappers, an index, and the level files back to back. Packed levels (JPEG
+ * tiles, see TilingCore+Codec.c) are copied as they are, with their tile lengths in the index.
+ * It is written to a temporary file next to the destination and renamed over it once synced, so
+ * a crash leaves either the old archive or the new one, never half of one.
+ */
+bool TCBuilderSaveArchive(TCBuilderRef b, const char *path)
+{
+	if(b->failed || !b->complete) {
+		LOG("Cannot archive an image that is not completely tiled");
+		return false;
+	}
+
+	size_t tileCount = 0;
+	for(size_t idx=0; idx<b->zoomLevels; ++idx) {
+		tileCount += b->ims[idx].cols * b->ims[idx].rows;
+	}
+
+	size_t metaSize = sizeof(tcArchiveHeader) + b->zoomLevels*sizeof(tcArchiveLevel) + tileCount*sizeof(tcArchiveTile);
+	unsigned char *meta = calloc(1, metaSize);
+	unsigned char *buffer = malloc(COPY_BUFFER_SIZE);
+	if(!meta || !buffer) {
+		free(meta);
+		free(buffer);
+		return false;
+	}
+
+	tcArchiveHeader *header = (tcArchiveHeader *)meta;
+	tcArchiveLevel *levels = (tcArchiveLevel *)(header + 1);
+	tcArchiveTile *index = (tcArchiveTile *)(levels + b->zoomLevels);
+
+	memcpy(header->magic, TC_ARCHIVE_MAGIC, sizeof(header->magic));
+	header->version			= TC_ARCHIVE_VERSION;
+	header->headerSize		= sizeof(tcArchiveHeader);
+	header->tileDimension	= (uint32_t)tileDimension;
+	header->bytesPerPixel	= (uint32_t)bytesPerPixel;
+	header->zoomLevels		= (uint32_t)b->zoomLevels;
+	header->orientation		= b->orientation;
+	header->tileCount		= (uint32_t)tileCount;
+	header->levelsOffset	= sizeof(tcArchiveHeader);
+	header->indexOffset		= header->levelsOffset + b->zoomLevels*sizeof(tcArchiveLevel);
+
+	size_t offset = alignUp(metaSize);
+	size_t tile = 0;
+	for(size_t idx=0; idx<b->zoomLevels; ++idx) {
+		imageMemory *im = &b->ims[idx];
+		tcArchiveLevel *level = &levels[idx];
+
+		level->width		= im->map.width;
+		level->height		= im->map.height;
+		level->bytesPerRow	= im->map.bytesPerRow;
+		level->col0offset	= im->map.col0offset;
+		level->row0offset	= im->map.row0offset;
+		level->cols			= (uint32_t)im->cols;
+		level->rows			= (uint32_t)im->rows;
+		level->firstTile	= tile;
+
+		for(size_t i=0; i<im->cols*im->rows; ++i, ++tile) {
+			size_t length = im->tileOffsets ? (size_t)(im->tileOffsets[i+1] - im->tileOffsets[i]) : tileSize;
+			index[tile].offset = offset;
+			index[tile].length = (uint32_t)length;
+			offset += length;
+		}
+	}
+	header->fileSize = offset;
+
+	size_t len = strlen(path) + sizeof(".XXXXXX");
+	char *tmpPath = malloc(len);
+	snprintf(tmpPath, len, "%s.XXXXXX", path);
+
+	bool success = false;
+	int fd = mkstemp(tmpPath);
+	if(fd == -1) {
+		LOG("OPEN failed file %s %s", tmpPath, strerror(errno));
+	} else {
+		tcNoCache(fd);
+		success = tcWriteAll(fd, meta, metaSize, 0);
+
+		for(size_t idx=0; success && idx<b->zoomLevels; ++idx) {
+			imageMemory *im = &b->ims[idx];
+			const tcArchiveTile *first = &index[levels[idx].firstTile];
+			const tcArchiveTile *last = first + im->cols*im->rows - 1;
+			success = copyLevel(fd, im->map.fd, (size_t)(last->offset + last->length - first->offset), (off_t)first->offset, buffer);
+		}
+		if(success && ftruncate(fd, (off_t)header->fileSize)) {		// open checks the size exactly
+			success = false;
+		}
+		if(success && tcFullSync(fd)) {
+			success = false;
+		}
+		if(close(fd)) {
+			success = false;
+		}
+		if(success && rename(tmpPath, path)) {
+			LOG("Failed to rename %s to %s (%s)", tmpPath, path, strerror(errno));
+			success = false;
+		}
+		if(success) {
+			syncDirectory(path);
+		} else {
+			unlink(tmpPath);
+		}
+	}
+
+	free(tmpPath);
+	free(buffer);
+	free(meta);
+	return success;
+}
+
+static bool copyLevel(int outFd, int inFd, size_t len, off_t offset, unsigned char *buffer)
+{
+	off_t inOffset = 0;
+	while(len) {
+		size_t count = MIN(len, (size_t)COPY_BUFFER_SIZE);
+		ssize_t ret = pread(inFd, buffer, count, inOffset);
+		if(ret <= 0) {
+			if(ret == -1 && errno == EINTR) continue;
+			LOG("Level file read failed (%s)", ret ? strerror(errno) : "short file");
+			return false;
+		}
+		if(!tcWriteAll(outFd, buffer, (size_t)ret, offset)) return false;
+		inOffset += ret;
+		offset += ret;
+		len -= (size_t)ret;
+	}
+	return true;
+}
+
+// the rename itself has to be durable too
+static void syncDirectory(const char *path)
+{
+	char *copy = strdup(path);
+	int fd = open(dirname(copy), O_RDONLY);
+	if(fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	free(copy);
+}
+
+#pragma mark Open
+
+/*
+ * Nothing is read but the header and index: the file is mapped, the level geometry restored, and
+ * tiles are served straight out of the mapping.
+ */
+TCBuilderRef TCBuilderOpenArchive(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd == -1) {
+		LOG("OPEN failed file %s %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct stat st;
+	tcArchiveHeader header;
+	if(fstat(fd, &st) || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+		|| memcmp(header.magic, TC_ARCHIVE_MAGIC, sizeof(header.magic))
+		|| header.version < 1 || header.version > TC_ARCHIVE_VERSION
+		|| header.headerSize != sizeof(tcArchiveHeader)
+		|| header.tileDimension != tileDimension
+		|| header.bytesPerPixel != bytesPerPixel
+		|| header.zoomLevels == 0
+		|| header.orientation < 0 || header.orientation > 8
+		|| header.fileSize != (uint64_t)st.st_size
+		|| header.levelsOffset + header.zoomLevels*sizeof(tcArchiveLevel) > header.indexOffset
+		|| header.indexOffset + (uint64_t)header.tileCount*sizeof(tcArchiveTile) > header.fileSize)
+	{
+		LOG("%s is not a version 1-%d tile archive (or is truncated)", path, TC_ARCHIVE_VERSION);
+		close(fd);
+		return NULL;
+	}
+
+	unsigned char *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED) {
+		LOG("FAILED to map %lld bytes - errno=%s", (long long)st.st_size, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	madvise(addr, (size_t)st.st_size, MADV_RANDOM);
+
+	TCBuilderOptions options = { 0, 0, header.zoomLevels, header.orientation, NULL, false, 0, 0, 0, TC_PRIORITY_NORMAL };
+	TCBuilderRef b = TCBuilderCreate(&options);
+	if(!b) {
+		munmap(addr, (size_t)st.st_size);
+		close(fd);
+		return NULL;
+	}
+	b->archiveMap	= malloc(sizeof(struct tcArchiveMap));
+	if(!b->archiveMap) {
+		munmap(addr, (size_t)st.st_size);
+		close(fd);
+		TCBuilderRelease(b);
+		return NULL;
+	}
+	*b->archiveMap	= (struct tcArchiveMap){ addr, (size_t)st.st_size, 1 };
+	b->archiveFd	= fd;
+	b->archiveAddr	= addr;
+	b->archiveIndex	= (const tcArchiveTile *)(addr + header.indexOffset);
+	b->zoomLevels	= header.zoomLevels;
+	b->ims			= calloc(b->zoomLevels, sizeof(imageMemory));
+	if(!b->ims) goto eRR;
+
+	const tcArchiveLevel *levels = (const tcArchiveLevel *)(addr + header.levelsOffset);
+	for(size_t idx=0; idx<b->zoomLevels; ++idx) {
+		const tcArchiveLevel *level = &levels[idx];
+		imageMemory *im = &b->ims[idx];
+
+		// the geometry has to agree with itself, or GetTile would read outside the mapping
+		if(level->cols != calcDimension(level->width)/tileDimension
+			|| level->rows != calcDimension(level->height)/tileDimension
+			|| level->bytesPerRow != calcBytesPerRow(level->width)
+			|| level->col0offset >= tileBytesPerRow || level->row0offset >= tileDimension
+			|| level->firstTile + (uint64_t)level->cols*level->rows > header.tileCount)
+		{
+			LOG("%s: level %zu is corrupt", path, idx);
+			goto eRR;
+		}
+		for(size_t i=0; i<(size_t)level->cols*level->rows; ++i) {
+			const tcArchiveTile *t = &b->archiveIndex[level->firstTile + i];
+			if(t->length == 0 || t->length > tileSize || (header.version == 1 && t->length != tileSize) || t->offset + t->length > header.fileSize) {
+				LOG("%s: level %zu tile %zu is corrupt", path, idx, i);
+				goto eRR;
+			}
+		}
+
+		im->map.fd			= -1;	// tiles come from the archive
+		im->map.width		= (size_t)level->width;
+		im->map.height		= (size_t)level->height;
+		im->map.bytesPerRow	= (size_t)level->bytesPerRow;
+		im->map.col0offset	= (size_t)level->col0offset;
+		im->map.row0offset	= (size_t)level->row0offset;
+		im->cols			= level->cols;
+		im->rows			= level->rows;
+		im->index			= idx;
+		im->firstTile		= (size_t)level->firstTile;
+		im->rotated			= header.orientation >= 5 && header.orientation <= 8;
+	}
+	b->complete = true;
+	return b;
+
+  eRR:
+	TCBuilderRelease(b);
+	return NULL;
+}
+
+void tcCloseArchive(TCBuilderRef b)
+{
+	if(b->archiveMap) {
+		tcArchiveMapRelease(b->archiveMap);		// tile views may still be using it
+		b->archiveMap = NULL;
+		b->archiveAddr = NULL;
+		b->archiveIndex = NULL;
+	}
+	if(b->archiveFd != -1) {
+		close(b->archiveFd);
+		b->archiveFd = -1;
+	}
+}
+
+void tcArchiveMapRetain(struct tcArchiveMap *map)
+{
+	atomic_fetch_add(&map->refs, 1);
+}
+
+void tcArchiveMapRelease(struct tcArchiveMap *map)
+{
+	if(atomic_fetch_sub(&map->refs, 1) != 1) return;
+	munmap(map->addr, map->size);
+	free(map);
+}
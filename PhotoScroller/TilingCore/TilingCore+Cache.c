@@ -0,0 +1,377 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+#include <pthread.h>
+
+/*
+ * One tile cache for the whole process, shared by every builder. CATiledLayer draws on several threads and asks for
+ * the same tiles again and again as the user pans and zooms, each time a fresh pread of 256 KB (and a decode for
+ * packed levels). Whole tiles of finished levels are kept here, keyed by (builder, level, col, row), least recently
+ * used first out once over budget.
+ *
+ * - the budget is a share (TCSetTileCacheRatio) of free memory, plus what the cache itself holds, re-probed at most
+ *   once a second when tiles are read, so it shrinks as the rest of the system takes memory
+ * - a tile asked for while another thread is still reading it waits for that read, rather than doing its own
+ * - TCTiles hold a reference: entries in use are never evicted, an evicted or forgotten entry goes with its last reference
+ * - memory warnings (TCTileCacheLowMemory, TCBuilderLowMemory, the Darwin memory pressure source) drop everything unused
+ *
+ * Keys use the builder's cacheId, never reused, so a tile of a released builder can never match a new one at the same address.
+ */
+
+#define CACHE_BUCKETS		4096		// power of 2
+#define CACHE_MIN_BYTES		(16 * TC_TILE_SIZE * TC_TILE_SIZE * TC_BYTES_PER_PIXEL)	// budget floor, a screenful of tiles
+
+typedef struct tcCacheEntry {
+	uint64_t				builderId;		// key
+	size_t					level;
+	size_t					col;
+	size_t					row;
+
+	unsigned char			*pixels;		// tileSize bytes, NULL while loading or when the load failed
+	int						refs;			// TCTiles using it
+	bool					loading;
+	bool					cached;			// in the table and on the LRU list, else freed with its last reference
+
+	struct tcCacheEntry		*hashNext;
+	struct tcCacheEntry		*newer;			// LRU list, newest first
+	struct tcCacheEntry		*older;
+} tcCacheEntry;
+
+static tcCacheEntry			*buckets[CACHE_BUCKETS];
+static tcCacheEntry			*newest;
+static tcCacheEntry			*oldest;
+static size_t				cacheBytes;
+static size_t				cacheBudget = CACHE_MIN_BYTES;		// until the first probe
+static TCTileCacheStats		stats;
+static pthread_mutex_t		cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		cacheLoaded = PTHREAD_COND_INITIALIZER;
+static pthread_once_t		cacheOnce = PTHREAD_ONCE_INIT;
+
+static float				cacheRatio = 0.25f;
+static _Atomic uint64_t		lastProbe;					// TCTimeStamp of the last budget probe, 0 == probe on the next read
+static _Atomic uint64_t		nextBuilderId = 1;
+
+static const uint64_t		probeInterval = 1000000000ull;	// nanoseconds
+
+static void watchMemory(void);
+static tcCacheEntry *findEntry(const TCTile *tile);
+static tcCacheEntry *newEntry(const TCTile *tile, bool share);
+static void fillEntry(tcCacheEntry *e, unsigned char *pixels);
+static void probeBudget(void);
+static bool loadTile(const TCTile *tile, unsigned char *pixels);
+static void lruRemove(tcCacheEntry *e);
+static void lruPush(tcCacheEntry *e);
+static void unlinkEntry(tcCacheEntry *e);
+static void evict(size_t budget);
+
+static inline size_t bucketFor(uint64_t builderId, size_t level, size_t col, size_t row)
+{
+	uint64_t h = builderId * 0x9E3779B97F4A7C15ull;
+	h ^= ((uint64_t)level << 48) ^ ((uint64_t)row << 24) ^ (uint64_t)col;
+	h *= 0xBF58476D1CE4E5B9ull;
+	return (size_t)(h >> 32) & (CACHE_BUCKETS-1);
+}
+
+#pragma mark Settings
+
+void TCSetTileCacheRatio(float ratio)
+{
+	cacheRatio = ratio;
+	TCTileCacheLowMemory();		// starts over with a budget from the new ratio
+}
+
+void TCTileCacheLowMemory(void)
+{
+	pthread_mutex_lock(&cacheLock);
+	evict(0);
+	pthread_mutex_unlock(&cacheLock);
+	atomic_store(&lastProbe, 0);	// less memory is free now, the next read gets a smaller budget
+}
+
+void TCTileCacheGetStats(TCTileCacheStats *s)
+{
+	pthread_mutex_lock(&cacheLock);
+	*s = stats;
+	s->bytes = cacheBytes;
+	s->budget = cacheBudget;
+	pthread_mutex_unlock(&cacheLock);
+}
+
+bool tcTileCacheEnabled(void)
+{
+	return cacheRatio > 0;
+}
+
+uint64_t tcTileCacheNewId(void)
+{
+	return atomic_fetch_add(&nextBuilderId, 1);
+}
+
+#pragma mark Tiles
+
+const unsigned char *tcTileCacheAcquire(TCTile *tile)
+{
+	pthread_once(&cacheOnce, watchMemory);
+
+	bool share = tile->shared && cacheRatio > 0;
+	if(share) probeBudget();
+
+	pthread_mutex_lock(&cacheLock);
+	tcCacheEntry *e = share ? findEntry(tile) : NULL;
+	if(e) {
+		++e->refs;
+		if(e->loading) {
+			++stats.joins;
+			while(e->loading) pthread_cond_wait(&cacheLoaded, &cacheLock);
+		} else {
+			++stats.hits;
+		}
+		if(e->cached) {
+			lruRemove(e);		// back in at the front
+			lruPush(e);
+		}
+		pthread_mutex_unlock(&cacheLock);
+	} else {
+		e = newEntry(tile, share);
+		if(e) ++stats.misses;
+		pthread_mutex_unlock(&cacheLock);
+		if(!e) return NULL;
+
+		unsigned char *pixels = malloc(tileSize);
+		if(pixels && !loadTile(tile, pixels)) {
+			free(pixels);
+			pixels = NULL;
+		}
+		fillEntry(e, pixels);
+	}
+
+	if(!e->pixels) {
+		tcTileCacheReleaseEntry(e);
+		return NULL;
+	}
+	tile->entry = e;
+	tile->pixels = e->pixels;
+	return e->pixels;
+}
+
+void tcTileCacheRelease(TCTile *tile)
+{
+	tcCacheEntry *e = tile->entry;
+	if(!e) return;
+
+	tile->entry = NULL;
+	tile->pixels = NULL;
+	tcTileCacheReleaseEntry(e);
+}
+
+tcCacheEntry *tcTileCacheReserve(TCTile *tile, unsigned char **pixels)
+{
+	pthread_once(&cacheOnce, watchMemory);
+	if(!tile->shared || cacheRatio <= 0) return NULL;	// nowhere to keep it
+	probeBudget();
+
+	pthread_mutex_lock(&cacheLock);
+	tcCacheEntry *e = findEntry(tile) ? NULL : newEntry(tile, true);	// there already, or on its way
+	if(e) ++stats.prefetches;
+	pthread_mutex_unlock(&cacheLock);
+	if(!e) return NULL;
+
+	*pixels = malloc(tileSize);
+	if(!*pixels) {
+		tcTileCacheFill(e, NULL, false);
+		return NULL;
+	}
+	return e;
+}
+
+void tcTileCacheFill(tcCacheEntry *e, unsigned char *pixels, bool ok)
+{
+	if(!ok) {
+		free(pixels);
+		pixels = NULL;
+	}
+	fillEntry(e, pixels);
+	tcTileCacheReleaseEntry(e);
+}
+
+void tcTileCacheForget(TCBuilderRef b)
+{
+	pthread_mutex_lock(&cacheLock);
+	for(tcCacheEntry *e = oldest, *next; e; e = next) {
+		next = e->newer;
+		if(e->builderId != b->cacheId) continue;
+		unlinkEntry(e);
+		if(!e->refs) {
+			free(e->pixels);
+			free(e);
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+#pragma mark Internals
+
+// Called with the lock held
+static tcCacheEntry *findEntry(const TCTile *tile)
+{
+	tcCacheEntry *e = buckets[bucketFor(tile->builderId, tile->level, tile->col, tile->row)];
+	while(e && !(e->builderId == tile->builderId && e->level == tile->level && e->col == tile->col && e->row == tile->row)) {
+		e = e->hashNext;
+	}
+	return e;
+}
+
+// Loading, held by the caller, and in the table if shared. Called with the lock held.
+static tcCacheEntry *newEntry(const TCTile *tile, bool share)
+{
+	tcCacheEntry *e = calloc(1, sizeof(tcCacheEntry));
+	if(!e) return NULL;
+
+	e->builderId	= tile->builderId;
+	e->level		= tile->level;
+	e->col			= tile->col;
+	e->row			= tile->row;
+	e->refs			= 1;
+	e->loading		= true;
+	if(share) {
+		size_t bucket	= bucketFor(e->builderId, e->level, e->col, e->row);
+		e->cached		= true;
+		e->hashNext		= buckets[bucket];
+		buckets[bucket]	= e;
+		lruPush(e);
+	}
+	return e;
+}
+
+// The load is over, NULL pixels == it failed
+static void fillEntry(tcCacheEntry *e, unsigned char *pixels)
+{
+	pthread_mutex_lock(&cacheLock);
+	e->loading = false;
+	e->pixels = pixels;
+	if(!pixels) {
+		if(e->cached) unlinkEntry(e);	// whoever is waiting gets the failure, the next request tries again
+	} else if(e->cached) {
+		cacheBytes += tileSize;
+		evict(cacheBudget);
+	}
+	pthread_cond_broadcast(&cacheLoaded);
+	pthread_mutex_unlock(&cacheLock);
+}
+
+void tcTileCacheReleaseEntry(tcCacheEntry *e)
+{
+	pthread_mutex_lock(&cacheLock);
+	bool last = --e->refs == 0;
+	if(last && e->cached) {
+		evict(cacheBudget);		// it may have been kept over budget while in use
+		last = false;
+	}
+	pthread_mutex_unlock(&cacheLock);
+
+	if(last) {
+		free(e->pixels);
+		free(e);
+	}
+}
+
+static bool loadTile(const TCTile *tile, unsigned char *pixels)
+{
+	if(tile->length == tileSize) {
+		if(tile->addr) {
+			memcpy(pixels, tile->addr, tileSize);
+			return true;
+		}
+		return pread(tile->fd, pixels, tileSize, tile->offset) == (ssize_t)tileSize;
+	}
+
+	unsigned char *copy = NULL;
+	const unsigned char *data = tile->addr;
+	if(!data) {
+		copy = malloc(tile->length);
+		if(copy && pread(tile->fd, copy, tile->length, tile->offset) == (ssize_t)tile->length) data = copy;
+	}
+	bool ok = data && tcUnpackTile(data, tile->length, pixels);
+	free(copy);
+	return ok;
+}
+
+// The LRU list and the table, called with the lock held
+static void lruRemove(tcCacheEntry *e)
+{
+	if(e->newer) e->newer->older = e->older;
+	else newest = e->older;
+	if(e->older) e->older->newer = e->newer;
+	else oldest = e->newer;
+	e->newer = e->older = NULL;
+}
+
+static void lruPush(tcCacheEntry *e)
+{
+	e->older = newest;
+	if(newest) newest->newer = e;
+	newest = e;
+	if(!oldest) oldest = e;
+}
+
+// Out of the table and the LRU list, the caller frees it if nobody holds it
+static void unlinkEntry(tcCacheEntry *e)
+{
+	tcCacheEntry **pp = &buckets[bucketFor(e->builderId, e->level, e->col, e->row)];
+	while(*pp && *pp != e) pp = &(*pp)->hashNext;
+	if(*pp) *pp = e->hashNext;
+	e->hashNext = NULL;
+
+	lruRemove(e);
+	if(e->pixels) cacheBytes -= tileSize;
+	e->cached = false;
+}
+
+// Called with the lock held
+static void evict(size_t budget)
+{
+	for(tcCacheEntry *e = oldest, *next; e && cacheBytes > budget; e = next) {
+		next = e->newer;
+		if(e->refs || e->loading) continue;
+		unlinkEntry(e);
+		free(e->pixels);
+		free(e);
+		++stats.evictions;
+	}
+}
+
+static void probeBudget(void)
+{
+	uint64_t now = TCTimeStamp();
+	uint64_t last = atomic_load(&lastProbe);
+	if(last && now - last < probeInterval) return;
+	if(!atomic_compare_exchange_strong(&lastProbe, &last, now)) return;		// another thread is on it
+
+	TCMemoryInfo fm = TCFreeMemory(NULL);
+
+	pthread_mutex_lock(&cacheLock);
+	// what the cache holds is not free, but it is ours to give back
+	cacheBudget = MAX((size_t)((float)(fm.freeMemory + cacheBytes) * cacheRatio), (size_t)CACHE_MIN_BYTES);
+	evict(cacheBudget);
+	pthread_mutex_unlock(&cacheLock);
+}
+
+static void watchMemory(void)
+{
+	tcWatchMemoryPressure(TCTileCacheLowMemory);
+}
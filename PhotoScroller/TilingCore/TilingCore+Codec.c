@@ -0,0 +1,199 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+/*
+ * Packed levels: with TCBuilderOptions.tileQuality set, each level file is rewritten once it is complete, every
+ * tile as a JPEG, back to back, with tileOffsets saying where each one went. A 256 KB tile typically shrinks to
+ * 15-30 KB, so temporary disk and the bytes read per drawn tile drop by about 10x, for one small decode per
+ * draw (TCTileGetBytesAtPosition). A tile that would not get smaller is kept raw - its length is tileSize.
+ *
+ * Rewriting happens in place, front to back: no tile is ever longer than tileSize, so the packed tile i always
+ * ends at or before the raw tile i+1 starts, and tile i has already been read.
+ */
+
+#ifdef LIBJPEG
+
+static bool packLevel(TCBuilderRef b, imageMemory *im, j_compress_ptr cinfo, unsigned char *tile, unsigned char *jpeg);
+static void padTile(imageMemory *im, size_t col, size_t row, unsigned char *tile);
+static void tile_error_exit(j_common_ptr cinfo);
+
+void tcPackLevels(TCBuilderRef b)
+{
+	if(b->failed || b->options.tileQuality <= 0) return;
+
+	unsigned char *tile = malloc(tileSize);
+	unsigned char *jpeg = malloc(tileSize);
+	if(!tile || !jpeg) {
+		free(tile);
+		free(jpeg);
+		return;		// it all still works unpacked
+	}
+
+	struct jpeg_compress_struct cinfo;
+	struct my_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = tile_error_exit;
+	if(setjmp(jerr.setjmp_buffer)) {
+		b->failed = true;
+	} else {
+		jpeg_create_compress(&cinfo);
+		cinfo.image_width		= (JDIMENSION)tileDimension;
+		cinfo.image_height		= (JDIMENSION)tileDimension;
+		cinfo.input_components	= (int)bytesPerPixel;
+		cinfo.in_color_space	= JCS_EXT_BGRA;
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, MIN(b->options.tileQuality, 100), TRUE);
+
+		for(size_t idx=0; idx<b->zoomLevels && !b->failed; ++idx) {
+			if(!b->ims[idx].tileOffsets && !packLevel(b, &b->ims[idx], &cinfo, tile, jpeg)) b->failed = true;
+		}
+	}
+	jpeg_destroy_compress(&cinfo);
+
+	free(tile);
+	free(jpeg);
+}
+
+static bool packLevel(TCBuilderRef b, imageMemory *im, j_compress_ptr cinfo, unsigned char *tile, unsigned char *jpeg)
+{
+	size_t count = im->cols*im->rows;
+	uint64_t *offsets = malloc((count+1) * sizeof(uint64_t));
+	if(!offsets) return false;
+
+	uint64_t offset = 0;
+	uint64_t written = 0;		// handed to writeback, a tile row at a time
+	for(size_t i=0; i<count; ++i) {
+		ssize_t ret = pread(im->map.fd, tile, tileSize, (off_t)(i*tileSize));
+		if(ret != (ssize_t)tileSize) {
+			LOG("Level file read failed (%s)", ret == -1 ? strerror(errno) : "short file");
+			free(offsets);
+			return false;
+		}
+		padTile(im, i % im->cols, i / im->cols, tile);
+
+		// libjpeg mallocs a bigger buffer if the JPEG outgrows this one - then the raw tile is smaller anyway
+		unsigned char *out = jpeg;
+		unsigned long len = tileSize;
+		jpeg_mem_dest(cinfo, &out, &len);
+		jpeg_start_compress(cinfo, TRUE);
+		while(cinfo->next_scanline < cinfo->image_height) {
+			JSAMPROW row = tile + cinfo->next_scanline*tileBytesPerRow;
+			jpeg_write_scanlines(cinfo, &row, 1);
+		}
+		jpeg_finish_compress(cinfo);
+
+		bool packed = out == jpeg && len < tileSize;
+		if(out != jpeg) free(out);
+		if(!packed) {
+			len = tileSize;		// raw, as padded - nothing outside the image is ever drawn
+		}
+		if(!tcWriteAll(im->map.fd, packed ? jpeg : tile, len, (off_t)offset)) {
+			free(offsets);
+			return false;
+		}
+		offsets[i] = offset;
+		offset += len;
+		if(i % im->cols == im->cols-1) {
+			tcWritebackRange(b, im->map.fd, written, offset - written);
+			written = offset;
+		}
+	}
+	offsets[count] = offset;
+
+	if(ftruncate(im->map.fd, (off_t)offset)) {
+		LOG("Failed to truncate file!");
+		free(offsets);
+		return false;
+	}
+	im->tileOffsets = offsets;
+	return true;
+}
+
+// JPEG blocks that straddle the edge of the image would bleed the empty space into it, so repeat the edge pixels instead
+static void padTile(imageMemory *im, size_t col, size_t row, unsigned char *tile)
+{
+	size_t left = im->map.col0offset/bytesPerPixel;
+	size_t top = im->map.row0offset;
+	size_t x0 = col ? 0 : left;
+	size_t y0 = row ? 0 : top;
+	size_t x1 = MIN(left + im->map.width - col*tileDimension, tileDimension);
+	size_t y1 = MIN(top + im->map.height - row*tileDimension, tileDimension);
+
+	for(size_t y=y0; y<y1; ++y) {
+		uint32_t *line = (uint32_t *)(tile + y*tileBytesPerRow);
+		for(size_t x=0; x<x0; ++x) line[x] = line[x0];
+		for(size_t x=x1; x<tileDimension; ++x) line[x] = line[x1-1];
+	}
+	for(size_t y=0; y<y0; ++y) {
+		memcpy(tile + y*tileBytesPerRow, tile + y0*tileBytesPerRow, tileBytesPerRow);
+	}
+	for(size_t y=y1; y<tileDimension; ++y) {
+		memcpy(tile + y*tileBytesPerRow, tile + (y1-1)*tileBytesPerRow, tileBytesPerRow);
+	}
+}
+
+bool tcUnpackTile(const unsigned char *data, size_t len, unsigned char *pixels)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct my_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = tile_error_exit;
+
+	volatile bool ok = false;
+	if(!setjmp(jerr.setjmp_buffer)) {
+		jpeg_create_decompress(&cinfo);
+		jpeg_mem_src(&cinfo, (unsigned char *)data, (unsigned long)len);
+		jpeg_read_header(&cinfo, TRUE);
+		if(cinfo.image_width == tileDimension && cinfo.image_height == tileDimension) {
+			cinfo.out_color_space = JCS_EXT_BGRA;
+			jpeg_start_decompress(&cinfo);
+			while(cinfo.output_scanline < cinfo.output_height) {
+				JSAMPROW row = pixels + cinfo.output_scanline*tileBytesPerRow;
+				jpeg_read_scanlines(&cinfo, &row, 1);
+			}
+			jpeg_finish_decompress(&cinfo);
+			ok = true;
+		}
+	}
+	jpeg_destroy_decompress(&cinfo);
+	return ok;
+}
+
+static void tile_error_exit(j_common_ptr cinfo)
+{
+	my_error_ptr myerr = (my_error_ptr)cinfo->err;
+
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(myerr->setjmp_buffer, 1);
+}
+
+#else
+
+void tcPackLevels(TCBuilderRef b)
+{
+	(void)b;	// no encoder, tiles stay raw
+}
+
+bool tcUnpackTile(const unsigned char *data, size_t len, unsigned char *pixels)
+{
+	(void)data; (void)len; (void)pixels;
+	LOG("JPEG tiles need LIBJPEG");
+	return false;
+}
+
+#endif // LIBJPEG
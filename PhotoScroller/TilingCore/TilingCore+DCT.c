@@ -0,0 +1,670 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef LIBJPEG
+
+#include "TilingCore-Private.h"
+
+#include <pthread.h>
+
+/*
+ * DCT scaling: with TCBuilderOptions.dctScaling set, JPEG data and file decodes run libjpeg in buffered image
+ * mode, so the entropy decoding is done once and the coefficients stay in memory. Level 0 then comes from
+ * libjpeg's output pass as usual, while levels 1/2, 1/4 and 1/8 are built here straight from the coefficients,
+ * one thread per level - none of them ever looks at a full size pixel. Anything smaller is reduced from 1/8.
+ *
+ * libjpeg's reduced size IDCTs are not part of its API, so the ones it uses for scale_denom 2, 4 and 8
+ * (jidctint.c and jidctred.c, this software is based in part on the work of the Independent JPEG Group)
+ * are repeated below. Like libjpeg, a chroma block that covers twice the luma area is decoded at twice
+ * the size instead of being upsampled; whatever factor is left (4:2:2 for instance) is replicated.
+ */
+
+#define MAX_DCT_LEVELS		3		// 1/2, 1/4, 1/8
+
+#define CONST_BITS			13
+#define PASS1_BITS			2
+#define DESCALE(x, n)		(((x) + ((int32_t)1 << ((n)-1))) >> (n))
+
+typedef void (*idctFunc)(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride);
+
+typedef struct {
+	JBLOCKROW	*rows;				// a row pointer for every block row, into libjpeg's coefficient arrays
+	size_t		widthInBlocks;
+	size_t		hSamp;
+	size_t		vSamp;
+	int			quant[DCTSIZE2];
+} dctComponent;
+
+typedef struct {
+	struct tcDCT	*dct;
+	imageMemory		*im;
+	size_t			blockSize;		// of luma blocks at this level: 4, 2 or 1
+	pthread_t		thread;
+	bool			running;
+	bool			ok;
+} dctJob;
+
+struct tcDCT {
+	size_t			numComponents;
+	size_t			maxHSamp;
+	size_t			maxVSamp;
+	size_t			iMCURows;
+	size_t			imageWidth;
+	size_t			imageHeight;
+	dctComponent	comp[3];
+	dctJob			jobs[MAX_DCT_LEVELS];
+};
+
+static struct tcDCT	*dctCreate(j_decompress_ptr cinfo);
+static void		dctRelease(struct tcDCT *dct);
+static void		*levelThread(void *arg);
+static bool		renderLevel(struct tcDCT *dct, size_t lumaBlockSize, unsigned char *out, size_t bytesPerRow, size_t width, size_t height, bool pushedRight, bool pushedDown);
+static void		initTables(void);
+
+static JSAMPLE			idctLimit[1024];		// libjpeg's post-IDCT range limit, indexed by value & 1023
+static int				crR[256], cbB[256];		// YCbCr->RGB, as jdcolor.c builds them
+static int32_t			crG[256], cbG[256];
+static pthread_once_t	tablesOnce = PTHREAD_ONCE_INIT;
+
+#pragma mark Setup
+
+// 8 bit YCbCr or grayscale, with chroma subsampled by powers of 2
+bool tcDCTUsable(j_decompress_ptr cinfo)
+{
+	if(cinfo->data_precision != 8) return false;
+
+	if(!(cinfo->jpeg_color_space == JCS_YCbCr && cinfo->num_components == 3)
+		&& !(cinfo->jpeg_color_space == JCS_GRAYSCALE && cinfo->num_components == 1))
+	{
+		return false;	// CMYK, RGB and friends take the usual route
+	}
+	for(int ci=0; ci<cinfo->num_components; ++ci) {
+		int h = cinfo->comp_info[ci].h_samp_factor;
+		int v = cinfo->comp_info[ci].v_samp_factor;
+		int hr = cinfo->max_h_samp_factor / h;
+		int vr = cinfo->max_v_samp_factor / v;
+		if(cinfo->max_h_samp_factor % h || cinfo->max_v_samp_factor % v || (hr & (hr-1)) || (vr & (vr-1))) return false;
+	}
+	return true;
+}
+
+size_t tcDCTLevelsForImage(TCBuilderRef b, j_decompress_ptr cinfo)
+{
+	if(!b->options.dctScaling || b->zoomLevels < 2 || !tcDCTUsable(cinfo)) return 0;
+
+	return MIN((size_t)MAX_DCT_LEVELS, b->zoomLevels-1);
+}
+
+/*
+ * Row pointers into libjpeg's coefficient arrays, as they stand - buffered image mode only. A component
+ * that no scan has reached yet has no quantization table; it is left without rows and decodes as flat.
+ */
+static struct tcDCT *dctCreate(j_decompress_ptr cinfo)
+{
+	jvirt_barray_ptr *coefs = jpeg_read_coefficients(cinfo);
+
+	struct tcDCT *dct = calloc(1, sizeof(struct tcDCT));
+	if(!dct) return NULL;
+
+	dct->numComponents	= (size_t)cinfo->num_components;
+	dct->maxHSamp		= (size_t)cinfo->max_h_samp_factor;
+	dct->maxVSamp		= (size_t)cinfo->max_v_samp_factor;
+	dct->iMCURows		= (size_t)cinfo->total_iMCU_rows;
+	dct->imageWidth		= cinfo->image_width;
+	dct->imageHeight	= cinfo->image_height;
+
+	// libjpeg-turbo keeps virtual arrays in memory (jmemnobs.c), so the row pointers stay put; access is limited to one iMCU row at a time
+	for(size_t ci=0; ci<dct->numComponents; ++ci) {
+		jpeg_component_info *compptr = &cinfo->comp_info[ci];
+		dctComponent *comp = &dct->comp[ci];
+
+		comp->widthInBlocks	= compptr->width_in_blocks;
+		comp->hSamp			= (size_t)compptr->h_samp_factor;
+		comp->vSamp			= (size_t)compptr->v_samp_factor;
+		if(!compptr->quant_table) continue;
+		for(int i=0; i<DCTSIZE2; ++i) {
+			comp->quant[i] = compptr->quant_table->quantval[i];
+		}
+
+		comp->rows = malloc(dct->iMCURows * comp->vSamp * sizeof(JBLOCKROW));
+		if(!comp->rows) {
+			dctRelease(dct);
+			return NULL;
+		}
+		for(size_t row=0; row<dct->iMCURows; ++row) {
+			JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo, coefs[ci], (JDIMENSION)(row*comp->vSamp), (JDIMENSION)comp->vSamp, FALSE);
+			for(size_t i=0; i<comp->vSamp; ++i) {
+				comp->rows[row*comp->vSamp + i] = blocks[i];
+			}
+		}
+	}
+	return dct;
+}
+
+static void dctRelease(struct tcDCT *dct)
+{
+	for(size_t ci=0; ci<dct->numComponents; ++ci) {
+		free(dct->comp[ci].rows);
+	}
+	free(dct);
+}
+
+/*
+ * Called after jpeg_start_decompress() in buffered image mode, with levels 1...dctLevels mapped. Reads the
+ * whole image, then starts filling the levels while the caller runs the level 0 output pass.
+ */
+bool tcDCTLevelsStart(TCBuilderRef b, j_decompress_ptr cinfo)
+{
+	assert(cinfo->buffered_image && !b->dct);
+	pthread_once(&tablesOnce, initTables);
+
+	int ret;
+	do {
+		ret = jpeg_consume_input(cinfo);
+	} while(ret != JPEG_REACHED_EOI && ret != JPEG_SUSPENDED);
+	if(ret == JPEG_SUSPENDED) {
+		LOG("DCT scaling needs the whole image");
+		return false;
+	}
+
+	struct tcDCT *dct = dctCreate(cinfo);
+	if(!dct) return false;
+	b->dct = dct;
+
+	for(size_t idx=0; idx<b->dctLevels; ++idx) {
+		dctJob *job = &dct->jobs[idx];
+		job->dct		= dct;
+		job->im			= &b->ims[idx+1];
+		job->blockSize	= DCTSIZE >> (idx+1);
+		assert(job->im->map.addr);
+
+		int err = pthread_create(&job->thread, NULL, levelThread, job);
+		if(err) {
+			LOG("Failed to start a DCT level thread (%s)", strerror(err));
+			return false;
+		}
+		job->running = true;
+	}
+	return true;
+}
+
+// Must run before jpeg_finish_decompress() or jpeg_destroy_decompress(), which free the coefficients. Safe to call more than once.
+bool tcDCTLevelsFinish(TCBuilderRef b)
+{
+	struct tcDCT *dct = b->dct;
+	if(!dct) return true;
+
+	bool ok = true;
+	for(size_t idx=0; idx<MAX_DCT_LEVELS; ++idx) {
+		dctJob *job = &dct->jobs[idx];
+		if(job->running) {
+			pthread_join(job->thread, NULL);
+			ok = ok && job->ok;
+		} else
+		if(idx < b->dctLevels) {
+			ok = false;	// never started
+		}
+	}
+	dctRelease(dct);
+	b->dct = NULL;
+
+	return ok;
+}
+
+/*
+ * Progressive streams (see jpegPreview in TilingCore+JPEG.c): level idx of whatever the scans read so far have
+ * left in the coefficients, on the caller's thread. Coefficients that have not arrived are zero, so early on
+ * this is mostly the DC terms - a blocky but complete picture.
+ */
+bool tcDCTPreview(TCBuilderRef b, j_decompress_ptr cinfo, size_t idx, unsigned char *out, size_t bytesPerRow)
+{
+	assert(cinfo->buffered_image && idx <= MAX_DCT_LEVELS);
+	pthread_once(&tablesOnce, initTables);
+
+	struct tcDCT *dct = dctCreate(cinfo);
+	if(!dct) return false;
+
+	mapper *map = &b->ims[idx].map;
+	bool ok = renderLevel(dct, DCTSIZE >> idx, out, bytesPerRow, map->width, map->height, map->col0offset != 0, map->row0offset != 0);
+	dctRelease(dct);
+
+	return ok;
+}
+
+#pragma mark Levels
+
+static void idctIslow(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride);
+static void idct4x4(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride);
+static void idct2x2(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride);
+static void idct1x1(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride);
+
+static idctFunc idctForSize(size_t size)
+{
+	switch(size) {
+	case 1:		return idct1x1;
+	case 2:		return idct2x2;
+	case 4:		return idct4x4;
+	default:	return idctIslow;
+	}
+}
+
+static size_t log2Size(size_t v)
+{
+	size_t s = 0;
+	while(v > 1) {
+		v >>= 1;
+		++s;
+	}
+	return s;
+}
+
+static void *levelThread(void *arg)
+{
+	dctJob *job = arg;
+	mapper *map = &job->im->map;
+
+	job->ok = renderLevel(job->dct, job->blockSize, map->addr + map->col0offset + map->row0offset*map->bytesPerRow, map->bytesPerRow,
+		map->width, map->height, map->col0offset != 0, map->row0offset != 0);
+	return NULL;
+}
+
+/*
+ * One iMCU row at a time: each component's blocks are decoded into a strip of samples, then the strips are
+ * converted to BGRA rows of the level, the first one at out.
+ */
+static bool renderLevel(struct tcDCT *dct, size_t lumaBlockSize, unsigned char *out, size_t bytesPerRow, size_t width, size_t height, bool pushedRight, bool pushedDown)
+{
+	bool ok = false;
+
+	// Decoded sizes round up, levels round down, so there is one partial column (row) to lose. When pushed right
+	// (down), the last ones should line up in all levels - drop the first one instead if that gets closer.
+	size_t scale = DCTSIZE / lumaBlockSize;
+	size_t skipCol = pushedRight && (dct->imageWidth % scale)*2 >= scale ? 1 : 0;
+	size_t skipRow = pushedDown && (dct->imageHeight % scale)*2 >= scale ? 1 : 0;
+
+	size_t blockSize[3], stride[3], hShift[3], vShift[3];
+	idctFunc idct[3];
+	JSAMPLE *strip[3] = { NULL, NULL, NULL };
+
+	for(size_t ci=0; ci<dct->numComponents; ++ci) {
+		dctComponent *comp = &dct->comp[ci];
+
+		// decode chroma bigger rather than upsample it, as long as a block stays 8x8 or less
+		size_t size = lumaBlockSize;
+		while(size < DCTSIZE
+			&& (dct->maxHSamp*lumaBlockSize) % (comp->hSamp*size*2) == 0
+			&& (dct->maxVSamp*lumaBlockSize) % (comp->vSamp*size*2) == 0)
+		{
+			size *= 2;
+		}
+		blockSize[ci]	= size;
+		idct[ci]		= idctForSize(size);
+		hShift[ci]		= log2Size(dct->maxHSamp*lumaBlockSize / (comp->hSamp*size));
+		vShift[ci]		= log2Size(dct->maxVSamp*lumaBlockSize / (comp->vSamp*size));
+		stride[ci]		= comp->widthInBlocks * size;
+		strip[ci]		= malloc(stride[ci] * comp->vSamp * size);
+		if(!strip[ci]) goto eRR;
+		if(!comp->rows) memset(strip[ci], CENTERJSAMPLE, stride[ci] * comp->vSamp * size);	// not in any scan yet
+	}
+
+	size_t rowsPerIMCU = dct->maxVSamp * lumaBlockSize;
+	for(size_t iMCURow=0; iMCURow<dct->iMCURows; ++iMCURow) {
+		size_t y0 = iMCURow * rowsPerIMCU;
+		if(y0 >= height + skipRow) break;
+
+		for(size_t ci=0; ci<dct->numComponents; ++ci) {
+			dctComponent *comp = &dct->comp[ci];
+			if(!comp->rows) continue;
+			size_t size = blockSize[ci];
+			for(size_t by=0; by<comp->vSamp; ++by) {
+				JBLOCKROW blocks = comp->rows[iMCURow*comp->vSamp + by];
+				JSAMPLE *samples = strip[ci] + by*size*stride[ci];
+				for(size_t bx=0; bx<comp->widthInBlocks; ++bx, samples += size) {
+					idct[ci](blocks[bx], comp->quant, samples, stride[ci]);
+				}
+			}
+		}
+
+		size_t rows = MIN(rowsPerIMCU, height + skipRow - y0);
+		for(size_t y=0; y<rows; ++y) {
+			if(y0 + y < skipRow) continue;
+			uint32_t *outPtr = (uint32_t *)(out + (y0 + y - skipRow)*bytesPerRow);
+			const JSAMPLE *yPtr = strip[0] + (y >> vShift[0])*stride[0];
+
+			if(dct->numComponents == 1) {
+				for(size_t x=skipCol; x<width+skipCol; ++x) {
+					uint32_t g = yPtr[x >> hShift[0]];
+					*outPtr++ = 0xFF000000 | g << 16 | g << 8 | g;
+				}
+			} else {
+				const JSAMPLE *cbPtr = strip[1] + (y >> vShift[1])*stride[1];
+				const JSAMPLE *crPtr = strip[2] + (y >> vShift[2])*stride[2];
+				for(size_t x=skipCol; x<width+skipCol; ++x) {
+					int lum	= yPtr[x >> hShift[0]];
+					int cb	= cbPtr[x >> hShift[1]];
+					int cr	= crPtr[x >> hShift[2]];
+					int r	= lum + crR[cr];
+					int g	= lum + (int)((cbG[cb] + crG[cr]) >> 16);
+					int bl	= lum + cbB[cb];
+					r		= r < 0 ? 0 : r > 255 ? 255 : r;
+					g		= g < 0 ? 0 : g > 255 ? 255 : g;
+					bl		= bl < 0 ? 0 : bl > 255 ? 255 : bl;
+					*outPtr++ = 0xFF000000 | (uint32_t)r << 16 | (uint32_t)g << 8 | (uint32_t)bl;
+				}
+			}
+		}
+	}
+	ok = true;
+
+  eRR:
+	for(size_t ci=0; ci<dct->numComponents; ++ci) {
+		free(strip[ci]);
+	}
+	return ok;
+}
+
+static void initTables(void)
+{
+	for(int i=0; i<1024; ++i) {
+		int x = (i < 512 ? i : i - 1024) + CENTERJSAMPLE;
+		idctLimit[i] = (JSAMPLE)(x < 0 ? 0 : x > MAXJSAMPLE ? MAXJSAMPLE : x);
+	}
+
+#define SCALEBITS	16
+#define ONE_HALF	((int32_t)1 << (SCALEBITS-1))
+#define FIX(x)		((int32_t)((x) * (1L << SCALEBITS) + 0.5))
+	for(int i=0, x=-CENTERJSAMPLE; i<=MAXJSAMPLE; ++i, ++x) {
+		crR[i] = (int)((FIX(1.40200) * x + ONE_HALF) >> SCALEBITS);
+		cbB[i] = (int)((FIX(1.77200) * x + ONE_HALF) >> SCALEBITS);
+		crG[i] = (-FIX(0.71414)) * x;
+		cbG[i] = (-FIX(0.34414)) * x + ONE_HALF;
+	}
+#undef SCALEBITS
+#undef ONE_HALF
+#undef FIX
+}
+
+#pragma mark IDCT
+
+#define FIX_0_211164243		((int32_t)1730)
+#define FIX_0_298631336		((int32_t)2446)
+#define FIX_0_390180644		((int32_t)3196)
+#define FIX_0_509795579		((int32_t)4176)
+#define FIX_0_541196100		((int32_t)4433)
+#define FIX_0_601344887		((int32_t)4926)
+#define FIX_0_720959822		((int32_t)5906)
+#define FIX_0_765366865		((int32_t)6270)
+#define FIX_0_850430095		((int32_t)6967)
+#define FIX_0_899976223		((int32_t)7373)
+#define FIX_1_061594337		((int32_t)8697)
+#define FIX_1_175875602		((int32_t)9633)
+#define FIX_1_272758580		((int32_t)10426)
+#define FIX_1_451774981		((int32_t)11893)
+#define FIX_1_501321110		((int32_t)12299)
+#define FIX_1_847759065		((int32_t)15137)
+#define FIX_1_961570560		((int32_t)16069)
+#define FIX_2_053119869		((int32_t)16819)
+#define FIX_2_172734803		((int32_t)17799)
+#define FIX_2_562915447		((int32_t)20995)
+#define FIX_3_072711026		((int32_t)25172)
+#define FIX_3_624509785		((int32_t)29692)
+
+#define DEQUANTIZE(coef, q)	((int32_t)(coef) * (q))
+#define LIMIT(x)			idctLimit[(int)(x) & 1023]
+
+// jpeg_idct_islow: the full 8x8, used for chroma blocks that cover twice the luma area
+static void idctIslow(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride)
+{
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	int workspace[DCTSIZE2];
+	int *ws = workspace;
+
+	// Pass 1: columns, results scaled up by sqrt(8) and 2**PASS1_BITS
+	for(int ctr=0; ctr<DCTSIZE; ++ctr, ++in, ++quant, ++ws) {
+		if(in[DCTSIZE*1] == 0 && in[DCTSIZE*2] == 0 && in[DCTSIZE*3] == 0 && in[DCTSIZE*4] == 0
+			&& in[DCTSIZE*5] == 0 && in[DCTSIZE*6] == 0 && in[DCTSIZE*7] == 0)
+		{
+			int dc = (int)(DEQUANTIZE(in[0], quant[0]) * (1 << PASS1_BITS));
+			for(int i=0; i<DCTSIZE; ++i) ws[DCTSIZE*i] = dc;
+			continue;
+		}
+
+		// even part
+		z2 = DEQUANTIZE(in[DCTSIZE*2], quant[DCTSIZE*2]);
+		z3 = DEQUANTIZE(in[DCTSIZE*6], quant[DCTSIZE*6]);
+		z1 = (z2 + z3) * FIX_0_541196100;
+		tmp2 = z1 + z3 * -FIX_1_847759065;
+		tmp3 = z1 + z2 * FIX_0_765366865;
+
+		z2 = DEQUANTIZE(in[DCTSIZE*0], quant[DCTSIZE*0]);
+		z3 = DEQUANTIZE(in[DCTSIZE*4], quant[DCTSIZE*4]);
+		tmp0 = (z2 + z3) * (1 << CONST_BITS);
+		tmp1 = (z2 - z3) * (1 << CONST_BITS);
+
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		// odd part
+		tmp0 = DEQUANTIZE(in[DCTSIZE*7], quant[DCTSIZE*7]);
+		tmp1 = DEQUANTIZE(in[DCTSIZE*5], quant[DCTSIZE*5]);
+		tmp2 = DEQUANTIZE(in[DCTSIZE*3], quant[DCTSIZE*3]);
+		tmp3 = DEQUANTIZE(in[DCTSIZE*1], quant[DCTSIZE*1]);
+
+		z1 = tmp0 + tmp3;
+		z2 = tmp1 + tmp2;
+		z3 = tmp0 + tmp2;
+		z4 = tmp1 + tmp3;
+		z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp0 = tmp0 * FIX_0_298631336;
+		tmp1 = tmp1 * FIX_2_053119869;
+		tmp2 = tmp2 * FIX_3_072711026;
+		tmp3 = tmp3 * FIX_1_501321110;
+		z1 = z1 * -FIX_0_899976223;
+		z2 = z2 * -FIX_2_562915447;
+		z3 = z3 * -FIX_1_961570560 + z5;
+		z4 = z4 * -FIX_0_390180644 + z5;
+
+		tmp0 += z1 + z3;
+		tmp1 += z2 + z4;
+		tmp2 += z2 + z3;
+		tmp3 += z1 + z4;
+
+		ws[DCTSIZE*0] = (int)DESCALE(tmp10 + tmp3, CONST_BITS-PASS1_BITS);
+		ws[DCTSIZE*7] = (int)DESCALE(tmp10 - tmp3, CONST_BITS-PASS1_BITS);
+		ws[DCTSIZE*1] = (int)DESCALE(tmp11 + tmp2, CONST_BITS-PASS1_BITS);
+		ws[DCTSIZE*6] = (int)DESCALE(tmp11 - tmp2, CONST_BITS-PASS1_BITS);
+		ws[DCTSIZE*2] = (int)DESCALE(tmp12 + tmp1, CONST_BITS-PASS1_BITS);
+		ws[DCTSIZE*5] = (int)DESCALE(tmp12 - tmp1, CONST_BITS-PASS1_BITS);
+		ws[DCTSIZE*3] = (int)DESCALE(tmp13 + tmp0, CONST_BITS-PASS1_BITS);
+		ws[DCTSIZE*4] = (int)DESCALE(tmp13 - tmp0, CONST_BITS-PASS1_BITS);
+	}
+
+	// Pass 2: rows, descale by 8 and undo PASS1_BITS
+	ws = workspace;
+	for(int ctr=0; ctr<DCTSIZE; ++ctr, ws += DCTSIZE, out += outStride) {
+		if(ws[1] == 0 && ws[2] == 0 && ws[3] == 0 && ws[4] == 0 && ws[5] == 0 && ws[6] == 0 && ws[7] == 0) {
+			JSAMPLE dc = LIMIT(DESCALE((int32_t)ws[0], PASS1_BITS+3));
+			memset(out, dc, DCTSIZE);
+			continue;
+		}
+
+		z2 = ws[2];
+		z3 = ws[6];
+		z1 = (z2 + z3) * FIX_0_541196100;
+		tmp2 = z1 + z3 * -FIX_1_847759065;
+		tmp3 = z1 + z2 * FIX_0_765366865;
+
+		tmp0 = ((int32_t)ws[0] + ws[4]) * (1 << CONST_BITS);
+		tmp1 = ((int32_t)ws[0] - ws[4]) * (1 << CONST_BITS);
+
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		tmp0 = ws[7];
+		tmp1 = ws[5];
+		tmp2 = ws[3];
+		tmp3 = ws[1];
+
+		z1 = tmp0 + tmp3;
+		z2 = tmp1 + tmp2;
+		z3 = tmp0 + tmp2;
+		z4 = tmp1 + tmp3;
+		z5 = (z3 + z4) * FIX_1_175875602;
+
+		tmp0 = tmp0 * FIX_0_298631336;
+		tmp1 = tmp1 * FIX_2_053119869;
+		tmp2 = tmp2 * FIX_3_072711026;
+		tmp3 = tmp3 * FIX_1_501321110;
+		z1 = z1 * -FIX_0_899976223;
+		z2 = z2 * -FIX_2_562915447;
+		z3 = z3 * -FIX_1_961570560 + z5;
+		z4 = z4 * -FIX_0_390180644 + z5;
+
+		tmp0 += z1 + z3;
+		tmp1 += z2 + z4;
+		tmp2 += z2 + z3;
+		tmp3 += z1 + z4;
+
+		out[0] = LIMIT(DESCALE(tmp10 + tmp3, CONST_BITS+PASS1_BITS+3));
+		out[7] = LIMIT(DESCALE(tmp10 - tmp3, CONST_BITS+PASS1_BITS+3));
+		out[1] = LIMIT(DESCALE(tmp11 + tmp2, CONST_BITS+PASS1_BITS+3));
+		out[6] = LIMIT(DESCALE(tmp11 - tmp2, CONST_BITS+PASS1_BITS+3));
+		out[2] = LIMIT(DESCALE(tmp12 + tmp1, CONST_BITS+PASS1_BITS+3));
+		out[5] = LIMIT(DESCALE(tmp12 - tmp1, CONST_BITS+PASS1_BITS+3));
+		out[3] = LIMIT(DESCALE(tmp13 + tmp0, CONST_BITS+PASS1_BITS+3));
+		out[4] = LIMIT(DESCALE(tmp13 - tmp0, CONST_BITS+PASS1_BITS+3));
+	}
+}
+
+// jpeg_idct_4x4: row and column 4 do not contribute
+static void idct4x4(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride)
+{
+	int32_t tmp0, tmp2, tmp10, tmp12;
+	int32_t z1, z2, z3, z4;
+	int workspace[DCTSIZE*4];
+	int *ws = workspace;
+
+	for(int ctr=DCTSIZE; ctr>0; --ctr, ++in, ++quant, ++ws) {
+		if(ctr == DCTSIZE-4) continue;
+		if(in[DCTSIZE*1] == 0 && in[DCTSIZE*2] == 0 && in[DCTSIZE*3] == 0
+			&& in[DCTSIZE*5] == 0 && in[DCTSIZE*6] == 0 && in[DCTSIZE*7] == 0)
+		{
+			int dc = (int)(DEQUANTIZE(in[0], quant[0]) * (1 << PASS1_BITS));
+			ws[DCTSIZE*0] = ws[DCTSIZE*1] = ws[DCTSIZE*2] = ws[DCTSIZE*3] = dc;
+			continue;
+		}
+
+		tmp0 = DEQUANTIZE(in[DCTSIZE*0], quant[DCTSIZE*0]) * (1 << (CONST_BITS+1));
+		z2 = DEQUANTIZE(in[DCTSIZE*2], quant[DCTSIZE*2]);
+		z3 = DEQUANTIZE(in[DCTSIZE*6], quant[DCTSIZE*6]);
+		tmp2 = z2 * FIX_1_847759065 + z3 * -FIX_0_765366865;
+		tmp10 = tmp0 + tmp2;
+		tmp12 = tmp0 - tmp2;
+
+		z1 = DEQUANTIZE(in[DCTSIZE*7], quant[DCTSIZE*7]);
+		z2 = DEQUANTIZE(in[DCTSIZE*5], quant[DCTSIZE*5]);
+		z3 = DEQUANTIZE(in[DCTSIZE*3], quant[DCTSIZE*3]);
+		z4 = DEQUANTIZE(in[DCTSIZE*1], quant[DCTSIZE*1]);
+		tmp0 = z1 * -FIX_0_211164243 + z2 * FIX_1_451774981 + z3 * -FIX_2_172734803 + z4 * FIX_1_061594337;
+		tmp2 = z1 * -FIX_0_509795579 + z2 * -FIX_0_601344887 + z3 * FIX_0_899976223 + z4 * FIX_2_562915447;
+
+		ws[DCTSIZE*0] = (int)DESCALE(tmp10 + tmp2, CONST_BITS-PASS1_BITS+1);
+		ws[DCTSIZE*3] = (int)DESCALE(tmp10 - tmp2, CONST_BITS-PASS1_BITS+1);
+		ws[DCTSIZE*1] = (int)DESCALE(tmp12 + tmp0, CONST_BITS-PASS1_BITS+1);
+		ws[DCTSIZE*2] = (int)DESCALE(tmp12 - tmp0, CONST_BITS-PASS1_BITS+1);
+	}
+
+	ws = workspace;
+	for(int ctr=0; ctr<4; ++ctr, ws += DCTSIZE, out += outStride) {
+		if(ws[1] == 0 && ws[2] == 0 && ws[3] == 0 && ws[5] == 0 && ws[6] == 0 && ws[7] == 0) {
+			JSAMPLE dc = LIMIT(DESCALE((int32_t)ws[0], PASS1_BITS+3));
+			out[0] = out[1] = out[2] = out[3] = dc;
+			continue;
+		}
+
+		tmp0 = (int32_t)ws[0] * (1 << (CONST_BITS+1));
+		tmp2 = ws[2] * FIX_1_847759065 + ws[6] * -FIX_0_765366865;
+		tmp10 = tmp0 + tmp2;
+		tmp12 = tmp0 - tmp2;
+
+		z1 = ws[7];
+		z2 = ws[5];
+		z3 = ws[3];
+		z4 = ws[1];
+		tmp0 = z1 * -FIX_0_211164243 + z2 * FIX_1_451774981 + z3 * -FIX_2_172734803 + z4 * FIX_1_061594337;
+		tmp2 = z1 * -FIX_0_509795579 + z2 * -FIX_0_601344887 + z3 * FIX_0_899976223 + z4 * FIX_2_562915447;
+
+		out[0] = LIMIT(DESCALE(tmp10 + tmp2, CONST_BITS+PASS1_BITS+3+1));
+		out[3] = LIMIT(DESCALE(tmp10 - tmp2, CONST_BITS+PASS1_BITS+3+1));
+		out[1] = LIMIT(DESCALE(tmp12 + tmp0, CONST_BITS+PASS1_BITS+3+1));
+		out[2] = LIMIT(DESCALE(tmp12 - tmp0, CONST_BITS+PASS1_BITS+3+1));
+	}
+}
+
+// jpeg_idct_2x2: only the odd rows and columns (and DC) contribute
+static void idct2x2(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride)
+{
+	int32_t tmp0, tmp10;
+	int workspace[DCTSIZE*2];
+	int *ws = workspace;
+
+	for(int ctr=DCTSIZE; ctr>0; --ctr, ++in, ++quant, ++ws) {
+		if(ctr == DCTSIZE-2 || ctr == DCTSIZE-4 || ctr == DCTSIZE-6) continue;
+		if(in[DCTSIZE*1] == 0 && in[DCTSIZE*3] == 0 && in[DCTSIZE*5] == 0 && in[DCTSIZE*7] == 0) {
+			int dc = (int)(DEQUANTIZE(in[0], quant[0]) * (1 << PASS1_BITS));
+			ws[DCTSIZE*0] = ws[DCTSIZE*1] = dc;
+			continue;
+		}
+
+		tmp10 = DEQUANTIZE(in[DCTSIZE*0], quant[DCTSIZE*0]) * (1 << (CONST_BITS+2));
+		tmp0 = DEQUANTIZE(in[DCTSIZE*7], quant[DCTSIZE*7]) * -FIX_0_720959822
+			 + DEQUANTIZE(in[DCTSIZE*5], quant[DCTSIZE*5]) * FIX_0_850430095
+			 + DEQUANTIZE(in[DCTSIZE*3], quant[DCTSIZE*3]) * -FIX_1_272758580
+			 + DEQUANTIZE(in[DCTSIZE*1], quant[DCTSIZE*1]) * FIX_3_624509785;
+
+		ws[DCTSIZE*0] = (int)DESCALE(tmp10 + tmp0, CONST_BITS-PASS1_BITS+2);
+		ws[DCTSIZE*1] = (int)DESCALE(tmp10 - tmp0, CONST_BITS-PASS1_BITS+2);
+	}
+
+	ws = workspace;
+	for(int ctr=0; ctr<2; ++ctr, ws += DCTSIZE, out += outStride) {
+		if(ws[1] == 0 && ws[3] == 0 && ws[5] == 0 && ws[7] == 0) {
+			out[0] = out[1] = LIMIT(DESCALE((int32_t)ws[0], PASS1_BITS+3));
+			continue;
+		}
+
+		tmp10 = (int32_t)ws[0] * (1 << (CONST_BITS+2));
+		tmp0 = ws[7] * -FIX_0_720959822 + ws[5] * FIX_0_850430095 + ws[3] * -FIX_1_272758580 + ws[1] * FIX_3_624509785;
+
+		out[0] = LIMIT(DESCALE(tmp10 + tmp0, CONST_BITS+PASS1_BITS+3+2));
+		out[1] = LIMIT(DESCALE(tmp10 - tmp0, CONST_BITS+PASS1_BITS+3+2));
+	}
+}
+
+// jpeg_idct_1x1: the block average
+static void idct1x1(const JCOEF *in, const int *quant, JSAMPLE *out, size_t outStride)
+{
+	(void)outStride;
+	out[0] = LIMIT(DESCALE(DEQUANTIZE(in[0], quant[0]), 3));
+}
+
+#endif // LIBJPEG
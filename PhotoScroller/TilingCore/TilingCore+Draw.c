@@ -0,0 +1,143 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+bool TCBuilderGetTile(TCBuilderRef b, size_t level, size_t col, size_t row, TCTile *tile)
+{
+	if(b->failed || level >= b->zoomLevels) return false;
+
+	imageMemory *im = &b->ims[level];
+	if(col >= im->cols || row >= im->rows) return false;
+
+	bool newCol = false;
+	bool newRow = false;
+
+	switch(b->orientation) {
+	default:
+	case 0:
+	case 1:
+	case 5:
+		break;
+	case 2:
+	case 8:
+		newCol = true;
+		break;
+	case 3:
+	case 7:
+		newCol = true;
+		newRow = true;
+		break;
+	case 4:
+	case 6:
+		newRow = true;
+		break;
+	}
+	size_t ncol = newCol ? im->cols - col - 1 : col;
+	size_t nrow = newRow ? im->rows - row - 1 : row;
+
+	size_t x = ncol * tileDimension;
+	size_t y = nrow * tileDimension;
+
+	tile->fd			= b->archiveAddr ? b->archiveFd : im->map.fd;
+	tile->width			= MIN(im->map.width-x, tileDimension);
+	tile->height		= MIN(im->map.height-y, tileDimension);
+	tile->bytesPerRow	= tileBytesPerRow;
+
+	size_t i = row*im->cols + col;
+	size_t offset, length;
+	if(b->archiveAddr) {
+		offset = (size_t)b->archiveIndex[im->firstTile + i].offset;
+		length = b->archiveIndex[im->firstTile + i].length;
+	} else if(im->tileOffsets) {
+		offset = (size_t)im->tileOffsets[i];
+		length = (size_t)(im->tileOffsets[i+1] - im->tileOffsets[i]);
+	} else {
+		offset = i * tileSize;
+		length = tileSize;
+	}
+
+	// orientation - the first tile row and column of a level are pushed right and down
+	size_t skip = 0;
+	if(!col) {
+		skip += im->map.col0offset;
+	}
+	if(!row) {
+		skip += im->map.row0offset * tileBytesPerRow;
+	}
+	tile->offset = (off_t)offset;
+	tile->addr = b->archiveAddr ? b->archiveAddr + offset : NULL;
+	tile->length = length;
+	tile->skip = skip;
+
+	tile->builderId = b->cacheId;
+	tile->level = level;
+	tile->col = col;
+	tile->row = row;
+	tile->shared = b->complete && tcTileCacheEnabled();	// a level still being written must not be cached half done
+	tile->pixels = NULL;
+	tile->entry = NULL;
+
+	return true;
+}
+
+size_t TCTileGetBytesAtPosition(TCTile *tile, void *buffer, off_t position, size_t origCount)
+{
+	//LOG("Draw offset=%lld", (long long)tile->offset);
+
+	position += (off_t)tile->skip;
+
+	// with a skip, a whole image's worth from there runs past the end of the tile - into the unused end of its last row
+	size_t inTile = (size_t)position < tileSize ? MIN(origCount, tileSize - (size_t)position) : 0;
+
+	if(tile->addr && tile->length == tileSize) {
+		memcpy(buffer, tile->addr+position, inTile);	// archive, already mapped
+		memset((unsigned char *)buffer + inTile, 0, origCount - inTile);
+		return origCount;
+	}
+	if(tile->length < tileSize || tile->shared) {
+		// JPEG tiles are decoded the first time through, finished raw tiles read whole - either way the tile cache keeps them
+		if(!tile->pixels && !tcTileCacheAcquire(tile)) return 0;
+		memcpy(buffer, tile->pixels + position, inTile);
+		memset((unsigned char *)buffer + inTile, 0, origCount - inTile);
+		return origCount;
+	}
+#if MAPPING_IMAGES == 1
+	// Turning the NOCACHE flag off might up performance, but really clog the system
+	// Note that the OS calls this on multiple threads. Thus, we cannot read directly from the file - we'd have to single thread those reads.
+	// mmap lets us map as many areas as we need.
+	unsigned char *startPtr = mmap(NULL, tileSize, PROT_READ, MAP_FILE | MAP_SHARED | MAP_NOCACHE, tile->fd, tile->offset);
+	if(startPtr == MAP_FAILED) {
+		//LOG("errno4=%s", strerror(errno) );
+		return 0;
+	}
+
+	memcpy(buffer, startPtr+position, origCount);	// blit the image, then return. How nice is that!
+	munmap(startPtr, tileSize);
+#else
+	ssize_t readSize = pread(tile->fd, buffer, origCount, tile->offset + position);
+	if((size_t)readSize != origCount) {
+		//LOG("errno4=%s", strerror(errno) );
+		return 0;
+	}
+#endif
+	return origCount;
+}
+
+void TCTileRelease(TCTile *tile)
+{
+	tcTileCacheRelease(tile);
+}
@@ -0,0 +1,328 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#ifdef LIBJPEG
+
+#include "TilingCore-Private.h"
+
+#include <pthread.h>
+#include "jerror.h"
+
+/*
+ * Threaded streams: the network hands chunks over and goes back to the network, a thread of the stream's own
+ * decodes them. Between the two is a ring of chunk references - the bytes stay where they arrived, as with
+ * TCBuilderAppendJPEGStreamChunk - with one writer and one reader, so the only shared state is the two indexes
+ * and the byte count. The lock and condition are only there to sleep on, when the ring is empty or full.
+ *
+ * The decode thread's source blocks for the next chunk rather than suspending, so libjpeg never backs up and
+ * each chunk goes back as soon as the next one is handed out. It's the bytes held, not the slots, that bound
+ * the ring: past capacity the network is told to pause, and resume() is called once the decoder has worked
+ * them down to half. The slots only fill with tiny chunks, and then queuing does wait for one.
+ */
+
+#define FEED_SLOTS			64						// chunks waiting, at most
+#define FEED_CAPACITY		(1024*1024)				// bytes held before the network is asked to pause, by default
+
+typedef struct {
+	const JOCTET		*bytes;
+	size_t				length;
+	void				(*release)(void *context);
+	void				*context;
+} feedChunk;
+
+struct tcFeed {
+	feedChunk			slots[FEED_SLOTS];
+	atomic_size_t		head;						// next to decode, only the decode thread moves it
+	atomic_size_t		tail;						// next free, only the network moves it
+	atomic_size_t		buffered;					// bytes held, queued or being read
+	atomic_size_t		peakBuffered;				// only the network raises it
+	atomic_uint_fast64_t received;
+	atomic_uint_fast64_t chunks;
+	size_t				capacity;
+	atomic_bool			paused;						// the network was told to stop reading
+	atomic_bool			ended;						// no more chunks are coming
+	atomic_bool			cancelled;
+	atomic_bool			done;						// the decode is over, chunks are let go as they come
+	atomic_int			sleepers;
+	pthread_mutex_t		lock;						// only to sleep on
+	pthread_cond_t		changed;
+	void				(*resume)(void *context);
+	void				*context;
+	pthread_t			thread;
+	feedChunk			chunk;						// the one libjpeg is reading, decode thread only
+};
+
+static void		*feedThread(void *arg);
+static void		feedSleep(struct tcFeed *f, bool (*ready)(struct tcFeed *f));
+static void		feedWake(struct tcFeed *f);
+static bool		chunkWaiting(struct tcFeed *f);
+static bool		slotFree(struct tcFeed *f);
+static void		letGo(struct tcFeed *f, feedChunk *chunk);
+static void		drain(struct tcFeed *f);
+
+static void		feed_init_source(j_decompress_ptr cinfo);
+static boolean	feed_fill_input_buffer(j_decompress_ptr cinfo);
+static void		feed_skip_input_data(j_decompress_ptr cinfo, long num_bytes);
+static void		feed_term_source(j_decompress_ptr cinfo);
+
+#pragma mark Network side
+
+bool TCBuilderStartJPEGStreamThread(TCBuilderRef b, size_t capacity, void (*resume)(void *context), void *context)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	// right after TCBuilderBeginJPEGStream, nothing handed over any other way
+	if(b->failed || src_mgr->feed || src_mgr->chunks || src_mgr->data || !src_mgr->cinfo.src) return false;
+
+	struct tcFeed *f = calloc(1, sizeof(struct tcFeed));
+	if(!f) {
+		b->failed = true;
+		return false;
+	}
+	atomic_init(&f->head, 0);
+	atomic_init(&f->tail, 0);
+	atomic_init(&f->buffered, 0);
+	atomic_init(&f->peakBuffered, 0);
+	atomic_init(&f->received, 0);
+	atomic_init(&f->chunks, 0);
+	atomic_init(&f->paused, false);
+	atomic_init(&f->ended, false);
+	atomic_init(&f->cancelled, false);
+	atomic_init(&f->done, false);
+	atomic_init(&f->sleepers, 0);
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->changed, NULL);
+	f->capacity		= capacity ? capacity : FEED_CAPACITY;
+	f->resume		= resume;
+	f->context		= context;
+
+	src_mgr->pub.init_source		= feed_init_source;
+	src_mgr->pub.fill_input_buffer	= feed_fill_input_buffer;
+	src_mgr->pub.skip_input_data	= feed_skip_input_data;
+	src_mgr->pub.resync_to_restart	= jpeg_resync_to_restart;	// blocking, so libjpeg's own can look ahead
+	src_mgr->pub.term_source		= feed_term_source;
+	src_mgr->feed					= f;
+
+	int ret = pthread_create(&f->thread, NULL, feedThread, b);
+	if(ret) {
+		LOG("Cannot start the decode thread (%s)", strerror(ret));
+		src_mgr->feed = NULL;
+		pthread_cond_destroy(&f->changed);
+		pthread_mutex_destroy(&f->lock);
+		free(f);
+		b->failed = true;
+		return false;
+	}
+	return true;
+}
+
+TCStreamQueueResult TCBuilderQueueJPEGStreamChunk(TCBuilderRef b, const void *bytes, size_t len, void (*release)(void *context), void *context)
+{
+	struct tcFeed *f = b->src_mgr->feed;
+	feedChunk chunk = { .bytes = bytes, .length = len, .release = release, .context = context };
+
+	if(!f || atomic_load(&f->done)) {
+		letGo(f, &chunk);
+		return TCStreamDone;
+	}
+	if(!len) {
+		letGo(f, &chunk);
+		return TCStreamQueued;
+	}
+
+	size_t tail = atomic_load_explicit(&f->tail, memory_order_relaxed);
+	if(tail - atomic_load(&f->head) == FEED_SLOTS) {
+		feedSleep(f, slotFree);
+		if(atomic_load(&f->done)) {
+			letGo(f, &chunk);
+			return TCStreamDone;
+		}
+	}
+	f->slots[tail % FEED_SLOTS] = chunk;
+
+	size_t buffered = atomic_fetch_add(&f->buffered, len) + len;
+	if(buffered > atomic_load_explicit(&f->peakBuffered, memory_order_relaxed)) atomic_store_explicit(&f->peakBuffered, buffered, memory_order_relaxed);
+	atomic_fetch_add_explicit(&f->received, len, memory_order_relaxed);
+	atomic_fetch_add_explicit(&f->chunks, 1, memory_order_relaxed);
+
+	atomic_store(&f->tail, tail + 1);
+	feedWake(f);
+
+	if(buffered < f->capacity) return TCStreamQueued;
+
+	// paused first, then look again: the decoder either sees it and resumes us later, or has already drained and we carry on
+	atomic_store(&f->paused, true);
+	if((atomic_load(&f->buffered) <= f->capacity/2 || atomic_load(&f->done)) && atomic_exchange(&f->paused, false)) return TCStreamQueued;
+	return TCStreamFull;
+}
+
+bool TCBuilderEndJPEGStream(TCBuilderRef b, bool cancel)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+	struct tcFeed *f = src_mgr->feed;
+	if(!f) return b->complete && !b->failed;
+
+	atomic_store(cancel ? &f->cancelled : &f->ended, true);
+	feedWake(f);
+	pthread_join(f->thread, NULL);
+
+	drain(f);		// anything queued after the decode was over
+	tcFeedStats(src_mgr, &src_mgr->streamStats);
+	src_mgr->feed = NULL;
+	pthread_cond_destroy(&f->changed);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+
+	return b->complete && !b->failed;
+}
+
+void tcFeedStats(co_jpeg_source_mgr *src_mgr, TCStreamStats *stats)
+{
+	struct tcFeed *f = src_mgr->feed;
+
+	stats->buffered		= atomic_load(&f->buffered);
+	stats->peakBuffered	= atomic_load(&f->peakBuffered);
+	stats->received		= atomic_load(&f->received);
+	stats->chunks		= atomic_load(&f->chunks);
+}
+
+#pragma mark Decode side
+
+static void *feedThread(void *arg)
+{
+	TCBuilderRef b = arg;
+	struct tcFeed *f = b->src_mgr->feed;
+
+	(void)tcJPEGStreamDecode(b);	// never suspends, so this is the whole image - or where it failed
+
+	atomic_store(&f->done, true);
+	drain(f);
+	feedWake(f);
+	if(atomic_exchange(&f->paused, false) && f->resume) f->resume(f->context);	// to hear it's over
+	return NULL;
+}
+
+bool tcFeedIdle(co_jpeg_source_mgr *src_mgr)
+{
+	struct tcFeed *f = src_mgr->feed;
+	return atomic_load(&f->head) == atomic_load(&f->tail);
+}
+
+static void feed_init_source(j_decompress_ptr cinfo)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+	src->start_of_stream = TRUE;
+}
+
+static boolean feed_fill_input_buffer(j_decompress_ptr cinfo)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+	struct tcFeed *f = src->feed;
+
+	// libjpeg never backs up into what it has been handed, so the last chunk can go
+	letGo(f, &f->chunk);
+
+	size_t head = atomic_load_explicit(&f->head, memory_order_relaxed);
+	if(head == atomic_load(&f->tail)) feedSleep(f, chunkWaiting);
+	if(atomic_load(&f->cancelled) || head == atomic_load(&f->tail)) {
+		ERREXIT(cinfo, JERR_INPUT_EOF);		// the stream was cut short, the decode is over
+	}
+	f->chunk = f->slots[head % FEED_SLOTS];
+	atomic_store(&f->head, head + 1);
+	feedWake(f);
+
+	src->pub.next_input_byte	= f->chunk.bytes;
+	src->pub.bytes_in_buffer	= f->chunk.length;
+	src->start_of_stream		= FALSE;
+	return TRUE;
+}
+
+static void feed_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+
+	if (num_bytes > 0) {
+		while((size_t)num_bytes > src->pub.bytes_in_buffer) {
+			num_bytes -= (long)src->pub.bytes_in_buffer;
+			(void)feed_fill_input_buffer(cinfo);		// waits for the chunk, or exits
+		}
+		src->pub.next_input_byte += (size_t)num_bytes;
+		src->pub.bytes_in_buffer -= (size_t)num_bytes;
+	}
+}
+
+static void feed_term_source(j_decompress_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+#pragma mark Utilities
+
+static void letGo(struct tcFeed *f, feedChunk *chunk)
+{
+	if(chunk->release) chunk->release(chunk->context);
+
+	if(f && chunk->length) {
+		// out of the ring - worked down to half, the network can read again
+		size_t buffered = atomic_fetch_sub(&f->buffered, chunk->length) - chunk->length;
+		if(buffered <= f->capacity/2 && atomic_load(&f->paused) && atomic_exchange(&f->paused, false) && f->resume) f->resume(f->context);
+	}
+	*chunk = (feedChunk){ .bytes = NULL };
+}
+
+// Decode thread, or once it is gone
+static void drain(struct tcFeed *f)
+{
+	letGo(f, &f->chunk);
+
+	size_t head = atomic_load(&f->head);
+	for(size_t tail = atomic_load(&f->tail); head != tail; ++head) {
+		letGo(f, &f->slots[head % FEED_SLOTS]);
+	}
+	atomic_store(&f->head, head);
+}
+
+static bool chunkWaiting(struct tcFeed *f)
+{
+	return atomic_load(&f->head) != atomic_load(&f->tail) || atomic_load(&f->ended) || atomic_load(&f->cancelled);
+}
+
+static bool slotFree(struct tcFeed *f)
+{
+	return atomic_load(&f->tail) - atomic_load(&f->head) < FEED_SLOTS || atomic_load(&f->done);
+}
+
+// Counting sleepers before looking at ready() means a waker either sees them or they see what it changed
+static void feedSleep(struct tcFeed *f, bool (*ready)(struct tcFeed *f))
+{
+	pthread_mutex_lock(&f->lock);
+	atomic_fetch_add(&f->sleepers, 1);
+	while(!ready(f)) pthread_cond_wait(&f->changed, &f->lock);
+	atomic_fetch_sub(&f->sleepers, 1);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static void feedWake(struct tcFeed *f)
+{
+	if(atomic_load(&f->sleepers)) {
+		pthread_mutex_lock(&f->lock);
+		pthread_cond_broadcast(&f->changed);
+		pthread_mutex_unlock(&f->lock);
+	}
+}
+
+#endif // LIBJPEG
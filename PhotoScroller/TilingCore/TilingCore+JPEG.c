@@ -0,0 +1,899 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef LIBJPEG
+
+#include "TilingCore-Private.h"
+
+static void my_error_exit(j_common_ptr cinfo);
+
+static void init_source(j_decompress_ptr cinfo);
+static boolean fill_input_buffer(j_decompress_ptr cinfo);
+static void skip_input_data(j_decompress_ptr cinfo, long num_bytes);
+static boolean resync_to_restart(j_decompress_ptr cinfo, int desired);
+static void term_source(j_decompress_ptr cinfo);
+static boolean chunk_fill_input_buffer(j_decompress_ptr cinfo);
+static void chunk_skip_input_data(j_decompress_ptr cinfo, long num_bytes);
+static void releaseChunk(co_jpeg_source_mgr *src_mgr);
+
+static bool partialTile(TCBuilderRef b, bool final);
+static bool jpegOutputScanLines(TCBuilderRef b);	// return true when done
+static bool jpegCreateLevels(TCBuilderRef b, bool wholeImage);
+static bool jpegDecodeBands(TCBuilderRef b, struct tcBands *bands);
+static bool jpegDecodeData(TCBuilderRef b, const void *data, size_t len);
+static bool jpegDecodeFile(TCBuilderRef b, const char *file);
+static bool jpegStartDCTLevels(TCBuilderRef b);
+static bool jpegFinishDCTLevels(TCBuilderRef b);
+static bool jpegConsumeScans(TCBuilderRef b);		// return true when done
+static void jpegPreview(TCBuilderRef b);
+static bool reduceLine(TCBuilderRef b, size_t idx, const unsigned char *line, size_t lineNo);
+static bool addStripLine(TCBuilderRef b, imageMemory *im, const unsigned char *line, size_t lineNo);
+static int exifOrientation(j_decompress_ptr cinfo);
+
+#define EXIF_ORIENTATION_TAG	0x0112
+#define JPEG_LINES				16			// asked for per jpeg_read_scanlines() call, libjpeg returns rec_outbuf_height or fewer
+
+// A zero copy stream's chunk, as the caller handed it over (TCBuilderAppendJPEGStreamChunk)
+struct tcStreamChunk {
+	struct tcStreamChunk	*next;
+	const JOCTET			*bytes;
+	size_t					length;
+	void					(*release)(void *context);
+	void					*context;
+};
+
+
+// Whole image decodes wait for a build slot (TilingCore+Sched.c)
+bool TCBuilderDecodeJPEGData(TCBuilderRef b, const void *data, size_t len)
+{
+	tcBuildAdmit(b);
+	bool ret = jpegDecodeData(b, data, len);
+	tcBuildRetire(b);
+	return ret;
+}
+
+bool TCBuilderDecodeJPEGFile(TCBuilderRef b, const char *file)
+{
+	tcBuildAdmit(b);
+	bool ret = jpegDecodeFile(b, file);
+	tcBuildRetire(b);
+	return ret;
+}
+
+static bool jpegDecodeData(TCBuilderRef b, const void *data, size_t len)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	/* We set up the normal JPEG error routines, then override error_exit. */
+	src_mgr->cinfo.err = jpeg_std_error(&src_mgr->jerr.pub);
+	src_mgr->jerr.pub.error_exit = my_error_exit;
+	/* Establish the setjmp return context for my_error_exit to use. */
+	if (setjmp(src_mgr->jerr.setjmp_buffer)) {
+		b->failed = true;
+	} else {
+		jpeg_create_decompress(&src_mgr->cinfo);
+		jpeg_mem_src(&src_mgr->cinfo, (unsigned char *)data, (unsigned long)len);
+		jpeg_save_markers(&src_mgr->cinfo, JPEG_APP0+1, 0xFFFF);
+
+		(void) jpeg_read_header(&src_mgr->cinfo, TRUE);
+		src_mgr->cinfo.out_color_space = JCS_EXT_BGRA;
+
+		struct tcBands *bands = b->options.dctScaling ? NULL : tcRestartBandsPlan(b, &src_mgr->cinfo, data, len);
+		if(bands) {
+			jpegDecodeBands(b, bands);
+			jpeg_abort_decompress(&src_mgr->cinfo);		// only read the header, the bands did the rest
+		} else if(jpegCreateLevels(b, true)) {
+			// same as a file from here on
+			src_mgr->cinfo.buffered_image = b->dctLevels ? TRUE : FALSE;
+			(void)jpeg_start_decompress(&src_mgr->cinfo);
+
+			if(!b->dctLevels || jpegStartDCTLevels(b)) {
+				while(!jpegOutputScanLines(b)) ;
+			}
+		}
+	}
+	tcDCTLevelsFinish(b);		// in case libjpeg bailed out while they were being built
+	jpeg_destroy_decompress(&src_mgr->cinfo);
+	src_mgr->cinfo.src = NULL;	// dealloc tests
+
+	return !b->failed;
+}
+
+// Restart bands write level 0 all over the place, so it is mapped whole and the other levels come from it
+static bool jpegDecodeBands(TCBuilderRef b, struct tcBands *bands)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	if(!b->orientation) {
+		b->orientation = exifOrientation(&src_mgr->cinfo);
+	}
+	b->mapWholeFile = true;
+	if(tcAllocLevels(b, src_mgr->cinfo.image_width, src_mgr->cinfo.image_height)) {
+		tcMapMemoryForIndex(b, 0, src_mgr->cinfo.image_width, src_mgr->cinfo.image_height);
+	}
+	if(b->failed) {
+		tcRestartBandsRelease(bands);
+		return false;
+	}
+
+	mapper *map = &b->ims[0].map;
+	if(tcRestartBandsDecode(b, bands, map->addr + map->col0offset + map->row0offset*map->bytesPerRow, map->bytesPerRow)) {
+		tcCreateLevelsAndTile(b);
+	}
+	return !b->failed;
+}
+
+static bool partialTile(TCBuilderRef b, bool final)
+{
+	imageMemory *im = b->ims;
+	for(size_t idx=0; idx<b->zoomLevels; ++idx, ++im) {
+		if(im->strip) continue;				// streamed levels are already tiles (see addStripLine)
+
+		// got enough to tile a row now? Levels fill at different rates, so each one has its own count.
+		size_t rows = final ? im->rows : MIN(im->outLine/tileDimension, im->rows);
+		if(rows > im->row) {
+			size_t allRows = im->rows;		// fool tilebuilder into doing just the complete rows
+			im->rows = rows;
+			b->failed = !tcTileBuilder(b, im, true);
+			im->rows = allRows;				// restore real number!
+			if(b->failed) {
+				return false;
+			}
+			im->row = rows;
+		}
+	}
+
+	if(final) {
+		im = b->ims;
+		for(size_t idx=0; idx<b->zoomLevels; ++idx, ++im) {
+			free(im->pendingRow);
+			im->pendingRow = NULL;
+			if(im->map.emptyTileRowSize) tcTruncateEmptySpace(b, im);
+			free(im->strip);
+			im->strip = NULL;
+			free(im->line);
+			im->line = NULL;
+		}
+		tcPackLevels(b);
+		tcWritebackRetire(b);
+		b->complete = !b->failed;
+	}
+	return true;
+}
+
+static bool jpegDecodeFile(TCBuilderRef b, const char *file)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+	FILE *imageFile;
+
+	int jfd = open(file, O_RDONLY, 0);
+	if(jfd <= 0) {
+		LOG("Error: failed to open input image file \"%s\" for reading (%d).\n", file, errno);
+		b->failed = true;
+		return false;
+	}
+	tcNoCache(jfd);
+
+	// Restart bands need the whole file, so threaded decodes map it and take the in memory route
+	if(b->options.decodeThreads > 1) {
+		struct stat st;
+		void *addr = fstat(jfd, &st) ? MAP_FAILED : mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_FILE | MAP_SHARED, jfd, 0);
+		close(jfd);
+		if(addr == MAP_FAILED) {
+			LOG("Error: failed to map input image file \"%s\" (%d).", file, errno);
+			b->failed = true;
+			return false;
+		}
+		bool ret = jpegDecodeData(b, addr, (size_t)st.st_size);
+		munmap(addr, (size_t)st.st_size);
+		return ret;
+	}
+
+	if ((imageFile = fdopen(jfd, "r")) == NULL) {
+		LOG("Error: failed to fdopen input image file \"%s\" for reading (%d).", file, errno);
+		close(jfd);
+		b->failed = true;
+		return false;
+	}
+
+	/* Step 1: allocate and initialize JPEG decompression object */
+
+	/* We set up the normal JPEG error routines, then override error_exit. */
+	src_mgr->cinfo.err = jpeg_std_error(&src_mgr->jerr.pub);
+	src_mgr->jerr.pub.error_exit = my_error_exit;
+	/* Establish the setjmp return context for my_error_exit to use. */
+	if (setjmp(src_mgr->jerr.setjmp_buffer)) {
+		/* If we get here, the JPEG code has signaled an error.
+		 * We need to clean up the JPEG object, close the input file, and return.
+		 */
+		b->failed = true;
+	} else {
+		/* Now we can initialize the JPEG decompression object. */
+		jpeg_create_decompress(&src_mgr->cinfo);
+
+		/* Step 2: specify data source (eg, a file) */
+		jpeg_stdio_src(&src_mgr->cinfo, imageFile);
+		jpeg_save_markers(&src_mgr->cinfo, JPEG_APP0+1, 0xFFFF);
+
+		/* Step 3: read file parameters with jpeg_read_header() */
+		(void) jpeg_read_header(&src_mgr->cinfo, TRUE);
+
+		if(jpegCreateLevels(b, true)) {
+			src_mgr->cinfo.buffered_image = b->dctLevels ? TRUE : FALSE;
+			(void)jpeg_start_decompress(&src_mgr->cinfo);
+
+			if(!b->dctLevels || jpegStartDCTLevels(b)) {
+				while(!jpegOutputScanLines(b)) ;
+			}
+		}
+	}
+	tcDCTLevelsFinish(b);		// in case libjpeg bailed out while they were being built
+	jpeg_destroy_decompress(&src_mgr->cinfo);
+	src_mgr->cinfo.src = NULL;	// dealloc tests
+
+	fclose(imageFile);
+	return !b->failed;
+}
+
+// Header has been read: settle orientation, then create a file for every level
+static bool jpegCreateLevels(TCBuilderRef b, bool wholeImage)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	if(!b->orientation) {
+		b->orientation = exifOrientation(&src_mgr->cinfo);
+	}
+	src_mgr->cinfo.out_color_space = JCS_EXT_BGRA; // (using JCS_EXT_ABGR below)
+	// Tried: JCS_EXT_ABGR JCS_EXT_ARGB JCS_EXT_RGBA JCS_EXT_BGRA
+
+	size_t width	= src_mgr->cinfo.image_width;
+	size_t height	= src_mgr->cinfo.image_height;
+
+	assert(src_mgr->cinfo.num_components == 3);
+	assert(width > 0 && height > 0);
+	//LOG("WID=%d HEIGHT=%d", src_mgr->cinfo.image_width, src_mgr->cinfo.image_height);
+
+	if(!tcAllocLevels(b, width, height)) return false;
+	b->dctLevels = wholeImage ? tcDCTLevelsForImage(b, &src_mgr->cinfo) : 0;
+
+	// Create files - levels built from the DCT coefficients are written in one go, so they are mapped whole
+	size_t scale = 1;
+	bool mapWholeFile = b->mapWholeFile;
+	for(size_t idx=0; idx<b->zoomLevels; ++idx) {
+		b->mapWholeFile = idx && idx <= b->dctLevels;
+		tcMapMemoryForIndex(b, idx, width/scale, height/scale);
+		if(b->failed) break;
+		scale *= 2;
+	}
+	b->mapWholeFile = mapWholeFile;
+
+	// each level that feeds the next one holds the first row of a pair until the second one arrives
+	for(size_t idx=b->dctLevels; idx+1<b->zoomLevels && !b->failed; ++idx) {
+		b->ims[idx].pendingRow = malloc(b->ims[idx+1].map.width*2*bytesPerPixel);
+		if(!b->ims[idx].pendingRow) b->failed = true;
+	}
+
+	// levels that arrive a line at a time collect a tile row of tiles, then write it out in one go
+	for(size_t idx=0; idx<b->zoomLevels && !b->failed; ++idx) {
+		if(idx && idx <= b->dctLevels) continue;
+		imageMemory *im = &b->ims[idx];
+		im->strip = calloc(tileDimension, im->map.bytesPerRow);
+		im->line = malloc((idx ? 1 : JPEG_LINES) * im->map.width*bytesPerPixel);
+		if(!im->strip || !im->line) b->failed = true;
+	}
+	return !b->failed;
+}
+
+/*
+ * A line of level idx has been written. Every second line completes a 2x2 pair, so the line below it in
+ * level idx+1 is written, and that line is in turn fed to idx+2. Pairs are chosen exactly as
+ * tcCreateLevelsAndTile does, so streamed and whole image decodes produce the same levels.
+ */
+static bool reduceLine(TCBuilderRef b, size_t idx, const unsigned char *line, size_t lineNo)
+{
+	if(idx+1 >= b->zoomLevels || idx < b->dctLevels) return true;
+
+	imageMemory *im = &b->ims[idx];
+	imageMemory *next = im + 1;
+
+	// when pushed right or down, odd sizes drop the first column or line so the last ones are the same in all levels
+	size_t oddRow = (im->map.row0offset && (im->map.height & 1)) ? 1 : 0;
+	size_t oddCol = (im->map.col0offset && (im->map.width & 1)) ? bytesPerPixel : 0;
+	if(lineNo < oddRow) return true;
+
+	size_t pairLine = lineNo - oddRow;
+	size_t outLine = pairLine/2;
+	if(outLine >= next->map.height) return true;
+
+	if(!(pairLine & 1)) {
+		memcpy(im->pendingRow, line + oddCol, next->map.width*2*bytesPerPixel);
+		return true;
+	}
+
+	tcReduceRows((uint32_t *)next->line, (const uint32_t *)im->pendingRow, (const uint32_t *)(line + oddCol), next->map.width);
+
+	return reduceLine(b, idx+1, next->line, outLine) && addStripLine(b, next, next->line, outLine);
+}
+
+/*
+ * A line of a streamed level is copied into its row of each tile in the strip. Once that completes a tile row,
+ * or the level, the strip is written to the file with one call - the file is tile ordered from the start.
+ */
+static bool addStripLine(TCBuilderRef b, imageMemory *im, const unsigned char *line, size_t lineNo)
+{
+	size_t fileRow = im->map.row0offset + lineNo;
+	size_t stripRow = fileRow % tileDimension;
+	unsigned char *tileRow = im->strip + stripRow*tileBytesPerRow;
+	size_t x = im->map.col0offset;
+	size_t left = im->map.width*bytesPerPixel;
+	while(left) {
+		size_t inTile = x % tileBytesPerRow;
+		size_t len = MIN(tileBytesPerRow - inTile, left);
+		memcpy(tileRow + (x / tileBytesPerRow)*tileSize + inTile, line, len);
+		line += len;
+		x += len;
+		left -= len;
+	}
+
+	im->outLine = fileRow + 1;
+	if(stripRow+1 < tileDimension && lineNo+1 < im->map.height) return true;
+
+	// the last tile row is only partly filled, and the rest of the strip still holds the one before it
+	if(stripRow+1 < tileDimension) {
+		for(size_t col=0; col<im->cols; ++col) {
+			memset(im->strip + col*tileSize + (stripRow+1)*tileBytesPerRow, 0, (tileDimension - stripRow - 1)*tileBytesPerRow);
+		}
+	}
+	uint64_t offset = (fileRow / tileDimension) * im->cols*tileSize;
+	if(!tcWriteAll(im->map.fd, im->strip, im->cols*tileSize, (off_t)offset)) {
+		b->failed = true;
+		return false;
+	}
+	tcWritebackRange(b, im->map.fd, offset, im->cols*tileSize);
+	return true;
+}
+
+// Buffered image mode: read the whole image, start the coefficient levels, then set up the level 0 output pass
+static bool jpegStartDCTLevels(TCBuilderRef b)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	if(!tcDCTLevelsStart(b, &src_mgr->cinfo)) {
+		b->failed = true;
+		return false;
+	}
+	(void)jpeg_start_output(&src_mgr->cinfo, src_mgr->cinfo.input_scan_number);
+	return true;
+}
+
+// File decodes: wait for the coefficient levels, feed the smallest one to the levels below it, and let partialTile have them all
+static bool jpegFinishDCTLevels(TCBuilderRef b)
+{
+	if(!tcDCTLevelsFinish(b)) b->failed = true;
+
+	for(size_t idx=1; idx<=b->dctLevels; ++idx) {
+		imageMemory *im = &b->ims[idx];
+		if(idx == b->dctLevels) {
+			for(size_t row=0; row<im->map.height && !b->failed; ++row) {
+				reduceLine(b, idx, im->map.addr + im->map.col0offset + (im->map.row0offset + row)*im->map.bytesPerRow, row);
+			}
+		}
+		im->outLine = im->map.row0offset + im->map.height;
+
+		int ret = munmap(im->map.emptyAddr, im->map.mappedSize);
+#if MMAP_DEBUGGING == 1
+		LOG("UNMAP[%d]: addr=%p 0x%zX bytes", im->map.fd, im->map.emptyAddr, im->map.mappedSize);
+#endif
+		assert(ret == 0);
+		(void)ret;
+		im->map.emptyAddr = NULL;
+		im->map.addr = NULL;
+	}
+	return !b->failed;
+}
+
+bool TCBuilderBeginJPEGStream(TCBuilderRef b)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	src_mgr->pub.next_input_byte	= NULL;
+	src_mgr->pub.bytes_in_buffer	= 0;
+	src_mgr->pub.init_source		= init_source;
+	src_mgr->pub.fill_input_buffer	= fill_input_buffer;
+	src_mgr->pub.skip_input_data	= skip_input_data;
+	src_mgr->pub.resync_to_restart	= resync_to_restart;
+	src_mgr->pub.term_source		= term_source;
+
+	src_mgr->consumed_data			= 0;
+	src_mgr->start_of_stream		= TRUE;
+
+	/* We set up the normal JPEG error routines, then override error_exit. */
+	src_mgr->cinfo.err = jpeg_std_error(&src_mgr->jerr.pub);
+	src_mgr->jerr.pub.error_exit = my_error_exit;
+	/* Establish the setjmp return context for my_error_exit to use. */
+	if (setjmp(src_mgr->jerr.setjmp_buffer)) {
+		/* If we get here, the JPEG code has signaled an error.
+		 * We need to clean up the JPEG object, close the input file, and return.
+		 */
+		//LOG("YIKES! SETJUMP");
+		b->failed = true;
+	} else {
+		/* Now we can initialize the JPEG decompression object. */
+		jpeg_create_decompress(&src_mgr->cinfo);
+		src_mgr->cinfo.src = &src_mgr->pub; // MUST be after the jpeg_create_decompress - ask me how I know this :-)
+		jpeg_save_markers(&src_mgr->cinfo, JPEG_APP0+1, 0xFFFF);
+	}
+	return !b->failed;
+}
+
+static bool jpegOutputScanLines(TCBuilderRef b)
+{
+	if(b->failed) return true;
+
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+	imageMemory *imP = b->ims;
+
+	while(src_mgr->cinfo.output_scanline < src_mgr->cinfo.image_height) {
+		JSAMPROW scanLines[JPEG_LINES];
+		for(size_t i=0; i<JPEG_LINES; ++i) {
+			scanLines[i] = imP->line + i*imP->map.width*bytesPerPixel;
+		}
+		int lines = (int)jpeg_read_scanlines(&src_mgr->cinfo, scanLines, JPEG_LINES);
+		if(lines <= 0) break;
+
+		for(size_t i=0; i<(size_t)lines; ++i, ++src_mgr->writtenLines) {
+			// feed the lower resolution levels, then from a tiling perspective, we have this many lines of the image
+			if(!reduceLine(b, 0, scanLines[i], src_mgr->writtenLines) || !addStripLine(b, imP, scanLines[i], src_mgr->writtenLines)) {
+				return true;
+			}
+		}
+
+		// tile the coefficient levels as we get full rows of tiles
+		if(!partialTile(b, false)) break;
+	}
+	//LOG("END LINES: me=%ld jpeg=%ld", src_mgr->writtenLines, src_mgr->cinfo.output_scanline);
+	bool ret = (src_mgr->cinfo.output_scanline == src_mgr->cinfo.image_height) || b->failed;
+
+	if(ret) {
+		if(src_mgr->cinfo.buffered_image && !b->failed) {
+			(void)jpeg_finish_output(&src_mgr->cinfo);
+			if(b->dctLevels) jpegFinishDCTLevels(b);
+		}
+		jpeg_finish_decompress(&src_mgr->cinfo);
+		if(!b->failed) {
+			assert(jpeg_input_complete(&src_mgr->cinfo));
+			ret = partialTile(b, true);
+		}
+	}
+	return ret;
+}
+
+bool TCBuilderAdvanceJPEGStream(TCBuilderRef b, const void *webData, size_t webDataLength)
+{
+	const unsigned char *dataPtr	= webData;
+	co_jpeg_source_mgr *src_mgr		= b->src_mgr;
+
+	// caller's bytes pointer can change invocation to invocation
+	size_t diff						= (size_t)(src_mgr->pub.next_input_byte - src_mgr->data);
+	src_mgr->pub.next_input_byte	= dataPtr + diff;
+	src_mgr->data					= dataPtr;
+	src_mgr->data_length			= webDataLength;
+
+	//LOG("s1=%ld s2=%d", src_mgr->data_length, highWaterMark);
+	if(!tcJPEGStreamDecode(b) || !src_mgr->got_header) return false;
+
+	// When we consume all the data in the web buffer, safe to free it up for the system to resuse
+	if(src_mgr->pub.bytes_in_buffer == 0) {
+		src_mgr->deleted_data += webDataLength;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Zero copy streams: the chunks stay where the caller received them, in a list, and fill_input_buffer hands libjpeg
+ * one at a time. The catch is suspension - when it runs out, libjpeg backs up to where it last finished a unit
+ * (an MCU, a marker), which may be a chunk or two back. So each fill_input_buffer call notes that restart point
+ * if libjpeg has moved it, and before suspending puts libjpeg back there, with the chunk it is in as the current one.
+ * Chunks before the restart point are never needed again and go back to the caller.
+ */
+bool TCBuilderAppendJPEGStreamChunk(TCBuilderRef b, const void *bytes, size_t len, void (*release)(void *context), void *context)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	struct tcStreamChunk *chunk = len && !b->failed ? malloc(sizeof(struct tcStreamChunk)) : NULL;
+	if(!chunk) {
+		if(release) release(context);
+		if(len && !b->failed) b->failed = true;
+		return !b->failed;
+	}
+	chunk->next		= NULL;
+	chunk->bytes	= bytes;
+	chunk->length	= len;
+	chunk->release	= release;
+	chunk->context	= context;
+
+	if(!src_mgr->lastChunk) {
+		src_mgr->chunks = chunk;
+		src_mgr->pub.fill_input_buffer	= chunk_fill_input_buffer;
+		src_mgr->pub.skip_input_data	= chunk_skip_input_data;
+	} else {
+		src_mgr->lastChunk->next = chunk;
+	}
+	src_mgr->lastChunk = chunk;
+
+	TCStreamStats *stats = &src_mgr->streamStats;
+	stats->buffered += len;
+	stats->peakBuffered = MAX(stats->peakBuffered, stats->buffered);
+	stats->received += len;
+	++stats->chunks;
+
+	bool ret = tcJPEGStreamDecode(b);
+	if(b->complete || b->failed) tcStreamChunksRelease(b);
+	return ret;
+}
+
+void TCBuilderGetStreamStats(TCBuilderRef b, TCStreamStats *stats)
+{
+	if(b->src_mgr->feed) {
+		tcFeedStats(b->src_mgr, stats);
+	} else {
+		*stats = b->src_mgr->streamStats;
+	}
+}
+
+void tcStreamChunksRelease(TCBuilderRef b)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	while(src_mgr->chunks) releaseChunk(src_mgr);
+	src_mgr->chunk = NULL;
+	src_mgr->pub.next_input_byte = NULL;
+	src_mgr->pub.bytes_in_buffer = 0;
+}
+
+// The oldest chunk
+static void releaseChunk(co_jpeg_source_mgr *src_mgr)
+{
+	struct tcStreamChunk *chunk = src_mgr->chunks;
+	src_mgr->chunks = chunk->next;
+	if(!src_mgr->chunks) src_mgr->lastChunk = NULL;
+	src_mgr->streamStats.buffered -= chunk->length;
+	if(chunk->release) chunk->release(chunk->context);
+	free(chunk);
+}
+
+// Whatever has arrived, as far as it goes: the header, then the scans or lines. False once the stream has failed.
+bool tcJPEGStreamDecode(TCBuilderRef b)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	if (setjmp(src_mgr->jerr.setjmp_buffer)) {
+		/* If we get here, the JPEG code has signaled an error.
+		 * We need to clean up the JPEG object, close the input file, and return.
+		 */
+		LOG("YIKES! SETJUMP");
+		b->failed = true;
+		return false;
+	}
+	if(src_mgr->jpegFailed) b->failed = true;
+
+	if(!b->failed) {
+		if(!src_mgr->got_header) {
+			/* Step 3: read file parameters with jpeg_read_header() */
+			int jret = jpeg_read_header(&src_mgr->cinfo, FALSE);
+			if(jret == JPEG_SUSPENDED || jret != JPEG_HEADER_OK) return true;
+
+			//LOG("GOT header");
+			src_mgr->got_header				= TRUE;
+			src_mgr->start_of_stream		= FALSE;
+
+			// progressive (and other multi scan) images are collected as coefficients, then output once they are all in
+			boolean multiScan = jpeg_has_multiple_scans(&src_mgr->cinfo);
+			if(jpegCreateLevels(b, multiScan)) {
+				src_mgr->cinfo.buffered_image = multiScan;
+				b->previewLevel = multiScan && tcDCTUsable(&src_mgr->cinfo) ? MIN((size_t)3, b->zoomLevels-1) : b->zoomLevels;
+				(void)jpeg_start_decompress(&src_mgr->cinfo);
+			}
+			if(src_mgr->jpegFailed) b->failed = true;
+		}
+		if(src_mgr->got_header && !b->failed) {
+			if(src_mgr->cinfo.buffered_image) {
+				jpegConsumeScans(b);
+			} else {
+				jpegOutputScanLines(b);
+			}
+		}
+	}
+	return !b->failed;
+}
+
+/*
+ * Multi scan streams: take in whatever has arrived, and if that finished a scan, refresh the previews. Once the
+ * last scan is in, the levels come from one output pass, the same as a whole image decode.
+ */
+static bool jpegConsumeScans(TCBuilderRef b)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	int ret;
+	do {
+		ret = jpeg_consume_input(&src_mgr->cinfo);
+		if(ret == JPEG_SCAN_COMPLETED) {
+			src_mgr->scansDone = (size_t)src_mgr->cinfo.input_scan_number;
+			// threaded streams never suspend: the preview is due when the decoder has caught up with the download instead
+			if(src_mgr->feed && tcFeedIdle(src_mgr) && b->previewLevel < b->zoomLevels) jpegPreview(b);
+		}
+	} while(ret != JPEG_SUSPENDED && ret != JPEG_REACHED_EOI && !src_mgr->jpegFailed);
+
+	if(src_mgr->jpegFailed) {
+		b->failed = true;
+		return true;
+	}
+	if(ret == JPEG_SUSPENDED) {
+		if(src_mgr->scansDone > b->previewScans && b->previewLevel < b->zoomLevels) jpegPreview(b);
+		return false;
+	}
+
+	if(b->dctLevels) {
+		jpegStartDCTLevels(b);
+	} else {
+		(void)jpeg_start_output(&src_mgr->cinfo, src_mgr->cinfo.input_scan_number);
+	}
+	while(!jpegOutputScanLines(b)) ;
+
+	// the tiles have it all now
+	pthread_mutex_lock(&b->previewLock);
+	free(b->preview);
+	b->preview = NULL;
+	b->previewScans = 0;
+	pthread_mutex_unlock(&b->previewLock);
+	return true;
+}
+
+// Rebuild the preview pyramid from the coefficients as they are now: previewLevel straight from them, the ones below reduced as the real levels are
+static void jpegPreview(TCBuilderRef b)
+{
+	co_jpeg_source_mgr *src_mgr = b->src_mgr;
+
+	pthread_mutex_lock(&b->previewLock);
+	if(!b->preview) {
+		size_t size = 0;
+		for(size_t idx=b->previewLevel; idx<b->zoomLevels; ++idx) {
+			size += b->ims[idx].map.width * b->ims[idx].map.height * bytesPerPixel;
+		}
+		b->preview = malloc(size);
+	}
+	imageMemory *im = &b->ims[b->previewLevel];
+	if(!b->preview || !tcDCTPreview(b, &src_mgr->cinfo, b->previewLevel, b->preview, im->map.width*bytesPerPixel)) {
+		LOG("Previews turned off, out of memory");
+		free(b->preview);
+		b->preview = NULL;
+		b->previewScans = 0;
+		b->previewLevel = b->zoomLevels;
+		pthread_mutex_unlock(&b->previewLock);
+		return;
+	}
+
+	unsigned char *in = b->preview;
+	for(size_t idx=b->previewLevel; idx+1<b->zoomLevels; ++idx, ++im) {
+		mapper *map = &im[0].map;
+		mapper *next = &im[1].map;
+		unsigned char *out = in + map->width*map->height*bytesPerPixel;
+
+		// when pushed right or down, odd sizes drop the first column or line, see reduceLine
+		size_t oddRow = (map->row0offset && (map->height & 1)) ? 1 : 0;
+		size_t oddCol = (map->col0offset && (map->width & 1)) ? 1 : 0;
+		for(size_t row=0; row<next->height; ++row) {
+			const uint32_t *in0 = (const uint32_t *)in + (oddRow + 2*row)*map->width + oddCol;
+			tcReduceRows((uint32_t *)out + row*next->width, in0, in0 + map->width, next->width);
+		}
+		in = out;
+	}
+	b->previewScans = src_mgr->scansDone;
+	pthread_mutex_unlock(&b->previewLock);
+}
+
+bool TCBuilderGetPreview(TCBuilderRef b, size_t level, TCPreview *preview)
+{
+	if(!b->previewScans || level < b->previewLevel || level >= b->zoomLevels) return false;
+
+	const unsigned char *pixels = b->preview;
+	for(size_t idx=b->previewLevel; idx<level; ++idx) {
+		pixels += b->ims[idx].map.width * b->ims[idx].map.height * bytesPerPixel;
+	}
+	preview->scans			= b->previewScans;
+	preview->width			= b->ims[level].map.width;
+	preview->height			= b->ims[level].map.height;
+	preview->bytesPerRow	= preview->width * bytesPerPixel;
+	preview->pixels			= pixels;
+	return true;
+}
+
+void TCBuilderLockPreview(TCBuilderRef b)
+{
+	pthread_mutex_lock(&b->previewLock);
+}
+
+void TCBuilderUnlockPreview(TCBuilderRef b)
+{
+	pthread_mutex_unlock(&b->previewLock);
+}
+
+// Pull the orientation out of the EXIF (APP1) marker, 0 if there isn't one
+static int exifOrientation(j_decompress_ptr cinfo)
+{
+	for(jpeg_saved_marker_ptr m = cinfo->marker_list; m; m = m->next) {
+		if(m->marker != JPEG_APP0+1 || m->data_length < 14 || memcmp(m->data, "Exif\0\0", 6)) continue;
+
+		const JOCTET *tiff = m->data + 6;
+		size_t len = m->data_length - 6;
+		bool little;
+		if(tiff[0] == 'I' && tiff[1] == 'I') little = true;
+		else if(tiff[0] == 'M' && tiff[1] == 'M') little = false;
+		else continue;
+
+#define GET16(p) (little ? (uint32_t)((p)[0] | (p)[1] << 8) : (uint32_t)((p)[0] << 8 | (p)[1]))
+#define GET32(p) (little ? (GET16(p) | GET16((p)+2) << 16) : (GET16(p) << 16 | GET16((p)+2)))
+		size_t ifd = GET32(tiff + 4);
+		if(ifd + 2 > len) continue;
+		size_t count = GET16(tiff + ifd);
+		for(size_t i=0; i<count && ifd + 2 + 12*(i+1) <= len; ++i) {
+			const JOCTET *entry = tiff + ifd + 2 + 12*i;
+			if(GET16(entry) == EXIF_ORIENTATION_TAG) {
+				uint32_t val = GET16(entry + 8);
+				return val >= 1 && val <= 8 ? (int)val : 0;
+			}
+		}
+#undef GET16
+#undef GET32
+	}
+	return 0;
+}
+
+static void my_error_exit(j_common_ptr cinfo)
+{
+  /* cinfo->err really points to a my_error_mgr struct, so coerce pointer */
+  my_error_ptr myerr = (my_error_ptr) cinfo->err;
+
+  /* Always display the message. */
+  /* We could postpone this until after returning, if we chose. */
+  (*cinfo->err->output_message) (cinfo);
+
+  /* Return control to the setjmp point */
+  longjmp(myerr->setjmp_buffer, 1);
+}
+
+static void init_source(j_decompress_ptr cinfo)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+	src->start_of_stream = TRUE;
+}
+
+static boolean fill_input_buffer(j_decompress_ptr cinfo)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+
+	size_t diff = src->consumed_data - src->deleted_data;
+	size_t unreadLen = src->data_length - diff;
+	//LOG("unreadLen=%ld", unreadLen);
+	if((long)unreadLen <= 0) {
+		return FALSE;
+	}
+	src->pub.bytes_in_buffer = unreadLen;
+
+	src->pub.next_input_byte = src->data + diff;
+	src->consumed_data = src->data_length + src->deleted_data;
+
+	src->start_of_stream = FALSE;
+	//LOG("returning %ld bytes consumed_data=%ld data_length=%ld deleted_data=%ld", unreadLen, src->consumed_data, src->data_length, src->deleted_data);
+
+	return TRUE;
+}
+
+static void skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+
+	if (num_bytes > 0) {
+		if(num_bytes <= (long)src->pub.bytes_in_buffer) {
+			//LOG("SKIPPER1: %ld", num_bytes);
+			src->pub.next_input_byte += (size_t)num_bytes;
+			src->pub.bytes_in_buffer -= (size_t)num_bytes;
+		} else {
+			//LOG("SKIPPER2: %ld", num_bytes);
+			src->consumed_data			+= (size_t)num_bytes - src->pub.bytes_in_buffer;
+			src->pub.bytes_in_buffer	= 0;
+		}
+	}
+}
+
+static boolean resync_to_restart(j_decompress_ptr cinfo, int desired)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+	// LOG("YIKES: resync_to_restart!!!");
+	(void)desired;
+
+	src->jpegFailed = TRUE;
+	return FALSE;
+}
+
+static void term_source(j_decompress_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+static boolean chunk_fill_input_buffer(j_decompress_ptr cinfo)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+
+	// libjpeg finished a unit since the last call: the new restart point, in the chunk it was reading
+	if(src->chunk && src->pub.next_input_byte != src->handedOut) {
+		src->restartByte	= src->pub.next_input_byte;
+		src->restartBytes	= src->pub.bytes_in_buffer;
+		src->restartSkip	= src->skipBytes;
+		while(src->chunks != src->chunk) releaseChunk(src);
+	}
+
+	for(struct tcStreamChunk *next = src->chunk ? src->chunk->next : src->chunks; next; next = next->next) {
+		if(src->skipBytes >= next->length) {
+			// skipped whole - if libjpeg would back up to just before it, it may as well back up to just after it
+			bool atRestart = src->restartByte && !src->restartBytes && src->restartSkip == src->skipBytes && src->chunks == src->chunk;
+			src->skipBytes -= next->length;
+			src->chunk = next;
+			if(atRestart) {
+				releaseChunk(src);
+				src->restartByte = next->bytes + next->length;
+				src->restartSkip = src->skipBytes;
+			}
+			continue;
+		}
+		src->chunk = next;
+		src->pub.next_input_byte	= next->bytes + src->skipBytes;
+		src->pub.bytes_in_buffer	= next->length - src->skipBytes;
+		src->skipBytes				= 0;
+		src->handedOut				= src->pub.next_input_byte;
+		src->start_of_stream		= FALSE;
+		return TRUE;
+	}
+
+	// suspend: when more arrives, libjpeg starts over from the restart point
+	src->chunk					= src->restartByte ? src->chunks : NULL;
+	src->pub.next_input_byte	= src->restartByte;
+	src->pub.bytes_in_buffer	= src->restartBytes;
+	src->skipBytes				= src->restartSkip;
+	src->handedOut				= src->restartByte;
+	return FALSE;
+}
+
+static void chunk_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+	co_jpeg_source_mgr *src = (co_jpeg_source_mgr *)cinfo->src;
+
+	if (num_bytes > 0) {
+		if(num_bytes <= (long)src->pub.bytes_in_buffer) {
+			src->pub.next_input_byte += (size_t)num_bytes;
+			src->pub.bytes_in_buffer -= (size_t)num_bytes;
+		} else {
+			// the rest is skipped as chunks are handed out
+			src->skipBytes				+= (size_t)num_bytes - src->pub.bytes_in_buffer;
+			src->pub.next_input_byte	+= src->pub.bytes_in_buffer;
+			src->pub.bytes_in_buffer	= 0;
+		}
+	}
+}
+
+#endif // LIBJPEG
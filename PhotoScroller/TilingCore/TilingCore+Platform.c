@@ -0,0 +1,279 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+#include <time.h>
+
+#ifdef __APPLE__
+#include <mach/mach.h>			// freeMemory
+#include <mach/mach_host.h>		// freeMemory
+#include <mach/mach_time.h>		// time metrics
+#include <mach/task_info.h>		// task metrics
+#include <dispatch/dispatch.h>	// memory pressure
+#else
+#include <sys/sysinfo.h>
+#endif
+
+static float				ubc_threshold_ratio = 0.5f;
+
+#pragma mark Temporary Files
+
+int tcCreateTempFile(TCBuilderRef b, bool unlinkFile, size_t sz, char **path)
+{
+	size_t len = strlen(b->tempDir) + sizeof("/imXXXXXX");
+	char *template = malloc(len);
+	if(!template) {
+		b->failed = true;
+		LOG("Cannot allocate a temp file name");
+		return -1;
+	}
+	snprintf(template, len, "%s/imXXXXXX", b->tempDir);
+
+	int fd = mkstemp(template);
+	//LOG("CREATE TMP FILE: %s fd=%d", template, fd);
+	if(fd == -1) {
+		b->failed = true;
+		LOG("OPEN failed file %s %s", template, strerror(errno));
+	} else {
+		if(unlinkFile) {
+			unlink(template);	// so it goes away when the fd is closed or on a crash
+
+#ifdef __APPLE__
+			int ret = fcntl(fd, F_RDAHEAD, 0);	// don't clog up the system's disk cache
+#else
+			int ret = posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM) ? -1 : 0;
+#endif
+			if(ret == -1) {
+				LOG("Warning: cannot turn off read ahead for level file (errno %s).", strerror(errno) );
+			}
+
+			ret = ftruncate(fd, (off_t)sz);			// Now the file is there for sure
+			if(ret == -1) {
+				LOG("Warning: cannot ftruncate level file (errno %s).", strerror(errno) );
+			}
+		} else {
+			tcNoCache(fd);
+		}
+	}
+	if(fd != -1 && path) {
+		*path = template;
+	} else {
+		free(template);
+	}
+	return fd;
+}
+
+void tcNoCache(int fd)
+{
+#ifdef __APPLE__
+	int ret = fcntl(fd, F_NOCACHE, 1);	// don't clog up the system's disk cache
+#else
+	int ret = posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE) ? -1 : 0;
+#endif
+	if(ret == -1) {
+		LOG("Warning: cannot turn off cacheing for input file (errno %s).", strerror(errno));
+	}
+}
+
+void tcAdviseFree(void *addr, size_t len)
+{
+#ifdef __APPLE__
+	madvise(addr, len, MADV_FREE);
+#else
+	madvise(addr, len, MADV_DONTNEED);	// MADV_FREE is only for anonymous memory on Linux, shared file pages stay in the page cache
+#endif
+}
+
+bool tcWriteAll(int fd, const void *buf, size_t len, off_t offset)
+{
+	const unsigned char *ptr = buf;
+	while(len) {
+		ssize_t ret = pwrite(fd, ptr, len, offset);
+		if(ret <= 0) {
+			if(ret == -1 && errno == EINTR) continue;
+			LOG("Write failed (%s)", strerror(errno));
+			return false;
+		}
+		ptr += ret;
+		len -= (size_t)ret;
+		offset += ret;
+	}
+	return true;
+}
+
+#pragma mark Memory Pressure
+
+void TCSetUbcThreshold(float val)
+{
+	ubc_threshold_ratio = val;
+}
+
+float tcUbcThresholdRatio(void)
+{
+	return ubc_threshold_ratio;
+}
+
+/*
+ * Level files are temporary, so getting them written is only about not holding memory: start the writeback and let
+ * the disk's own cache have it. Darwin can't write back part of a file, so there nothing starts early, and waiting
+ * means an fsync of the whole file - still not F_FULLFSYNC, that is for data that has to survive a power cut.
+ */
+int tcSyncRange(int fd, uint64_t offset, uint64_t length, bool wait)
+{
+#ifdef __APPLE__
+	(void)offset;
+	(void)length;
+	int ret = wait ? fsync(fd) : 0;
+#else
+	unsigned int flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE;
+	int ret = sync_file_range(fd, (off64_t)offset, (off64_t)length, flags);
+#endif
+	if(ret == -1 && errno != EINVAL && errno != ESPIPE) LOG("ERROR: failed to write back fd=%d (%s)", fd, strerror(errno));
+	return ret;
+}
+
+int tcFullSync(int fd)
+{
+#ifdef __APPLE__
+	int ret = fcntl(fd,  F_FULLFSYNC);
+#else
+	int ret = fdatasync(fd);
+#endif
+	if(ret == -1) LOG("ERROR: failed to sync fd=%d", fd);
+	return ret;
+}
+
+void tcWatchMemoryPressure(void (*handler)(void))
+{
+#ifdef __APPLE__
+	dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0,
+								DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL, dispatch_get_global_queue(QOS_CLASS_UTILITY, 0));
+	if(!source) return;
+	dispatch_source_set_event_handler(source, ^{ handler(); });
+	dispatch_resume(source);	// lives as long as the process
+#else
+	(void)handler;				// no notification here, TCFreeMemory() going down shrinks what callers ask for
+#endif
+}
+
+#pragma mark Utilities
+
+uint64_t TCTimeStamp(void)
+{
+#ifdef __APPLE__
+	static mach_timebase_info_data_t info;
+	if(!info.denom) mach_timebase_info(&info);
+
+	// Compliments to Rainer Brockerhoff
+	return mach_absolute_time() * info.numer / info.denom;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint32_t TCDeltaMilliSeconds(uint64_t then, uint64_t now)
+{
+	return (uint32_t)((now - then) / 1000000ull);
+}
+
+#ifdef __APPLE__
+
+TCMemoryInfo TCFreeMemory(const char *msg)
+{
+	// http://stackoverflow.com/questions/5012886
+	mach_port_t host_port;
+	mach_msg_type_number_t host_size;
+	vm_size_t pagesize;
+	TCMemoryInfo fm = { 0, 0, 0, 0, 0 };
+
+	host_port = mach_host_self();
+	host_size = sizeof(vm_statistics_data_t) / sizeof(integer_t);
+	host_page_size(host_port, &pagesize);
+
+	vm_statistics_data_t vm_stat;
+
+	if (host_statistics(host_port, HOST_VM_INFO, (host_info_t)&vm_stat, &host_size) != KERN_SUCCESS) {
+		LOG("Failed to fetch vm statistics");
+	} else {
+		/* Stats in bytes */
+		fm.usedMemory = (size_t)(vm_stat.active_count + vm_stat.inactive_count + vm_stat.wire_count) * pagesize;
+		fm.freeMemory = (size_t)vm_stat.free_count * pagesize;
+		fm.totlMemory = fm.usedMemory + fm.freeMemory;
+
+		struct task_basic_info info;
+		mach_msg_type_number_t size = sizeof( struct task_basic_info );
+		if(task_info( mach_task_self(), TASK_BASIC_INFO, (task_info_t)&info, &size ) == KERN_SUCCESS) {
+			fm.resident_size = (size_t)info.resident_size;
+			fm.virtual_size = (size_t)info.virtual_size;
+		}
+	}
+#if MEMORY_DEBUGGING == 1
+	if(msg) LOG("%s:   total: %zu used: %zu FREE: %zu  [resident=%zu virtual=%zu]", msg, fm.totlMemory, fm.usedMemory, fm.freeMemory, fm.resident_size, fm.virtual_size);
+#else
+	(void)msg;
+#endif
+	return fm;
+}
+
+#else
+
+TCMemoryInfo TCFreeMemory(const char *msg)
+{
+	TCMemoryInfo fm = { 0, 0, 0, 0, 0 };
+
+	// MemAvailable counts reclaimable page cache, which is what "free" means to the throttle
+	FILE *f = fopen("/proc/meminfo", "r");
+	if(f) {
+		char line[128];
+		unsigned long long kb;
+		while(fgets(line, sizeof(line), f)) {
+			if(sscanf(line, "MemTotal: %llu kB", &kb) == 1) fm.totlMemory = (size_t)kb * 1024;
+			else if(sscanf(line, "MemAvailable: %llu kB", &kb) == 1) fm.freeMemory = (size_t)kb * 1024;
+		}
+		fclose(f);
+	}
+	if(!fm.totlMemory) {
+		struct sysinfo si;
+		if(sysinfo(&si) == 0) {
+			fm.totlMemory = (size_t)si.totalram * si.mem_unit;
+			fm.freeMemory = (size_t)si.freeram * si.mem_unit;
+		} else {
+			LOG("Failed to fetch vm statistics");
+		}
+	}
+	fm.usedMemory = fm.totlMemory - fm.freeMemory;
+
+	f = fopen("/proc/self/statm", "r");
+	if(f) {
+		unsigned long long vsize, rsize;
+		if(fscanf(f, "%llu %llu", &vsize, &rsize) == 2) {
+			fm.virtual_size = (size_t)vsize * (size_t)getpagesize();
+			fm.resident_size = (size_t)rsize * (size_t)getpagesize();
+		}
+		fclose(f);
+	}
+#if MEMORY_DEBUGGING == 1
+	if(msg) LOG("%s:   total: %zu used: %zu FREE: %zu  [resident=%zu virtual=%zu]", msg, fm.totlMemory, fm.usedMemory, fm.freeMemory, fm.resident_size, fm.virtual_size);
+#else
+	(void)msg;
+#endif
+	return fm;
+}
+
+#endif
@@ -0,0 +1,225 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+#include <pthread.h>
+
+/*
+ * CATiledLayer asks for tiles as they come on screen, so a pan always waits on the disk for its leading edge.
+ * TCBuilderPrefetch is told what is visible; a couple of background threads then read into the tile cache the
+ * ring of tiles around it, the tiles covering it one level coarser (zooming out) and one level finer (zooming in),
+ * in that order.
+ *
+ * The queue is shared by all builders and holds at most queueDepth tiles, the rest of a request is dropped.
+ * Each new request for a builder replaces what is still queued for it - when the view moves on, the tiles around
+ * where it was are no longer wanted. Tiles already being read finish, they are in the cache either way.
+ * A thread takes up to PREFETCH_BATCH tiles of one builder at a time, so neighbours are read with one request.
+ */
+
+#define PREFETCH_THREADS	2
+#define PREFETCH_BATCH		16		// tiles of one builder read together, see TCBuilderReadTiles
+
+typedef struct {
+	TCBuilderRef	b;
+	size_t			level;
+	size_t			col;
+	size_t			row;
+} prefetchJob;
+
+static prefetchJob			*jobs;					// oldest first
+static size_t				jobCount;
+static size_t				queueDepth = 32;
+static TCBuilderRef			working[PREFETCH_THREADS];	// builder each thread is reading for, NULL == idle
+static pthread_mutex_t		prefetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		prefetchWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		prefetchIdle = PTHREAD_COND_INITIALIZER;
+static pthread_once_t		prefetchOnce = PTHREAD_ONCE_INIT;
+
+static void startThreads(void);
+static void *prefetchThread(void *arg);
+static bool queueTile(TCBuilderRef b, size_t level, ssize_t col, ssize_t row);
+static void dropJobs(TCBuilderRef b);
+
+#pragma mark Requests
+
+void TCSetPrefetchDepth(size_t depth)
+{
+	pthread_mutex_lock(&prefetchLock);
+	jobCount = 0;
+	if(!depth) {
+		free(jobs);
+		jobs = NULL;
+		queueDepth = 0;
+	} else {
+		prefetchJob *p = realloc(jobs, depth * sizeof(prefetchJob));
+		if(p) {
+			jobs = p;
+			queueDepth = depth;
+		}
+	}
+	pthread_mutex_unlock(&prefetchLock);
+}
+
+size_t TCBuilderPrefetch(TCBuilderRef b, size_t level, size_t col0, size_t row0, size_t col1, size_t row1)
+{
+	if(b->failed || !b->complete || level >= b->zoomLevels || !tcTileCacheEnabled()) return 0;
+	pthread_once(&prefetchOnce, startThreads);
+
+	pthread_mutex_lock(&prefetchLock);
+	dropJobs(b);
+
+	size_t queued = 0;
+	bool room = jobs != NULL;
+
+	// the ring, one tile wide
+	ssize_t c0 = (ssize_t)col0 - 1, c1 = (ssize_t)col1 + 1;
+	ssize_t r0 = (ssize_t)row0 - 1, r1 = (ssize_t)row1 + 1;
+	for(ssize_t c=c0; c<=c1 && room; ++c) {
+		if(queueTile(b, level, c, r0)) ++queued;
+		if(queueTile(b, level, c, r1)) ++queued;
+		room = jobCount < queueDepth;
+	}
+	for(ssize_t r=r0+1; r<r1 && room; ++r) {
+		if(queueTile(b, level, c0, r)) ++queued;
+		if(queueTile(b, level, c1, r)) ++queued;
+		room = jobCount < queueDepth;
+	}
+	// coarser, then finer
+	if(level+1 < b->zoomLevels) {
+		for(size_t r=row0/2; r<=row1/2 && room; ++r) {
+			for(size_t c=col0/2; c<=col1/2 && room; ++c) {
+				if(queueTile(b, level+1, (ssize_t)c, (ssize_t)r)) ++queued;
+				room = jobCount < queueDepth;
+			}
+		}
+	}
+	if(level > 0) {
+		for(size_t r=row0*2; r<=row1*2+1 && room; ++r) {
+			for(size_t c=col0*2; c<=col1*2+1 && room; ++c) {
+				if(queueTile(b, level-1, (ssize_t)c, (ssize_t)r)) ++queued;
+				room = jobCount < queueDepth;
+			}
+		}
+	}
+	if(queued) pthread_cond_broadcast(&prefetchWork);
+	pthread_mutex_unlock(&prefetchLock);
+
+	return queued;
+}
+
+void TCBuilderCancelPrefetch(TCBuilderRef b)
+{
+	pthread_mutex_lock(&prefetchLock);
+	dropJobs(b);
+	pthread_mutex_unlock(&prefetchLock);
+}
+
+void tcPrefetchForget(TCBuilderRef b)
+{
+	pthread_mutex_lock(&prefetchLock);
+	dropJobs(b);
+	for(size_t i=0; i<PREFETCH_THREADS; ++i) {
+		while(working[i] == b) pthread_cond_wait(&prefetchIdle, &prefetchLock);
+	}
+	pthread_mutex_unlock(&prefetchLock);
+}
+
+#pragma mark Internals
+
+static void startThreads(void)
+{
+	pthread_mutex_lock(&prefetchLock);
+	if(!jobs && queueDepth) {
+		jobs = malloc(queueDepth * sizeof(prefetchJob));
+		if(!jobs) queueDepth = 0;
+	}
+	pthread_mutex_unlock(&prefetchLock);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(size_t i=0; i<PREFETCH_THREADS; ++i) {
+		pthread_t thread;
+		if(pthread_create(&thread, &attr, prefetchThread, (void *)i)) {
+			LOG("Cannot start the tile prefetch thread (%s)", strerror(errno));
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void *prefetchThread(void *arg)
+{
+	size_t me = (size_t)arg;
+	prefetchJob batch[PREFETCH_BATCH];
+	TCTileRequest requests[PREFETCH_BATCH];
+	struct tcCacheEntry *entries[PREFETCH_BATCH];
+
+	for(;;) {
+		// the oldest job, and whatever else is queued for its builder
+		pthread_mutex_lock(&prefetchLock);
+		while(!jobCount) pthread_cond_wait(&prefetchWork, &prefetchLock);
+		TCBuilderRef b = jobs[0].b;
+		size_t n = 0, kept = 0;
+		for(size_t i=0; i<jobCount; ++i) {
+			if(jobs[i].b == b && n < PREFETCH_BATCH) batch[n++] = jobs[i];
+			else jobs[kept++] = jobs[i];
+		}
+		jobCount = kept;
+		working[me] = b;
+		pthread_mutex_unlock(&prefetchLock);
+
+		size_t count = 0;
+		for(size_t i=0; i<n; ++i) {
+			TCTile tile;
+			unsigned char *pixels;
+			if(!TCBuilderGetTile(b, batch[i].level, batch[i].col, batch[i].row, &tile)) continue;
+			if(!(entries[count] = tcTileCacheReserve(&tile, &pixels))) continue;
+			requests[count++] = (TCTileRequest){ batch[i].level, batch[i].col, batch[i].row, pixels, false };
+		}
+		if(count) (void)TCBuilderReadTiles(b, requests, count, TCTileReaderDefault);	// neighbours come off the disk together
+		for(size_t i=0; i<count; ++i) {
+			tcTileCacheFill(entries[i], requests[i].pixels, requests[i].done);
+		}
+
+		pthread_mutex_lock(&prefetchLock);
+		working[me] = NULL;
+		pthread_cond_broadcast(&prefetchIdle);
+		pthread_mutex_unlock(&prefetchLock);
+	}
+	return NULL;
+}
+
+// Called with the lock held. Tiles off the edge of the level are quietly skipped.
+static bool queueTile(TCBuilderRef b, size_t level, ssize_t col, ssize_t row)
+{
+	imageMemory *im = &b->ims[level];
+	if(col < 0 || row < 0 || (size_t)col >= im->cols || (size_t)row >= im->rows) return false;
+	if(jobCount >= queueDepth) return false;
+
+	jobs[jobCount++] = (prefetchJob){ b, level, (size_t)col, (size_t)row };
+	return true;
+}
+
+// Called with the lock held
+static void dropJobs(TCBuilderRef b)
+{
+	size_t kept = 0;
+	for(size_t i=0; i<jobCount; ++i) {
+		if(jobs[i].b != b) jobs[kept++] = jobs[i];
+	}
+	jobCount = kept;
+}
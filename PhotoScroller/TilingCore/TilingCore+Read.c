@@ -0,0 +1,472 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <time.h>
+#define READ_URING			1		// raw system calls, liburing is not needed
+#endif
+#endif
+
+/*
+ * Batched tile reads. Tiles of one level are stored one after the other in row major order, so the tiles of a
+ * tile row (and packed tiles too, see TilingCore+Codec.c) are contiguous in the level file. Requests are sorted by
+ * file and offset, and each run of neighbours becomes one preadv: raw tiles land straight in the callers' buffers,
+ * JPEG tiles in a staging buffer and are decoded from there. How the runs get read is up to the reader:
+ *
+ *   TCTileReaderSingle		one pread per tile, as TCTileGetBytesAtPosition does
+ *   TCTileReaderVector		one preadv per run, on the calling thread
+ *   TCTileReaderThreads	runs shared out as scheduler jobs, up to queueDepth at once, which also decode
+ *   TCTileReaderRing		Linux: io_uring, up to queueDepth runs in flight, everywhere else the same as Threads
+ *
+ * A reopened archive is already mapped, its tiles are copied (or decoded) and never read.
+ */
+
+#define RUN_TILES			64		// at most, one iovec each; 16 MB of raw tiles
+#define RING_RETRY			1000000	// nanoseconds before looking at the ring again, when io_uring_enter won't wait
+
+typedef enum {
+	runWaiting = 0,
+	runQueued,								// prepared, and in the submission ring
+	runInFlight,							// the kernel has it
+	runDone,								// finishRun has been, requests marked
+} runState;
+
+typedef struct {
+	TCTileRequest			*req;
+	int						fd;
+	off_t					offset;
+	size_t					length;
+} readSlot;
+
+typedef struct {
+	readSlot				*slots;
+	size_t					count;
+	size_t					length;			// bytes
+	unsigned char			*staging;		// JPEG tiles, read here and then decoded into their requests
+	struct iovec			iov[RUN_TILES];
+	runState				state;
+	bool					ok;
+} readRun;
+
+typedef struct {
+	readRun					*runs;
+	size_t					count;
+	atomic_size_t			next;
+} runList;
+
+static size_t				queueDepth = 8;
+
+static int		compareSlots(const void *a, const void *b);
+static bool		prepareRun(readRun *run);
+static bool		readRunVector(readRun *run);
+static bool		readRunSingle(readRun *run);
+static void		finishRun(readRun *run);
+static void		*runThread(void *arg);
+static void		readThreads(readRun *runs, size_t count, int priority);
+#if READ_URING == 1
+static bool		readRing(readRun *runs, size_t count);
+#endif
+
+#pragma mark Requests
+
+void TCSetTileReadDepth(size_t depth)
+{
+	queueDepth = MAX(depth, (size_t)1);
+}
+
+size_t TCBuilderReadTiles(TCBuilderRef b, TCTileRequest *requests, size_t count, TCTileReader reader)
+{
+	readSlot *slots = malloc(count * sizeof(readSlot));
+	readRun *runs = calloc(count, sizeof(readRun));
+	if(!slots || !runs) {
+		free(slots);
+		free(runs);
+		return 0;
+	}
+
+	size_t slotCount = 0;
+	for(size_t i=0; i<count; ++i) {
+		TCTileRequest *req = &requests[i];
+		TCTile tile;
+		req->done = false;
+		if(!TCBuilderGetTile(b, req->level, req->col, req->row, &tile)) continue;
+
+		if(tile.addr) {
+			if(tile.length == tileSize) {
+				memcpy(req->pixels, tile.addr, tileSize);
+				req->done = true;
+			} else {
+				req->done = tcUnpackTile(tile.addr, tile.length, req->pixels);
+			}
+			continue;
+		}
+		slots[slotCount++] = (readSlot){ req, tile.fd, tile.offset, tile.length };
+	}
+
+	// neighbours in the same file make a run
+	qsort(slots, slotCount, sizeof(readSlot), compareSlots);
+	size_t runCount = 0;
+	for(size_t i=0; i<slotCount; ++i) {
+		readRun *run = runCount ? &runs[runCount-1] : NULL;
+		const readSlot *last = run ? &run->slots[run->count-1] : NULL;
+		if(!run || run->count == RUN_TILES || last->fd != slots[i].fd || last->offset + (off_t)last->length != slots[i].offset) {
+			run = &runs[runCount++];
+			run->slots = &slots[i];
+		}
+		++run->count;
+		run->length += slots[i].length;
+	}
+
+	if(reader == TCTileReaderDefault) {
+#if READ_URING == 1
+		reader = TCTileReaderRing;
+#else
+		reader = TCTileReaderThreads;
+#endif
+	}
+	switch(reader) {
+	case TCTileReaderSingle:
+		for(size_t i=0; i<runCount; ++i) {
+			runs[i].ok = readRunSingle(&runs[i]);
+			finishRun(&runs[i]);
+		}
+		break;
+	case TCTileReaderRing:
+#if READ_URING == 1
+		if(readRing(runs, runCount)) break;
+#endif
+		// fall through
+	case TCTileReaderThreads:
+		readThreads(runs, runCount, atomic_load(&b->priority));
+		break;
+	default:
+	case TCTileReaderVector:
+		for(size_t i=0; i<runCount; ++i) {
+			runs[i].ok = prepareRun(&runs[i]) && readRunVector(&runs[i]);
+			finishRun(&runs[i]);
+		}
+		break;
+	}
+
+	size_t done = 0;
+	for(size_t i=0; i<count; ++i) {
+		if(requests[i].done) ++done;
+	}
+	free(runs);
+	free(slots);
+	return done;
+}
+
+#pragma mark Runs
+
+static int compareSlots(const void *a, const void *b)
+{
+	const readSlot *x = a;
+	const readSlot *y = b;
+	if(x->fd != y->fd) return x->fd < y->fd ? -1 : 1;
+	if(x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+	return 0;
+}
+
+// Where each tile of the run goes
+static bool prepareRun(readRun *run)
+{
+	size_t packed = 0;
+	for(size_t i=0; i<run->count; ++i) {
+		if(run->slots[i].length < tileSize) packed += run->slots[i].length;
+	}
+	if(packed) {
+		run->staging = malloc(packed);
+		if(!run->staging) return false;
+	}
+	unsigned char *staged = run->staging;
+	for(size_t i=0; i<run->count; ++i) {
+		readSlot *s = &run->slots[i];
+		if(s->length == tileSize) {
+			run->iov[i].iov_base = s->req->pixels;
+		} else {
+			run->iov[i].iov_base = staged;
+			staged += s->length;
+		}
+		run->iov[i].iov_len = s->length;
+	}
+	return true;
+}
+
+static bool readRunVector(readRun *run)
+{
+	struct iovec iov[RUN_TILES];
+	memcpy(iov, run->iov, run->count * sizeof(struct iovec));	// partial reads move these along
+
+	struct iovec *v = iov;
+	int count = (int)run->count;
+	off_t offset = run->slots[0].offset;
+	while(count) {
+		ssize_t ret = preadv(run->slots[0].fd, v, MIN(count, IOV_MAX), offset);
+		if(ret <= 0) {
+			if(ret == -1 && errno == EINTR) continue;
+			return false;
+		}
+		offset += ret;
+		while(count && (size_t)ret >= v->iov_len) {
+			ret -= (ssize_t)v->iov_len;
+			++v;
+			--count;
+		}
+		if(count) {
+			v->iov_base = (unsigned char *)v->iov_base + ret;
+			v->iov_len -= (size_t)ret;
+		}
+	}
+	return true;
+}
+
+// today's way, kept for comparison
+static bool readRunSingle(readRun *run)
+{
+	bool ok = true;
+	for(size_t i=0; i<run->count; ++i) {
+		readSlot *s = &run->slots[i];
+		if(s->length == tileSize) {
+			s->req->done = pread(s->fd, s->req->pixels, tileSize, s->offset) == (ssize_t)tileSize;
+		} else {
+			unsigned char *copy = malloc(s->length);
+			s->req->done = copy && pread(s->fd, copy, s->length, s->offset) == (ssize_t)s->length && tcUnpackTile(copy, s->length, s->req->pixels);
+			free(copy);
+		}
+		ok &= s->req->done;
+	}
+	return ok;
+}
+
+// Decode what was staged, and mark the requests
+static void finishRun(readRun *run)
+{
+	if(run->ok && run->staging) {
+		for(size_t i=0; i<run->count; ++i) {
+			readSlot *s = &run->slots[i];
+			s->req->done = s->length == tileSize || tcUnpackTile(run->iov[i].iov_base, s->length, s->req->pixels);
+		}
+	} else if(run->ok) {
+		for(size_t i=0; i<run->count; ++i) run->slots[i].req->done = true;
+	}
+	free(run->staging);
+	run->staging = NULL;
+	run->state = runDone;
+}
+
+#pragma mark Threads
+
+static void readThreads(readRun *runs, size_t count, int priority)
+{
+	runList list = { runs, count, 0 };
+	size_t threads = MIN(queueDepth, count);
+
+	// the scheduler's workers help, this thread takes runs too (TilingCore+Sched.c)
+	tcJobGroup group;
+	tcJobGroupInit(&group);
+	for(size_t i=1; i<threads; ++i) {
+		tcJobSubmit(&group, priority, runThread, &list);
+	}
+	runThread(&list);
+	tcJobGroupWait(&group);
+}
+
+static void *runThread(void *arg)
+{
+	runList *list = arg;
+	for(size_t i; (i = atomic_fetch_add(&list->next, 1)) < list->count; ) {
+		readRun *run = &list->runs[i];
+		run->ok = prepareRun(run) && readRunVector(run);
+		finishRun(run);
+	}
+	return NULL;
+}
+
+#if READ_URING == 1
+
+#pragma mark io_uring
+
+typedef struct {
+	int						fd;
+	unsigned				entries;
+	unsigned				*sqTail;
+	unsigned				*sqMask;
+	unsigned				*sqArray;
+	unsigned				*cqHead;
+	unsigned				*cqTail;
+	unsigned				*cqMask;
+	struct io_uring_sqe		*sqes;
+	struct io_uring_cqe		*cqes;
+	void					*sqRing;
+	size_t					sqRingSize;
+	void					*cqRing;
+	size_t					cqRingSize;
+	size_t					sqesSize;
+} uring;
+
+static bool	ringOpen(uring *r, unsigned entries);
+static void	ringClose(uring *r);
+static size_t ringReap(uring *r);
+
+/*
+ * A ring per batch: setting one up is a few microseconds, next to reading megabytes. A run whose read fails
+ * or comes back short is read again with preadv. False == no io_uring here (old kernel, seccomp), nothing was read.
+ * If io_uring_enter fails part way, what the kernel has is waited out - it is writing into the callers' buffers -
+ * and the runs it never got are read with preadv.
+ */
+static bool readRing(readRun *runs, size_t count)
+{
+	uring r;
+	if(!count) return true;
+	if(!ringOpen(&r, (unsigned)MIN(queueDepth, (size_t)4096))) return false;
+
+	size_t next = 0, oldestQueued = 0, finished = 0, inFlight = 0;
+	unsigned unsubmitted = 0;
+	while(finished < count) {
+		unsigned tail = *r.sqTail;
+		while(next < count && inFlight + unsubmitted < r.entries) {
+			readRun *run = &runs[next++];
+			if(!prepareRun(run)) {
+				finishRun(run);
+				++finished;
+				continue;
+			}
+			unsigned idx = tail & *r.sqMask;
+			struct io_uring_sqe *sqe = &r.sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode		= IORING_OP_READV;
+			sqe->fd			= run->slots[0].fd;
+			sqe->off		= (uint64_t)run->slots[0].offset;
+			sqe->addr		= (uint64_t)(uintptr_t)run->iov;
+			sqe->len		= (uint32_t)run->count;
+			sqe->user_data	= (uint64_t)(uintptr_t)run;
+			r.sqArray[idx]	= idx;
+			run->state		= runQueued;
+			++tail;
+			++unsubmitted;
+		}
+		__atomic_store_n(r.sqTail, tail, __ATOMIC_RELEASE);
+		if(!inFlight && !unsubmitted) continue;		// everything left failed to prepare
+
+		long ret = syscall(__NR_io_uring_enter, r.fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0) {
+			if(errno == EINTR) continue;
+			break;	// the rest go through preadv below
+		}
+		// the kernel takes submissions in order
+		unsubmitted -= (unsigned)ret;
+		inFlight += (size_t)ret;
+		for(; ret && oldestQueued < next; ++oldestQueued) {
+			if(runs[oldestQueued].state != runQueued) continue;
+			runs[oldestQueued].state = runInFlight;
+			--ret;
+		}
+
+		size_t reaped = ringReap(&r);
+		finished += reaped;
+		inFlight -= reaped;
+	}
+
+	// only after an io_uring_enter failure: never let go of the ring with reads in flight, completions still arrive
+	while(inFlight) {
+		if(syscall(__NR_io_uring_enter, r.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			struct timespec retry = { 0, RING_RETRY };
+			nanosleep(&retry, NULL);
+		}
+		inFlight -= ringReap(&r);
+	}
+	ringClose(&r);
+
+	// then the runs the kernel never got, the usual way
+	for(size_t i=0; i<count; ++i) {
+		readRun *run = &runs[i];
+		if(run->state == runDone) continue;
+		run->ok = (run->state == runQueued || prepareRun(run)) && readRunVector(run);
+		finishRun(run);
+	}
+	return true;
+}
+
+// Finish the runs that have completed, a short or failed read again with preadv; returns how many
+static size_t ringReap(uring *r)
+{
+	size_t reaped = 0;
+	unsigned head = *r->cqHead;
+	while(head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+		readRun *run = (readRun *)(uintptr_t)cqe->user_data;
+		run->ok = cqe->res == (int32_t)run->length || readRunVector(run);
+		finishRun(run);
+		++head;
+		++reaped;
+	}
+	__atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+	return reaped;
+}
+
+static bool ringOpen(uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if(r->fd < 0) return false;
+	r->entries = p.sq_entries;
+
+	r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED || r->sqes == MAP_FAILED) {
+		ringClose(r);
+		return false;
+	}
+
+	unsigned char *sq = r->sqRing;
+	unsigned char *cq = r->cqRing;
+	r->sqTail	= (unsigned *)(sq + p.sq_off.tail);
+	r->sqMask	= (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sqArray	= (unsigned *)(sq + p.sq_off.array);
+	r->cqHead	= (unsigned *)(cq + p.cq_off.head);
+	r->cqTail	= (unsigned *)(cq + p.cq_off.tail);
+	r->cqMask	= (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes		= (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+static void ringClose(uring *r)
+{
+	if(r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqesSize);
+	if(r->cqRing && r->cqRing != MAP_FAILED) munmap(r->cqRing, r->cqRingSize);
+	if(r->sqRing && r->sqRing != MAP_FAILED) munmap(r->sqRing, r->sqRingSize);
+	close(r->fd);
+}
+
+#endif // READ_URING
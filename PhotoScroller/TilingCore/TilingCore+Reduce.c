@@ -0,0 +1,174 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REDUCE_X86			1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define REDUCE_NEON			1
+#endif
+
+/*
+ * Each output pixel is the average of a 2x2 block of input pixels, per channel, rounded: (a+b+c+d+2)/4.
+ * The vector versions produce exactly the same bytes as the scalar one, so levels do not depend on the CPU.
+ * Taking every other pixel used to alias badly on fine detail (text, fabric, foliage) - this costs about the same.
+ */
+typedef void (*reduceFunc)(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth);
+
+static void reduceScalar(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth);
+#if REDUCE_X86 == 1
+static void reduceSSE2(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth);
+static void reduceAVX2(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth);
+#endif
+#if REDUCE_NEON == 1
+static void reduceNEON(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth);
+#endif
+
+static reduceFunc		reducer;
+static pthread_once_t	reducerOnce = PTHREAD_ONCE_INIT;
+
+static void pickReducer(void)
+{
+	reducer = reduceScalar;
+#if REDUCE_X86 == 1
+	reducer = reduceSSE2;
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) reducer = reduceAVX2;
+#elif REDUCE_NEON == 1
+	reducer = reduceNEON;
+#endif
+}
+
+void tcReduceRows(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth)
+{
+	pthread_once(&reducerOnce, pickReducer);
+	reducer(out, in0, in1, outWidth);
+}
+
+static inline uint32_t reducePixel(const uint32_t *in0, const uint32_t *in1)
+{
+	const unsigned char *a = (const unsigned char *)in0;
+	const unsigned char *b = (const unsigned char *)in1;
+	uint32_t px;
+	unsigned char *o = (unsigned char *)&px;
+	for(size_t c=0; c<bytesPerPixel; ++c) {
+		o[c] = (unsigned char)((a[c] + a[c+bytesPerPixel] + b[c] + b[c+bytesPerPixel] + 2) >> 2);
+	}
+	return px;
+}
+
+static void reduceScalar(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth)
+{
+	for(size_t col=0; col<outWidth; ++col, in0 += 2, in1 += 2) {
+		*out++ = reducePixel(in0, in1);
+	}
+}
+
+#if REDUCE_X86 == 1
+
+// 8 input pixels from each row make 4 output pixels
+static void reduceSSE2(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	size_t col = 0;
+
+	for(; col+4 <= outWidth; col += 4, in0 += 8, in1 += 8, out += 4) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)in0);
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(in0 + 4));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)in1);
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(in1 + 4));
+
+		// vertical sums, 16 bits per channel, two pixels per register
+		__m128i v0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));	// p0 p1
+		__m128i v1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));	// p2 p3
+		__m128i v2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));	// p4 p5
+		__m128i v3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));	// p6 p7
+
+		// horizontal sums land in the low half
+		v0 = _mm_add_epi16(v0, _mm_srli_si128(v0, 8));
+		v1 = _mm_add_epi16(v1, _mm_srli_si128(v1, 8));
+		v2 = _mm_add_epi16(v2, _mm_srli_si128(v2, 8));
+		v3 = _mm_add_epi16(v3, _mm_srli_si128(v3, 8));
+
+		__m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(v0, v1), two), 2);
+		__m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(v2, v3), two), 2);
+		_mm_storeu_si128((__m128i *)out, _mm_packus_epi16(lo, hi));
+	}
+	reduceScalar(out, in0, in1, outWidth - col);
+}
+
+// 16 input pixels from each row make 8 output pixels. A byte shuffle puts the channels of neighbouring pixels
+// side by side so one maddubs does the horizontal sums. The 256 bit unpack/pack work within 128 bit lanes, hence the final permute.
+__attribute__((target("avx2")))
+static void reduceAVX2(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth)
+{
+	const __m256i pairs = _mm256_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15,
+										   0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+	const __m256i ones = _mm256_set1_epi8(1);
+	const __m256i two = _mm256_set1_epi16(2);
+	size_t col = 0;
+
+	for(; col+8 <= outWidth; col += 8, in0 += 16, in1 += 16, out += 8) {
+		__m256i a0 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)in0), pairs);
+		__m256i a1 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(in0 + 8)), pairs);
+		__m256i b0 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)in1), pairs);
+		__m256i b1 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(in1 + 8)), pairs);
+
+		__m256i lo = _mm256_add_epi16(_mm256_maddubs_epi16(a0, ones), _mm256_maddubs_epi16(b0, ones));	// o0 o1 | o2 o3
+		__m256i hi = _mm256_add_epi16(_mm256_maddubs_epi16(a1, ones), _mm256_maddubs_epi16(b1, ones));	// o4 o5 | o6 o7
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+
+		__m256i packed = _mm256_packus_epi16(lo, hi);											// o0 o1 o4 o5 | o2 o3 o6 o7
+		_mm256_storeu_si256((__m256i *)out, _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+	}
+	reduceSSE2(out, in0, in1, outWidth - col);
+}
+
+#endif // REDUCE_X86
+
+#if REDUCE_NEON == 1
+
+// vld2 splits even and odd pixels, so the horizontal pairs are already in separate registers
+static void reduceNEON(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth)
+{
+	size_t col = 0;
+
+	for(; col+4 <= outWidth; col += 4, in0 += 8, in1 += 8, out += 4) {
+		uint32x4x2_t a = vld2q_u32(in0);
+		uint32x4x2_t b = vld2q_u32(in1);
+
+		uint8x16_t ae = vreinterpretq_u8_u32(a.val[0]);
+		uint8x16_t ao = vreinterpretq_u8_u32(a.val[1]);
+		uint8x16_t be = vreinterpretq_u8_u32(b.val[0]);
+		uint8x16_t bo = vreinterpretq_u8_u32(b.val[1]);
+
+		uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(ae), vget_low_u8(ao)), vaddl_u8(vget_low_u8(be), vget_low_u8(bo)));
+		uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(ae), vget_high_u8(ao)), vaddl_u8(vget_high_u8(be), vget_high_u8(bo)));
+
+		// vrshrn rounds: (x + 2) >> 2
+		vst1q_u8((uint8_t *)out, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+	}
+	reduceScalar(out, in0, in1, outWidth - col);
+}
+
+#endif // REDUCE_NEON
@@ -0,0 +1,398 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifdef LIBJPEG
+
+#include "TilingCore-Private.h"
+
+#include <pthread.h>
+
+/*
+ * Restart bands: the entropy coder and the DC predictions start over at every restart marker, so libjpeg can
+ * begin decoding right after one without having seen anything before it. When markers fall on MCU row
+ * boundaries, a baseline image is cut into bands of MCU rows and each band gets its own decompressor, fed
+ * the original header (height reduced to what is left of the image) followed by the entropy data from
+ * the marker on. Bands write straight into their rows of the level 0 mapping.
+ *
+ * Fancy upsampling of vertically subsampled chroma (4:2:0) blends every row with its neighbours, so there
+ * a band first decodes (and throws away) the marker aligned rows above it, and reads one row group past
+ * its end. Either way the pixels are exactly those of a single decoder.
+ */
+
+#define BANDS_PER_THREAD	2		// some parts of an image take longer than others, so threads pick bands off a list
+#define JPEG_SOF0			0xC0	// baseline, jpeglib.h only names the markers an application might write
+#define JPEG_SOF1			0xC1	// extended sequential, Huffman
+#define JPEG_SOI			0xD8
+#define JPEG_SOS			0xDA
+
+typedef struct {
+	size_t					firstRow;		// decoding starts here, above startRow when rows are thrown away
+	size_t					startRow;		// first row written
+	size_t					endRow;			// one past the last row written
+	size_t					restart;		// markers before firstRow, 0 == start of the scan
+	size_t					scanOffset;		// entropy data for firstRow
+} band;
+
+struct tcBands {
+	const unsigned char		*data;
+	size_t					length;
+	size_t					threads;
+	size_t					sofHeight;		// offset of the frame height
+	size_t					headerLength;	// SOI through the SOS segment
+	J_COLOR_SPACE			colorSpace;
+	size_t					imageHeight;
+	size_t					rowBytes;
+	unsigned char			*base;			// level 0, row 0
+	size_t					bytesPerRow;
+
+	band					*bands;
+	size_t					count;
+	atomic_size_t			next;
+	atomic_bool				failed;
+};
+
+typedef struct {
+	struct jpeg_source_mgr	pub;
+	const unsigned char		*scan;
+	size_t					scanLength;
+	bool					inScan;
+} bandSource;
+
+static bool		planBands(struct tcBands *p, j_decompress_ptr cinfo, size_t threads);
+static bool		findRestarts(struct tcBands *p, size_t scanStart);
+static void		*bandThread(void *arg);
+static bool		decodeBand(struct tcBands *p, const band *bd, unsigned char *header, unsigned char *scratch);
+
+static void		band_error_exit(j_common_ptr cinfo);
+static void		band_init_source(j_decompress_ptr cinfo);
+static boolean	band_fill_input_buffer(j_decompress_ptr cinfo);
+static void		band_skip_input_data(j_decompress_ptr cinfo, long num_bytes);
+static boolean	band_resync_to_restart(j_decompress_ptr cinfo, int desired);
+static void		band_term_source(j_decompress_ptr cinfo);
+
+static const JOCTET eoiMarker[2] = { 0xFF, JPEG_EOI };
+
+#pragma mark Setup
+
+/*
+ * Called after jpeg_read_header() on the whole image in memory. Returns NULL when the image can't be
+ * split (no restart markers, progressive, one band...), so the caller decodes it as usual.
+ */
+struct tcBands *tcRestartBandsPlan(TCBuilderRef b, j_decompress_ptr cinfo, const unsigned char *data, size_t len)
+{
+	size_t threads = b->options.decodeThreads;
+	if(threads < 2) return NULL;
+
+	struct tcBands *p = calloc(1, sizeof(struct tcBands));
+	if(!p) return NULL;
+	p->data			= data;
+	p->length		= len;
+	p->threads		= threads;
+	p->colorSpace	= cinfo->out_color_space;
+	p->imageHeight	= cinfo->image_height;
+	p->rowBytes		= cinfo->image_width * bytesPerPixel;
+	atomic_init(&p->next, 0);
+	atomic_init(&p->failed, false);
+
+	if(!planBands(p, cinfo, threads)) {
+		tcRestartBandsRelease(p);
+		return NULL;
+	}
+	return p;
+}
+
+// Decode every band into level 0, mapped at base, then release the plan
+bool tcRestartBandsDecode(TCBuilderRef b, struct tcBands *p, unsigned char *base, size_t bytesPerRow)
+{
+	p->base			= base;
+	p->bytesPerRow	= bytesPerRow;
+	size_t threads	= MIN(p->threads, p->count);
+
+	// the scheduler's workers help, this thread takes bands too (TilingCore+Sched.c)
+	tcJobGroup group;
+	tcJobGroupInit(&group);
+	for(size_t i=1; i<threads; ++i) {
+		tcJobSubmit(&group, atomic_load(&b->priority), bandThread, p);
+	}
+	bandThread(p);
+	tcJobGroupWait(&group);
+
+	if(atomic_load(&p->failed)) b->failed = true;
+	tcRestartBandsRelease(p);
+	return !b->failed;
+}
+
+void tcRestartBandsRelease(struct tcBands *p)
+{
+	if(!p) return;
+	free(p->bands);
+	free(p);
+}
+
+static size_t gcd(size_t a, size_t b)
+{
+	while(b) {
+		size_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static bool planBands(struct tcBands *p, j_decompress_ptr cinfo, size_t threads)
+{
+	// one sequential scan holding every component, with markers
+	if(cinfo->progressive_mode || cinfo->arith_code || !cinfo->restart_interval || cinfo->data_precision != 8
+		|| cinfo->comps_in_scan != cinfo->num_components)
+	{
+		return false;
+	}
+
+	// walk the markers for the frame header and the end of the scan header (only SOF0/1 are baseline/extended Huffman)
+	const unsigned char *data = p->data;
+	size_t len = p->length;
+	size_t offset = 2;
+	size_t sof = 0;
+	if(len < 4 || data[0] != 0xFF || data[1] != JPEG_SOI) return false;
+	for(;;) {
+		while(offset < len && data[offset] == 0xFF && offset+1 < len && data[offset+1] == 0xFF) ++offset;	// fill bytes
+		if(offset+4 > len || data[offset] != 0xFF) return false;
+		int marker = data[offset+1];
+		size_t segment = (size_t)data[offset+2] << 8 | data[offset+3];
+		if(segment < 2 || offset+2+segment > len) return false;
+		if(marker == JPEG_SOF0 || marker == JPEG_SOF1) {
+			sof = offset;
+		} else if(marker >= JPEG_SOF0 && marker <= JPEG_SOF0+15 && marker != JPEG_SOF0+4 && marker != JPEG_SOF0+8 && marker != JPEG_SOF0+12) {
+			return false;	// some other kind of frame
+		}
+		offset += 2 + segment;
+		if(marker == JPEG_SOS) break;
+	}
+	if(!sof || sof+9 > len) return false;
+	p->sofHeight	= sof + 5;
+	p->headerLength	= offset;
+
+	// MCU geometry, as libjpeg's per_scan_setup() works it out
+	size_t mcuWidth		= DCTSIZE;
+	size_t mcuHeight	= DCTSIZE;
+	bool context		= false;
+	if(cinfo->num_components > 1) {
+		mcuWidth	= DCTSIZE * (size_t)cinfo->max_h_samp_factor;
+		mcuHeight	= DCTSIZE * (size_t)cinfo->max_v_samp_factor;
+		for(int ci=0; ci<cinfo->num_components; ++ci) {
+			if(cinfo->comp_info[ci].v_samp_factor < cinfo->max_v_samp_factor) context = cinfo->do_fancy_upsampling;
+		}
+	}
+	size_t mcusPerRow	= (cinfo->image_width + mcuWidth - 1) / mcuWidth;
+	size_t mcuRows		= (cinfo->image_height + mcuHeight - 1) / mcuHeight;
+	size_t interval		= cinfo->restart_interval;
+
+	// bands start on MCU rows that also start a restart interval
+	size_t unit		= interval / gcd(interval, mcusPerRow);		// in MCU rows
+	size_t units	= (mcuRows + unit - 1) / unit;
+	size_t count	= MIN(units, threads * BANDS_PER_THREAD);
+	if(count < 2) return false;
+
+	p->bands = calloc(count, sizeof(band));
+	if(!p->bands) return false;
+	p->count = count;
+
+	for(size_t i=0; i<count; ++i) {
+		band *bd = &p->bands[i];
+		size_t firstUnit	= i * units / count;
+		size_t startRow		= firstUnit * unit;
+		size_t endRow		= (i+1) * units / count * unit;
+		size_t decodeRow	= (context && startRow) ? startRow - unit : startRow;
+
+		bd->startRow	= startRow * mcuHeight;
+		bd->endRow		= MIN(endRow * mcuHeight, p->imageHeight);
+		bd->firstRow	= decodeRow * mcuHeight;
+		bd->restart		= decodeRow * mcusPerRow / interval;
+	}
+	return findRestarts(p, offset);
+}
+
+// One pass over the entropy data for the markers the bands start after
+static bool findRestarts(struct tcBands *p, size_t scanStart)
+{
+	const unsigned char *data = p->data;
+	size_t len = p->length;
+	size_t offset = scanStart;
+	size_t markers = 0;
+	size_t next = 0;
+
+	while(next < p->count && !p->bands[next].restart) {
+		p->bands[next++].scanOffset = scanStart;
+	}
+	while(next < p->count && offset+1 < len) {
+		const unsigned char *ff = memchr(data + offset, 0xFF, len - offset - 1);
+		if(!ff) break;
+		offset = (size_t)(ff - data);
+
+		int marker = data[offset+1];
+		if(marker == 0x00) {				// stuffed byte
+			offset += 2;
+		} else if(marker == 0xFF) {			// fill byte
+			offset += 1;
+		} else if(marker >= JPEG_RST0 && marker <= JPEG_RST0+7) {
+			offset += 2;
+			++markers;
+			while(next < p->count && p->bands[next].restart == markers) {
+				p->bands[next++].scanOffset = offset;
+			}
+		} else {
+			break;							// EOI, or something unexpected
+		}
+	}
+	if(next < p->count) {
+		LOG("Restart bands: only found %zu restart markers", markers);
+		return false;
+	}
+	return true;
+}
+
+#pragma mark Decoding
+
+static void *bandThread(void *arg)
+{
+	struct tcBands *p = arg;
+
+	// each thread patches the frame height in its own copy of the header
+	unsigned char *header = malloc(p->headerLength);
+	unsigned char *scratch = malloc(p->rowBytes);
+	if(!header || !scratch) {
+		atomic_store(&p->failed, true);
+	} else {
+		memcpy(header, p->data, p->headerLength);
+
+		size_t i;
+		while(!atomic_load(&p->failed) && (i = atomic_fetch_add(&p->next, 1)) < p->count) {
+			if(!decodeBand(p, &p->bands[i], header, scratch)) {
+				atomic_store(&p->failed, true);
+			}
+		}
+	}
+	free(header);
+	free(scratch);
+	return NULL;
+}
+
+static bool decodeBand(struct tcBands *p, const band *bd, unsigned char *header, unsigned char *scratch)
+{
+	struct jpeg_decompress_struct	cinfo;
+	struct my_error_mgr				jerr;
+	bandSource						src;
+	volatile bool					ok = false;
+
+	size_t height = p->imageHeight - bd->firstRow;
+	header[p->sofHeight]	= (unsigned char)(height >> 8);
+	header[p->sofHeight+1]	= (unsigned char)height;
+
+	memset(&src, 0, sizeof(src));
+	src.pub.next_input_byte		= header;
+	src.pub.bytes_in_buffer		= p->headerLength;
+	src.pub.init_source			= band_init_source;
+	src.pub.fill_input_buffer	= band_fill_input_buffer;
+	src.pub.skip_input_data		= band_skip_input_data;
+	src.pub.resync_to_restart	= band_resync_to_restart;
+	src.pub.term_source			= band_term_source;
+	src.scan					= p->data + bd->scanOffset;
+	src.scanLength				= p->length - bd->scanOffset;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = band_error_exit;
+	if(setjmp(jerr.setjmp_buffer)) {
+		ok = false;
+	} else {
+		jpeg_create_decompress(&cinfo);
+		cinfo.src = &src.pub;
+
+		(void)jpeg_read_header(&cinfo, TRUE);
+		cinfo.out_color_space = p->colorSpace;
+		(void)jpeg_start_decompress(&cinfo);
+
+		size_t row = bd->firstRow;
+		while(row < bd->endRow) {
+			JSAMPROW line = row < bd->startRow ? scratch : p->base + row*p->bytesPerRow;
+			if(jpeg_read_scanlines(&cinfo, &line, 1) != 1) break;
+			++row;
+		}
+		ok = row == bd->endRow;
+	}
+	jpeg_destroy_decompress(&cinfo);
+	return ok;
+}
+
+#pragma mark Source
+
+static void band_error_exit(j_common_ptr cinfo)
+{
+	my_error_ptr myerr = (my_error_ptr)cinfo->err;
+
+	(*cinfo->err->output_message)(cinfo);
+	longjmp(myerr->setjmp_buffer, 1);
+}
+
+static void band_init_source(j_decompress_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+// The header goes first (set up before jpeg_read_header), then the scan from the band's marker on
+static boolean band_fill_input_buffer(j_decompress_ptr cinfo)
+{
+	bandSource *src = (bandSource *)cinfo->src;
+
+	if(!src->inScan) {
+		src->inScan = true;
+		src->pub.next_input_byte	= src->scan;
+		src->pub.bytes_in_buffer	= src->scanLength;
+	} else {
+		src->pub.next_input_byte	= eoiMarker;	// truncated file, same as jpeg_mem_src()
+		src->pub.bytes_in_buffer	= sizeof(eoiMarker);
+	}
+	return TRUE;
+}
+
+static void band_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	if(num_bytes <= 0) return;
+	while((size_t)num_bytes > src->bytes_in_buffer) {
+		num_bytes -= (long)src->bytes_in_buffer;
+		(void)(*src->fill_input_buffer)(cinfo);
+	}
+	src->next_input_byte += (size_t)num_bytes;
+	src->bytes_in_buffer -= (size_t)num_bytes;
+}
+
+// The markers a band sees are numbered from wherever it started, not RST0, and that's fine
+static boolean band_resync_to_restart(j_decompress_ptr cinfo, int desired)
+{
+	if(cinfo->unread_marker >= JPEG_RST0 && cinfo->unread_marker <= JPEG_RST0+7) {
+		cinfo->unread_marker = 0;
+		return TRUE;
+	}
+	return jpeg_resync_to_restart(cinfo, desired);
+}
+
+static void band_term_source(j_decompress_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+#endif // LIBJPEG
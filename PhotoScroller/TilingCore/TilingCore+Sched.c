@@ -0,0 +1,396 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+#include <pthread.h>
+
+/*
+ * One scheduler for every builder in the process, so several big images at once share the cores and memory rather
+ * than each taking all of both.
+ *
+ * Builds: a whole image decode (TCBuilderDecodeJPEGFile/Data, TCBuilderBeginImage to TCBuilderFinishImage) first
+ * takes one of a limited number of build slots - as many as there are cores, fewer when free memory could not
+ * hold that many builds at once (TCSetBuildConcurrency overrides this). Builds that have to wait go in order of
+ * priority (TCBuilderOptions.priority, TCBuilderSetPriority - say the page on screen), then of arrival.
+ *
+ * Jobs: the work a build splits up (restart bands, reducing and tiling levels) runs on one pool of workers, one per
+ * core. Each worker has a deque per priority. It takes its own newest job first, and when it has none steals the
+ * oldest from another worker - higher priority jobs always before lower ones, wherever they are queued. The thread
+ * that submits jobs works on them too, and whatever no worker has started by the time it is done it runs itself,
+ * so a build never waits on a pool busy with other images. Jobs without a group are flushes: a finished build's
+ * level files still on their way to the disk, waited for at its priority (see TilingCore+Writeback.c).
+ */
+
+#define SCHED_WORKERS_MAX	16
+#define SCHED_PRIORITIES	3					// TC_PRIORITY_LOW ... TC_PRIORITY_HIGH
+#define BUILD_MEMORY		(128ull << 20)		// what one build keeps busy: tile rows in flight, decoder buffers, dirty pages not yet flushed
+#define MEMORY_PROBE		1000000000ull		// nanoseconds between looks at free memory, every waiter checks on each wakeup
+
+typedef struct tcJob {
+	void				*(*func)(void *);
+	void				*arg;
+	tcJobGroup			*group;
+	struct tcJob		*next;					// reclaimed by tcJobGroupWait
+} tcJob;
+
+typedef struct {
+	pthread_mutex_t		lock;
+	tcJob				**jobs;					// ring, power of two
+	size_t				capacity;
+	size_t				head;					// oldest, thieves take from here
+	size_t				tail;					// one past the newest, the owner takes from here
+} jobDeque;
+
+typedef struct waiter {
+	TCBuilderRef		b;
+	uint64_t			ticket;
+	struct waiter		*next;
+} waiter;
+
+static jobDeque				deques[SCHED_WORKERS_MAX][SCHED_PRIORITIES];
+static size_t				workers;
+static atomic_size_t		queued;				// in all the deques
+static atomic_size_t		nextDeque;			// round robin for threads that are not workers
+static pthread_mutex_t		sleepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		workQueued = PTHREAD_COND_INITIALIZER;
+static pthread_once_t		schedOnce = PTHREAD_ONCE_INIT;
+static __thread int			selfIndex = -1;		// which worker this is
+
+static pthread_mutex_t		admitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		admitChanged = PTHREAD_COND_INITIALIZER;
+static size_t				building;
+static size_t				buildLimit;			// 0 == from cores and free memory
+static size_t				memoryLimit;		// builds free memory holds, as of memoryProbed
+static uint64_t				memoryProbed;		// TCTimeStamp, 0 == never
+static waiter				*waiters;
+static uint64_t				tickets;
+
+static void		startWorkers(void);
+static void		*workerThread(void *arg);
+static tcJob	*findJob(int self);
+static void		runJob(tcJob *job);
+static bool		pushJob(jobDeque *d, tcJob *job);
+static tcJob	*popNewest(jobDeque *d);
+static tcJob	*popOldest(jobDeque *d);
+static size_t	cpuCount(void);
+static size_t	admitLimit(void);
+static bool		admissible(const waiter *w);
+
+static inline size_t priorityIndex(int priority)
+{
+	return (size_t)(MAX(TC_PRIORITY_LOW, MIN(TC_PRIORITY_HIGH, priority)) - TC_PRIORITY_LOW);
+}
+
+#pragma mark Settings
+
+void TCSetBuildConcurrency(size_t builds)
+{
+	pthread_mutex_lock(&admitLock);
+	buildLimit = builds;
+	pthread_cond_broadcast(&admitChanged);
+	pthread_mutex_unlock(&admitLock);
+}
+
+size_t TCGetBuildConcurrency(void)
+{
+	pthread_mutex_lock(&admitLock);
+	size_t limit = admitLimit();
+	pthread_mutex_unlock(&admitLock);
+	return limit;
+}
+
+void TCBuilderSetPriority(TCBuilderRef b, int priority)
+{
+	atomic_store(&b->priority, priority);
+
+	pthread_mutex_lock(&admitLock);
+	pthread_cond_broadcast(&admitChanged);		// it may be waiting for a slot
+	pthread_mutex_unlock(&admitLock);
+}
+
+size_t tcSchedWorkers(void)
+{
+	pthread_once(&schedOnce, startWorkers);
+	return workers;
+}
+
+#pragma mark Builds
+
+void tcBuildAdmit(TCBuilderRef b)
+{
+	if(b->admitted) return;
+
+	pthread_mutex_lock(&admitLock);
+	waiter w = { b, tickets++, waiters };
+	waiters = &w;
+	while(!admissible(&w)) {
+		pthread_cond_wait(&admitChanged, &admitLock);
+	}
+	for(waiter **wp = &waiters; *wp; wp = &(*wp)->next) {
+		if(*wp == &w) {
+			*wp = w.next;
+			break;
+		}
+	}
+	++building;
+	pthread_cond_broadcast(&admitChanged);		// the next in line may fit too
+	pthread_mutex_unlock(&admitLock);
+
+	b->admitted = true;
+}
+
+void tcBuildRetire(TCBuilderRef b)
+{
+	if(!b->admitted) return;
+	b->admitted = false;
+
+	pthread_mutex_lock(&admitLock);
+	--building;
+	pthread_cond_broadcast(&admitChanged);
+	pthread_mutex_unlock(&admitLock);
+}
+
+// admitLock held: a slot is free, and nobody waiting is ahead of w
+static bool admissible(const waiter *w)
+{
+	if(building >= admitLimit()) return false;
+
+	int priority = atomic_load(&w->b->priority);
+	for(const waiter *o = waiters; o; o = o->next) {
+		int p = atomic_load(&o->b->priority);
+		if(p > priority || (p == priority && o->ticket < w->ticket)) return false;
+	}
+	return true;
+}
+
+static size_t admitLimit(void)
+{
+	if(buildLimit) return buildLimit;
+
+	uint64_t now = TCTimeStamp();
+	if(!memoryProbed || now - memoryProbed >= MEMORY_PROBE) {
+		TCMemoryInfo fm = TCFreeMemory(NULL);
+		memoryLimit = (size_t)(fm.freeMemory / BUILD_MEMORY);
+		memoryProbed = now;
+	}
+	return MAX(1, MIN(cpuCount(), memoryLimit));
+}
+
+#pragma mark Jobs
+
+void tcJobGroupInit(tcJobGroup *g)
+{
+	g->pending = 0;
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->finished, NULL);
+}
+
+void tcJobSubmit(tcJobGroup *g, int priority, void *(*func)(void *), void *arg)
+{
+	pthread_once(&schedOnce, startWorkers);
+
+	tcJob *job = workers ? malloc(sizeof(tcJob)) : NULL;
+	if(!job) {
+		func(arg);		// nobody to run it, or nowhere to queue it, so now
+		return;
+	}
+	job->func	= func;
+	job->arg	= arg;
+	job->group	= g;
+
+	if(g) {
+		pthread_mutex_lock(&g->lock);
+		++g->pending;
+		pthread_mutex_unlock(&g->lock);
+	}
+
+	// counted before it is visible: a worker awake already can take it, and uncount it, as soon as it is pushed
+	atomic_fetch_add(&queued, 1);
+	size_t worker = selfIndex >= 0 ? (size_t)selfIndex : atomic_fetch_add(&nextDeque, 1) % workers;
+	if(!pushJob(&deques[worker][priorityIndex(priority)], job)) {
+		atomic_fetch_sub(&queued, 1);
+		runJob(job);
+		return;
+	}
+
+	pthread_mutex_lock(&sleepLock);
+	pthread_cond_signal(&workQueued);
+	pthread_mutex_unlock(&sleepLock);
+}
+
+void tcJobGroupWait(tcJobGroup *g)
+{
+	// take back whatever has not started
+	tcJob *mine = NULL;
+	for(size_t i=0; i<workers; ++i) {
+		for(size_t p=0; p<SCHED_PRIORITIES; ++p) {
+			jobDeque *d = &deques[i][p];
+			pthread_mutex_lock(&d->lock);
+			size_t keep = d->head;
+			for(size_t j=d->head; j<d->tail; ++j) {
+				tcJob *job = d->jobs[j & (d->capacity-1)];
+				if(job->group == g) {
+					job->next = mine;
+					mine = job;
+					atomic_fetch_sub(&queued, 1);
+				} else {
+					d->jobs[keep++ & (d->capacity-1)] = job;
+				}
+			}
+			d->tail = keep;
+			pthread_mutex_unlock(&d->lock);
+		}
+	}
+	while(mine) {
+		tcJob *job = mine;
+		mine = job->next;
+		runJob(job);
+	}
+
+	pthread_mutex_lock(&g->lock);
+	while(g->pending) {
+		pthread_cond_wait(&g->finished, &g->lock);
+	}
+	pthread_mutex_unlock(&g->lock);
+
+	pthread_cond_destroy(&g->finished);
+	pthread_mutex_destroy(&g->lock);
+}
+
+#pragma mark Workers
+
+// Workers are numbered as they start, and the deques are theirs: with none, tcJobSubmit runs every job right away
+static void startWorkers(void)
+{
+	size_t count = MIN(cpuCount(), SCHED_WORKERS_MAX);
+	for(size_t i=0; i<count; ++i) {
+		for(size_t p=0; p<SCHED_PRIORITIES; ++p) {
+			pthread_mutex_init(&deques[i][p].lock, NULL);
+		}
+	}
+
+	size_t started = 0;
+	for(size_t i=0; i<count; ++i) {
+		pthread_t tid;
+		if(!pthread_create(&tid, NULL, workerThread, (void *)(intptr_t)started)) {
+			pthread_detach(tid);
+			++started;
+		}
+	}
+	workers = started;
+	if(!started) {
+		LOG("Scheduler: no worker threads, jobs run on the threads that submit them");
+	}
+}
+
+static void *workerThread(void *arg)
+{
+	selfIndex = (int)(intptr_t)arg;
+	pthread_once(&schedOnce, startWorkers);		// returns once startWorkers has settled how many workers there are
+
+	for(;;) {
+		tcJob *job = findJob(selfIndex);
+		if(job) {
+			runJob(job);
+			continue;
+		}
+		pthread_mutex_lock(&sleepLock);
+		while(!atomic_load(&queued)) {
+			pthread_cond_wait(&workQueued, &sleepLock);
+		}
+		pthread_mutex_unlock(&sleepLock);
+	}
+	return NULL;
+}
+
+// Highest priority first: own newest, then the oldest of whoever has one
+static tcJob *findJob(int self)
+{
+	for(size_t p=SCHED_PRIORITIES; p-- > 0; ) {
+		tcJob *job = popNewest(&deques[self][p]);
+		for(size_t k=1; !job && k<workers; ++k) {
+			job = popOldest(&deques[((size_t)self + k) % workers][p]);
+		}
+		if(job) {
+			atomic_fetch_sub(&queued, 1);
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void runJob(tcJob *job)
+{
+	tcJobGroup *g = job->group;
+	job->func(job->arg);
+	free(job);
+	if(!g) return;
+
+	pthread_mutex_lock(&g->lock);
+	if(!--g->pending) pthread_cond_broadcast(&g->finished);
+	pthread_mutex_unlock(&g->lock);
+}
+
+#pragma mark Deques
+
+static bool pushJob(jobDeque *d, tcJob *job)
+{
+	pthread_mutex_lock(&d->lock);
+	if(d->tail - d->head == d->capacity) {
+		size_t capacity = d->capacity ? d->capacity*2 : 16;
+		tcJob **jobs = malloc(capacity * sizeof(tcJob *));
+		if(!jobs) {
+			pthread_mutex_unlock(&d->lock);
+			return false;
+		}
+		for(size_t j=d->head; j<d->tail; ++j) {
+			jobs[j - d->head] = d->jobs[j & (d->capacity-1)];
+		}
+		free(d->jobs);
+		d->jobs		= jobs;
+		d->tail		-= d->head;
+		d->head		= 0;
+		d->capacity	= capacity;
+	}
+	d->jobs[d->tail++ & (d->capacity-1)] = job;
+	pthread_mutex_unlock(&d->lock);
+	return true;
+}
+
+static tcJob *popNewest(jobDeque *d)
+{
+	tcJob *job = NULL;
+	pthread_mutex_lock(&d->lock);
+	if(d->tail != d->head) job = d->jobs[--d->tail & (d->capacity-1)];
+	pthread_mutex_unlock(&d->lock);
+	return job;
+}
+
+static tcJob *popOldest(jobDeque *d)
+{
+	tcJob *job = NULL;
+	pthread_mutex_lock(&d->lock);
+	if(d->tail != d->head) job = d->jobs[d->head++ & (d->capacity-1)];
+	pthread_mutex_unlock(&d->lock);
+	return job;
+}
+
+static size_t cpuCount(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (size_t)n : 1;
+}
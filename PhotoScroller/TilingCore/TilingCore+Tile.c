@@ -0,0 +1,297 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+/*
+ * Whole image builds make each level from the one before it, then cut that one into tiles. Tiling is done in place:
+ * tile row r is written over the image rows of tile row r-1 (row 0 goes into the empty tile row in front of the image),
+ * so tile rows go in order, but the tiles of one row are independent. Making the next level only reads this one.
+ *
+ * So the two run side by side: level N+1 is averaged in bands of rows while level N is tiled, a tile at a time,
+ * by the same threads. Tile row r may start once no band still has to read tile row r-1 - tiling follows right
+ * behind the reduction, while the rows it reads are still in memory.
+ */
+
+#define REDUCE_BAND_ROWS	64		// output rows per band
+
+typedef struct {
+	TCBuilderRef			b;
+	pthread_mutex_t			lock;
+	pthread_cond_t			changed;
+
+	// level N, being tiled
+	imageMemory				*im;
+	size_t					tileRow;			// all rows above are done
+	size_t					nextCol;
+	size_t					colsDone;
+
+	// level N+1, made from level N (bands == 0 when it is not)
+	mapper					*from;
+	mapper					*to;
+	const unsigned char		*inBase;
+	unsigned char			*outBase;
+	size_t					bands;
+	size_t					nextBand;
+	size_t					bandsDone;			// first band not done, the ones after it may be
+	bool					*done;
+	size_t					firstRow;			// level N row that the first output row is made from
+	size_t					consumed;			// leading tile rows of level N no band reads any more
+} levelStep;
+
+static void		levelStepRun(TCBuilderRef b, size_t idx);
+static void		*levelStepThread(void *arg);
+static void		tileOne(imageMemory *im, size_t row, size_t col);
+static void		reduceBand(levelStep *s, size_t band);
+static bool		finishTiling(TCBuilderRef b, imageMemory *im);
+
+bool tcTileBuilder(TCBuilderRef b, imageMemory *im, bool useMMAP)
+{
+	unsigned char *optr = im->map.emptyAddr;
+	unsigned char *iptr = im->map.addr;
+
+	// LOG("tile...");
+	// Now, we are going to pre-tile the image in 256x256 tiles, so we can map in contigous chunks of memory
+	for(size_t row=im->row; row<im->rows; ++row) {
+		unsigned char *tileIptr;
+		if(useMMAP) {
+			im->map.mappedSize = im->map.emptyTileRowSize*2;	// two tile rows
+			im->map.emptyAddr = mmap(NULL, im->map.mappedSize, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, im->map.fd, (off_t)(row*im->map.emptyTileRowSize));  /*| MAP_NOCACHE */
+			if(im->map.emptyAddr == MAP_FAILED) return false;
+#if MMAP_DEBUGGING == 1
+			LOG("MMAP[%d]: addr=%p 0x%zX bytes", im->map.fd, im->map.emptyAddr, im->map.mappedSize);
+#endif
+			im->map.addr = im->map.emptyAddr + im->map.emptyTileRowSize;
+
+			iptr = im->map.addr;
+			optr = im->map.emptyAddr;
+			tileIptr = im->map.emptyAddr;
+		} else {
+			tileIptr = iptr;
+		}
+		for(size_t col=0; col<im->cols; ++col) {
+			unsigned char *lastIptr = iptr;
+			for(size_t i=0; i<tileDimension; ++i) {
+				memcpy(optr, iptr, tileBytesPerRow);
+				iptr += im->map.bytesPerRow;
+				optr += tileBytesPerRow;
+			}
+			iptr = lastIptr + tileBytesPerRow;	// move to the next image
+		}
+		if(useMMAP) {
+			int ret = munmap(im->map.emptyAddr, im->map.mappedSize);
+#if MMAP_DEBUGGING == 1
+			LOG("UNMAP[%d]: addr=%p 0x%zX bytes", im->map.fd, im->map.emptyAddr, im->map.mappedSize);
+#endif
+			assert(ret == 0);
+			if(ret) b->failed = true;
+			tcWritebackRange(b, im->map.fd, row*im->map.emptyTileRowSize, im->map.emptyTileRowSize);
+		} else {
+			iptr = tileIptr + im->map.emptyTileRowSize;
+		}
+	}
+	//LOG("...tile");
+
+	return useMMAP || finishTiling(b, im);
+}
+
+static bool finishTiling(TCBuilderRef b, imageMemory *im)
+{
+	// OK we're done with this memory now
+	int ret = munmap(im->map.emptyAddr, im->map.mappedSize);
+#if MMAP_DEBUGGING == 1
+	LOG("UNMAP[%d]: addr=%p 0x%zX bytes", im->map.fd, im->map.emptyAddr, im->map.mappedSize);
+#endif
+	assert(ret==0);
+	if(ret) b->failed = true;
+
+	// don't need the scratch space now
+	tcTruncateEmptySpace(b, im);
+
+#if MEMORY_DEBUGGING == 1
+	char msg[128];
+	uint64_t usage = tcWritebackInFlight(b);
+	snprintf(msg, sizeof(msg), "%s threshold: usage=%llu thresh=%lld", usage > (uint64_t)b->ubc_threshold ? "Exceeded" : "Under", (unsigned long long)usage, (long long)b->ubc_threshold);
+	TCFreeMemory(msg);
+#endif
+
+	return !b->failed;
+}
+
+void tcTruncateEmptySpace(TCBuilderRef b, imageMemory *im)
+{
+	// don't need the scratch space now
+	off_t properLen = lseek(im->map.fd, 0, SEEK_END) - (off_t)im->map.emptyTileRowSize;
+	int ret = ftruncate(im->map.fd, properLen);
+	if(ret) {
+		LOG("Failed to truncate file!");
+		b->failed = true;
+	}
+	im->map.mappedSize = 0;	// force errors if someone tries to use mmap now
+}
+
+void tcCreateLevelsAndTile(TCBuilderRef b)
+{
+	assert(b->zoomLevels);
+
+	// step idx tiles level idx-1, and makes level idx unless the DCT did (or there is none)
+	for(size_t idx=1; idx <= b->zoomLevels; ++idx) {
+		levelStepRun(b, idx);
+		if(b->failed) return;
+	}
+	tcPackLevels(b);
+	tcWritebackRetire(b);
+	b->complete = !b->failed;
+}
+
+#pragma mark Level Steps
+
+static void levelStepRun(TCBuilderRef b, size_t idx)
+{
+	levelStep s = { .b = b, .im = &b->ims[idx-1] };
+	s.tileRow = s.im->row;
+
+	if(idx < b->zoomLevels && idx > b->dctLevels) {
+		mapper *lastMap = &b->ims[idx-1].map;
+		tcMapMemoryForIndex(b, idx, lastMap->width/2, lastMap->height/2);
+		if(b->failed) return;
+		mapper *currMap = &b->ims[idx].map;
+
+		// Average each 2x2 block of pixels to "down sample" the image (see TilingCore+Reduce.c)
+		madvise(lastMap->addr, lastMap->mappedSize-lastMap->emptyTileRowSize, MADV_SEQUENTIAL);
+		madvise(currMap->addr, currMap->mappedSize-currMap->emptyTileRowSize, MADV_SEQUENTIAL);
+
+		size_t oddColOffset = 0;
+		size_t oddRow = 0;
+		if(lastMap->col0offset && (lastMap->width & 1)) oddColOffset = bytesPerPixel;	// so rightmost pixels the same
+		if(lastMap->row0offset && (lastMap->height & 1)) oddRow = 1;					// so we use the bottom row
+
+		s.from		= lastMap;
+		s.to		= currMap;
+		s.firstRow	= lastMap->row0offset + oddRow;
+		s.inBase	= lastMap->addr + lastMap->col0offset + oddColOffset + s.firstRow*lastMap->bytesPerRow;
+		s.outBase	= currMap->addr + currMap->col0offset + currMap->row0offset*currMap->bytesPerRow;
+		s.bands		= (currMap->height + REDUCE_BAND_ROWS - 1) / REDUCE_BAND_ROWS;
+		s.done		= calloc(s.bands, sizeof(bool));
+		if(!s.done) {
+			b->failed = true;
+			return;
+		}
+	} else {
+		s.consumed = SIZE_MAX;	// tiling has the level to itself
+	}
+
+	size_t jobs = (s.im->rows - s.im->row) * s.im->cols + s.bands;
+	size_t threads = b->options.levelThreads ? b->options.levelThreads : tcSchedWorkers() + 1;
+	threads = MIN(threads, jobs);
+
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.changed, NULL);
+
+	// the scheduler's workers help, this thread works too (TilingCore+Sched.c)
+	tcJobGroup group;
+	tcJobGroupInit(&group);
+	for(size_t i=1; i<threads; ++i) {
+		tcJobSubmit(&group, atomic_load(&b->priority), levelStepThread, &s);
+	}
+	levelStepThread(&s);
+	tcJobGroupWait(&group);
+
+	pthread_cond_destroy(&s.changed);
+	pthread_mutex_destroy(&s.lock);
+	free(s.done);
+
+	if(s.to) {
+		tcAdviseFree(s.from->addr, s.from->mappedSize-s.from->emptyTileRowSize);
+		tcAdviseFree(s.to->addr, s.to->mappedSize-s.to->emptyTileRowSize);
+	}
+	if(!finishTiling(b, s.im)) b->failed = true;
+}
+
+static void *levelStepThread(void *arg)
+{
+	levelStep *s = (levelStep *)arg;
+	imageMemory *im = s->im;
+
+	pthread_mutex_lock(&s->lock);
+	while(s->tileRow < im->rows || s->bandsDone < s->bands) {
+		if(s->tileRow < im->rows && s->nextCol < im->cols && s->consumed >= s->tileRow) {
+			// tiles first, they hold up the bands' rows in memory
+			size_t row = s->tileRow;
+			size_t col = s->nextCol++;
+			pthread_mutex_unlock(&s->lock);
+			tileOne(im, row, col);
+			pthread_mutex_lock(&s->lock);
+
+			if(++s->colsDone == im->cols) {
+				++s->tileRow;
+				s->nextCol = 0;
+				s->colsDone = 0;
+				pthread_cond_broadcast(&s->changed);
+
+				// that part of the file is final now, whatever else happens to the level
+				pthread_mutex_unlock(&s->lock);
+				tcWritebackRange(s->b, im->map.fd, row*im->map.emptyTileRowSize, im->map.emptyTileRowSize);
+				pthread_mutex_lock(&s->lock);
+			}
+		} else if(s->nextBand < s->bands) {
+			size_t band = s->nextBand++;
+			pthread_mutex_unlock(&s->lock);
+			reduceBand(s, band);
+			pthread_mutex_lock(&s->lock);
+
+			s->done[band] = true;
+			while(s->bandsDone < s->bands && s->done[s->bandsDone]) ++s->bandsDone;
+			if(s->bandsDone == s->bands) {
+				s->consumed = SIZE_MAX;
+			} else {
+				size_t firstUnread = s->firstRow + 2*s->bandsDone*REDUCE_BAND_ROWS;
+				s->consumed = firstUnread / tileDimension;
+			}
+			pthread_cond_broadcast(&s->changed);
+		} else {
+			pthread_cond_wait(&s->changed, &s->lock);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+// Tile row r goes over the image rows of tile row r-1, tile by tile
+static void tileOne(imageMemory *im, size_t row, size_t col)
+{
+	const unsigned char *iptr = im->map.addr + row*im->map.emptyTileRowSize + col*tileBytesPerRow;
+	unsigned char *optr = im->map.emptyAddr + row*im->map.emptyTileRowSize + col*tileSize;
+	for(size_t i=0; i<tileDimension; ++i) {
+		memcpy(optr, iptr, tileBytesPerRow);
+		iptr += im->map.bytesPerRow;
+		optr += tileBytesPerRow;
+	}
+}
+
+static void reduceBand(levelStep *s, size_t band)
+{
+	size_t row0 = band*REDUCE_BAND_ROWS;
+	size_t row1 = MIN(row0 + REDUCE_BAND_ROWS, s->to->height);
+
+	const unsigned char *inPtr = s->inBase + 2*row0*s->from->bytesPerRow;
+	unsigned char *outPtr = s->outBase + row0*s->to->bytesPerRow;
+	for(size_t row=row0; row<row1; ++row) {
+		tcReduceRows((uint32_t *)outPtr, (const uint32_t *)inPtr, (const uint32_t *)(inPtr + s->from->bytesPerRow), s->to->width);
+		inPtr += s->from->bytesPerRow*2;
+		outPtr += s->to->bytesPerRow;
+	}
+}
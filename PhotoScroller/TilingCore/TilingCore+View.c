@@ -0,0 +1,149 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+/*
+ * Tile views: a tile ready to hand to CoreGraphics as is. Where TCTileGetBytesAtPosition copies pixels into
+ * the caller's buffer, a view points at memory that already holds them and keeps it alive until released:
+ *   - a tile cache entry (finished levels, and every JPEG tile)
+ *   - the mapping of a reopened archive
+ *   - a mapping of just that tile of its level file (levels still being built, or no tile cache)
+ *
+ * Views come from a pool with a lock free free list, so a tile cache hit takes no locks beyond the cache's own and
+ * allocates nothing. The list head packs a tag that changes with every update next to the index, so a view popped
+ * and pushed back between another thread's read of the head and its compare and swap cannot fool it (ABA).
+ * Should all of the pool be in use at once, views are malloc'd.
+ */
+
+#define VIEW_POOL			1024
+
+typedef struct {
+	TCTileView				pub;			// first, the caller's pointer is ours
+	atomic_int				refs;
+	_Atomic uint32_t		next;			// free list: index+1 of the next free view, 0 == none
+	bool					pooled;
+
+	// what keeps the pixels there, one of
+	struct tcCacheEntry		*entry;
+	struct tcArchiveMap		*archive;
+	void					*map;
+} tcView;
+
+static tcView				pool[VIEW_POOL];
+static _Atomic uint64_t		freeHead;		// tag << 32 | index+1 of the first free view
+static _Atomic uint32_t		neverUsed;		// views from here on have not been handed out yet
+
+static tcView	*popView(void);
+static void		pushView(tcView *v);
+
+#pragma mark Views
+
+TCTileView *TCBuilderGetTileView(TCBuilderRef b, size_t level, size_t col, size_t row)
+{
+	TCTile tile;
+	if(!TCBuilderGetTile(b, level, col, row, &tile)) return NULL;
+
+	tcView *v = popView();
+	if(!v) return NULL;
+	v->entry = NULL;
+	v->archive = NULL;
+	v->map = NULL;
+
+	const unsigned char *base;
+	if(tile.addr && tile.length == tileSize) {
+		base = tile.addr;
+		v->archive = b->archiveMap;
+		tcArchiveMapRetain(v->archive);
+	} else if(tile.length < tileSize || tile.shared) {
+		base = tcTileCacheAcquire(&tile);
+		v->entry = tile.entry;
+	} else {
+		base = v->map = mmap(NULL, tileSize, PROT_READ, MAP_FILE | MAP_SHARED | MAP_NOCACHE, tile.fd, tile.offset);
+		if(base == MAP_FAILED) base = v->map = NULL;
+	}
+	if(!base) {
+		pushView(v);
+		return NULL;
+	}
+
+	atomic_store_explicit(&v->refs, 1, memory_order_relaxed);
+	v->pub.bytes		= base + tile.skip;
+	v->pub.width		= tile.width;
+	v->pub.height		= tile.height;
+	v->pub.bytesPerRow	= tile.bytesPerRow;
+	v->pub.length		= tile.bytesPerRow * (tile.height - 1) + tile.width * bytesPerPixel;
+	return &v->pub;
+}
+
+TCTileView *TCTileViewRetain(TCTileView *view)
+{
+	atomic_fetch_add_explicit(&((tcView *)view)->refs, 1, memory_order_relaxed);
+	return view;
+}
+
+void TCTileViewRelease(TCTileView *view)
+{
+	if(!view) return;
+
+	tcView *v = (tcView *)view;
+	if(atomic_fetch_sub_explicit(&v->refs, 1, memory_order_acq_rel) != 1) return;
+
+	if(v->entry) tcTileCacheReleaseEntry(v->entry);
+	if(v->archive) tcArchiveMapRelease(v->archive);
+	if(v->map) munmap(v->map, tileSize);
+	pushView(v);
+}
+
+#pragma mark Pool
+
+static tcView *popView(void)
+{
+	uint64_t head = atomic_load_explicit(&freeHead, memory_order_acquire);
+	while((uint32_t)head) {
+		tcView *v = &pool[(uint32_t)head - 1];
+		uint64_t next = (((head >> 32) + 1) << 32) | atomic_load_explicit(&v->next, memory_order_relaxed);
+		if(atomic_compare_exchange_weak_explicit(&freeHead, &head, next, memory_order_acquire, memory_order_acquire)) return v;
+	}
+
+	uint32_t fresh = atomic_load_explicit(&neverUsed, memory_order_relaxed);
+	while(fresh < VIEW_POOL) {
+		if(atomic_compare_exchange_weak_explicit(&neverUsed, &fresh, fresh+1, memory_order_relaxed, memory_order_relaxed)) {
+			pool[fresh].pooled = true;
+			return &pool[fresh];
+		}
+	}
+
+	tcView *v = malloc(sizeof(tcView));
+	if(v) v->pooled = false;
+	return v;
+}
+
+static void pushView(tcView *v)
+{
+	if(!v->pooled) {
+		free(v);
+		return;
+	}
+
+	uint32_t index = (uint32_t)(v - pool) + 1;
+	uint64_t head = atomic_load_explicit(&freeHead, memory_order_relaxed);
+	uint64_t next;
+	do {
+		atomic_store_explicit(&v->next, (uint32_t)head, memory_order_relaxed);
+		next = (((head >> 32) + 1) << 32) | index;
+	} while(!atomic_compare_exchange_weak_explicit(&freeHead, &head, next, memory_order_release, memory_order_relaxed));
+}
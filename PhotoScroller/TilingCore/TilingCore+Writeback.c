@@ -0,0 +1,261 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+
+#include "TilingCore-Private.h"
+
+#include <pthread.h>
+
+/*
+ * Level files are written through the page cache, and on iOS the pages not yet written back are memory the app is
+ * charged for. Rather than fsync each file once it is complete, the parts that are final - a tile row, a run of packed
+ * tiles - are handed to writeback as they are done (tcWritebackRange), so the disk works while the build goes on.
+ *
+ * Each builder keeps what it handed over in a ring, oldest first, counted in bytes. Once its own bytes in flight exceed
+ * its threshold, or its ring is full, a builder waits until its oldest range is on disk: the build that is filling
+ * memory is the one that waits, and never on another image. Retired builders' ranges are waited for by a flush job on
+ * the scheduler, at the builder's priority; they are nobody's budget any more, but still slow the token bucket below.
+ *
+ * On top of that writes are admitted by a token bucket: a range costs its size, tokens come back at the rate the disk
+ * has been seen to write, up to a burst of the threshold. A build running ahead of the disk stalls a little at a time,
+ * instead of filling memory to the threshold and then waiting for all of it. TCSetWritebackRate holds the bucket to a
+ * rate of the caller's, a slow disk as far as the builds can tell.
+ */
+
+#define RATE_INITIAL		(64.0 * 1024 * 1024)		// bytes a second, until a writeback has been timed
+#define RATE_MINIMUM		(1.0 * 1024 * 1024)
+#define TOKEN_WAIT_MAX		10000000ull					// nanoseconds, then the bucket is looked at again
+
+typedef struct {
+	size_t				count;
+	tcWritebackSpan		ranges[TC_WRITEBACK_RANGES];
+} retiredRanges;
+
+static pthread_mutex_t		writebackLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		writebackDone = PTHREAD_COND_INITIALIZER;
+static uint64_t				inFlight;					// bytes, all builders and retired ranges: is the disk busy
+static double				rate = RATE_INITIAL;		// bytes a second the disk has been writing
+static double				rateLimit;					// TCSetWritebackRate, 0 == none
+static uint64_t				lastDone;					// TCTimeStamp of the last range known written
+static double				tokens;
+static uint64_t				refilled;					// TCTimeStamp, 0 == bucket never used
+
+static void		payTokens(TCBuilderRef b, uint64_t length);
+static bool		waitOldest(TCBuilderRef b);
+static void		countStall(TCBuilderRef b, uint64_t start);
+static void		rangeDone(const tcWritebackSpan *r, uint64_t now);
+static void		*flushRetired(void *arg);
+
+#pragma mark Writeback
+
+void TCSetWritebackRate(double bytesPerSecond)
+{
+	pthread_mutex_lock(&writebackLock);
+	rateLimit = MAX(bytesPerSecond, 0);
+	pthread_mutex_unlock(&writebackLock);
+}
+
+void tcWritebackRange(TCBuilderRef b, int fd, uint64_t offset, uint64_t length)
+{
+	if(!length) return;
+
+	tcWritebackSpan r = { .fd = dup(fd), .offset = offset, .length = length };
+	if(r.fd == -1) {
+		LOG("Cannot dup fd=%d for writeback (%s)", fd, strerror(errno));
+		return;		// the system writes it back in its own time
+	}
+	payTokens(b, length);
+
+	r.started = TCTimeStamp();
+	(void)tcSyncRange(r.fd, offset, length, false);
+
+	tcWriteback *wb = &b->writeback;
+	uint64_t start = 0;
+	pthread_mutex_lock(&writebackLock);
+	while(wb->count == TC_WRITEBACK_RANGES) {
+		pthread_mutex_unlock(&writebackLock);
+		if(!start) start = TCTimeStamp();
+		(void)waitOldest(b);
+		pthread_mutex_lock(&writebackLock);
+	}
+	wb->ranges[(wb->first + wb->count++) % TC_WRITEBACK_RANGES] = r;
+	wb->stats.written += length;
+	wb->stats.inFlight += length;
+	inFlight += length;
+	pthread_mutex_unlock(&writebackLock);
+	if(start) countStall(b, start);
+
+	tcWritebackAdmit(b);
+}
+
+void tcWritebackAdmit(TCBuilderRef b)
+{
+	uint64_t start = 0;
+	while(true) {
+		pthread_mutex_lock(&writebackLock);
+		bool over = b->writeback.stats.inFlight > (uint64_t)MAX(b->ubc_threshold, 0);
+		pthread_mutex_unlock(&writebackLock);
+		if(!over) break;
+		if(!start) start = TCTimeStamp();
+		if(!waitOldest(b)) break;
+	}
+	if(start) countStall(b, start);
+}
+
+void tcWritebackRetire(TCBuilderRef b)
+{
+	tcWriteback *wb = &b->writeback;
+
+	pthread_mutex_lock(&writebackLock);
+	retiredRanges *retired = wb->count ? malloc(sizeof(retiredRanges)) : NULL;
+	if(retired) {
+		retired->count = wb->count;
+		for(size_t i=0; i<wb->count; ++i) {
+			retired->ranges[i] = wb->ranges[(wb->first + i) % TC_WRITEBACK_RANGES];
+		}
+		wb->first = 0;
+		wb->count = 0;
+		wb->stats.inFlight = 0;		// not the builder's any more
+	}
+	pthread_mutex_unlock(&writebackLock);
+	if(!retired) {
+		while(waitOldest(b)) ;		// no memory, wait here then
+		return;
+	}
+
+	tcJobSubmit(NULL, atomic_load(&b->priority), flushRetired, retired);
+}
+
+uint64_t tcWritebackInFlight(TCBuilderRef b)
+{
+	pthread_mutex_lock(&writebackLock);
+	uint64_t bytes = b->writeback.stats.inFlight;
+	pthread_mutex_unlock(&writebackLock);
+	return bytes;
+}
+
+void TCBuilderGetWritebackStats(TCBuilderRef b, TCWritebackStats *stats)
+{
+	pthread_mutex_lock(&writebackLock);
+	*stats = b->writeback.stats;
+	pthread_mutex_unlock(&writebackLock);
+}
+
+#pragma mark Waiting
+
+// Owing tokens is allowed, so a range bigger than the burst still goes - the next one waits until the debt is paid
+static void payTokens(TCBuilderRef b, uint64_t length)
+{
+	uint64_t stalled = 0;
+
+	pthread_mutex_lock(&writebackLock);
+	while(true) {
+		uint64_t now = TCTimeStamp();
+		double burst = (double)MAX(b->ubc_threshold, (int64_t)length);		// memory warnings can take the threshold to 0
+		double admitted = rateLimit ? MIN(rate, rateLimit) : rate;
+		tokens = refilled ? MIN(burst, tokens + admitted * (double)(now - refilled) / 1e9) : burst;
+		refilled = now;
+		if(tokens > 0 || (!inFlight && !rateLimit)) break;		// an idle disk is never waited for, unless it is a slow one
+
+		// waiting for our own writes shows how fast the disk is going, otherwise (or held to a rate) give it time
+		uint64_t start = now;
+		if(b->writeback.count && !rateLimit) {
+			pthread_mutex_unlock(&writebackLock);
+			(void)waitOldest(b);
+			pthread_mutex_lock(&writebackLock);
+		} else {
+			uint64_t wait = MIN((uint64_t)(-tokens / admitted * 1e9) + 1, TOKEN_WAIT_MAX);
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += (time_t)((until.tv_nsec + (long)wait) / 1000000000);
+			until.tv_nsec = (until.tv_nsec + (long)wait) % 1000000000;
+			pthread_cond_timedwait(&writebackDone, &writebackLock, &until);
+		}
+		stalled += TCTimeStamp() - start;
+	}
+	tokens -= (double)length;
+	if(stalled) {
+		++b->writeback.stats.stalls;
+		b->writeback.stats.stallNanos += stalled;
+	}
+	pthread_mutex_unlock(&writebackLock);
+}
+
+// The build was held up since start, once
+static void countStall(TCBuilderRef b, uint64_t start)
+{
+	uint64_t now = TCTimeStamp();
+	pthread_mutex_lock(&writebackLock);
+	++b->writeback.stats.stalls;
+	b->writeback.stats.stallNanos += now - start;
+	pthread_mutex_unlock(&writebackLock);
+}
+
+// false when b has nothing in flight. Not a stall in itself, the callers holding up a build count those
+static bool waitOldest(TCBuilderRef b)
+{
+	tcWriteback *wb = &b->writeback;
+
+	pthread_mutex_lock(&writebackLock);
+	if(!wb->count) {
+		pthread_mutex_unlock(&writebackLock);
+		return false;
+	}
+	tcWritebackSpan r = wb->ranges[wb->first];
+	wb->first = (wb->first + 1) % TC_WRITEBACK_RANGES;
+	--wb->count;
+	pthread_mutex_unlock(&writebackLock);
+
+	(void)tcSyncRange(r.fd, r.offset, r.length, true);
+	close(r.fd);
+	uint64_t now = TCTimeStamp();
+
+	pthread_mutex_lock(&writebackLock);
+	wb->stats.inFlight -= r.length;
+	rangeDone(&r, now);
+	pthread_mutex_unlock(&writebackLock);
+	return true;
+}
+
+// writebackLock held. The disk wrote r since it was started, or since it finished the last range, whichever is later.
+static void rangeDone(const tcWritebackSpan *r, uint64_t now)
+{
+	uint64_t since = MAX(r->started, lastDone);
+	if(now > since) {
+		double sample = (double)r->length * 1e9 / (double)(now - since);
+		rate = MAX(RATE_MINIMUM, rate * 0.75 + sample * 0.25);
+	}
+	lastDone = now;
+	inFlight -= r->length;
+	pthread_cond_broadcast(&writebackDone);
+}
+
+static void *flushRetired(void *arg)
+{
+	retiredRanges *retired = arg;
+
+	for(size_t i=0; i<retired->count; ++i) {
+		tcWritebackSpan *r = &retired->ranges[i];
+		(void)tcSyncRange(r->fd, r->offset, r->length, true);
+		close(r->fd);
+
+		pthread_mutex_lock(&writebackLock);
+		rangeDone(r, TCTimeStamp());
+		pthread_mutex_unlock(&writebackLock);
+	}
+	free(retired);
+	return NULL;
+}
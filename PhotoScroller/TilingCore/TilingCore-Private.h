@@ -0,0 +1,358 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef TILING_CORE_PRIVATE_H
+#define TILING_CORE_PRIVATE_H
+
+#define TIMING_STATS			1		// set to 1 if you want to see how long things take
+#define MEMORY_DEBUGGING		1		// set to 1 if you want to see how memory changes when images are processed
+#define MMAP_DEBUGGING			0		// set to 1 to see how mmap/munmap working
+#define MAPPING_IMAGES			0		// set to 1 to use MMAP for image tile retrieval - if 0 use pread
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef LIBJPEG
+#include "jpeglib.h"
+#include <setjmp.h>
+#endif
+
+#include "TilingCore.h"
+
+#define LOG(fmt, ...)	fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+
+#ifndef MIN
+#define MIN(a, b)		((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b)		((a) > (b) ? (a) : (b))
+#endif
+
+// Linux has no equivalent, the page cache is managed with posix_fadvise instead (see TilingCore+Platform.c)
+#ifndef MAP_NOCACHE
+#define MAP_NOCACHE		0
+#endif
+
+static const size_t bytesPerPixel = TC_BYTES_PER_PIXEL;
+static const size_t tileDimension = TC_TILE_SIZE;
+static const size_t tileBytesPerRow = TC_TILE_SIZE * TC_BYTES_PER_PIXEL;
+static const size_t tileSize = TC_TILE_SIZE * TC_TILE_SIZE * TC_BYTES_PER_PIXEL;
+
+static inline size_t calcDimension(size_t d) { return(d + (tileDimension-1)) & ~(tileDimension-1); }
+static inline size_t calcBytesPerRow(size_t row) { return calcDimension(row) * bytesPerPixel; }
+
+typedef struct {
+	int fd;
+	unsigned char *addr;		// address == emptyAddr + emptyTileRowSize
+	unsigned char *emptyAddr;	// first address of allocated space
+	size_t mappedSize;			// all space from emptyAddr to end of file
+	size_t height;				// image
+	size_t width;				// image
+	size_t bytesPerRow;			// mapped space, rounded to next full tile
+	size_t emptyTileRowSize;	// free space at the beginning of the file, 0 for streamed levels
+
+	// used for orientations other than "1"
+	size_t col0offset;
+	size_t row0offset;
+} mapper;
+
+typedef struct {
+	mapper map;
+
+	// whole image
+	size_t cols;
+	size_t rows;
+
+	// scale
+	size_t index;
+
+	// construction and tile prep
+	size_t outLine;				// lines filled in, counting row0offset
+	unsigned char *pendingRow;	// streaming: first line of a 2x2 pair, waiting for the second
+	unsigned char *strip;		// streaming: the tile row being filled, already in tile order, written to the file once it is complete
+	unsigned char *line;		// streaming: lines waiting to be copied into the strip
+
+	// used by tiling and during construction
+	size_t row;
+
+	// tiling only
+	size_t col;
+	size_t tileHeight;
+	size_t tileWidth;
+
+	// drawing
+	bool rotated;
+
+	// archive only
+	size_t firstTile;		// this level's first entry in the tile index
+
+	// packed levels (TilingCore+Codec.c): cols*rows+1 offsets, tile i is tileOffsets[i]...tileOffsets[i+1] of the level file
+	uint64_t *tileOffsets;
+
+} imageMemory;
+
+#ifdef LIBJPEG
+
+struct my_error_mgr {
+  struct jpeg_error_mgr pub;		/* "public" fields */
+  jmp_buf setjmp_buffer;			/* for return to caller */
+};
+typedef struct my_error_mgr * my_error_ptr;
+
+typedef struct {
+	struct jpeg_source_mgr			pub;
+	struct jpeg_decompress_struct	cinfo;
+	struct my_error_mgr				jerr;
+
+	// input data management
+	const unsigned char				*data;
+	size_t							data_length;
+	size_t							consumed_data;		// where the next chunk of data should come from, offset into the caller's buffer
+	size_t							deleted_data;		// removed from the caller's buffer
+	// zero copy streams (TCBuilderAppendJPEGStreamChunk), see TilingCore+JPEG.c
+	struct tcStreamChunk			*chunks;			// oldest still held, the one libjpeg backs up into when it suspends
+	struct tcStreamChunk			*lastChunk;
+	struct tcStreamChunk			*chunk;				// being read, NULL == none handed out yet
+	const JOCTET					*handedOut;			// next_input_byte as fill_input_buffer left it
+	const JOCTET					*restartByte;		// where libjpeg resumes, in chunks
+	size_t							restartBytes;
+	size_t							restartSkip;
+	size_t							skipBytes;			// skip_input_data beyond what has arrived
+	TCStreamStats					streamStats;
+	struct tcFeed					*feed;				// threaded streams, TilingCore+Feed.c
+
+	size_t							writtenLines;
+	size_t							scansDone;			// multi scan streams: completed scans
+	boolean							start_of_stream;
+	boolean							got_header;
+	boolean							jpegFailed;
+} co_jpeg_source_mgr;
+
+#endif
+
+/*
+ * Archive layout (all integers little endian, see TilingCore+Archive.c):
+ *   tcArchiveHeader
+ *   tcArchiveLevel[zoomLevels]
+ *   tcArchiveTile[tileCount]			index of every tile, level 0 first, then row major
+ *   padding to tcArchiveAlignment
+ *   tile data
+ */
+#define TC_ARCHIVE_MAGIC		"PSNTILES"
+#define TC_ARCHIVE_VERSION		2		// 1 has only raw tiles, and is still read
+
+static const size_t tcArchiveAlignment = 16384;	// largest page size we run on, so tiles can be mapped individually
+
+typedef struct {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	headerSize;			// sizeof(tcArchiveHeader), lets later versions grow it
+	uint32_t	tileDimension;
+	uint32_t	bytesPerPixel;
+	uint32_t	zoomLevels;
+	int32_t		orientation;
+	uint32_t	tileCount;
+	uint32_t	reserved;
+	uint64_t	levelsOffset;
+	uint64_t	indexOffset;
+	uint64_t	fileSize;			// a truncated file is rejected
+} tcArchiveHeader;
+
+typedef struct {
+	uint64_t	width;				// the mapper geometry
+	uint64_t	height;
+	uint64_t	bytesPerRow;
+	uint64_t	col0offset;
+	uint64_t	row0offset;
+	uint32_t	cols;
+	uint32_t	rows;
+	uint64_t	firstTile;			// index of this level's first tcArchiveTile
+} tcArchiveLevel;
+
+typedef struct {
+	uint64_t	offset;				// from the start of the file
+	uint32_t	length;				// tileSize, or less for a JPEG tile (version 2)
+	uint32_t	reserved;
+} tcArchiveTile;
+
+// A reopened archive's mapping, held by its builder and by tile views into it (TilingCore+View.c)
+struct tcArchiveMap {
+	unsigned char	*addr;
+	size_t			size;
+	atomic_int		refs;
+};
+
+// Parts of level files handed to writeback and not yet waited for (TilingCore+Writeback.c), oldest first
+#define TC_WRITEBACK_RANGES		32
+
+typedef struct {
+	int			fd;					// a dup, the level file may be closed first
+	uint64_t	offset;
+	uint64_t	length;
+	uint64_t	started;			// TCTimeStamp
+} tcWritebackSpan;
+
+typedef struct {
+	tcWritebackSpan		ranges[TC_WRITEBACK_RANGES];
+	size_t				first;
+	size_t				count;
+	TCWritebackStats	stats;
+} tcWriteback;
+
+struct TCBuilder {
+	TCBuilderOptions		options;
+	char					*tempDir;
+	bool					failed;
+	bool					complete;			// every level is tiled
+	int						orientation;
+	size_t					zoomLevels;
+	imageMemory				*ims;
+	size_t					pageSize;
+	bool					mapWholeFile;
+	int64_t					ubc_threshold;
+
+	// staged image data
+	FILE					*imageFile;
+	char					*imagePath;
+	atomic_bool				imageWriteFailed;	// TCBuilderWriteImageData, any thread - failed once the file is closed
+
+	uint64_t				cacheId;			// tile cache key (TilingCore+Cache.c), unique for the life of the process
+
+	size_t					dctLevels;			// levels after 0 that come straight from the DCT coefficients, not reduced
+
+#ifdef LIBJPEG
+	co_jpeg_source_mgr		*src_mgr;
+	struct tcDCT			*dct;				// TilingCore+DCT.c, while those levels are being built
+
+	// progressive streams (TilingCore+JPEG.c): previews of levels previewLevel and up, packed one after the other
+	unsigned char			*preview;
+	size_t					previewLevel;		// zoomLevels == no previews for this image
+	size_t					previewScans;		// scans in the current preview, 0 == none yet
+	pthread_mutex_t			previewLock;		// threaded streams rebuild it while the caller may be reading it
+#endif
+
+	// reopened archive (TilingCore+Archive.c), all levels share one read only mapping
+	int						archiveFd;
+	unsigned char			*archiveAddr;
+	struct tcArchiveMap		*archiveMap;		// archiveAddr, shared with tile views into it
+	const tcArchiveTile		*archiveIndex;		// zoomLevels runs of cols*rows entries, level 0 first
+
+	// TilingCore+Sched.c
+	atomic_int				priority;
+	bool					admitted;			// holds a build slot
+
+	// TilingCore+Writeback.c, under its lock
+	tcWriteback				writeback;
+};
+
+// TilingCore.c
+size_t	tcZoomLevelsForSize(TCBuilderRef b, size_t width, size_t height);
+bool	tcAllocLevels(TCBuilderRef b, size_t width, size_t height);
+void	tcMapMemoryForIndex(TCBuilderRef b, size_t idx, size_t w, size_t h);
+
+// TilingCore+Tile.c
+bool	tcTileBuilder(TCBuilderRef b, imageMemory *im, bool useMMAP);
+void	tcTruncateEmptySpace(TCBuilderRef b, imageMemory *im);
+void	tcCreateLevelsAndTile(TCBuilderRef b);
+
+// TilingCore+Reduce.c
+void	tcReduceRows(uint32_t *out, const uint32_t *in0, const uint32_t *in1, size_t outWidth);	// 2x2 box filter, in rows are 2*outWidth
+
+#ifdef LIBJPEG
+// TilingCore+JPEG.c
+void	tcStreamChunksRelease(TCBuilderRef b);						// every chunk still held
+bool	tcJPEGStreamDecode(TCBuilderRef b);							// as far as the data goes, false once failed
+
+// TilingCore+Feed.c
+bool	tcFeedIdle(co_jpeg_source_mgr *src_mgr);					// the decoder has caught up with the download
+void	tcFeedStats(co_jpeg_source_mgr *src_mgr, TCStreamStats *stats);
+
+// TilingCore+DCT.c
+bool	tcDCTUsable(j_decompress_ptr cinfo);							// the coefficients can be turned into levels here
+size_t	tcDCTLevelsForImage(TCBuilderRef b, j_decompress_ptr cinfo);	// how many levels to build from coefficients, 0 == none
+bool	tcDCTLevelsStart(TCBuilderRef b, j_decompress_ptr cinfo);		// buffered image mode, after jpeg_start_decompress
+bool	tcDCTLevelsFinish(TCBuilderRef b);								// before jpeg_finish_decompress frees the coefficients
+bool	tcDCTPreview(TCBuilderRef b, j_decompress_ptr cinfo, size_t idx, unsigned char *out, size_t bytesPerRow);	// level idx <= 3 from the scans so far
+
+// TilingCore+Restart.c
+struct tcBands *tcRestartBandsPlan(TCBuilderRef b, j_decompress_ptr cinfo, const unsigned char *data, size_t len);	// NULL == decode it the usual way
+bool	tcRestartBandsDecode(TCBuilderRef b, struct tcBands *bands, unsigned char *base, size_t bytesPerRow);				// releases bands
+void	tcRestartBandsRelease(struct tcBands *bands);
+#endif
+
+// TilingCore+Codec.c
+void	tcPackLevels(TCBuilderRef b);									// options.tileQuality: compress the tiles of finished levels in place
+bool	tcUnpackTile(const unsigned char *data, size_t len, unsigned char *pixels);	// a whole tile, tileSize bytes
+
+// TilingCore+Cache.c
+uint64_t	tcTileCacheNewId(void);
+bool	tcTileCacheEnabled(void);
+const unsigned char *tcTileCacheAcquire(TCTile *tile);					// the whole tile, held until tcTileCacheRelease
+void	tcTileCacheRelease(TCTile *tile);
+void	tcTileCacheReleaseEntry(struct tcCacheEntry *e);
+struct tcCacheEntry *tcTileCacheReserve(TCTile *tile, unsigned char **pixels);		// NULL == cached or being read already, else read it into pixels
+void	tcTileCacheFill(struct tcCacheEntry *e, unsigned char *pixels, bool ok);	// and let go of it
+void	tcTileCacheForget(TCBuilderRef b);								// the builder is going away
+
+// TilingCore+Prefetch.c
+void	tcPrefetchForget(TCBuilderRef b);								// drops its queued tiles, waits for the ones being read
+
+// TilingCore+Sched.c - jobs in a group are waited for together
+typedef struct {
+	size_t					pending;			// submitted, not finished
+	pthread_mutex_t			lock;
+	pthread_cond_t			finished;
+} tcJobGroup;
+
+void	tcBuildAdmit(TCBuilderRef b);									// waits for a build slot
+void	tcBuildRetire(TCBuilderRef b);
+size_t	tcSchedWorkers(void);
+void	tcJobGroupInit(tcJobGroup *g);
+void	tcJobSubmit(tcJobGroup *g, int priority, void *(*func)(void *), void *arg);	// g NULL == nobody waits for it
+void	tcJobGroupWait(tcJobGroup *g);									// runs the jobs nobody has started, waits for the others, destroys g
+
+// TilingCore+Writeback.c
+void	tcWritebackRange(TCBuilderRef b, int fd, uint64_t offset, uint64_t length);	// that much of fd is final: write it back, maybe wait for the disk
+void	tcWritebackAdmit(TCBuilderRef b);								// before dirtying a new level, waits while b is over its threshold
+void	tcWritebackRetire(TCBuilderRef b);								// done writing: what is still in flight is waited for in the background
+uint64_t tcWritebackInFlight(TCBuilderRef b);							// bytes b has handed over, not known to be on disk
+
+// TilingCore+Archive.c
+void	tcCloseArchive(TCBuilderRef b);
+void	tcArchiveMapRetain(struct tcArchiveMap *map);
+void	tcArchiveMapRelease(struct tcArchiveMap *map);					// unmapped with the last reference
+
+// TilingCore+Platform.c - the parts that differ between Darwin and Linux
+int		tcCreateTempFile(TCBuilderRef b, bool unlinkFile, size_t sz, char **path);
+void	tcNoCache(int fd);
+void	tcAdviseFree(void *addr, size_t len);
+bool	tcWriteAll(int fd, const void *buf, size_t len, off_t offset);	// pwrite until it is all out
+float	tcUbcThresholdRatio(void);
+int		tcSyncRange(int fd, uint64_t offset, uint64_t length, bool wait);	// start writing back a range of fd, or wait until it is on disk
+int		tcFullSync(int fd);								// data actually on the media, not just in the drive cache
+void	tcWatchMemoryPressure(void (*handler)(void));	// handler runs when the OS says memory is short, where it can tell us
+
+#endif // TILING_CORE_PRIVATE_H
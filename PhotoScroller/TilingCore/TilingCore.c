@@ -0,0 +1,391 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "TilingCore-Private.h"
+
+static void tcMapMemory(TCBuilderRef b, mapper *mapP);
+
+#ifndef NDEBUG
+//static void dumpMapper(const char *str, mapper *m)
+//{
+//	printf("MAP: %s\n", str);
+//	printf(" fd = %d\n", m->fd);
+//	printf(" emptyAddr = %p\n", m->emptyAddr);
+//	printf(" addr = %p\n", m->addr);
+//	printf(" mappedSize = %lu\n", m->mappedSize);
+//	printf(" height = %lu\n", m->height);
+//	printf(" width = %lu\n", m->width);
+//	printf(" bytesPerRow = %lu\n", m->bytesPerRow);
+//	printf(" emptyTileRowSize = %lu\n", m->emptyTileRowSize);
+//	putchar('\n');
+//}
+#endif
+
+#pragma mark Lifecycle
+
+TCBuilderRef TCBuilderCreate(const TCBuilderOptions *options)
+{
+	TCBuilderRef b = calloc(1, sizeof(struct TCBuilder));
+	if(!b) return NULL;
+
+	if(options) b->options = *options;
+	b->options.tempDir	= NULL;		// caller's string, we keep our own copy
+	b->orientation		= b->options.orientation;
+	b->pageSize			= (size_t)getpagesize();
+	b->archiveFd		= -1;
+	b->cacheId			= tcTileCacheNewId();
+	atomic_init(&b->priority, b->options.priority);
+
+	const char *dir = options && options->tempDir ? options->tempDir : getenv("TMPDIR");
+	b->tempDir			= strdup(dir && *dir ? dir : "/tmp");
+	if(!b->tempDir) {
+		free(b);
+		return NULL;
+	}
+#ifdef LIBJPEG
+	b->src_mgr			= calloc(1, sizeof(co_jpeg_source_mgr));
+	if(!b->src_mgr) {
+		free(b->tempDir);
+		free(b);
+		return NULL;
+	}
+	pthread_mutex_init(&b->previewLock, NULL);
+#endif
+
+	// Take a big chunk of either free memory or all memory
+	TCMemoryInfo fm		= TCFreeMemory("Initialize");
+	float freeThresh	= (float)fm.freeMemory*tcUbcThresholdRatio();
+	float totalThresh	= (float)fm.totlMemory*tcUbcThresholdRatio();
+	float thresh		= MAX(freeThresh, totalThresh);
+	b->ubc_threshold	= (int64_t)thresh;
+	//LOG("A: freeThresh=%lf totalThresh=%lf ubc_thresh=%u", (freeThresh), (totalThresh), b->ubc_threshold);
+
+	return b;
+}
+
+void TCBuilderRelease(TCBuilderRef b)
+{
+	if(!b) return;
+
+#ifdef LIBJPEG
+	if(b->src_mgr && b->src_mgr->feed) (void)TCBuilderEndJPEGStream(b, true);	// the decode thread uses everything below
+#endif
+	tcBuildRetire(b);		// begun, never finished
+	tcWritebackRetire(b);
+	tcPrefetchForget(b);
+	tcTileCacheForget(b);
+	for(size_t idx=0; idx<b->zoomLevels; ++idx) {
+		int fd = b->ims[idx].map.fd;
+		if(fd>0) close(fd);
+		free(b->ims[idx].pendingRow);
+		free(b->ims[idx].strip);
+		free(b->ims[idx].line);
+		free(b->ims[idx].tileOffsets);
+	}
+	free(b->ims);
+
+	if(b->imageFile) fclose(b->imageFile);
+	TCBuilderRemoveImageFile(b);
+	tcCloseArchive(b);
+#ifdef LIBJPEG
+	if(b->src_mgr) {
+		tcStreamChunksRelease(b);
+		if(b->src_mgr->cinfo.src) jpeg_destroy_decompress(&b->src_mgr->cinfo);
+		free(b->src_mgr);
+	}
+	free(b->preview);
+	pthread_mutex_destroy(&b->previewLock);
+#endif
+	free(b->tempDir);
+	free(b);
+}
+
+#pragma mark State
+
+bool TCBuilderFailed(TCBuilderRef b)
+{
+	return b->failed;
+}
+
+void TCBuilderSetFailed(TCBuilderRef b)
+{
+	b->failed = true;
+}
+
+int TCBuilderGetOrientation(TCBuilderRef b)
+{
+	return b->orientation;
+}
+
+void TCBuilderSetOrientation(TCBuilderRef b, int orientation)
+{
+	assert(!b->zoomLevels);		// too late, geometry already depends on it
+	b->orientation = orientation;
+}
+
+size_t TCBuilderGetZoomLevels(TCBuilderRef b)
+{
+	return b->zoomLevels;
+}
+
+void TCBuilderGetImageSize(TCBuilderRef b, size_t *width, size_t *height)
+{
+	size_t w = b->zoomLevels ? b->ims[0].map.width : 0;
+	size_t h = b->zoomLevels ? b->ims[0].map.height : 0;
+
+	switch(b->orientation) {
+	case 5:
+	case 6:
+	case 7:
+	case 8:
+		*width = h;
+		*height = w;
+		break;
+	default:
+		*width = w;
+		*height = h;
+		break;
+	}
+}
+
+void TCBuilderGetLevelTiles(TCBuilderRef b, size_t level, size_t *cols, size_t *rows)
+{
+	assert(level < b->zoomLevels);
+	*cols = b->ims[level].cols;
+	*rows = b->ims[level].rows;
+}
+
+int64_t TCBuilderGetUbcThreshold(TCBuilderRef b)
+{
+	return b->ubc_threshold;
+}
+
+void TCBuilderSetUbcThreshold(TCBuilderRef b, int64_t threshold)
+{
+	b->ubc_threshold = threshold;
+}
+
+void TCBuilderLowMemory(TCBuilderRef b)
+{
+	b->ubc_threshold = (int64_t)((double)b->ubc_threshold * tcUbcThresholdRatio());
+	TCTileCacheLowMemory();
+	TCFreeMemory("Yikes!");
+}
+
+#pragma mark Levels
+
+size_t tcZoomLevelsForSize(TCBuilderRef b, size_t width, size_t height)
+{
+	if(b->options.zoomLevels) return b->options.zoomLevels;
+
+	double w = (double)width;
+	double h = (double)height;
+	size_t zLevels = 1;	// Must always have "1"
+	while(true) {
+		w /= 2.0;
+		h /= 2.0;
+		// We don't want to define levels that could only be magnified when viewed, not reduced.
+		if(h < (double)b->options.height || w < (double)b->options.width) break;
+		++zLevels;
+	}
+	LOG("ZLEVELS=%zu", zLevels);
+	return zLevels;
+}
+
+bool tcAllocLevels(TCBuilderRef b, size_t width, size_t height)
+{
+	assert(!b->ims);
+	b->zoomLevels = tcZoomLevelsForSize(b, width, height);
+	b->ims = calloc(b->zoomLevels, sizeof(imageMemory));
+	if(!b->ims) {
+		b->zoomLevels = 0;
+		b->failed = true;
+	}
+	return !b->failed;
+}
+
+void tcMapMemoryForIndex(TCBuilderRef b, size_t idx, size_t w, size_t h)
+{
+	// Don't start dirtying another level til memory pressure has dropped
+	tcWritebackAdmit(b);
+	imageMemory *imsP = &b->ims[idx];
+
+	imsP->map.width = w;
+	imsP->map.height = h;
+
+	imsP->index = idx;
+	imsP->rows = calcDimension(imsP->map.height)/tileDimension;
+	imsP->cols = calcDimension(imsP->map.width)/tileDimension;
+
+	tcMapMemory(b, &imsP->map);
+
+	bool colOffset = false;
+	bool rowOffset = false;
+	switch(b->orientation) {
+	case 0:
+	case 1:
+	case 5:
+		break;
+	case 2:
+	case 8:
+		colOffset = true;
+		break;
+	case 3:
+	case 7:
+		colOffset = true;
+		rowOffset = true;
+		break;
+	case 4:
+	case 6:
+		rowOffset = true;
+		break;
+	}
+	if(colOffset) {
+		imsP->map.col0offset = imsP->map.bytesPerRow - imsP->map.width*bytesPerPixel;
+	}
+	if(rowOffset) {
+		imsP->map.row0offset = imsP->rows * tileDimension - imsP->map.height;
+		// LOG("ROW OFFSET = %ld", imsP->map.row0offset);
+	}
+	if(b->orientation >= 5 && b->orientation <= 8) imsP->rotated = true;
+}
+
+static void tcMapMemory(TCBuilderRef b, mapper *mapP)
+{
+	mapP->bytesPerRow = calcBytesPerRow(mapP->width);
+	// levels that are not mapped whole are streamed, and written as tiles from the start (TilingCore+JPEG.c)
+	mapP->emptyTileRowSize = b->mapWholeFile ? mapP->bytesPerRow * tileDimension : 0;
+	mapP->mappedSize = mapP->bytesPerRow * calcDimension(mapP->height) + mapP->emptyTileRowSize;
+
+	//dumpMapper("Yikes!", mapP);
+
+	if(mapP->fd <= 0) {
+		mapP->fd = tcCreateTempFile(b, true, mapP->mappedSize, NULL);
+		if(mapP->fd == -1) return;
+	}
+
+	if(b->mapWholeFile && !mapP->emptyAddr) {
+		mapP->emptyAddr = mmap(NULL, mapP->mappedSize, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED | MAP_NOCACHE, mapP->fd, 0);
+		mapP->addr = mapP->emptyAddr + mapP->emptyTileRowSize;
+		if(mapP->emptyAddr == MAP_FAILED) {
+			b->failed = true;
+			LOG("FAILED to allocate %zu bytes - errno3=%s", mapP->mappedSize, strerror(errno) );
+			mapP->emptyAddr = NULL;
+			mapP->addr = NULL;
+			mapP->mappedSize = 0;
+		}
+#if MMAP_DEBUGGING == 1
+		LOG("MMAP[%d]: addr=%p 0x%zX bytes", mapP->fd, mapP->emptyAddr, mapP->mappedSize);
+#endif
+	}
+}
+
+#pragma mark Caller Supplied Raster
+
+unsigned char *TCBuilderBeginImage(TCBuilderRef b, size_t width, size_t height, size_t *bytesPerRow)
+{
+	if(b->failed) return NULL;
+	tcBuildAdmit(b);		// held until TCBuilderFinishImage
+	if(!tcAllocLevels(b, width, height)) {
+		tcBuildRetire(b);
+		return NULL;
+	}
+
+	b->mapWholeFile = true;
+	tcMapMemoryForIndex(b, 0, width, height);
+	if(b->failed) {
+		tcBuildRetire(b);
+		return NULL;
+	}
+
+	mapper *map = &b->ims[0].map;
+	assert(map->addr);
+	madvise(map->addr, map->mappedSize-map->emptyTileRowSize, MADV_SEQUENTIAL);
+
+	*bytesPerRow = map->bytesPerRow;
+	return map->addr + map->col0offset + map->row0offset*map->bytesPerRow;
+}
+
+bool TCBuilderFinishImage(TCBuilderRef b)
+{
+	if(!b->failed) {
+		mapper *map = &b->ims[0].map;
+		tcAdviseFree(map->addr, map->mappedSize-map->emptyTileRowSize);
+		tcCreateLevelsAndTile(b);
+	}
+	tcBuildRetire(b);
+	return !b->failed;
+}
+
+#pragma mark Staged Image Data
+
+bool TCBuilderCreateImageFile(TCBuilderRef b)
+{
+	assert(!b->imageFile);
+	b->mapWholeFile = true;
+
+	int fd = tcCreateTempFile(b, false, 0, &b->imagePath);
+	if(fd == -1) {
+		b->failed = true;
+	} else
+	if ((b->imageFile = fdopen(fd, "r+")) == NULL) {
+		LOG("Error: failed to fdopen image file \"%s\" for \"r+\" (%d).", b->imagePath, errno);
+		close(fd);
+		b->failed = true;
+	}
+	return !b->failed;
+}
+
+bool TCBuilderAppendImageData(TCBuilderRef b, const void *data, size_t len)
+{
+	if(!b->failed && len) {	// got a zero byte data object!
+		size_t ret = fwrite(data, len, 1, b->imageFile);
+		assert(ret == 1);
+		if(ret != 1) b->failed = true;
+	}
+	return !b->failed;
+}
+
+// Segmented downloads: each range goes straight to its place, the file is complete once they all are. Ranges come in
+// on several threads at once, so a failure is kept aside until TCBuilderCloseImageFile.
+bool TCBuilderWriteImageData(TCBuilderRef b, off_t offset, const void *data, size_t len)
+{
+	if(atomic_load(&b->imageWriteFailed)) return false;
+	if(!tcWriteAll(fileno(b->imageFile), data, len, offset)) {
+		LOG("Error: failed to write %zu bytes at %lld to the image file.", len, (long long)offset);
+		atomic_store(&b->imageWriteFailed, true);
+		return false;
+	}
+	return true;
+}
+
+const char *TCBuilderCloseImageFile(TCBuilderRef b)
+{
+	if(b->imageFile) {
+		if(fclose(b->imageFile) || atomic_load(&b->imageWriteFailed)) b->failed = true;
+		b->imageFile = NULL;
+	}
+	return b->imagePath;
+}
+
+void TCBuilderRemoveImageFile(TCBuilderRef b)
+{
+	if(b->imagePath) {
+		unlink(b->imagePath);
+		free(b->imagePath);
+		b->imagePath = NULL;
+	}
+}
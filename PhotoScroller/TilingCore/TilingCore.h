@@ -0,0 +1,270 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * TilingCore is the decode / pyramid / tile engine that used to live inside the TiledImageBuilder
+ * categories. It is plain C (no UIKit, Foundation or CoreGraphics), so it builds on iOS as part
+ * of the app and on Linux as a static library (see the Makefile in this folder) for server side
+ * ingest and profiling.
+ *
+ * A builder owns one image: a set of "zoomLevels" files, each holding one level of the pyramid
+ * rearranged into TC_TILE_SIZE square tiles of 32 bit BGRA pixels. Level 0 is full size, each
+ * following level is half the size of the one before it.
+ *
+ * Images get into a builder one of three ways:
+ *   - a caller supplied raster: TCBuilderBeginImage() returns memory to draw into, then TCBuilderFinishImage()
+ *   - JPEG (needs LIBJPEG): a whole buffer, a file read a tile row at a time, or a stream fed as it downloads
+ *   - a file staged with TCBuilderAppendImageData(), which is then decoded by one of the above
+ * A finished builder can be saved to an archive, and TCBuilderOpenArchive() brings it back ready to draw.
+ *
+ * All functions return false (or 0/NULL) on failure, and the builder's failed flag is set.
+ */
+
+#ifndef TILING_CORE_H
+#define TILING_CORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TC_TILE_SIZE		256		// could make larger or smaller, but power of 2
+#define TC_BYTES_PER_PIXEL	4		// BGRA, alpha is unused (kCGImageAlphaNoneSkipFirst | kCGBitmapByteOrder32Little)
+
+#define TC_PRIORITY_LOW		-1		// builders waiting for a build slot, and the jobs they queue, go highest first
+#define TC_PRIORITY_NORMAL	0
+#define TC_PRIORITY_HIGH	1
+
+typedef struct TCBuilder *TCBuilderRef;
+
+typedef struct {
+	size_t		width;				// smallest dimension used to display the image, see note 1 in TiledImageBuilder.h
+	size_t		height;
+	size_t		zoomLevels;			// if non-zero, use this many levels and ignore width and height
+	int			orientation;		// 0 == use the EXIF orientation in the image (JPEG only), or force one of 1-8
+	const char	*tempDir;			// where level files go, NULL == $TMPDIR or /tmp
+	bool		dctScaling;			// JPEG data and file decodes, and progressive streams: build the 1/2, 1/4 and 1/8 levels from the DCT coefficients
+	size_t		decodeThreads;		// JPEG data and file decodes: split images with restart markers across this many threads, 0 or 1 == don't
+	int			tileQuality;		// 0 == raw BGRA tiles, 1-100 == once a level is built, keep its tiles as JPEGs of this quality (needs LIBJPEG)
+	size_t		levelThreads;		// whole image decodes: make and tile the zoom levels on this many threads, 0 == one per core
+	int			priority;			// TC_PRIORITY_NORMAL (0), _HIGH or _LOW, see TCBuilderSetPriority
+} TCBuilderOptions;
+
+// What one tile looks like on disk. Filled in by TCBuilderGetTile, safe to copy until TCTileGetBytesAtPosition is called.
+typedef struct {
+	int			fd;					// level file
+	off_t		offset;				// of the tile in the level file, or of its JPEG
+	size_t		width;				// pixels
+	size_t		height;				// rows
+	size_t		bytesPerRow;		// always TC_TILE_SIZE * TC_BYTES_PER_PIXEL
+	const unsigned char *addr;		// non-NULL when the tile is already mapped (reopened archives)
+	size_t		length;				// bytes stored, less than a whole tile when it is a JPEG (see TCBuilderOptions.tileQuality)
+	size_t		skip;				// from the start of the tile to the first pixel, orientations other than 1 push the image right and down
+
+	// the tile cache: key, and the whole tile once it has been read (or decoded). TCTileRelease lets go of it
+	uint64_t	builderId;
+	size_t		level;
+	size_t		col;
+	size_t		row;
+	bool		shared;				// finished levels go through the cache, others are read straight from the file
+	const unsigned char *pixels;
+	struct tcCacheEntry *entry;
+} TCTile;
+
+// One tile of a batch, see TCBuilderReadTiles
+typedef struct {
+	size_t		level;
+	size_t		col;				// as stored, like TCBuilderGetTile
+	size_t		row;
+	unsigned char *pixels;			// TC_TILE_SIZE * TC_TILE_SIZE * TC_BYTES_PER_PIXEL bytes: the whole tile, decoded if it is a JPEG
+	bool		done;
+} TCTileRequest;
+
+typedef enum {
+	TCTileReaderDefault = 0,		// the best there is here
+	TCTileReaderSingle,				// a pread per tile, the way drawing reads them
+	TCTileReaderVector,				// neighbouring tiles in one preadv
+	TCTileReaderThreads,			// those spread over threads
+	TCTileReaderRing,				// those through io_uring (Linux), else Threads
+} TCTileReader;
+
+// What the tile cache is doing, see TCTileCacheGetStats
+typedef struct {
+	size_t		budget;				// bytes, from free memory and TCSetTileCacheRatio
+	size_t		bytes;				// tiles held now
+	uint64_t	hits;
+	uint64_t	misses;				// tiles read (and decoded) from level files
+	uint64_t	joins;				// requests that waited for another thread already reading the same tile
+	uint64_t	prefetches;			// tiles read ahead of drawing, see TCBuilderPrefetch
+	uint64_t	evictions;
+} TCTileCacheStats;
+
+// What a builder's level files are costing the disk, see TCBuilderGetWritebackStats
+typedef struct {
+	uint64_t	written;			// bytes of finished level file handed to writeback
+	uint64_t	inFlight;			// of those, not known to be on disk yet
+	uint64_t	stalls;				// times the build waited for the disk to catch up
+	uint64_t	stallNanos;			// and how long, all told
+} TCWritebackStats;
+
+// A tile in memory, ready to draw from. See TCBuilderGetTileView.
+typedef struct {
+	const unsigned char *bytes;		// the tile's first pixel, rows are bytesPerRow apart
+	size_t		width;				// pixels
+	size_t		height;				// rows
+	size_t		bytesPerRow;		// always TC_TILE_SIZE * TC_BYTES_PER_PIXEL
+	size_t		length;				// bytesPerRow * (height-1) + width * TC_BYTES_PER_PIXEL, all of it that may be read
+} TCTileView;
+
+// Zero copy JPEG streams: what the chunks handed to TCBuilderAppendJPEGStreamChunk (or Queue) are holding, see TCBuilderGetStreamStats
+typedef struct {
+	size_t		buffered;			// bytes of chunks not yet released
+	size_t		peakBuffered;
+	uint64_t	received;			// bytes, all chunks
+	uint64_t	chunks;
+} TCStreamStats;
+
+// Threaded JPEG streams: what TCBuilderQueueJPEGStreamChunk did with a chunk
+typedef enum {
+	TCStreamQueued = 0,				// keep them coming
+	TCStreamFull,					// queued, but stop reading until resume(context) is called
+	TCStreamDone,					// the decode is over (finished or failed), the chunk was let go - call TCBuilderEndJPEGStream
+} TCStreamQueueResult;
+
+// Progressive JPEG streams: the image so far, refreshed after every scan. Filled in by TCBuilderGetPreview.
+typedef struct {
+	size_t		scans;				// that went into it
+	size_t		width;				// of the level it stands in for
+	size_t		height;
+	size_t		bytesPerRow;
+	const unsigned char *pixels;	// BGRA as stored, like tiles. Valid until the next TCBuilderAdvanceJPEGStream call, or TCBuilderUnlockPreview
+} TCPreview;
+
+// Values of interest when probing the system
+typedef struct {
+	size_t		freeMemory;
+	size_t		usedMemory;
+	size_t		totlMemory;
+	size_t		resident_size;
+	size_t		virtual_size;
+} TCMemoryInfo;
+
+// Lifecycle
+TCBuilderRef	TCBuilderCreate(const TCBuilderOptions *options);
+void			TCBuilderRelease(TCBuilderRef builder);
+
+// State
+bool			TCBuilderFailed(TCBuilderRef builder);
+void			TCBuilderSetFailed(TCBuilderRef builder);
+int				TCBuilderGetOrientation(TCBuilderRef builder);
+void			TCBuilderSetOrientation(TCBuilderRef builder, int orientation);	// before any image data is supplied
+size_t			TCBuilderGetZoomLevels(TCBuilderRef builder);						// 0 until the image dimensions are known
+void			TCBuilderGetImageSize(TCBuilderRef builder, size_t *width, size_t *height);	// after orientation is applied
+void			TCBuilderGetLevelTiles(TCBuilderRef builder, size_t level, size_t *cols, size_t *rows);
+
+// Memory pressure: finished parts of level files go to disk as they are done, and a builder waits for the disk once the
+// bytes it still has being written exceed its threshold, or it is writing faster than the disk has been keeping up
+void			TCSetUbcThreshold(float ratio);				// default is 0.5 - Image disk cache can use half of the available free memory pool
+int64_t			TCBuilderGetUbcThreshold(TCBuilderRef builder);
+void			TCBuilderSetUbcThreshold(TCBuilderRef builder, int64_t threshold);
+void			TCBuilderLowMemory(TCBuilderRef builder);		// call when the OS complains, also empties the tile cache
+void			TCBuilderGetWritebackStats(TCBuilderRef builder, TCWritebackStats *stats);
+void			TCSetWritebackRate(double bytesPerSecond);		// default 0 == as fast as the disk has been writing, else no faster (a slow disk, say)
+
+// Caller supplied raster. Returns where pixel (0,0) goes, rows are *bytesPerRow apart.
+unsigned char	*TCBuilderBeginImage(TCBuilderRef builder, size_t width, size_t height, size_t *bytesPerRow);
+bool			TCBuilderFinishImage(TCBuilderRef builder);	// downsample and tile all levels
+
+// Staging a download (or any byte source) in a temporary file
+bool			TCBuilderCreateImageFile(TCBuilderRef builder);
+bool			TCBuilderAppendImageData(TCBuilderRef builder, const void *data, size_t len);
+bool			TCBuilderWriteImageData(TCBuilderRef builder, off_t offset, const void *data, size_t len);	// or pieces in any order, from any thread, failures show once closed
+const char		*TCBuilderCloseImageFile(TCBuilderRef builder);	// returns the path, valid until TCBuilderRemoveImageFile
+void			TCBuilderRemoveImageFile(TCBuilderRef builder);
+
+#ifdef LIBJPEG
+bool			TCBuilderDecodeJPEGData(TCBuilderRef builder, const void *data, size_t len);	// whole image in memory
+bool			TCBuilderDecodeJPEGFile(TCBuilderRef builder, const char *path);				// read and tiled a tile row at a time
+bool			TCBuilderBeginJPEGStream(TCBuilderRef builder);
+bool			TCBuilderAdvanceJPEGStream(TCBuilderRef builder, const void *data, size_t len);	// YES when all of data was consumed
+// Or, instead of TCBuilderAdvanceJPEGStream: chunks as they arrive, never copied. Each is decoded where it is and released (release(context))
+// once libjpeg can't back up into it any more - or when the builder is. Returns false once the stream has failed.
+bool			TCBuilderAppendJPEGStreamChunk(TCBuilderRef builder, const void *bytes, size_t len, void (*release)(void *context), void *context);
+// Or decoded on a thread of its own, so the network never waits on libjpeg: start it after TCBuilderBeginJPEGStream and queue the
+// chunks, which are released as above. Once capacity bytes (0 == 1 MB) are held the network should pause. End waits for the decode,
+// cancel gives up on it. Returns true if the image was completely tiled.
+bool			TCBuilderStartJPEGStreamThread(TCBuilderRef builder, size_t capacity, void (*resume)(void *context), void *context);
+TCStreamQueueResult TCBuilderQueueJPEGStreamChunk(TCBuilderRef builder, const void *bytes, size_t len, void (*release)(void *context), void *context);
+bool			TCBuilderEndJPEGStream(TCBuilderRef builder, bool cancel);
+void			TCBuilderGetStreamStats(TCBuilderRef builder, TCStreamStats *stats);
+bool			TCBuilderGetPreview(TCBuilderRef builder, size_t level, TCPreview *preview);		// level 3 (1/8 size, or the last one) and smaller, until the stream is complete
+void			TCBuilderLockPreview(TCBuilderRef builder);		// threaded streams refresh the preview on the decode thread: hold it from
+void			TCBuilderUnlockPreview(TCBuilderRef builder);	// TCBuilderGetPreview until done with the pixels
+#endif
+
+// Archives: a finished pyramid in one file, so a saved image can be shown again without downloading or decoding.
+// Saving is atomic (temporary file, sync, rename). Opening maps the file and reads only the header and index.
+bool			TCBuilderSaveArchive(TCBuilderRef builder, const char *path);		// the image must be completely tiled
+TCBuilderRef	TCBuilderOpenArchive(const char *path);							// NULL if missing, truncated or another version
+
+// Tiles, using column and row as stored (see translateTileForScale: in TiledImageBuilder+Draw.m)
+bool			TCBuilderGetTile(TCBuilderRef builder, size_t level, size_t col, size_t row, TCTile *tile);
+size_t			TCTileGetBytesAtPosition(TCTile *tile, void *buffer, off_t position, size_t count);
+void			TCTileRelease(TCTile *tile);												// its hold on the tile cache, not the TCTile itself
+
+// Tile views: read only, reference counted, straight onto the tile cache or a mapping - no copy of the pixels, and from
+// the tile cache no allocation either. Usable after the builder is released.
+TCTileView		*TCBuilderGetTileView(TCBuilderRef builder, size_t level, size_t col, size_t row);	// NULL on failure, else hold one reference
+TCTileView		*TCTileViewRetain(TCTileView *view);
+void			TCTileViewRelease(TCTileView *view);
+
+// Tile cache: whole tiles of finished levels, shared by all builders, least recently used go first
+void			TCSetTileCacheRatio(float ratio);			// default is 0.25 - decoded tiles can use a quarter of the available free memory, 0 == no cache
+void			TCTileCacheLowMemory(void);					// drop every tile not being drawn
+void			TCTileCacheGetStats(TCTileCacheStats *stats);
+
+// Batched reads: whole tiles into the callers' buffers, tiles next to each other on disk are read together.
+// Returns how many are done. queueDepth is how many reads are in flight or threads working, default 8.
+size_t			TCBuilderReadTiles(TCBuilderRef builder, TCTileRequest *requests, size_t count, TCTileReader reader);
+void			TCSetTileReadDepth(size_t depth);
+
+// Prefetch: given the tiles on screen (columns col0...col1, rows row0...row1 of a level, as stored), background threads read
+// the ring around them and the tiles covering them one level coarser and finer into the tile cache. Each request replaces what
+// is still queued from the last one for that builder. Finished images only. Returns how many tiles were queued.
+size_t			TCBuilderPrefetch(TCBuilderRef builder, size_t level, size_t col0, size_t row0, size_t col1, size_t row1);
+void			TCBuilderCancelPrefetch(TCBuilderRef builder);
+void			TCSetPrefetchDepth(size_t depth);			// default is 32 tiles queued for all builders together, 0 == no prefetching
+
+// Scheduling: whole image decodes share the cores and memory. Each takes a build slot first, there are as many as cores,
+// fewer when free memory is short. Waiting builders go by priority, then first come first served. The work they split
+// up runs on one pool of threads, higher priority jobs first. Priorities can change at any time, say as pages scroll.
+void			TCBuilderSetPriority(TCBuilderRef builder, int priority);
+void			TCSetBuildConcurrency(size_t builds);		// default 0 == from cores and free memory
+size_t			TCGetBuildConcurrency(void);				// the slots there are right now
+
+// Utilities
+uint64_t		TCTimeStamp(void);										// nanoseconds, monotonic
+uint32_t		TCDeltaMilliSeconds(uint64_t then, uint64_t now);
+TCMemoryInfo	TCFreeMemory(const char *msg);						// msg NULL == don't log
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TILING_CORE_H
@@ -0,0 +1,1088 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ * This file is part of PhotoScrollerNetwork -- An iOS project that smoothly and efficiently
+ * renders large images in progressively smaller ones for display in a CATiledLayer backed view.
+ * Images can either be local, or more interestingly, downloaded from the internet.
+ * Images can be rendered by an iOS CGImageSource, libjpeg-turbo, or incrmentally by
+ * libjpeg (the turbo version) - the latter gives the best speed.
+ *
+ * Parts taken with minor changes from Apple's PhotoScroller sample code, the
+ * ConcurrentOp from my ConcurrentOperations github sample code, and TiledImageBuilder
+ * was completely original source code developed by me.
+ *
+ * Copyright 2012-2019 David Hoerl All Rights Reserved.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * tcbench - measurements of the tiling core on real images, for Linux and command line macOS. Build with "make bench".
+ *
+ *   tcbench reads <jpeg> [tileQuality [WxH [cold]]]
+ *		Reads every WxH tile viewport of level 0 (default 4x4), as one batch each, with each TCTileReader and the
+ *		way drawing reads a tile (TCTileGetBytesAtPosition, tile cache off). "cold" drops the level files from the
+ *		page cache before each pass (Linux).
+ *
+ *   tcbench ingest <corpus dir> [maxMP [mode,...]]
+ *		Generates (once, it is deterministic) a corpus of JPEGs in the directory: 1 MP up to maxMP (default 16, at most
+ *		200), each at 4:4:4, 4:2:2 and 4:2:0, baseline and progressive, with and without restart markers - and a 1 MP
+ *		one in each EXIF orientation. Each goes through the full pyramid build the way PhotoScroller does it for each
+ *		ImageDecoder mode ("turbo" == libjpegTurboDecoder, "incremental" == libjpegIncremental; CGImageSource is iOS
+ *		only). Prints JSON: wall time, CPU time, peak RSS and bytes written for each stage - staging the download,
+ *		building the pyramid, saving the archive.
+ *
+ *   tcbench serve <jpeg> [threads,... [trace ...]]
+ *		Replays tile requests the way CATiledLayer makes them - a tile view per tile, its bytes copied out as CG does
+ *		through PhotoScrollerProviderGetBytesAtPosition - on 1, 2, 4 and 8 threads (or the ones given). The requests are
+ *		synthetic pans, zoom-ins and random jumps with a 5x4 tile screen, and the trace files given: logs of real
+ *		sessions made with TRACE_TILES in TiledImageBuilder-Private.h, or anything with "tile <level> <col> <row>" lines.
+ *		Each goes against the level files read with pread (TCTileGetBytesAtPosition) and mapped (tile views), the tile
+ *		cache, and a reopened archive, with the page cache cold and warm. Prints p50/p99/p99.9 latency and tiles/second.
+ *
+ *   tcbench writeback <jpeg> [thresholdMB [rateMB/s]]
+ *		Memory pressure: builds the image with a small writeback threshold (default 4 MB) on a disk held to a slow rate
+ *		(default 32 MB/s, TCSetWritebackRate), sending TCBuilderLowMemory and TCTileCacheLowMemory while it runs.
+ *		Checks the build stalled, the bytes in flight never passed the threshold by more than the range being handed
+ *		over, and the tiles are the same as those of an unthrottled build.
+ *
+ *   tcbench stream <corpus dir> [levels,...]
+ *		Streams a 4 MP progressive JPEG (made in the directory, once) with 4, 5, 6 and 7 zoom levels (or the ones given), with
+ *		and without DCT scaling, each way a download can hand it over: TCBuilderAdvanceJPEGStream, TCBuilderAppendJPEGStreamChunk
+ *		and the decode thread. Checks every preview level after each chunk is the right size, and the tiles are the same as
+ *		those of a whole image decode. "make check" runs it.
+ */
+
+#include "TilingCore.h"
+
+#ifndef LIBJPEG
+#error tcbench decodes JPEGs, build it with LIBJPEG=1
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+
+#define TILE_BYTES		(TC_TILE_SIZE * TC_TILE_SIZE * TC_BYTES_PER_PIXEL)
+
+static int readsCommand(int argc, char **argv);
+static int ingestCommand(int argc, char **argv);
+static int serveCommand(int argc, char **argv);
+static int writebackCommand(int argc, char **argv);
+static int streamCommand(int argc, char **argv);
+
+static const struct {
+	const char	*name;
+	int			(*run)(int argc, char **argv);
+	const char	*usage;
+} commands[] = {
+	{ "reads", readsCommand, "<jpeg> [tileQuality [WxH [cold]]]" },
+	{ "ingest", ingestCommand, "<corpus dir> [maxMP [turbo,incremental]]" },
+	{ "serve", serveCommand, "<jpeg> [threads,... [trace ...]]" },
+	{ "writeback", writebackCommand, "<jpeg> [thresholdMB [rateMB/s]]" },
+	{ "stream", streamCommand, "<corpus dir> [levels,...]" },
+};
+
+int main(int argc, char **argv)
+{
+	for(size_t i=0; argc > 1 && i<sizeof(commands)/sizeof(commands[0]); ++i) {
+		if(!strcmp(argv[1], commands[i].name)) return commands[i].run(argc-2, argv+2);
+	}
+	for(size_t i=0; i<sizeof(commands)/sizeof(commands[0]); ++i) {
+		fprintf(stderr, "%s tcbench %s %s\n", i ? "      " : "usage:", commands[i].name, commands[i].usage);
+	}
+	return 2;
+}
+
+#pragma mark Helpers
+
+static TCBuilderRef buildJPEG(const char *path, int tileQuality)
+{
+	TCBuilderOptions options = { 0, 0, 0, 0, NULL, false, 0, tileQuality, 0, TC_PRIORITY_NORMAL };
+	options.zoomLevels = 4;
+	TCBuilderRef b = TCBuilderCreate(&options);
+	if(!b || !TCBuilderDecodeJPEGFile(b, path) || TCBuilderFailed(b)) {
+		fprintf(stderr, "cannot decode %s\n", path);
+		TCBuilderRelease(b);
+		return NULL;
+	}
+	return b;
+}
+
+// Linux keeps clean pages of the level files around, this makes the next pass read from the disk
+static void dropPageCache(TCBuilderRef b)
+{
+#ifdef __linux__
+	for(size_t level=0; level<TCBuilderGetZoomLevels(b); ++level) {
+		TCTile tile;
+		if(!TCBuilderGetTile(b, level, 0, 0, &tile)) continue;
+		fdatasync(tile.fd);
+		posix_fadvise(tile.fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+#else
+	(void)b;
+#endif
+}
+
+#pragma mark Reads
+
+static const char *readerNames[] = { "default", "single", "vector", "threads", "ring" };
+
+static int readsCommand(int argc, char **argv)
+{
+	if(argc < 1) return 2;
+	int quality = argc > 1 ? atoi(argv[1]) : 0;
+	size_t w = 4, h = 4;
+	if(argc > 2 && sscanf(argv[2], "%zux%zu", &w, &h) != 2) return 2;
+	bool cold = argc > 3 && !strcmp(argv[3], "cold");
+
+	TCBuilderRef b = buildJPEG(argv[0], quality);
+	if(!b) return 1;
+	TCSetTileCacheRatio(0);		// every pass reads from the files
+
+	size_t cols, rows;
+	TCBuilderGetLevelTiles(b, 0, &cols, &rows);
+	if(w > cols) w = cols;
+	if(h > rows) h = rows;
+	size_t batches = (cols-w+1) * (rows-h+1);
+	size_t perBatch = w*h;
+
+	TCTileRequest *requests = calloc(perBatch, sizeof(TCTileRequest));
+	unsigned char *pixels = malloc(perBatch * TILE_BYTES);
+	unsigned char *check = malloc(perBatch * TILE_BYTES);
+	if(!requests || !pixels || !check) return 1;
+	for(size_t i=0; i<perBatch; ++i) requests[i].pixels = pixels + i*TILE_BYTES;
+
+	printf("%s: level 0 %zux%zu tiles, tileQuality %d, %zu batches of %zux%zu, %s\n", argv[0], cols, rows, quality, batches, w, h, cold ? "cold" : "warm");
+
+	// drawing, for the baseline: TCBuilderGetTile and a TCTileGetBytesAtPosition per tile
+	dropPageCache(b);
+	uint64_t start = TCTimeStamp();
+	for(size_t r=0; r+h<=rows; ++r) {
+		for(size_t c=0; c+w<=cols; ++c) {
+			for(size_t i=0; i<perBatch; ++i) {
+				TCTile tile;
+				if(!TCBuilderGetTile(b, 0, c + i%w, r + i/w, &tile)) continue;
+				TCTileGetBytesAtPosition(&tile, check + i*TILE_BYTES, 0, tile.bytesPerRow * tile.height);
+				TCTileRelease(&tile);
+			}
+		}
+	}
+	uint64_t ns = TCTimeStamp() - start;
+	double mb = (double)(batches * perBatch * TILE_BYTES) / (1024.0*1024.0);
+	printf("  %-8s %8.1f ms %8.1f us/batch %8.0f MB/s\n", "draw", ns/1e6, ns/1e3/batches, mb / (ns/1e9));
+
+	int status = 0;
+	for(TCTileReader reader = TCTileReaderSingle; reader <= TCTileReaderRing; ++reader) {
+		dropPageCache(b);
+		size_t done = 0;
+		start = TCTimeStamp();
+		for(size_t r=0; r+h<=rows; ++r) {
+			for(size_t c=0; c+w<=cols; ++c) {
+				for(size_t i=0; i<perBatch; ++i) {
+					requests[i].level = 0;
+					requests[i].col = c + i%w;
+					requests[i].row = r + i/w;
+				}
+				done += TCBuilderReadTiles(b, requests, perBatch, reader);
+			}
+		}
+		ns = TCTimeStamp() - start;
+
+		// the last batch against a tile at a time
+		bool same = true;
+		for(size_t i=0; i<perBatch; ++i) {
+			TCTileRequest one = requests[i];
+			one.pixels = check;
+			same &= TCBuilderReadTiles(b, &one, 1, TCTileReaderSingle) == 1 && !memcmp(check, requests[i].pixels, TILE_BYTES);
+		}
+		printf("  %-8s %8.1f ms %8.1f us/batch %8.0f MB/s  %s\n", readerNames[reader], ns/1e6, ns/1e3/batches, mb / (ns/1e9),
+			done == batches*perBatch && same ? "ok" : "MISMATCH");
+		if(done != batches*perBatch || !same) status = 1;
+	}
+
+	free(requests);
+	free(pixels);
+	free(check);
+	TCBuilderRelease(b);
+	return status;
+}
+
+#pragma mark Ingest
+
+#define CORPUS_MP_MAX	200
+#define CHUNK_SIZE		(64*1024)		// what a download hands over at a time
+#define RESTART_ROWS	1				// restart markers every MCU row, as cameras write them
+
+typedef struct {
+	double		megapixels;
+	size_t		width;
+	size_t		height;
+	int			hSamp, vSamp;			// of luma: 1x1 == 4:4:4, 2x1 == 4:2:2, 2x2 == 4:2:0
+	bool		progressive;
+	bool		restart;
+	int			orientation;
+	char		path[1024];
+} corpusImage;
+
+typedef struct {
+	uint64_t	wallNanos;
+	uint64_t	cpuNanos;
+	long		peakRssKB;
+	uint64_t	bytesWritten;
+} stageStats;
+
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	resumed;
+	bool			paused;
+} streamPacer;
+
+static const char *samplingName(const corpusImage *im)
+{
+	return im->hSamp == 1 ? "4:4:4" : im->vSamp == 1 ? "4:2:2" : "4:2:0";
+}
+
+// Something like a photo as far as the encoder is concerned: smooth gradients, edges, and some grain
+static void corpusRow(unsigned char *row, size_t width, size_t y, size_t height)
+{
+	for(size_t x=0; x<width; ++x) {
+		uint32_t h = (uint32_t)(x * 73856093u) ^ (uint32_t)(y * 19349663u);
+		h ^= h >> 13; h *= 0x5bd1e995u; h ^= h >> 15;
+		int grain = (int)(h & 31) - 16;
+		int band = ((x / 97) + (y / 61)) & 1 ? 40 : 0;
+		int r = (int)(255 * x / width) + grain;
+		int g = (int)(255 * y / height) + band + grain / 2;
+		int b = 128 + (int)(100 * sin((double)(x + y) / 180.0)) + grain;
+		row[3*x+0] = (unsigned char)(r < 0 ? 0 : r > 255 ? 255 : r);
+		row[3*x+1] = (unsigned char)(g < 0 ? 0 : g > 255 ? 255 : g);
+		row[3*x+2] = (unsigned char)(b < 0 ? 0 : b > 255 ? 255 : b);
+	}
+}
+
+static bool writeCorpusImage(const corpusImage *im)
+{
+	struct stat st;
+	if(!stat(im->path, &st) && st.st_size > 0) return true;		// made last time
+
+	char tmp[1100];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", im->path);
+	FILE *f = fopen(tmp, "wb");
+	if(!f) {
+		fprintf(stderr, "cannot create %s: %s\n", tmp, strerror(errno));
+		return false;
+	}
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, f);
+	cinfo.image_width		= (JDIMENSION)im->width;
+	cinfo.image_height		= (JDIMENSION)im->height;
+	cinfo.input_components	= 3;
+	cinfo.in_color_space	= JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 90, TRUE);
+	cinfo.comp_info[0].h_samp_factor = im->hSamp;
+	cinfo.comp_info[0].v_samp_factor = im->vSamp;
+	if(im->restart) cinfo.restart_in_rows = RESTART_ROWS;
+	if(im->progressive) jpeg_simple_progression(&cinfo);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	// EXIF with only the orientation: "MM" TIFF header, one IFD entry (0x0112, SHORT)
+	const unsigned char exif[] = {
+		'E','x','i','f',0,0, 'M','M',0,42, 0,0,0,8, 0,1, 0x01,0x12, 0,3, 0,0,0,1, 0,(unsigned char)im->orientation,0,0, 0,0,0,0
+	};
+	jpeg_write_marker(&cinfo, JPEG_APP0+1, exif, sizeof(exif));
+
+	unsigned char *row = malloc(im->width * 3);
+	while(cinfo.next_scanline < cinfo.image_height) {
+		corpusRow(row, im->width, cinfo.next_scanline, im->height);
+		JSAMPROW rows[1] = { row };
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(row);
+
+	bool ok = !ferror(f);
+	ok &= !fclose(f);
+	ok = ok && !rename(tmp, im->path);
+	if(!ok) fprintf(stderr, "cannot write %s\n", im->path);
+	return ok;
+}
+
+static size_t makeCorpus(const char *dir, double maxMP, corpusImage **images)
+{
+	static const double sizes[] = { 1, 4, 16, 50, 100, 200 };
+	static const int samplings[][2] = { { 1, 1 }, { 2, 1 }, { 2, 2 } };
+
+	size_t count = 0;
+	*images = calloc(sizeof(sizes)/sizeof(sizes[0]) * 12 + 8, sizeof(corpusImage));
+	for(size_t s=0; s<sizeof(sizes)/sizeof(sizes[0]) && sizes[s] <= maxMP; ++s) {
+		for(int orientation=1; orientation<=8; ++orientation) {
+			for(size_t k=0; k<3; ++k) {
+				for(int variant=0; variant<4; ++variant) {
+					// every orientation once, on the smallest baseline 4:2:0 image
+					if(orientation > 1 && (s || k != 2 || variant)) continue;
+
+					corpusImage *im = &(*images)[count++];
+					im->megapixels	= sizes[s];
+					im->width		= (size_t)lrint(sqrt(sizes[s] * 1e6 * 4 / 3));			// 4:3
+					im->height		= (size_t)lrint(sizes[s] * 1e6 / (double)im->width);
+					im->hSamp		= samplings[k][0];
+					im->vSamp		= samplings[k][1];
+					im->progressive	= variant & 1;
+					im->restart		= variant & 2;
+					im->orientation	= orientation;
+					snprintf(im->path, sizeof(im->path), "%s/c%03.0fmp-%d%d-%s-%s-o%d.jpg", dir, sizes[s], im->hSamp, im->vSamp,
+						im->progressive ? "prog" : "base", im->restart ? "rst" : "norst", orientation);
+					fprintf(stderr, "corpus %s\n", im->path);
+					if(!writeCorpusImage(im)) {
+						free(*images);
+						return 0;
+					}
+				}
+			}
+		}
+	}
+	return count;
+}
+
+// Peak RSS is reset at the start of each stage (Linux: clear_refs), elsewhere it is the process' peak so far
+static void beginStage(stageStats *stage, uint64_t *wall, uint64_t *cpu)
+{
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if(f) {
+		fputs("5", f);
+		fclose(f);
+	}
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	*cpu = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull + (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+	*wall = TCTimeStamp();
+	memset(stage, 0, sizeof(*stage));
+}
+
+static void endStage(stageStats *stage, uint64_t wall, uint64_t cpu)
+{
+	stage->wallNanos = TCTimeStamp() - wall;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	stage->cpuNanos = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull + (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull - cpu;
+	stage->peakRssKB = ru.ru_maxrss;		// KB on Linux
+
+	FILE *f = fopen("/proc/self/status", "r");
+	if(f) {
+		char line[256];
+		while(fgets(line, sizeof(line), f)) {
+			if(!strncmp(line, "VmHWM:", 6)) stage->peakRssKB = atol(line + 6);
+		}
+		fclose(f);
+	}
+}
+
+static void noRelease(void *context)
+{
+	(void)context;
+}
+
+static void resumeStream(void *context)
+{
+	streamPacer *pacer = context;
+	pthread_mutex_lock(&pacer->lock);
+	pacer->paused = false;
+	pthread_cond_signal(&pacer->resumed);
+	pthread_mutex_unlock(&pacer->lock);
+}
+
+// libjpegIncremental: chunks go to the decode thread as they "arrive", the download pausing whenever it is told to
+static bool ingestIncremental(TCBuilderRef b, const unsigned char *jpeg, size_t len)
+{
+	streamPacer pacer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+	if(!TCBuilderBeginJPEGStream(b) || !TCBuilderStartJPEGStreamThread(b, 0, resumeStream, &pacer)) return false;
+
+	for(size_t offset=0; offset<len; offset += CHUNK_SIZE) {
+		size_t n = len - offset < CHUNK_SIZE ? len - offset : CHUNK_SIZE;
+		pthread_mutex_lock(&pacer.lock);
+		while(pacer.paused) pthread_cond_wait(&pacer.resumed, &pacer.lock);
+		pacer.paused = true;		// before queueing: a resume can come before this thread looks at what the queue said
+		pthread_mutex_unlock(&pacer.lock);
+
+		TCStreamQueueResult ret = TCBuilderQueueJPEGStreamChunk(b, jpeg + offset, n, noRelease, NULL);
+		if(ret != TCStreamFull) {
+			pthread_mutex_lock(&pacer.lock);
+			pacer.paused = false;
+			pthread_mutex_unlock(&pacer.lock);
+		}
+		if(ret == TCStreamDone) break;
+	}
+	bool ok = TCBuilderEndJPEGStream(b, false);
+	pthread_mutex_destroy(&pacer.lock);
+	pthread_cond_destroy(&pacer.resumed);
+	return ok;
+}
+
+static void printStage(const char *name, const stageStats *stage, bool last)
+{
+	printf("        \"%s\": { \"wallMs\": %.3f, \"cpuMs\": %.3f, \"peakRssKB\": %ld, \"bytesWritten\": %llu }%s\n", name,
+		stage->wallNanos / 1e6, stage->cpuNanos / 1e6, stage->peakRssKB, (unsigned long long)stage->bytesWritten, last ? "" : ",");
+}
+
+static int ingestCommand(int argc, char **argv)
+{
+	if(argc < 1) return 2;
+	const char *dir = argv[0];
+	double maxMP = argc > 1 ? atof(argv[1]) : 16;
+	const char *modes = argc > 2 ? argv[2] : "turbo,incremental";
+	if(maxMP < 1 || maxMP > CORPUS_MP_MAX) return 2;
+	bool turbo = strstr(modes, "turbo") != NULL;
+	bool incremental = strstr(modes, "incremental") != NULL;
+
+	if(mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "cannot create %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	corpusImage *images;
+	size_t count = makeCorpus(dir, maxMP, &images);
+	if(!count) return 1;
+
+	char archive[1100];
+	snprintf(archive, sizeof(archive), "%s/ingest.pst", dir);
+
+	printf("{\n  \"command\": \"ingest\",\n  \"maxMP\": %g,\n  \"cores\": %ld,\n  \"runs\": [\n", maxMP, sysconf(_SC_NPROCESSORS_ONLN));
+	int status = 0;
+	bool first = true;
+	for(size_t i=0; i<count; ++i) {
+		const corpusImage *im = &images[i];
+		int fd = open(im->path, O_RDONLY);
+		struct stat st;
+		unsigned char *jpeg = fd < 0 || fstat(fd, &st) ? MAP_FAILED : mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(jpeg == MAP_FAILED) {
+			fprintf(stderr, "cannot read %s\n", im->path);
+			status = 1;
+			if(fd >= 0) close(fd);
+			continue;
+		}
+		size_t len = (size_t)st.st_size;
+
+		for(int mode=0; mode<2; ++mode) {
+			if(!(mode ? incremental : turbo)) continue;
+			fprintf(stderr, "ingest %s %s\n", mode ? "incremental" : "turbo", im->path);
+
+			TCBuilderOptions options = { 320, 320, 0, 0, NULL, false, 0, 0, 0, TC_PRIORITY_NORMAL };	// as PhotoScroller
+			TCBuilderRef b = TCBuilderCreate(&options);
+			stageStats staged, built, saved;
+			uint64_t wall, cpu;
+			bool ok = b != NULL;
+
+			// libjpegTurboDecoder: the download is written to the image file, then decoded from it
+			beginStage(&staged, &wall, &cpu);
+			if(ok && !mode) {
+				ok = TCBuilderCreateImageFile(b);
+				for(size_t offset=0; ok && offset<len; offset += CHUNK_SIZE) {
+					ok = TCBuilderAppendImageData(b, jpeg + offset, len - offset < CHUNK_SIZE ? len - offset : CHUNK_SIZE);
+				}
+				staged.bytesWritten = ok ? len : 0;
+			}
+			const char *path = ok && !mode ? TCBuilderCloseImageFile(b) : NULL;
+			endStage(&staged, wall, cpu);
+
+			beginStage(&built, &wall, &cpu);
+			if(ok) ok = mode ? ingestIncremental(b, jpeg, len) : TCBuilderDecodeJPEGFile(b, path);
+			ok = ok && !TCBuilderFailed(b);
+			endStage(&built, wall, cpu);
+			if(ok) {
+				TCWritebackStats wb;
+				TCBuilderGetWritebackStats(b, &wb);
+				built.bytesWritten = wb.written;
+			}
+			if(path) TCBuilderRemoveImageFile(b);
+
+			beginStage(&saved, &wall, &cpu);
+			ok = ok && TCBuilderSaveArchive(b, archive);
+			endStage(&saved, wall, cpu);
+			struct stat ast;
+			if(ok && !stat(archive, &ast)) saved.bytesWritten = (uint64_t)ast.st_size;
+			unlink(archive);
+
+			size_t width = 0, height = 0;
+			if(b) TCBuilderGetImageSize(b, &width, &height);
+			printf("%s    {\n", first ? "" : ",\n");
+			printf("      \"image\": \"%s\", \"bytes\": %zu, \"megapixels\": %g, \"width\": %zu, \"height\": %zu, \"subsampling\": \"%s\",\n",
+				strrchr(im->path, '/') + 1, len, im->megapixels, im->width, im->height, samplingName(im));
+			printf("      \"progressive\": %s, \"restartMarkers\": %s, \"orientation\": %d, \"mode\": \"%s\", \"ok\": %s, \"levels\": %zu, \"tiledWidth\": %zu, \"tiledHeight\": %zu,\n",
+				im->progressive ? "true" : "false", im->restart ? "true" : "false", im->orientation, mode ? "incremental" : "turbo",
+				ok ? "true" : "false", b ? TCBuilderGetZoomLevels(b) : 0, width, height);
+			printf("      \"stages\": {\n");
+			printStage("stage", &staged, false);
+			printStage("build", &built, false);
+			printStage("archive", &saved, true);
+			printf("      }\n    }");
+			fflush(stdout);
+			first = false;
+
+			if(!ok) status = 1;
+			TCBuilderRelease(b);
+		}
+		munmap(jpeg, len);
+		close(fd);
+	}
+	printf("\n  ]\n}\n");
+
+	free(images);
+	return status;
+}
+
+#pragma mark Serve
+
+#define SCREEN_COLS		5		// tiles CATiledLayer asks for to fill a 1024x768 screen, give or take
+#define SCREEN_ROWS		4
+#define ZOOMS			16		// zoom-ins, coarsest level to finest
+#define JUMPS			256		// screens at random levels and places
+#define MAX_THREADS		64
+
+typedef struct {
+	uint32_t	level;
+	uint32_t	col;
+	uint32_t	row;
+} traceTile;
+
+typedef struct {
+	char		name[256];
+	traceTile	*tiles;
+	size_t		count;
+	size_t		capacity;
+	size_t		screen[4];			// the last screen added: level, col, row - and whether there is one
+} trace;
+
+typedef enum {
+	backendPread = 0,				// level files, TCTileGetBytesAtPosition as drawing did before tile views (MAPPING_IMAGES 0)
+	backendMmap,					// level files, tile views map each tile (what MAPPING_IMAGES 1 did too)
+	backendCache,					// tile views from the tile cache
+	backendArchive,					// tile views of a reopened archive's mapping
+	backendCount
+} serveBackend;
+
+static const char *backendNames[] = { "pread", "mmap", "cache", "archive" };
+
+typedef struct {
+	TCBuilderRef	b;
+	serveBackend	backend;
+	const trace		*t;
+	atomic_size_t	next;
+	uint64_t		*nanos;			// of each tile of the trace
+	atomic_size_t	failed;
+} replay;
+
+static uint64_t traceRandom(uint64_t *state)
+{
+	*state = *state * 6364136223846793005ull + 1442695040888963407ull;
+	return *state >> 33;
+}
+
+static void traceAdd(trace *t, size_t level, size_t col, size_t row)
+{
+	if(t->count == t->capacity) {
+		t->capacity = t->capacity ? t->capacity * 2 : 1024;
+		t->tiles = realloc(t->tiles, t->capacity * sizeof(traceTile));
+	}
+	t->tiles[t->count++] = (traceTile){ (uint32_t)level, (uint32_t)col, (uint32_t)row };
+}
+
+// A screen with its top left tile at col, row: CATiledLayer only asks for the tiles the last one did not show
+static void traceScreen(trace *t, TCBuilderRef b, size_t level, size_t col, size_t row)
+{
+	size_t cols, rows;
+	TCBuilderGetLevelTiles(b, level, &cols, &rows);
+	size_t w = cols < SCREEN_COLS ? cols : SCREEN_COLS;
+	size_t h = rows < SCREEN_ROWS ? rows : SCREEN_ROWS;
+	if(col + w > cols) col = cols - w;
+	if(row + h > rows) row = rows - h;
+
+	bool same = t->screen[3] && t->screen[0] == level;
+	for(size_t r=row; r<row+h; ++r) {
+		for(size_t c=col; c<col+w; ++c) {
+			if(same && c >= t->screen[1] && c < t->screen[1] + w && r >= t->screen[2] && r < t->screen[2] + h) continue;
+			traceAdd(t, level, c, r);
+		}
+	}
+	t->screen[0] = level;
+	t->screen[1] = col;
+	t->screen[2] = row;
+	t->screen[3] = 1;
+}
+
+// Full size, a tile at a time left to right, then down a screen and back right to left
+static void tracePan(trace *t, TCBuilderRef b)
+{
+	size_t cols, rows;
+	TCBuilderGetLevelTiles(b, 0, &cols, &rows);
+	size_t lastCol = cols > SCREEN_COLS ? cols - SCREEN_COLS : 0;
+	for(size_t row=0, band=0; ; row += SCREEN_ROWS, ++band) {
+		if(row + SCREEN_ROWS > rows) row = rows > SCREEN_ROWS ? rows - SCREEN_ROWS : 0;
+		for(size_t i=0; i<=lastCol; ++i) traceScreen(t, b, 0, band & 1 ? lastCol - i : i, row);
+		if(row + SCREEN_ROWS >= rows) break;
+	}
+}
+
+// From the whole image down to full size, each level centered on the same random point
+static void traceZoom(trace *t, TCBuilderRef b)
+{
+	uint64_t state = 1;
+	size_t levels = TCBuilderGetZoomLevels(b);
+	for(size_t i=0; i<ZOOMS; ++i) {
+		double x = traceRandom(&state) / 2147483648.0;
+		double y = traceRandom(&state) / 2147483648.0;
+		for(size_t level=levels; level-- > 0; ) {
+			size_t cols, rows;
+			TCBuilderGetLevelTiles(b, level, &cols, &rows);
+			double col = x * cols - SCREEN_COLS / 2.0, row = y * rows - SCREEN_ROWS / 2.0;
+			traceScreen(t, b, level, col > 0 ? (size_t)col : 0, row > 0 ? (size_t)row : 0);
+		}
+	}
+}
+
+static void traceJump(trace *t, TCBuilderRef b)
+{
+	uint64_t state = 2;
+	size_t levels = TCBuilderGetZoomLevels(b);
+	for(size_t i=0; i<JUMPS; ++i) {
+		size_t level = traceRandom(&state) % levels;
+		size_t cols, rows;
+		TCBuilderGetLevelTiles(b, level, &cols, &rows);
+		traceScreen(t, b, level, traceRandom(&state) % cols, traceRandom(&state) % rows);
+	}
+}
+
+// Lines with "tile <level> <col> <row>" anywhere in them (NSLog puts a date and the process first), others are skipped
+static bool traceLoad(trace *t, TCBuilderRef b, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if(!f) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	char line[512];
+	size_t skipped = 0;
+	while(fgets(line, sizeof(line), f)) {
+		const char *p = strstr(line, "tile ");
+		size_t level, col, row, cols, rows;
+		if(!p || sscanf(p, "tile %zu %zu %zu", &level, &col, &row) != 3) continue;
+		if(level < TCBuilderGetZoomLevels(b)) TCBuilderGetLevelTiles(b, level, &cols, &rows);
+		if(level >= TCBuilderGetZoomLevels(b) || col >= cols || row >= rows) {
+			++skipped;		// recorded on another image
+			continue;
+		}
+		traceAdd(t, level, col, row);
+	}
+	fclose(f);
+	if(skipped) fprintf(stderr, "%s: %zu tiles outside this image skipped\n", path, skipped);
+	return true;
+}
+
+static bool serveTile(TCBuilderRef b, serveBackend backend, const traceTile *tt, unsigned char *buffer)
+{
+	if(backend == backendPread) {
+		TCTile tile;
+		if(!TCBuilderGetTile(b, tt->level, tt->col, tt->row, &tile)) return false;
+		size_t length = tile.bytesPerRow * (tile.height - 1) + tile.width * TC_BYTES_PER_PIXEL;
+		bool ok = TCTileGetBytesAtPosition(&tile, buffer, 0, length) == length;
+		TCTileRelease(&tile);
+		return ok;
+	}
+	TCTileView *view = TCBuilderGetTileView(b, tt->level, tt->col, tt->row);
+	if(!view) return false;
+	memcpy(buffer, view->bytes, view->length);
+	TCTileViewRelease(view);
+	return true;
+}
+
+static void *replayThread(void *arg)
+{
+	replay *r = arg;
+	unsigned char *buffer = malloc(TILE_BYTES);
+	for(size_t i; (i = atomic_fetch_add(&r->next, 1)) < r->t->count; ) {
+		uint64_t start = TCTimeStamp();
+		if(!serveTile(r->b, r->backend, &r->t->tiles[i], buffer)) atomic_fetch_add(&r->failed, 1);
+		r->nanos[i] = TCTimeStamp() - start;
+	}
+	free(buffer);
+	return NULL;
+}
+
+static int compareNanos(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Nearest rank
+static double percentileMicros(const uint64_t *sorted, size_t count, double p)
+{
+	size_t rank = (size_t)ceil(p / 100.0 * count);
+	return sorted[rank ? rank - 1 : 0] / 1e3;
+}
+
+static void dropFile(const char *path)
+{
+#ifdef __linux__
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+#else
+	(void)path;
+#endif
+}
+
+static int serveCommand(int argc, char **argv)
+{
+	if(argc < 1) return 2;
+	size_t threads[MAX_THREADS] = { 1, 2, 4, 8 }, threadCounts = 4;
+	if(argc > 1) {
+		threadCounts = 0;
+		for(char *p = argv[1]; *p && threadCounts < MAX_THREADS; ++p) {
+			size_t n = strtoul(p, &p, 10);
+			if(n < 1 || n > MAX_THREADS || (*p && *p != ',')) return 2;
+			threads[threadCounts++] = n;
+			if(!*p) break;
+		}
+	}
+
+	TCBuilderRef b = buildJPEG(argv[0], 0);
+	if(!b) return 1;
+	char archive[] = "/tmp/tcbench-serve-XXXXXX";
+	int afd = mkstemp(archive);
+	if(afd < 0 || !TCBuilderSaveArchive(b, archive)) {
+		fprintf(stderr, "cannot save an archive\n");
+		TCBuilderRelease(b);
+		return 1;
+	}
+	close(afd);
+
+	size_t traceCount = 3 + (argc > 2 ? argc - 2 : 0);
+	trace *traces = calloc(traceCount, sizeof(trace));
+	strcpy(traces[0].name, "pan");
+	tracePan(&traces[0], b);
+	strcpy(traces[1].name, "zoom");
+	traceZoom(&traces[1], b);
+	strcpy(traces[2].name, "jump");
+	traceJump(&traces[2], b);
+	int status = 0;
+	for(size_t i=3; i<traceCount; ++i) {
+		const char *name = strrchr(argv[i-1], '/');
+		snprintf(traces[i].name, sizeof(traces[i].name), "%s", name ? name + 1 : argv[i-1]);
+		if(!traceLoad(&traces[i], b, argv[i-1])) status = 1;
+	}
+
+	size_t cols, rows;
+	TCBuilderGetLevelTiles(b, 0, &cols, &rows);
+	printf("%s: level 0 %zux%zu tiles, %zu levels\n", argv[0], cols, rows, TCBuilderGetZoomLevels(b));
+	printf("  %-12s %-8s %-5s %7s %7s %10s %9s %9s %9s\n", "trace", "backend", "cache", "threads", "tiles", "tiles/s", "p50 us", "p99 us", "p99.9 us");
+
+	for(size_t ti=0; ti<traceCount; ++ti) {
+		const trace *t = &traces[ti];
+		if(!t->count) continue;
+		uint64_t *nanos = malloc(t->count * sizeof(uint64_t));
+
+		for(serveBackend backend=0; backend<backendCount; ++backend) {
+			TCSetTileCacheRatio(backend == backendCache ? 0.25f : 0);
+			TCBuilderRef rb = b;		// NULL once the archive won't open: the rest of this backend is skipped
+			for(int cold=1; rb && cold>=0; --cold) {
+				for(size_t tc=0; rb && tc<threadCounts; ++tc) {
+					replay r = { .backend = backend, .t = t, .nanos = nanos };
+
+					// cold: nothing of the image in memory - the archive's mapping has to go too, or its pages stay
+					if(backend == backendArchive && (cold || rb == b)) {
+						if(rb != b) TCBuilderRelease(rb);
+						if(cold) dropFile(archive);
+						rb = TCBuilderOpenArchive(archive);
+						if(!rb) {
+							fprintf(stderr, "cannot open the archive\n");
+							status = 1;
+							continue;
+						}
+					}
+					if(cold) {
+						TCTileCacheLowMemory();
+						dropPageCache(b);
+					} else {
+						r.b = rb;
+						replayThread(&r);		// warm: the same replay once before
+						atomic_store(&r.next, 0);
+					}
+					r.b = rb;
+
+					pthread_t tids[MAX_THREADS];
+					uint64_t start = TCTimeStamp();
+					for(size_t i=0; i<threads[tc]; ++i) pthread_create(&tids[i], NULL, replayThread, &r);
+					for(size_t i=0; i<threads[tc]; ++i) pthread_join(tids[i], NULL);
+					uint64_t ns = TCTimeStamp() - start;
+
+					qsort(nanos, t->count, sizeof(uint64_t), compareNanos);
+					size_t failed = atomic_load(&r.failed);
+					printf("  %-12s %-8s %-5s %7zu %7zu %10.0f %9.1f %9.1f %9.1f%s\n", t->name, backendNames[backend], cold ? "cold" : "warm",
+						threads[tc], t->count, t->count / (ns / 1e9), percentileMicros(nanos, t->count, 50),
+						percentileMicros(nanos, t->count, 99), percentileMicros(nanos, t->count, 99.9), failed ? "  FAILED" : "");
+					fflush(stdout);
+					if(failed) status = 1;
+				}
+			}
+			if(rb && rb != b) TCBuilderRelease(rb);
+		}
+		free(nanos);
+	}
+	TCSetTileCacheRatio(0.25f);
+
+	for(size_t i=0; i<traceCount; ++i) free(traces[i].tiles);
+	free(traces);
+	unlink(archive);
+	TCBuilderRelease(b);
+	return status;
+}
+
+#pragma mark Writeback
+
+#define PRESSURE_POLL		1000000ull		// nanoseconds between looks at the build
+#define PRESSURE_EVERY		50				// polls between memory warnings
+
+typedef struct {
+	TCBuilderRef	b;
+	const char		*path;
+	atomic_bool		done;
+	bool			ok;
+} pressureBuild;
+
+static void *pressureThread(void *arg)
+{
+	pressureBuild *pb = arg;
+	pb->ok = TCBuilderDecodeJPEGFile(pb->b, pb->path) && !TCBuilderFailed(pb->b);
+	atomic_store(&pb->done, true);
+	return NULL;
+}
+
+// FNV-1a over every pixel of every level, as drawing reads them
+static uint64_t hashTiles(TCBuilderRef b)
+{
+	unsigned char *pixels = malloc(TILE_BYTES);
+	uint64_t hash = 1469598103934665603ull;
+	for(size_t level=0; level<TCBuilderGetZoomLevels(b); ++level) {
+		size_t cols, rows;
+		TCBuilderGetLevelTiles(b, level, &cols, &rows);
+		for(size_t row=0; row<rows; ++row) {
+			for(size_t col=0; col<cols; ++col) {
+				TCTile tile;
+				if(!TCBuilderGetTile(b, level, col, row, &tile)) return 0;
+				size_t length = tile.bytesPerRow * (tile.height - 1) + tile.width * TC_BYTES_PER_PIXEL;
+				if(TCTileGetBytesAtPosition(&tile, pixels, 0, length) != length) length = 0;
+				TCTileRelease(&tile);
+				for(size_t i=0; i<length; ++i) hash = (hash ^ pixels[i]) * 1099511628211ull;
+			}
+		}
+	}
+	free(pixels);
+	return hash;
+}
+
+static int writebackCommand(int argc, char **argv)
+{
+	if(argc < 1) return 2;
+	int64_t threshold = (int64_t)((argc > 1 ? atof(argv[1]) : 4) * 1024 * 1024);
+	double rate = (argc > 2 ? atof(argv[2]) : 32) * 1024 * 1024;
+	if(threshold <= 0 || rate <= 0) return 2;
+
+	// one thread tiles, so one range at a time is handed over past the threshold
+	TCBuilderOptions options = { 0, 0, 4, 0, NULL, false, 0, 0, 1, TC_PRIORITY_NORMAL };
+	pressureBuild pb = { TCBuilderCreate(&options), argv[0], false, false };
+	if(!pb.b) return 1;
+	TCBuilderSetUbcThreshold(pb.b, threshold);
+	TCSetWritebackRate(rate);
+
+	pthread_t tid;
+	uint64_t start = TCTimeStamp();
+	if(pthread_create(&tid, NULL, pressureThread, &pb)) return 1;
+	uint64_t peak = 0;
+	size_t polls = 0, warnings = 0;
+	while(!atomic_load(&pb.done)) {
+		struct timespec poll = { 0, PRESSURE_POLL };
+		nanosleep(&poll, NULL);
+
+		TCWritebackStats wb;
+		TCBuilderGetWritebackStats(pb.b, &wb);
+		if(wb.inFlight > peak) peak = wb.inFlight;
+		if(wb.written && !(++polls % PRESSURE_EVERY)) {
+			if(warnings++ & 1) TCTileCacheLowMemory();
+			else TCBuilderLowMemory(pb.b);
+		}
+	}
+	pthread_join(tid, NULL);
+	uint64_t ns = TCTimeStamp() - start;
+	TCSetWritebackRate(0);
+
+	TCWritebackStats wb;
+	TCBuilderGetWritebackStats(pb.b, &wb);
+	size_t cols = 0, rows = 0;
+	if(pb.ok) TCBuilderGetLevelTiles(pb.b, 0, &cols, &rows);
+	uint64_t bound = (uint64_t)threshold + cols * TILE_BYTES;		// the threshold, and a tile row of level 0 on top
+
+	TCBuilderRef reference = buildJPEG(argv[0], 0);
+	bool same = pb.ok && reference && hashTiles(pb.b) == hashTiles(reference);
+
+	printf("%s: threshold %.1f MB, rate %.1f MB/s, %.0f ms, %zu memory warnings\n", argv[0], threshold / 1048576.0, rate / 1048576.0, ns / 1e6, warnings);
+	printf("  written %.1f MB, %llu stalls for %.0f ms, peak in flight %.1f MB of at most %.1f MB\n", wb.written / 1048576.0,
+		(unsigned long long)wb.stalls, wb.stallNanos / 1e6, peak / 1048576.0, bound / 1048576.0);
+
+	int status = 0;
+	if(!pb.ok)			{ printf("  FAILED: the build\n"); status = 1; }
+	if(!warnings)		{ printf("  FAILED: done before a memory warning, give it a bigger image or a slower rate\n"); status = 1; }
+	if(!wb.stalls)		{ printf("  FAILED: never stalled\n"); status = 1; }
+	if(peak > bound)	{ printf("  FAILED: too much in flight\n"); status = 1; }
+	if(!same)			{ printf("  FAILED: tiles differ from an unthrottled build\n"); status = 1; }
+	if(!status) printf("  ok\n");
+
+	TCBuilderRelease(reference);
+	TCBuilderRelease(pb.b);
+	return status;
+}
+
+#pragma mark Stream
+
+#define STREAM_GAP		10000000		// nanoseconds between chunks handed to the decode thread
+
+static const char *streamModes[] = { "advance", "append", "thread" };
+
+// Every preview level there is now, as a view would draw them: false if one is the wrong size (the image isn't rotated, so level n
+// is the image size >> n), or the smaller levels are missing
+static bool streamPreviews(TCBuilderRef b, size_t *scans)
+{
+	size_t width, height;
+	TCBuilderGetImageSize(b, &width, &height);
+	bool ok = true, found = false;
+	TCBuilderLockPreview(b);
+	for(size_t level=0; level<TCBuilderGetZoomLevels(b); ++level) {
+		TCPreview preview;
+		if(!TCBuilderGetPreview(b, level, &preview)) {
+			if(found) ok = false;
+			continue;
+		}
+		found = true;
+		if(preview.width != width >> level || preview.height != height >> level || !preview.pixels) ok = false;
+		if(preview.scans > *scans) *scans = preview.scans;
+	}
+	TCBuilderUnlockPreview(b);
+	return ok;
+}
+
+static bool streamJPEG(TCBuilderRef b, int mode, const unsigned char *jpeg, size_t len, size_t *scans)
+{
+	streamPacer pacer = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+	bool ok = TCBuilderBeginJPEGStream(b);
+	if(ok && mode == 2) ok = TCBuilderStartJPEGStreamThread(b, 0, resumeStream, &pacer);
+
+	size_t start = 0;
+	for(size_t offset=0; ok && offset<len; ) {
+		size_t n = len - offset < CHUNK_SIZE ? len - offset : CHUNK_SIZE;
+		offset += n;
+		if(mode == 0) {
+			// the download keeps what libjpeg hasn't taken yet, and hands it over again with the next chunk
+			if(TCBuilderAdvanceJPEGStream(b, jpeg + start, offset - start)) start = offset;
+			ok = !TCBuilderFailed(b);
+		} else if(mode == 1) {
+			ok = TCBuilderAppendJPEGStreamChunk(b, jpeg + offset - n, n, noRelease, NULL);
+		} else {
+			pthread_mutex_lock(&pacer.lock);
+			while(pacer.paused) pthread_cond_wait(&pacer.resumed, &pacer.lock);
+			pacer.paused = true;
+			pthread_mutex_unlock(&pacer.lock);
+
+			TCStreamQueueResult ret = TCBuilderQueueJPEGStreamChunk(b, jpeg + offset - n, n, noRelease, NULL);
+			if(ret != TCStreamFull) {
+				pthread_mutex_lock(&pacer.lock);
+				pacer.paused = false;
+				pthread_mutex_unlock(&pacer.lock);
+			}
+			if(ret == TCStreamDone) break;
+
+			// the decode thread makes a preview when it runs out of data, so the network has to be slower than it
+			struct timespec gap = { 0, STREAM_GAP };
+			nanosleep(&gap, NULL);
+		}
+		if(!streamPreviews(b, scans)) {
+			fprintf(stderr, "bad preview after %zu bytes\n", offset);
+			ok = false;
+		}
+	}
+	ok = TCBuilderEndJPEGStream(b, !ok) && ok;
+	pthread_mutex_destroy(&pacer.lock);
+	pthread_cond_destroy(&pacer.resumed);
+	return ok;
+}
+
+static int streamCommand(int argc, char **argv)
+{
+	if(argc < 1) return 2;
+	const char *dir = argv[0];
+	const char *levelList = argc > 1 ? argv[1] : "4,5,6,7";
+
+	if(mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "cannot create %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	corpusImage im = { 4, 2309, 1732, 2, 2, true, false, 1, "" };		// as the ingest corpus' 4 MP progressive 4:2:0
+	snprintf(im.path, sizeof(im.path), "%s/stream-4mp-22-prog.jpg", dir);
+	int fd = writeCorpusImage(&im) ? open(im.path, O_RDONLY) : -1;
+	struct stat st;
+	unsigned char *jpeg = fd < 0 || fstat(fd, &st) ? MAP_FAILED : mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(jpeg == MAP_FAILED) {
+		fprintf(stderr, "cannot read %s\n", im.path);
+		if(fd >= 0) close(fd);
+		return 1;
+	}
+	size_t len = (size_t)st.st_size;
+
+	int status = 0;
+	for(const char *s=levelList; *s; ) {
+		char *end;
+		size_t levels = strtoul(s, &end, 10);
+		if(end == s || !levels) return 2;
+		s = *end ? end + 1 : end;
+
+		for(int dct=0; dct<2; ++dct) {
+			TCBuilderOptions options = { 0, 0, levels, 0, NULL, dct, 0, 0, 0, TC_PRIORITY_NORMAL };
+			TCBuilderRef reference = TCBuilderCreate(&options);
+			bool refOK = reference && TCBuilderDecodeJPEGData(reference, jpeg, len) && !TCBuilderFailed(reference);
+			uint64_t refHash = refOK ? hashTiles(reference) : 0;
+			TCBuilderRelease(reference);
+
+			for(int mode=0; mode<3; ++mode) {
+				TCBuilderRef b = TCBuilderCreate(&options);
+				size_t scans = 0;
+				uint64_t start = TCTimeStamp();
+				bool ok = b && streamJPEG(b, mode, jpeg, len, &scans) && !TCBuilderFailed(b);
+				uint64_t ns = TCTimeStamp() - start;
+				bool same = ok && refOK && hashTiles(b) == refHash;
+
+				printf("%zu levels, %s, %s: %.0f ms, previews up to scan %zu: %s\n", levels, dct ? "dct" : "nodct", streamModes[mode],
+					ns / 1e6, scans, !ok ? "FAILED: the build" : !same ? "FAILED: tiles differ from a whole image decode" :
+					!scans ? "FAILED: no preview" : "ok");
+				if(!ok || !same || !scans) status = 1;
+				TCBuilderRelease(b);
+			}
+		}
+	}
+	munmap(jpeg, len);
+	close(fd);
+	return status;
+}